@@ -0,0 +1,68 @@
+"""
+Compare the JSON and binary encodings of API key payloads: plaintext size
+and decode throughput.
+
+Does not touch the kernel keyring and so may be run as any user:
+
+    python3 benchmarks/bench_api_key_codec.py --keys 1000 --rounds 20
+"""
+import argparse
+import base64
+import os
+import time
+import truenas_keyring
+
+from truenas_api_key import keyring as api_keyring
+from truenas_api_key.constants import ApiKeyAlgorithm, UserApiKey
+
+
+def make_keys(count):
+    return [UserApiKey(
+        username='bench_codec',
+        dbid=i,
+        algorithm=ApiKeyAlgorithm.SHA512,
+        iterations=500000,
+        expiry=0,
+        salt=base64.b64encode(os.urandom(16)).decode(),
+        server_key=base64.b64encode(os.urandom(64)).decode(),
+        stored_key=base64.b64encode(os.urandom(64)).decode(),
+    ) for i in range(1, count + 1)]
+
+
+def decode_record(payload):
+    """ Binary payload decoded to ApiKeyRecord only, as done by verify_scram() """
+    return truenas_keyring.unpack_api_key(base64.b64decode(payload))
+
+
+def measure(fn, payloads, rounds):
+    start = time.perf_counter_ns()
+    for i in range(rounds):
+        for payload in payloads:
+            fn(payload)
+
+    return (time.perf_counter_ns() - start) / 1000 / (rounds * len(payloads))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--keys', type=int, default=1000, help='API keys to encode')
+    parser.add_argument('--rounds', type=int, default=20)
+    args = parser.parse_args()
+
+    keys = make_keys(args.keys)
+
+    print(f'{"format":<16} {"bytes/key":>10} {"decode (us/key)":>16}')
+    for name, binary, fn in (
+        ('json', False, api_keyring.decode_api_key),
+        ('binary', True, api_keyring.decode_api_key),
+        ('binary (record)', True, decode_record),
+    ):
+        payloads = [api_keyring.encode_api_key(key, binary) for key in keys]
+        assert [api_keyring.decode_api_key(p) for p in payloads] == keys
+
+        size = sum(len(p) for p in payloads) / len(payloads)
+        elapsed = measure(fn, payloads, args.rounds)
+        print(f'{name:<16} {size:>10.1f} {elapsed:>16.2f}')
+
+if __name__ == '__main__':
+    main()
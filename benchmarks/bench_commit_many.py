@@ -0,0 +1,89 @@
+"""
+Compare committing API keys for many users one commit_user_entry() call at
+a time against a single commit_many() call, with the keyring work spread
+over an increasing number of native worker threads.
+
+Must be run as root on a host with kernel keyring support. The kernel
+limits the number of keys per user (see /proc/sys/kernel/keys/root_maxkeys)
+and so it may need to be raised for large user counts:
+
+    python3 benchmarks/bench_commit_many.py --users 10000 --keys 2
+"""
+import argparse
+import os
+import time
+import truenas_keyring
+
+from truenas_api_key import keyring as api_keyring
+from truenas_api_key.constants import ApiKeyAlgorithm, UserApiKey
+
+USER_PREFIX = 'bench_commit_'
+
+
+def make_entries(users, keys):
+    return {f'{USER_PREFIX}{u}': [UserApiKey(
+        username=f'{USER_PREFIX}{u}',
+        dbid=(u * keys) + i,
+        algorithm=ApiKeyAlgorithm.SHA512,
+        iterations=500000,
+        expiry=0,
+        salt='c2FsdA==',
+        server_key='c2VydmVyX2tleQ==',
+        stored_key='c3RvcmVkX2tleQ==',
+    ) for i in range(1, keys + 1)] for u in range(users)}
+
+
+def sequential(entries, seal_key, workers):
+    for username, api_keys in entries.items():
+        api_keyring.commit_user_entry(username, api_keys, seal_key=seal_key)
+
+
+def many(entries, seal_key, workers):
+    results = api_keyring.commit_many(entries, seal_key=seal_key, workers=workers)
+    failed = [username for username, err in results.items() if err is not None]
+    assert not failed, f'{len(failed)} users failed, e.g. {failed[0]}: {results[failed[0]]}'
+
+
+def cleanup(entries):
+    pam_keyring = api_keyring.get_pam_keyring()
+    for username in entries:
+        user_keyring = pam_keyring.try_search(
+            key_type=truenas_keyring.KeyType.KEYRING, description=username
+        )
+        if user_keyring is not None:
+            truenas_keyring.unlink_key(serial=user_keyring.key.serial, keyring=pam_keyring.key.serial)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--users', type=int, default=10000)
+    parser.add_argument('--keys', type=int, default=2, help='API keys per user')
+    parser.add_argument('--max-workers', type=int, default=os.cpu_count())
+    args = parser.parse_args()
+
+    seal_key = os.urandom(32)
+    entries = make_entries(args.users, args.keys)
+
+    runs = [('commit_user_entry', sequential, 1)]
+    workers = 1
+    while workers <= args.max_workers:
+        runs.append((f'commit_many x{workers}', many, workers))
+        workers *= 2
+
+    print(f'{"mode":<24} {"total (s)":>10} {"us/user":>10} {"speedup":>10}')
+    baseline = None
+    for name, fn, workers in runs:
+        # Start each run from empty user keyrings so that all runs create the same keys
+        cleanup(entries)
+        start = time.perf_counter_ns()
+        fn(entries, seal_key, workers)
+        elapsed = time.perf_counter_ns() - start
+        baseline = baseline or elapsed
+        print(f'{name:<24} {elapsed / 1e9:>10.2f} {elapsed / 1000 / args.users:>10.1f} '
+              f'{baseline / elapsed:>10.2f}')
+
+    cleanup(entries)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,104 @@
+"""
+Compare committing every API key update for a user as it arrives with
+commit_user_entry() against submitting the updates to a CommitQueue, which
+coalesces updates for the same user arriving within its delay window into a
+single keyring commit.
+
+Updates arrive in bursts: each user receives --updates back-to-back updates
+of their API keys. Write amplification is the number of keyring commits per
+logical update.
+
+Must be run as root on a host with kernel keyring support:
+
+    python3 benchmarks/bench_commit_queue.py --users 1000 --updates 8 --delay 0.05
+"""
+import argparse
+import os
+import time
+import truenas_keyring
+
+from truenas_api_key import keyring as api_keyring
+from truenas_api_key.constants import ApiKeyAlgorithm, UserApiKey
+
+USER_PREFIX = 'bench_queue_'
+
+
+def make_update(user, update):
+    username = f'{USER_PREFIX}{user}'
+    return username, [UserApiKey(
+        username=username,
+        dbid=user + 1,
+        algorithm=ApiKeyAlgorithm.SHA512,
+        iterations=500000,
+        expiry=update,
+        salt='c2FsdA==',
+        server_key='c2VydmVyX2tleQ==',
+        stored_key='c3RvcmVkX2tleQ==',
+    )]
+
+
+def bursts(users, updates):
+    for user in range(users):
+        for update in range(updates):
+            yield make_update(user, update)
+
+
+def direct(args, seal_key):
+    commits = 0
+    for username, api_keys in bursts(args.users, args.updates):
+        api_keyring.commit_user_entry(username, api_keys, seal_key=seal_key)
+        commits += 1
+
+    return commits
+
+
+def queued(args, seal_key):
+    with api_keyring.CommitQueue(seal_key=seal_key, delay=args.delay) as queue:
+        for username, api_keys in bursts(args.users, args.updates):
+            queue.submit(username, api_keys)
+
+        depth = queue.pending
+        assert queue.flush(), 'timed out flushing commit queue'
+        stats = queue.stats()
+
+    assert not stats['failed'], f'{stats["failed"]} commits failed'
+    print(f'  queue depth before flush: {depth}, coalesced: {stats["coalesced"]}')
+    return stats['committed']
+
+
+def cleanup(users):
+    pam_keyring = api_keyring.get_pam_keyring()
+    for user in range(users):
+        user_keyring = pam_keyring.try_search(
+            key_type=truenas_keyring.KeyType.KEYRING, description=f'{USER_PREFIX}{user}'
+        )
+        if user_keyring is not None:
+            truenas_keyring.unlink_key(serial=user_keyring.key.serial, keyring=pam_keyring.key.serial)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--users', type=int, default=1000)
+    parser.add_argument('--updates', type=int, default=8, help='updates per user in each burst')
+    parser.add_argument('--delay', type=float, default=0.05, help='CommitQueue delay window (s)')
+    args = parser.parse_args()
+
+    seal_key = os.urandom(32)
+    logical = args.users * args.updates
+
+    print(f'{"mode":<20} {"total (s)":>10} {"commits":>10} {"add_key":>10} {"write amp":>10}')
+    for name, fn in (('commit_user_entry', direct), ('CommitQueue', queued)):
+        cleanup(args.users)
+        truenas_keyring.get_syscall_stats(reset=True)
+        start = time.perf_counter_ns()
+        commits = fn(args, seal_key)
+        elapsed = time.perf_counter_ns() - start
+        add_key = truenas_keyring.get_syscall_stats()['add_key']
+        print(f'{name:<20} {elapsed / 1e9:>10.2f} {commits:>10} {add_key:>10} '
+              f'{commits / logical:>10.3f}')
+
+    cleanup(args.users)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,82 @@
+"""
+Compare the latency of reading a single API key payload via
+truenas_api_key.keyring.lookup_api_key() with resolving the keyrings
+and reading the key from Python.
+
+Must be run as root on a host with kernel keyring support:
+
+    python3 benchmarks/bench_lookup_api_key.py --keys 100 --iterations 10000
+"""
+import argparse
+import statistics
+import time
+import truenas_keyring
+
+from truenas_api_key import keyring as api_keyring
+from truenas_api_key.constants import ApiKeyAlgorithm, UserApiKey
+
+USERNAME = 'bench_lookup'
+
+
+def python_path(username, dbid):
+    """ Equivalent lookup using the object-based API """
+    api_keys_ring = api_keyring.get_api_keys_keyring(username)
+    key = api_keys_ring.try_search(key_type=truenas_keyring.KeyType.USER, description=str(dbid))
+    return None if key is None else key.read_data()
+
+
+def native_path(username, dbid):
+    return api_keyring.lookup_api_key(username, dbid)
+
+
+def measure(fn, dbids, iterations):
+    samples = []
+    for i in range(iterations):
+        dbid = dbids[i % len(dbids)]
+        start = time.perf_counter_ns()
+        fn(USERNAME, dbid)
+        samples.append(time.perf_counter_ns() - start)
+
+    samples.sort()
+    return {
+        'p50': samples[len(samples) // 2] / 1000,
+        'p99': samples[int(len(samples) * 0.99)] / 1000,
+        'mean': statistics.fmean(samples) / 1000,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--keys', type=int, default=100, help='API keys in keyring')
+    parser.add_argument('--iterations', type=int, default=10000)
+    args = parser.parse_args()
+
+    keys = [UserApiKey(
+        username=USERNAME,
+        dbid=i,
+        algorithm=ApiKeyAlgorithm.SHA512,
+        iterations=500000,
+        expiry=0,
+        salt='c2FsdA==',
+        server_key='c2VydmVyX2tleQ==',
+        stored_key='c3RvcmVkX2tleQ==',
+    ) for i in range(1, args.keys + 1)]
+    api_keyring.commit_user_entry(USERNAME, keys, lambda data: data)
+    dbids = [key.dbid for key in keys]
+
+    assert python_path(USERNAME, dbids[0]) == native_path(USERNAME, dbids[0])
+
+    print(f'{"path":<10} {"p50 (us)":>10} {"p99 (us)":>10} {"mean (us)":>10} {"syscalls":>10}')
+    for name, fn in (('python', python_path), ('native', native_path)):
+        truenas_keyring.get_syscall_stats(reset=True)
+        fn(USERNAME, dbids[0])
+        syscalls = sum(truenas_keyring.get_syscall_stats(reset=True).values())
+
+        res = measure(fn, dbids, args.iterations)
+        print(f'{name:<10} {res["p50"]:>10.1f} {res["p99"]:>10.1f} {res["mean"]:>10.1f} {syscalls:>10}')
+
+    api_keyring.clear_user_keyring(USERNAME)
+
+
+if __name__ == '__main__':
+    main()
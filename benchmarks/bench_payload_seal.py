@@ -0,0 +1,56 @@
+"""
+Compare sealing API key payloads one call per key (as with an encrypt_fn
+callable) against sealing the whole batch in one GIL-released call, with
+and without thread fan-out.
+
+Does not touch the kernel keyring and so may be run as any user:
+
+    python3 benchmarks/bench_payload_seal.py --keys 1000 --rounds 20 --threads 4
+"""
+import argparse
+import os
+import time
+import truenas_keyring
+
+
+def per_key(key, payloads, threads):
+    return [truenas_keyring.seal_payloads(key=key, payloads=[p])[0] for p in payloads]
+
+
+def batch(key, payloads, threads):
+    return truenas_keyring.seal_payloads(key=key, payloads=payloads, threads=threads)
+
+
+def open_batch(key, payloads, threads):
+    return truenas_keyring.open_payloads(key=key, payloads=payloads, threads=threads)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--keys', type=int, default=1000, help='payloads per batch')
+    parser.add_argument('--size', type=int, default=256, help='payload size in bytes')
+    parser.add_argument('--rounds', type=int, default=20)
+    parser.add_argument('--threads', type=int, default=4)
+    args = parser.parse_args()
+
+    key = os.urandom(32)
+    payloads = [os.urandom(args.size) for i in range(args.keys)]
+    sealed = batch(key, payloads, 1)
+
+    print(f'{"mode":<24} {"us/key":>10}')
+    for name, fn, data, threads in (
+        ('seal per key', per_key, payloads, 1),
+        ('seal batch', batch, payloads, 1),
+        (f'seal batch x{args.threads}', batch, payloads, args.threads),
+        ('open batch', open_batch, sealed, 1),
+        (f'open batch x{args.threads}', open_batch, sealed, args.threads),
+    ):
+        start = time.perf_counter_ns()
+        for i in range(args.rounds):
+            fn(key, data, threads)
+        elapsed = (time.perf_counter_ns() - start) / 1000 / (args.rounds * len(data))
+        print(f'{name:<24} {elapsed:>10.2f}')
+
+
+if __name__ == '__main__':
+    main()
@@ -5,13 +5,24 @@ truenas_keyring_ext = Extension(
     sources=[
         'src/truenas_keyring.c',
         'src/py_key_utils.c',
+        'src/py_api_key_record.c',
+        'src/py_key_cache.c',
+        'src/py_scratch.c',
+        'src/py_key_bundle.c',
+        'src/py_scram.c',
+        'src/py_payload_seal.c',
+        'src/py_commit_pool.c',
         'src/py_tn_key.c',
         'src/py_tn_keyring.c',
         'src/py_tn_keyring_iter.c',
+        'src/py_tn_keyring_walk.c',
+        'src/py_tn_key_watcher.c',
+        'src/py_tn_completion_queue.c',
+        'src/py_tn_commit_queue.c',
         'src/py_tn_key_enum.c'
     ],
     include_dirs=['src'],
-    libraries=['keyutils']
+    libraries=['keyutils', 'crypto']
 )
 
 setup(
@@ -0,0 +1,312 @@
+/* Compact binary encoding of API key records */
+
+#include "truenas_keyring.h"
+#include <endian.h>
+
+/*
+ * Record layout (version 1). All integers are little-endian.
+ *
+ *   0  magic          "TNAK"
+ *   4  version        u8
+ *   5  algorithm      u8 (enum tn_api_key_alg)
+ *   6  reserved       u16, must be zero
+ *   8  dbid           s64
+ *  16  expiry         s64
+ *  24  iterations     u32
+ *  28  username_len   u16
+ *  30  salt_len       u16
+ *  32  server_key_len u16
+ *  34  stored_key_len u16
+ *  36  username, salt, server_key, stored_key
+ */
+#define TN_API_KEY_RECORD_HDRSZ 36
+
+static const char *api_key_alg_names[TN_API_KEY_ALG_CNT] = {
+	[TN_API_KEY_ALG_SHA512] = "SHA512",
+};
+
+static PyStructSequence_Field api_key_record_fields[] = {
+	{"username", "Name of the user"},
+	{"dbid", "Datastore primary key of the API key"},
+	{"algorithm", "Crypto algorithm used for auth"},
+	{"iterations", "Number of pbkdf2_hmac iterations"},
+	{"expiry", "Unix timestamp when the API key expires, zero for never"},
+	{"salt", "Cryptographic salt"},
+	{"server_key", "SCRAM ServerKey"},
+	{"stored_key", "SCRAM StoredKey"},
+	{NULL}
+};
+
+static PyStructSequence_Desc api_key_record_desc = {
+	.name = MODULE_NAME ".ApiKeyRecord",
+	.doc = "Decoded API key record. Binary fields are raw bytes",
+	.fields = api_key_record_fields,
+	.n_in_sequence = 8,
+};
+
+static inline void
+put_le16(unsigned char *p, uint16_t val)
+{
+	val = htole16(val);
+	memcpy(p, &val, sizeof(val));
+}
+
+static inline void
+put_le32(unsigned char *p, uint32_t val)
+{
+	val = htole32(val);
+	memcpy(p, &val, sizeof(val));
+}
+
+static inline void
+put_le64(unsigned char *p, uint64_t val)
+{
+	val = htole64(val);
+	memcpy(p, &val, sizeof(val));
+}
+
+static inline uint16_t
+get_le16(const unsigned char *p)
+{
+	uint16_t val;
+	memcpy(&val, p, sizeof(val));
+	return le16toh(val);
+}
+
+static inline uint32_t
+get_le32(const unsigned char *p)
+{
+	uint32_t val;
+	memcpy(&val, p, sizeof(val));
+	return le32toh(val);
+}
+
+static inline uint64_t
+get_le64(const unsigned char *p)
+{
+	uint64_t val;
+	memcpy(&val, p, sizeof(val));
+	return le64toh(val);
+}
+
+/*
+ * Look up the algorithm ID for the specified name. Returns false
+ * if the algorithm is not supported.
+ */
+bool
+api_key_alg_from_name(const char *name, enum tn_api_key_alg *alg_out)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(api_key_alg_names); i++) {
+		if (strcmp(api_key_alg_names[i], name) == 0) {
+			*alg_out = (enum tn_api_key_alg)i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Encode the record as bytes. Field lengths must have been validated
+ * against TN_API_KEY_FIELD_MAX by caller. Requires GIL.
+ */
+PyObject *
+api_key_record_pack(const tn_api_key_record_t *rec)
+{
+	const tn_api_key_field_t *fields[] = {
+		&rec->username, &rec->salt, &rec->server_key, &rec->stored_key
+	};
+	unsigned char *p;
+	size_t i, len = TN_API_KEY_RECORD_HDRSZ;
+	PyObject *out;
+
+	for (i = 0; i < ARRAY_SIZE(fields); i++) {
+		len += fields[i]->len;
+	}
+
+	out = PyBytes_FromStringAndSize(NULL, len);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	p = (unsigned char *)PyBytes_AS_STRING(out);
+	memcpy(p, TN_API_KEY_RECORD_MAGIC, 4);
+	p[4] = TN_API_KEY_RECORD_VERSION;
+	p[5] = (unsigned char)rec->algorithm;
+	put_le16(p + 6, 0);
+	put_le64(p + 8, (uint64_t)rec->dbid);
+	put_le64(p + 16, (uint64_t)rec->expiry);
+	put_le32(p + 24, rec->iterations);
+
+	p += 28;
+	for (i = 0; i < ARRAY_SIZE(fields); i++, p += 2) {
+		put_le16(p, (uint16_t)fields[i]->len);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(fields); i++) {
+		memcpy(p, fields[i]->buf, fields[i]->len);
+		p += fields[i]->len;
+	}
+
+	return out;
+}
+
+/*
+ * Validate a record produced by api_key_record_pack() and point the fields
+ * of rec into buf. Returns false with errno set to EINVAL if buf is not a
+ * record, EPROTONOSUPPORT if the record version is unsupported, EOPNOTSUPP
+ * if the algorithm is unsupported or EBADMSG if the record is truncated or
+ * corrupt. Does not require GIL.
+ */
+bool
+api_key_record_parse(const unsigned char *buf, size_t len, tn_api_key_record_t *rec)
+{
+	tn_api_key_field_t *fields[] = {
+		&rec->username, &rec->salt, &rec->server_key, &rec->stored_key
+	};
+	size_t i, offset = TN_API_KEY_RECORD_HDRSZ;
+
+	if ((len < TN_API_KEY_RECORD_HDRSZ) || (memcmp(buf, TN_API_KEY_RECORD_MAGIC, 4) != 0)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	if (buf[4] != TN_API_KEY_RECORD_VERSION) {
+		errno = EPROTONOSUPPORT;
+		return false;
+	}
+
+	if (buf[5] >= TN_API_KEY_ALG_CNT) {
+		errno = EOPNOTSUPP;
+		return false;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(fields); i++) {
+		fields[i]->len = get_le16(buf + 28 + (i * 2));
+		fields[i]->buf = buf + offset;
+		offset += fields[i]->len;
+	}
+
+	if (offset != len) {
+		errno = EBADMSG;
+		return false;
+	}
+
+	rec->algorithm = (enum tn_api_key_alg)buf[5];
+	rec->dbid = (int64_t)get_le64(buf + 8);
+	rec->expiry = (int64_t)get_le64(buf + 16);
+	rec->iterations = get_le32(buf + 24);
+	return true;
+}
+
+/*
+ * Decode a record produced by api_key_record_pack() into an ApiKeyRecord.
+ * Raises ValueError if the buffer is not a valid record. Requires GIL.
+ */
+PyObject *
+api_key_record_unpack(PyObject *module_obj, const unsigned char *buf, size_t len)
+{
+	tn_module_state_t *state = NULL;
+	tn_api_key_record_t parsed;
+	const tn_api_key_field_t *fields[] = {
+		&parsed.salt, &parsed.server_key, &parsed.stored_key
+	};
+	PyObject *rec = NULL, *val = NULL;
+	size_t i;
+
+	state = (tn_module_state_t *)PyModule_GetState(module_obj);
+	if (state == NULL) {
+		return NULL;
+	}
+
+	if (!api_key_record_parse(buf, len, &parsed)) {
+		switch (errno) {
+		case EPROTONOSUPPORT:
+			PyErr_Format(PyExc_ValueError, "%u: unsupported API key record version",
+				     buf[4]);
+			break;
+		case EOPNOTSUPP:
+			PyErr_Format(PyExc_ValueError, "%u: unsupported API key algorithm", buf[5]);
+			break;
+		case EBADMSG:
+			PyErr_SetString(PyExc_ValueError, "API key record is truncated or corrupt");
+			break;
+		default:
+			PyErr_SetString(PyExc_ValueError, "not an API key record");
+			break;
+		}
+		return NULL;
+	}
+
+	rec = PyStructSequence_New((PyTypeObject *)state->api_key_record_type);
+	if (rec == NULL) {
+		return NULL;
+	}
+
+	val = PyUnicode_DecodeUTF8(parsed.username.buf, parsed.username.len, NULL);
+	if (val == NULL) {
+		goto fail;
+	}
+	PyStructSequence_SetItem(rec, 0, val);
+
+	val = PyLong_FromLongLong((long long)parsed.dbid);
+	if (val == NULL) {
+		goto fail;
+	}
+	PyStructSequence_SetItem(rec, 1, val);
+
+	val = PyUnicode_FromString(api_key_alg_names[parsed.algorithm]);
+	if (val == NULL) {
+		goto fail;
+	}
+	PyStructSequence_SetItem(rec, 2, val);
+
+	val = PyLong_FromUnsignedLong(parsed.iterations);
+	if (val == NULL) {
+		goto fail;
+	}
+	PyStructSequence_SetItem(rec, 3, val);
+
+	val = PyLong_FromLongLong((long long)parsed.expiry);
+	if (val == NULL) {
+		goto fail;
+	}
+	PyStructSequence_SetItem(rec, 4, val);
+
+	for (i = 0; i < ARRAY_SIZE(fields); i++) {
+		val = PyBytes_FromStringAndSize(fields[i]->buf, fields[i]->len);
+		if (val == NULL) {
+			goto fail;
+		}
+		PyStructSequence_SetItem(rec, 5 + i, val);
+	}
+
+	return rec;
+
+fail:
+	Py_DECREF(rec);
+	return NULL;
+}
+
+/*
+ * Create the ApiKeyRecord type. Requires GIL.
+ */
+int
+tn_api_key_record_add_to_module(PyObject *module)
+{
+	tn_module_state_t *state;
+
+	state = (tn_module_state_t *)PyModule_GetState(module);
+	if (state == NULL) {
+		return -1;
+	}
+
+	state->api_key_record_type = (PyObject *)PyStructSequence_NewType(&api_key_record_desc);
+	if (state->api_key_record_type == NULL) {
+		return -1;
+	}
+
+	return PyModule_AddObjectRef(module, "ApiKeyRecord", state->api_key_record_type);
+}
@@ -0,0 +1,244 @@
+/* Parallel commit and clear of keyrings for many parents */
+
+#include "truenas_keyring.h"
+#include <pthread.h>
+
+/*
+ * Jobs are spread over a small pool of threads created for the duration of
+ * a call. Each job touches independent kernel state (a different child of
+ * root) and so workers just take the next job from a shared counter, which
+ * keeps a few slow jobs from holding up the rest.
+ */
+typedef struct {
+	void (*fn)(void *ctx, size_t idx);
+	void *ctx;
+	size_t cnt;
+	size_t next;
+} tn_pool_t;
+
+static void *
+pool_worker(void *arg)
+{
+	tn_pool_t *pool = arg;
+	size_t idx;
+
+	while ((idx = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->cnt) {
+		pool->fn(pool->ctx, idx);
+	}
+
+	return NULL;
+}
+
+/*
+ * Call fn(ctx, idx) for every idx below cnt using up to `workers` threads,
+ * the calling thread being one of them. If a thread can't be created the
+ * remaining threads pick up its share. Does not require GIL.
+ */
+static void
+pool_run(void (*fn)(void *ctx, size_t idx), void *ctx, size_t cnt, size_t workers)
+{
+	tn_pool_t pool = {
+		.fn = fn,
+		.ctx = ctx,
+		.cnt = cnt,
+	};
+	pthread_t tids[TN_COMMIT_WORKERS_MAX];
+	size_t i, started = 0;
+
+	if (workers > cnt) {
+		workers = cnt;
+	}
+	if (workers > TN_COMMIT_WORKERS_MAX) {
+		workers = TN_COMMIT_WORKERS_MAX;
+	}
+
+	for (i = 1; i < workers; i++) {
+		if (pthread_create(&tids[started], NULL, pool_worker, &pool) != 0) {
+			break;
+		}
+		started++;
+	}
+
+	pool_worker(&pool);
+
+	for (i = 0; i < started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+}
+
+typedef struct {
+	key_serial_t root;
+	const char *description;
+	const char *key_type_str;
+	const tn_commit_unlink_t *unlink;
+	size_t unlink_cnt;
+	void *jobs;
+} tn_commit_ctx_t;
+
+/* Unlink keys listed in ctx->unlink from parent, if present */
+static void
+commit_unlink(tn_commit_ctx_t *ctx, key_serial_t parent)
+{
+	key_serial_t serial;
+	size_t i;
+
+	for (i = 0; i < ctx->unlink_cnt; i++) {
+		serial = tn_keyctl_search(parent, ctx->unlink[i].key_type_str,
+					  ctx->unlink[i].description, 0);
+		if (serial != -1) {
+			/* ENOENT if it was found in a nested keyring instead */
+			tn_keyctl_unlink(serial, parent);
+		}
+	}
+}
+
+/*
+ * Resolve (creating if needed) the child of root called name and atomically
+ * replace the keyring `description` within it by one holding entries (see
+ * swap_in_keyring()). Keys listed in unlink are then removed from the child
+ * if present. Returns false with errno set on failure. Does not require GIL.
+ */
+bool
+commit_keyring(key_serial_t root, const char *name, const char *description,
+	       const char *key_type_str, const tn_commit_unlink_t *unlink,
+	       size_t unlink_cnt, tn_add_entry_t *entries, size_t cnt,
+	       key_serial_t *serial_out)
+{
+	tn_commit_ctx_t ctx = {
+		.root = root,
+		.unlink = unlink,
+		.unlink_cnt = unlink_cnt,
+	};
+	key_serial_t parent;
+
+	if (!resolve_keyring_path(root, &name, 1, true, &parent, NULL) ||
+	    !swap_in_keyring(parent, description, key_type_str, entries, cnt, serial_out)) {
+		return false;
+	}
+
+	commit_unlink(&ctx, parent);
+	return true;
+}
+
+static void
+commit_one(void *arg, size_t idx)
+{
+	tn_commit_ctx_t *ctx = arg;
+	tn_commit_job_t *job = (tn_commit_job_t *)ctx->jobs + idx;
+
+	if (!commit_keyring(ctx->root, job->name, ctx->description, ctx->key_type_str,
+			    ctx->unlink, ctx->unlink_cnt, job->entries, job->cnt,
+			    &job->serial)) {
+		job->error = errno;
+	}
+}
+
+/*
+ * Call commit_keyring() for each job, with job->name as the child of root.
+ * The jobs are spread over up to `workers` threads. Per-job failures are
+ * reported in job->error. Does not require GIL.
+ */
+void
+commit_keyrings(key_serial_t root, const char *description, const char *key_type_str,
+		const tn_commit_unlink_t *unlink, size_t unlink_cnt,
+		tn_commit_job_t *jobs, size_t cnt, size_t workers)
+{
+	tn_commit_ctx_t ctx = {
+		.root = root,
+		.description = description,
+		.key_type_str = key_type_str,
+		.unlink = unlink,
+		.unlink_cnt = unlink_cnt,
+		.jobs = jobs,
+	};
+
+	pool_run(commit_one, &ctx, cnt, workers);
+}
+
+static void
+clear_one(void *arg, size_t idx)
+{
+	tn_commit_ctx_t *ctx = arg;
+	tn_clear_job_t *job = (tn_clear_job_t *)ctx->jobs + idx;
+
+	job->target = job->child;
+	if (ctx->description != NULL) {
+		job->target = tn_keyctl_search(job->child, KEY_TYPE_STR_KEYRING,
+					       ctx->description, 0);
+	}
+
+	if ((job->target != -1) && (tn_keyctl_clear(job->target) != -1)) {
+		job->result = TN_CLEAR_CLEARED;
+		commit_unlink(ctx, job->child);
+		return;
+	}
+
+	switch (errno) {
+	case ENOKEY:
+		/* child is a keyring without description */
+		job->result = TN_CLEAR_SKIPPED;
+		commit_unlink(ctx, job->child);
+		break;
+	case ENOTDIR:
+	case EKEYEXPIRED:
+	case EKEYREVOKED:
+		/* nothing there to clear, dead keys are reaped by the kernel */
+		job->result = TN_CLEAR_SKIPPED;
+		break;
+	default:
+		job->result = TN_CLEAR_FAILED;
+		job->error = errno;
+		break;
+	}
+}
+
+/*
+ * Clear the keyring `description` found within each keyring linked into
+ * root, or each of those keyrings themselves if description is NULL. Keys
+ * listed in unlink are then removed from each child that is a keyring,
+ * whether or not it contained description.
+ *
+ * The children of root are collected with a single read and the per-child
+ * work is spread over up to `workers` threads. On success *jobs_out holds
+ * the outcome for each child and must be freed with PyMem_RawFree().
+ * Returns false with errno set if root can't be read, ENOTDIR if it isn't a
+ * keyring. Does not require GIL.
+ */
+bool
+clear_keyrings(key_serial_t root, const char *description,
+	       const tn_commit_unlink_t *unlink, size_t unlink_cnt,
+	       tn_clear_job_t **jobs_out, size_t *cnt_out, size_t workers)
+{
+	tn_commit_ctx_t ctx = {
+		.root = root,
+		.description = description,
+		.unlink = unlink,
+		.unlink_cnt = unlink_cnt,
+	};
+	tn_clear_job_t *jobs;
+	key_serial_t *keys;
+	size_t i, cnt;
+
+	if (!check_keyring(root) || !read_keyring_serials(root, &keys, &cnt)) {
+		return false;
+	}
+
+	jobs = PyMem_RawCalloc(cnt ? cnt : 1, sizeof(tn_clear_job_t));
+	if (jobs == NULL) {
+		scratch_tls_put(keys, cnt * sizeof(key_serial_t));
+		errno = ENOMEM;
+		return false;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		jobs[i].child = keys[i];
+	}
+	scratch_tls_put(keys, cnt * sizeof(key_serial_t));
+
+	ctx.jobs = jobs;
+	pool_run(clear_one, &ctx, cnt, workers);
+
+	*jobs_out = jobs;
+	*cnt_out = cnt;
+	return true;
+}
@@ -0,0 +1,256 @@
+/* Indexed bundle of key payloads stored in a single key */
+
+#include "truenas_keyring.h"
+#include <endian.h>
+
+/*
+ * Bundle layout (version 1). All integers are little-endian.
+ *
+ *   0  magic          "TNKB"
+ *   4  version        u8
+ *   5  reserved       3 bytes, must be zero
+ *   8  count          u32
+ *  12  reserved       u32, must be zero
+ *  16  index          count entries sorted by dbid:
+ *                       s64 dbid, s64 expiry, u32 offset, u32 length
+ *      payloads       referenced by offset from start of bundle
+ *
+ * The index allows a single payload to be located by binary search
+ * without touching the others.
+ */
+#define TN_BUNDLE_HDRSZ 16
+#define TN_BUNDLE_IDXSZ 24
+
+static inline uint32_t
+bundle_u32(const unsigned char *p)
+{
+	uint32_t val;
+	memcpy(&val, p, sizeof(val));
+	return le32toh(val);
+}
+
+static inline int64_t
+bundle_s64(const unsigned char *p)
+{
+	uint64_t val;
+	memcpy(&val, p, sizeof(val));
+	return (int64_t)le64toh(val);
+}
+
+static inline bool
+bundle_expired(int64_t expiry, time_t now)
+{
+	return (expiry > 0) && (expiry <= (int64_t)now);
+}
+
+static int
+bundle_entry_cmp(const void *a, const void *b)
+{
+	const tn_bundle_entry_t *ea = a, *eb = b;
+
+	if (ea->dbid == eb->dbid) {
+		return 0;
+	}
+
+	return ea->dbid < eb->dbid ? -1 : 1;
+}
+
+/*
+ * Sort entries by dbid and compute the size of the packed bundle. Returns
+ * false with errno set to EEXIST if a dbid is duplicated or EFBIG if the
+ * bundle would be too large to index. Does not require GIL.
+ */
+bool
+bundle_prepare(tn_bundle_entry_t *entries, size_t cnt, size_t *size_out)
+{
+	size_t i, size;
+
+	if (cnt > (UINT32_MAX - TN_BUNDLE_HDRSZ) / TN_BUNDLE_IDXSZ) {
+		errno = EFBIG;
+		return false;
+	}
+
+	qsort(entries, cnt, sizeof(tn_bundle_entry_t), bundle_entry_cmp);
+
+	size = TN_BUNDLE_HDRSZ + (cnt * TN_BUNDLE_IDXSZ);
+	for (i = 0; i < cnt; i++) {
+		if ((i > 0) && (entries[i].dbid == entries[i - 1].dbid)) {
+			errno = EEXIST;
+			return false;
+		}
+
+		size += entries[i].data_len;
+		if (size > UINT32_MAX) {
+			errno = EFBIG;
+			return false;
+		}
+	}
+
+	*size_out = size;
+	return true;
+}
+
+/*
+ * Write entries prepared by bundle_prepare() into buf, which must be the
+ * size returned by it. Does not require GIL.
+ */
+void
+bundle_pack(const tn_bundle_entry_t *entries, size_t cnt, unsigned char *buf)
+{
+	unsigned char *idx = buf + TN_BUNDLE_HDRSZ;
+	uint32_t offset = TN_BUNDLE_HDRSZ + (cnt * TN_BUNDLE_IDXSZ);
+	uint32_t u32;
+	uint64_t u64;
+	size_t i;
+
+	memset(buf, 0, TN_BUNDLE_HDRSZ);
+	memcpy(buf, TN_BUNDLE_MAGIC, 4);
+	buf[4] = TN_BUNDLE_VERSION;
+	u32 = htole32((uint32_t)cnt);
+	memcpy(buf + 8, &u32, sizeof(u32));
+
+	for (i = 0; i < cnt; i++, idx += TN_BUNDLE_IDXSZ) {
+		u64 = htole64((uint64_t)entries[i].dbid);
+		memcpy(idx, &u64, sizeof(u64));
+		u64 = htole64((uint64_t)entries[i].expiry);
+		memcpy(idx + 8, &u64, sizeof(u64));
+		u32 = htole32(offset);
+		memcpy(idx + 16, &u32, sizeof(u32));
+		u32 = htole32((uint32_t)entries[i].data_len);
+		memcpy(idx + 20, &u32, sizeof(u32));
+
+		memcpy(buf + offset, entries[i].data, entries[i].data_len);
+		offset += (uint32_t)entries[i].data_len;
+	}
+}
+
+/*
+ * Validate bundle header and index. Returns false with errno set to
+ * EINVAL if buf is not a bundle and EBADMSG if it is corrupt.
+ * Does not require GIL.
+ */
+bool
+bundle_check(const unsigned char *buf, size_t len, size_t *cnt_out)
+{
+	const unsigned char *idx = buf + TN_BUNDLE_HDRSZ;
+	size_t i, cnt;
+
+	if ((len < TN_BUNDLE_HDRSZ) || (memcmp(buf, TN_BUNDLE_MAGIC, 4) != 0) ||
+	    (buf[4] != TN_BUNDLE_VERSION)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	cnt = bundle_u32(buf + 8);
+	if (cnt > (len - TN_BUNDLE_HDRSZ) / TN_BUNDLE_IDXSZ) {
+		errno = EBADMSG;
+		return false;
+	}
+
+	for (i = 0; i < cnt; i++, idx += TN_BUNDLE_IDXSZ) {
+		size_t offset = bundle_u32(idx + 16);
+		size_t data_len = bundle_u32(idx + 20);
+
+		if ((offset > len) || (data_len > len - offset) ||
+		    ((i > 0) && (bundle_s64(idx) <= bundle_s64(idx - TN_BUNDLE_IDXSZ)))) {
+			errno = EBADMSG;
+			return false;
+		}
+	}
+
+	*cnt_out = cnt;
+	return true;
+}
+
+/*
+ * Get entry at position i of a bundle validated by bundle_check().
+ * Does not require GIL.
+ */
+void
+bundle_get(const unsigned char *buf, size_t i, tn_bundle_entry_t *entry)
+{
+	const unsigned char *idx = buf + TN_BUNDLE_HDRSZ + (i * TN_BUNDLE_IDXSZ);
+
+	entry->dbid = bundle_s64(idx);
+	entry->expiry = bundle_s64(idx + 8);
+	entry->data = (const char *)buf + bundle_u32(idx + 16);
+	entry->data_len = bundle_u32(idx + 20);
+}
+
+/*
+ * Binary search a bundle validated by bundle_check() for dbid. Returns
+ * false if the entry doesn't exist or has expired as of now.
+ * Does not require GIL.
+ */
+bool
+bundle_find(const unsigned char *buf, size_t cnt, int64_t dbid, time_t now,
+	    tn_bundle_entry_t *entry)
+{
+	size_t lo = 0, hi = cnt;
+
+	while (lo < hi) {
+		size_t mid = lo + ((hi - lo) / 2);
+		int64_t cur = bundle_s64(buf + TN_BUNDLE_HDRSZ + (mid * TN_BUNDLE_IDXSZ));
+
+		if (cur == dbid) {
+			bundle_get(buf, mid, entry);
+			return !bundle_expired(entry->expiry, now);
+		} else if (cur < dbid) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Convert unexpired entries of a bundle validated by bundle_check() to
+ * a dict of dbid -> payload. Requires GIL.
+ */
+PyObject *
+bundle_to_dict(const unsigned char *buf, size_t cnt, time_t now)
+{
+	tn_bundle_entry_t entry;
+	PyObject *out;
+	size_t i;
+
+	out = PyDict_New();
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *key, *val;
+		int err;
+
+		bundle_get(buf, i, &entry);
+		if (bundle_expired(entry.expiry, now)) {
+			continue;
+		}
+
+		key = PyLong_FromLongLong(entry.dbid);
+		if (key == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		val = PyBytes_FromStringAndSize(entry.data, entry.data_len);
+		if (val == NULL) {
+			Py_DECREF(key);
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		err = PyDict_SetItem(out, key, val);
+		Py_DECREF(key);
+		Py_DECREF(val);
+		if (err) {
+			Py_DECREF(out);
+			return NULL;
+		}
+	}
+
+	return out;
+}
@@ -0,0 +1,448 @@
+/*
+ * In-process cache of keyring search results
+ *
+ * Maps (parent serial, key type, description) to the serial returned by
+ * keyctl_search(). A cached serial is only used after keyctl_describe()
+ * shows that it is still a live key of the expected type and description,
+ * and keyctl_read() of the parent shows that it is still linked there.
+ * This catches keys that were revoked, invalidated, expired, garbage
+ * collected, unlinked or moved since they were cached, whichever process
+ * made the change. Keys unlinked through this module are also dropped
+ * from the cache directly (see the syscall wrappers in truenas_keyring.h).
+ * Searches racing with a change in this process are covered by a
+ * generation count that is bumped whenever entries are dropped: a search
+ * only caches its result if no entries were dropped while it was in the
+ * kernel.
+ *
+ * keyctl_search() is recursive, but only results linked directly into the
+ * parent are cached, since linkage of a key nested further down can't be
+ * confirmed with a single read. Any change to keyring topology made
+ * through this module flushes the whole cache rather than trying to work
+ * out which entries are affected. Adding non-keyring keys only drops
+ * entries with the same type and description.
+ *
+ * Misses may optionally be cached as well (see key_cache_set_negative()).
+ * Negative entries can't be revalidated, and so they expire after a short
+ * TTL. They are dropped under the same rules as positive entries, which
+ * covers keys added through this module. Keys added by other processes are
+ * only noticed once the negative entry expires.
+ *
+ * The cache is shared by all threads and is protected by a mutex. None of
+ * the functions here require the GIL.
+ */
+
+#include "truenas_keyring.h"
+#include <pthread.h>
+#include <time.h>
+
+#define TN_KEY_CACHE_BUCKETS 128
+#define TN_KEY_CACHE_MAX_ENTRIES 1024
+#define TN_KEY_CACHE_NEG_MAX_DEFAULT 256
+
+typedef struct tn_cache_entry {
+	struct tn_cache_entry *next;
+	key_serial_t parent;
+	key_serial_t serial;
+	/* CLOCK_MONOTONIC expiry of negative entry (serial 0), else 0 */
+	uint64_t expires;
+	uint32_t hash;
+	const char *key_type_str;
+	const char *description;
+	/* key_type_str and description are stored here */
+	char strings[];
+} tn_cache_entry_t;
+
+static struct {
+	pthread_mutex_t lock;
+	tn_cache_entry_t *buckets[TN_KEY_CACHE_BUCKETS];
+	size_t cnt;
+	size_t neg_cnt;
+	size_t neg_max;
+	uint64_t neg_ttl_ns;
+	/* bumped each time entries are invalidated */
+	uint64_t gen;
+} key_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.neg_max = TN_KEY_CACHE_NEG_MAX_DEFAULT,
+};
+
+unsigned long tn_cache_stats[TN_CACHE_STAT_CNT];
+const char *tn_cache_stat_names[TN_CACHE_STAT_CNT] = {
+	[TN_CACHE_STAT_HIT] = "hits",
+	[TN_CACHE_STAT_MISS] = "misses",
+	[TN_CACHE_STAT_STALE] = "stale",
+	[TN_CACHE_STAT_FLUSH] = "flushes",
+	[TN_CACHE_STAT_NEG_HIT] = "negative_hits",
+};
+
+#define TN_CACHE_STAT_INC(stat) \
+	__atomic_fetch_add(&tn_cache_stats[stat], 1, __ATOMIC_RELAXED)
+
+static uint64_t
+key_cache_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Must be called with key_cache.lock held */
+static void
+key_cache_free_entry_locked(tn_cache_entry_t *entry)
+{
+	if (entry->serial == 0) {
+		key_cache.neg_cnt--;
+	}
+
+	key_cache.cnt--;
+	PyMem_RawFree(entry);
+}
+
+/*
+ * FNV-1a over type and description. The parent serial is deliberately not
+ * part of the hash so that key_cache_forget() only has to walk one bucket.
+ */
+static uint32_t
+key_cache_hash(const char *key_type_str, const char *description)
+{
+	uint32_t hash = 2166136261u;
+	const char *p;
+
+	for (p = key_type_str; *p; p++) {
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
+	}
+
+	hash = (hash ^ 0xff) * 16777619u;
+
+	for (p = description; *p; p++) {
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
+	}
+
+	return hash;
+}
+
+static bool
+key_cache_match(const tn_cache_entry_t *entry, uint32_t hash,
+		const char *key_type_str, const char *description)
+{
+	return (entry->hash == hash) &&
+	       (strcmp(entry->key_type_str, key_type_str) == 0) &&
+	       (strcmp(entry->description, description) == 0);
+}
+
+/* Must be called with key_cache.lock held */
+static void
+key_cache_flush_locked(void)
+{
+	size_t i;
+
+	for (i = 0; i < TN_KEY_CACHE_BUCKETS; i++) {
+		tn_cache_entry_t *entry = key_cache.buckets[i];
+
+		while (entry != NULL) {
+			tn_cache_entry_t *next = entry->next;
+			PyMem_RawFree(entry);
+			entry = next;
+		}
+
+		key_cache.buckets[i] = NULL;
+	}
+
+	key_cache.cnt = 0;
+	key_cache.neg_cnt = 0;
+	key_cache.gen++;
+}
+
+/* Drop all negative entries. Must be called with key_cache.lock held */
+static void
+key_cache_flush_negative_locked(void)
+{
+	size_t i;
+
+	for (i = 0; i < TN_KEY_CACHE_BUCKETS && key_cache.neg_cnt; i++) {
+		tn_cache_entry_t **pentry = &key_cache.buckets[i];
+
+		while (*pentry != NULL) {
+			tn_cache_entry_t *entry = *pentry;
+
+			if (entry->serial == 0) {
+				*pentry = entry->next;
+				key_cache_free_entry_locked(entry);
+				continue;
+			}
+
+			pentry = &entry->next;
+		}
+	}
+}
+
+/*
+ * Remove entries matching type and description. If parent is 0 then
+ * entries for all parents are removed. Must be called with lock held.
+ */
+static void
+key_cache_remove_locked(key_serial_t parent, const char *key_type_str,
+			const char *description)
+{
+	uint32_t hash = key_cache_hash(key_type_str, description);
+	tn_cache_entry_t **pentry = &key_cache.buckets[hash % TN_KEY_CACHE_BUCKETS];
+
+	while (*pentry != NULL) {
+		tn_cache_entry_t *entry = *pentry;
+
+		if (key_cache_match(entry, hash, key_type_str, description) &&
+		    ((parent == 0) || (entry->parent == parent))) {
+			*pentry = entry->next;
+			key_cache_free_entry_locked(entry);
+			continue;
+		}
+
+		pentry = &entry->next;
+	}
+}
+
+/*
+ * Look up cached search result. serial_out is 0 for a negative entry, in
+ * which case expires_out is its expiry time.
+ */
+static bool
+key_cache_lookup(key_serial_t parent, const char *key_type_str,
+		 const char *description, key_serial_t *serial_out,
+		 uint64_t *expires_out)
+{
+	uint32_t hash = key_cache_hash(key_type_str, description);
+	tn_cache_entry_t *entry;
+	bool found = false;
+
+	pthread_mutex_lock(&key_cache.lock);
+	for (entry = key_cache.buckets[hash % TN_KEY_CACHE_BUCKETS];
+	     entry != NULL; entry = entry->next) {
+		if ((entry->parent == parent) &&
+		    key_cache_match(entry, hash, key_type_str, description)) {
+			*serial_out = entry->serial;
+			*expires_out = entry->expires;
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&key_cache.lock);
+
+	return found;
+}
+
+static uint64_t
+key_cache_generation(void)
+{
+	uint64_t gen;
+
+	pthread_mutex_lock(&key_cache.lock);
+	gen = key_cache.gen;
+	pthread_mutex_unlock(&key_cache.lock);
+
+	return gen;
+}
+
+/*
+ * If gen is not NULL then the entry is only inserted if the cache
+ * generation still matches it, i.e. nothing was invalidated since the
+ * result being recorded was obtained.
+ */
+static void
+key_cache_insert_entry(key_serial_t parent, const char *key_type_str,
+		       const char *description, key_serial_t serial,
+		       uint64_t expires, const uint64_t *gen)
+{
+	size_t type_len = strlen(key_type_str) + 1;
+	size_t desc_len = strlen(description) + 1;
+	tn_cache_entry_t *entry;
+	size_t idx;
+
+	entry = PyMem_RawMalloc(sizeof(tn_cache_entry_t) + type_len + desc_len);
+	if (entry == NULL) {
+		return;
+	}
+
+	memcpy(entry->strings, key_type_str, type_len);
+	memcpy(entry->strings + type_len, description, desc_len);
+	entry->key_type_str = entry->strings;
+	entry->description = entry->strings + type_len;
+	entry->parent = parent;
+	entry->serial = serial;
+	entry->expires = expires;
+	entry->hash = key_cache_hash(key_type_str, description);
+	idx = entry->hash % TN_KEY_CACHE_BUCKETS;
+
+	pthread_mutex_lock(&key_cache.lock);
+	if ((gen != NULL) && (*gen != key_cache.gen)) {
+		pthread_mutex_unlock(&key_cache.lock);
+		PyMem_RawFree(entry);
+		return;
+	}
+
+	key_cache_remove_locked(parent, key_type_str, description);
+
+	/* The working set is small. Start over rather than track LRU order. */
+	if (key_cache.cnt >= TN_KEY_CACHE_MAX_ENTRIES) {
+		key_cache_flush_locked();
+	} else if ((serial == 0) && (key_cache.neg_cnt >= key_cache.neg_max)) {
+		key_cache_flush_negative_locked();
+	}
+
+	entry->next = key_cache.buckets[idx];
+	key_cache.buckets[idx] = entry;
+	key_cache.cnt++;
+	if (serial == 0) {
+		key_cache.neg_cnt++;
+	}
+	pthread_mutex_unlock(&key_cache.lock);
+}
+
+/*
+ * Record the result of a search. serial must be linked directly into
+ * parent. Failure to allocate simply means the result isn't cached.
+ */
+void key_cache_insert(key_serial_t parent, const char *key_type_str,
+		      const char *description, key_serial_t serial)
+{
+	key_cache_insert_entry(parent, key_type_str, description, serial, 0, NULL);
+}
+
+/* Record that a search failed with ENOKEY, if negative caching is enabled */
+static void
+key_cache_insert_negative(key_serial_t parent, const char *key_type_str,
+			  const char *description, uint64_t gen)
+{
+	uint64_t ttl = __atomic_load_n(&key_cache.neg_ttl_ns, __ATOMIC_RELAXED);
+
+	if (ttl == 0) {
+		return;
+	}
+
+	key_cache_insert_entry(parent, key_type_str, description, 0,
+			       key_cache_now_ns() + ttl, &gen);
+}
+
+/*
+ * Configure caching of failed searches. A TTL of 0 disables it. Existing
+ * negative entries are dropped.
+ */
+void key_cache_set_negative(uint64_t ttl_ns, size_t max_entries)
+{
+	pthread_mutex_lock(&key_cache.lock);
+	key_cache_flush_negative_locked();
+	key_cache.neg_max = max_entries;
+	__atomic_store_n(&key_cache.neg_ttl_ns, ttl_ns, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&key_cache.lock);
+}
+
+/*
+ * Drop cached results for the specified type and description under any
+ * parent. Used when a key is added, since it may displace a cached one.
+ */
+void key_cache_forget(const char *key_type_str, const char *description)
+{
+	pthread_mutex_lock(&key_cache.lock);
+	key_cache_remove_locked(0, key_type_str, description);
+	key_cache.gen++;
+	pthread_mutex_unlock(&key_cache.lock);
+}
+
+void key_cache_flush(void)
+{
+	pthread_mutex_lock(&key_cache.lock);
+	key_cache_flush_locked();
+	pthread_mutex_unlock(&key_cache.lock);
+	TN_CACHE_STAT_INC(TN_CACHE_STAT_FLUSH);
+}
+
+size_t key_cache_size(void)
+{
+	size_t cnt;
+
+	pthread_mutex_lock(&key_cache.lock);
+	cnt = key_cache.cnt;
+	pthread_mutex_unlock(&key_cache.lock);
+
+	return cnt;
+}
+
+/*
+ * Check that the cached serial still refers to a live key of the expected
+ * type and description that is linked directly into parent. Leaves the
+ * description of the key in info.
+ */
+static bool
+key_cache_validate(key_serial_t parent, key_serial_t serial, const char *key_type_str,
+		   const char *description, tn_key_info_t *info)
+{
+	bool linked;
+
+	if (!describe_key(serial, info)) {
+		return false;
+	}
+
+	if ((strcmp(info->key_type_str, key_type_str) != 0) ||
+	    (strcmp(info->description, description) != 0)) {
+		return false;
+	}
+
+	return keyring_links(parent, serial, &linked) && linked;
+}
+
+/*
+ * Cached equivalent of keyctl_search(parent, key_type_str, description, 0).
+ * If info is not NULL then it is filled in with the description of the
+ * returned key. Returns -1 with errno set on failure.
+ */
+key_serial_t cached_keyring_search(key_serial_t parent, const char *key_type_str,
+				   const char *description, tn_key_info_t *info)
+{
+	tn_key_info_t scratch = { 0 };
+	tn_key_info_t *pinfo = info ? info : &scratch;
+	key_serial_t serial;
+	uint64_t expires, gen;
+	bool linked;
+
+	if (key_cache_lookup(parent, key_type_str, description, &serial, &expires)) {
+		if ((serial == 0) && (key_cache_now_ns() < expires)) {
+			TN_CACHE_STAT_INC(TN_CACHE_STAT_NEG_HIT);
+			errno = ENOKEY;
+			return -1;
+		} else if ((serial != 0) &&
+			   key_cache_validate(parent, serial, key_type_str, description, pinfo)) {
+			TN_CACHE_STAT_INC(TN_CACHE_STAT_HIT);
+			free_key_info(&scratch);
+			return serial;
+		}
+
+		TN_CACHE_STAT_INC(TN_CACHE_STAT_STALE);
+		pthread_mutex_lock(&key_cache.lock);
+		key_cache_remove_locked(parent, key_type_str, description);
+		pthread_mutex_unlock(&key_cache.lock);
+	}
+
+	TN_CACHE_STAT_INC(TN_CACHE_STAT_MISS);
+	free_key_info(&scratch);
+
+	gen = key_cache_generation();
+	serial = tn_keyctl_search(parent, key_type_str, description, 0);
+	if (serial == -1) {
+		if (errno == ENOKEY) {
+			key_cache_insert_negative(parent, key_type_str, description, gen);
+			errno = ENOKEY;
+		}
+		return -1;
+	}
+
+	/* A result nested below parent is returned but not cached */
+	if (keyring_links(parent, serial, &linked) && linked) {
+		key_cache_insert_entry(parent, key_type_str, description, serial, 0, &gen);
+	}
+
+	if ((info != NULL) && !describe_key(serial, info)) {
+		return -1;
+	}
+
+	return serial;
+}
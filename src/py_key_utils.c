@@ -3,36 +3,261 @@
 #include "truenas_keyring.h"
 
 
+#define TNKEY_SEPARATOR ";"
+
+enum tnkeydescfield {
+	TNKEYDESC_KEY_TYPE_NAME = 0,
+	TNKEYDESC_KEY_UID,
+	TNKEYDESC_KEY_GID,
+	TNKEYDESC_KEY_PERM
+};
+
+unsigned long tn_syscall_stats[TN_STAT_CNT];
+const char *tn_syscall_stat_names[TN_STAT_CNT] = {
+	[TN_STAT_DESCRIBE] = "describe",
+	[TN_STAT_READ] = "read",
+	[TN_STAT_SEARCH] = "search",
+	[TN_STAT_ADD] = "add_key",
+	[TN_STAT_SET_TIMEOUT] = "set_timeout",
+	[TN_STAT_UPDATE] = "update",
+	[TN_STAT_UNLINK] = "unlink",
+	[TN_STAT_LINK] = "link",
+	[TN_STAT_MOVE] = "move",
+	[TN_STAT_CLEAR] = "clear",
+};
+
+unsigned long tn_read_stats[TN_READ_STAT_CNT];
+const char *tn_read_stat_names[TN_READ_STAT_CNT] = {
+	[TN_READ_STAT_DESCRIBE_HIT] = "describe_hit",
+	[TN_READ_STAT_DESCRIBE_MISS] = "describe_miss",
+	[TN_READ_STAT_SERIALS_HIT] = "serials_hit",
+	[TN_READ_STAT_SERIALS_MISS] = "serials_miss",
+	[TN_READ_STAT_PAYLOAD_HIT] = "payload_hit",
+	[TN_READ_STAT_PAYLOAD_MISS] = "payload_miss",
+	[TN_READ_STAT_DATA_HIT] = "read_data_hit",
+	[TN_READ_STAT_DATA_MISS] = "read_data_miss",
+};
+
+/*
+ * Largest result observed so far by each of the optimistic read helpers.
+ * Used to size the buffer for the first attempt so that after warming up
+ * nearly every read completes with a single syscall.
+ */
+static size_t desc_size_hint = TN_DESC_BUFSZ;
+static size_t serials_size_hint = TN_SERIALS_BUFSZ;
+static size_t payload_size_hint_val = TN_PAYLOAD_BUFSZ;
+
+static inline size_t
+size_hint_get(size_t *hint)
+{
+	return __atomic_load_n(hint, __ATOMIC_RELAXED);
+}
+
+static inline void
+size_hint_observe(size_t *hint, size_t size)
+{
+	size_t cur = __atomic_load_n(hint, __ATOMIC_RELAXED);
+
+	while ((size > cur) &&
+	       !__atomic_compare_exchange_n(hint, &cur, size, false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+size_t payload_size_hint(void)
+{
+	return size_hint_get(&payload_size_hint_val);
+}
+
+void payload_size_observe(size_t size)
+{
+	size_hint_observe(&payload_size_hint_val, size);
+}
+
+/*
+ * Parse the raw keyctl_describe() output in info->desc_buf and set the
+ * remaining fields of info to point into it. Does not require GIL.
+ */
+bool parse_key_description(tn_key_info_t *info)
+{
+	char *pdesc;
+	char *token;
+	char *saveptr;
+	char *endptr;
+	int field = 0;
+	unsigned long val;
+
+	/*
+	 * Description has form "%s;%d;%d;%08x;%s"
+	 * new items may be added in future kernels before
+	 * the trailing %s (description) and so we use
+	 * strrchr to reach it.
+	 *
+	 * c.f. man (3) keyctl_describe
+	 */
+	pdesc = strrchr(info->desc_buf, ';');
+	if (pdesc == NULL) {
+		errno = EINVAL;
+		return false;
+	}
+	info->description = pdesc + 1;
+
+	token = strtok_r(info->desc_buf, TNKEY_SEPARATOR, &saveptr);
+	while (token != NULL && field <= TNKEYDESC_KEY_PERM) {
+		switch (field) {
+		case TNKEYDESC_KEY_TYPE_NAME:
+			info->key_type_str = token;
+			break;
+		case TNKEYDESC_KEY_UID:
+			val = strtoul(token, &endptr, 10);
+			if (*endptr != '\0' || endptr == token) {
+				info->uid = TNKEY_NOVAL;
+			} else {
+				info->uid = (uid_t)val;
+			}
+			break;
+		case TNKEYDESC_KEY_GID:
+			val = strtoul(token, &endptr, 10);
+			if (*endptr != '\0' || endptr == token) {
+				info->gid = TNKEY_NOVAL;
+			} else {
+				info->gid = (gid_t)val;
+			}
+			break;
+		case TNKEYDESC_KEY_PERM:
+			val = strtoul(token, &endptr, 16);
+			if (*endptr != '\0' || endptr == token) {
+				info->perm = TNKEY_NOVAL;
+			} else {
+				info->perm = (uint)val;
+			}
+			break;
+		}
+		field++;
+		token = strtok_r(NULL, TNKEY_SEPARATOR, &saveptr);
+	}
+
+	if (field < TNKEYDESC_KEY_PERM) {
+		// Somehow we have a truncated description
+		errno = EINVAL;
+		return false;
+	}
+
+	return true;
+}
+
 /*
- * Retrieve description of key. Allocates memory that must be freed using
- * PyMem_RawFree().
+ * Describe the key with the specified serial and parse the result into info.
+ *
+ * Any buffer already present in info->desc_buf is reused (and grown if the
+ * kernel reports that it is too small) so that callers walking many keys
+ * pay for a single keyctl_describe() per key in the common case. If
+ * info->desc_buf is NULL a new buffer is allocated; it must be released
+ * via free_key_info() unless ownership is passed on to a key object.
  *
- * Does not require GIL. Caller should generate exception
- * from errno.
+ * Does not require GIL. Caller should generate exception from errno.
  */
-char *get_key_description(key_serial_t serial)
+bool describe_key(key_serial_t serial, tn_key_info_t *info)
 {
-	long bufsz, res;
-	char *desc;
+	long res;
+	char *buf;
+	bool first = true;
 
-	bufsz = keyctl_describe(serial, NULL, 0);
-	if (bufsz == -1) {
-		return NULL;
+	if (info->desc_buf == NULL) {
+		size_t bufsz = size_hint_get(&desc_size_hint);
+
+		info->desc_buf = PyMem_RawMalloc(bufsz);
+		if (info->desc_buf == NULL) {
+			errno = ENOMEM;
+			return false;
+		}
+		info->desc_bufsz = bufsz;
 	}
 
-	desc = PyMem_RawMalloc(bufsz);
-	if (desc == NULL) {
-		errno = ENOMEM;
-		return NULL;
+	for (;;) {
+		res = tn_keyctl_describe(serial, info->desc_buf, info->desc_bufsz);
+		if (res == -1) {
+			return false;
+		}
+
+		if ((size_t)res <= info->desc_bufsz) {
+			break;
+		}
+
+		/* Kernel didn't copy anything; grow to reported size and retry */
+		if (first) {
+			TN_READ_STAT_INC(TN_READ_STAT_DESCRIBE_MISS);
+			size_hint_observe(&desc_size_hint, (size_t)res);
+			first = false;
+		}
+
+		buf = PyMem_RawRealloc(info->desc_buf, res);
+		if (buf == NULL) {
+			errno = ENOMEM;
+			return false;
+		}
+		info->desc_buf = buf;
+		info->desc_bufsz = (size_t)res;
 	}
 
-	res = keyctl_describe(serial, desc, bufsz);
-	if (res == -1) {
-		PyMem_RawFree(desc);
-		return NULL;
+	if (first) {
+		TN_READ_STAT_INC(TN_READ_STAT_DESCRIBE_HIT);
+	}
+
+	return parse_key_description(info);
+}
+
+/*
+ * Release the description buffer held by info. Does not require GIL.
+ */
+void free_key_info(tn_key_info_t *info)
+{
+	PyMem_RawFree(info->desc_buf);
+	memset(info, 0, sizeof(*info));
+}
+
+/*
+ * Check a described key against a listing filter. Does not require GIL.
+ */
+bool key_filter_match(const tn_key_filter_t *filter, const tn_key_info_t *info)
+{
+	if ((filter->key_type_str != NULL) &&
+	    (strcmp(filter->key_type_str, info->key_type_str) != 0)) {
+		return false;
 	}
 
-	return desc;
+	if ((filter->description != NULL) &&
+	    (strcmp(filter->description, info->description) != 0)) {
+		return false;
+	}
+
+	if ((filter->description_prefix != NULL) &&
+	    (strncmp(filter->description_prefix, info->description, filter->prefix_len) != 0)) {
+		return false;
+	}
+
+	if ((filter->uid != (uid_t)-1) && (filter->uid != info->uid)) {
+		return false;
+	}
+
+	if ((filter->gid != (gid_t)-1) && (filter->gid != info->gid)) {
+		return false;
+	}
+
+	return (info->perm & filter->perm_mask) == filter->perm_mask;
+}
+
+/*
+ * Release the strings held by filter. Does not require GIL.
+ */
+void free_key_filter(tn_key_filter_t *filter)
+{
+	PyMem_RawFree(filter->key_type_str);
+	PyMem_RawFree(filter->description);
+	PyMem_RawFree(filter->description_prefix);
+	filter->key_type_str = NULL;
+	filter->description = NULL;
+	filter->description_prefix = NULL;
 }
 
 /*
@@ -41,164 +266,1102 @@ char *get_key_description(key_serial_t serial)
  */
 bool check_key_type(key_serial_t serial, const char *key_type_str, bool *match_out)
 {
-	bool match;
-	char *desc;
-	char *saveptr;
-	const char *type_found;
+	tn_key_info_t info = { 0 };
 
-	desc = get_key_description(serial);
-	if (desc == NULL)
+	if (!describe_key(serial, &info)) {
+		free_key_info(&info);
 		return false;
+	}
+
+	*match_out = strcmp(key_type_str, info.key_type_str) == 0;
+	free_key_info(&info);
+	return true;
+}
 
+/*
+ * Check that serial refers to a keyring before reading it as one. Used by
+ * functions taking a keyring as a plain serial rather than a TNKeyring.
+ * Sets errno to ENOTDIR if it is some other type of key. Does not require GIL.
+ */
+bool check_keyring(key_serial_t serial)
+{
+	bool is_keyring;
 
-	type_found = strtok_r(desc, ";", &saveptr);
-	if (type_found == NULL) {
-		PyMem_RawFree(desc);
-		errno = ENOENT;
+	if (!check_key_type(serial, KEY_TYPE_STR_KEYRING, &is_keyring)) {
 		return false;
 	}
 
-	match = strcmp(key_type_str, type_found) == 0;
-	PyMem_RawFree(desc);
+	if (!is_keyring) {
+		errno = ENOTDIR;
+		return false;
+	}
 
-	*match_out = match;
 	return true;
 }
 
 /*
- * Retrieve an array of serial numbers of keys within the specified keyring.
- * Passes out pointer to keyring array and number of members of array.
- * Does not require GIL.
+ * Read the serial numbers of keys within the specified keyring into this
+ * thread's scratch buffer, sized from the largest keyring seen so far, so
+ * that a single keyctl_read() is issued in the common case.
+ *
+ * serial must refer to a keyring, since keyctl_read() of any other key type
+ * returns its payload. Callers that don't hold the serial of a TNKeyring
+ * must check it with check_keyring() first.
  *
  * On failure, errno will be set to a relevant value that can be used
  * to generate an appropriate OSError or TNKeyError exception.
  *
- * NOTE: caller must free keys_out via PyMem_RawFree()
+ * NOTE: caller must release keys_out via scratch_tls_put(). Does not
+ * require GIL.
  */
-bool get_keyring_serials(key_serial_t serial, key_serial_t **keys_out, size_t *cnt_out)
+bool read_keyring_serials(key_serial_t serial, key_serial_t **keys_out, size_t *cnt_out)
 {
+	size_t bufsz = size_hint_get(&serials_size_hint);
+	bool first = true;
+	char *buf;
 	long res;
-	size_t bufsz;
-	key_serial_t *keys;
-	bool is_keyring, success;
+	int err;
 
-	/* First check whether the provided serial is actually a keyring */
-	success = check_key_type(serial, KEY_TYPE_STR_KEYRING, &is_keyring);
-	if (!success)
-		return false;
+	for (;;) {
+		buf = scratch_tls_get(bufsz);
+		if (buf == NULL) {
+			return false;
+		}
+		bufsz = scratch_size(buf);
 
-	if (!is_keyring) {
+		res = tn_keyctl_read(serial, buf, bufsz);
+		if (res == -1) {
+			err = errno;
+			scratch_tls_put(buf, 0);
+			errno = err;
+			return false;
+		}
+
+		if ((size_t)res <= bufsz) {
+			break;
+		}
+
+		/* Kernel didn't copy anything; grow to reported size and retry */
+		scratch_tls_put(buf, 0);
+		if (first) {
+			TN_READ_STAT_INC(TN_READ_STAT_SERIALS_MISS);
+			size_hint_observe(&serials_size_hint, (size_t)res);
+			first = false;
+		}
+		bufsz = (size_t)res;
+	}
+
+	if (res % sizeof(key_serial_t) != 0) {
+		// This shouldn't happen, but perhaps we got a short read
+		// or the length of read isn't what's expected for an array of serials
+		scratch_tls_put(buf, (size_t)res);
 		errno = EINVAL;
 		return false;
 	}
 
-	res = keyctl_read(serial, NULL, 0);
-	if (res == -1) {
+	if (first) {
+		TN_READ_STAT_INC(TN_READ_STAT_SERIALS_HIT);
+	}
+
+	*keys_out = (key_serial_t *)buf;
+	*cnt_out = res / sizeof(key_serial_t);
+
+	return true;
+}
+
+/*
+ * Check whether target is linked directly into the keyring. See
+ * read_keyring_serials(). Does not require GIL.
+ */
+bool keyring_links(key_serial_t ring, key_serial_t target, bool *found)
+{
+	key_serial_t *keys;
+	size_t i, cnt;
+
+	if (!read_keyring_serials(ring, &keys, &cnt)) {
+		return false;
+	}
+
+	*found = false;
+	for (i = 0; i < cnt; i++) {
+		if (keys[i] == target) {
+			*found = true;
+			break;
+		}
+	}
+	scratch_tls_put(keys, cnt * sizeof(key_serial_t));
+
+	return true;
+}
+
+/*
+ * Retrieve an array of serial numbers of keys within the specified keyring.
+ * Passes out pointer to keyring array and number of members of array.
+ * See read_keyring_serials(). Does not require GIL.
+ *
+ * NOTE: caller must free keys_out via PyMem_RawFree()
+ */
+bool get_keyring_serials(key_serial_t serial, key_serial_t **keys_out, size_t *cnt_out)
+{
+	key_serial_t *buf, *keys;
+	size_t cnt;
+
+	if (!read_keyring_serials(serial, &buf, &cnt)) {
 		return false;
 	}
-	bufsz = (size_t)res;
 
-	keys = (key_serial_t *)PyMem_RawMalloc(bufsz);
+	keys = (key_serial_t *)PyMem_RawMalloc(cnt ? cnt * sizeof(key_serial_t) : 1);
 	if (keys == NULL) {
+		scratch_tls_put(buf, cnt * sizeof(key_serial_t));
 		errno = ENOMEM;
 		return false;
 	}
 
-	res = keyctl_read(serial, (char *)keys, bufsz);
-	if (res == -1) {
-		PyMem_RawFree(keys);
+	memcpy(keys, buf, cnt * sizeof(key_serial_t));
+	scratch_tls_put(buf, cnt * sizeof(key_serial_t));
+
+	*keys_out = keys;
+	*cnt_out = cnt;
+
+	return true;
+}
+
+/*
+ * Read the payload of serial with a single keyctl_read() in the common
+ * case. The payload is read into this thread's scratch buffer, which is
+ * sized from the largest payload seen so far and is only grown (and the
+ * read repeated) if the payload turns out to be larger. Caller must hand
+ * the buffer back with scratch_tls_put(data, data_len) once done with it.
+ * Does not require GIL.
+ */
+bool read_key_payload(key_serial_t serial, char **data_out, size_t *data_len)
+{
+	size_t bufsz = payload_size_hint();
+	bool first = true;
+	char *data;
+	long res;
+
+	for (;;) {
+		data = scratch_tls_get(bufsz);
+		if (data == NULL) {
+			return false;
+		}
+
+		/* Use whatever the size class has room for */
+		bufsz = scratch_size(data);
+		res = tn_keyctl_read(serial, data, bufsz);
+		if (res == -1) {
+			int err = errno;
+			scratch_tls_put(data, 0);
+			errno = err;
+			return false;
+		}
+
+		if ((size_t)res <= bufsz) {
+			break;
+		}
+
+		/* Payload didn't fit. Nothing was copied, so retry at full size. */
+		scratch_tls_put(data, 0);
+		if (first) {
+			TN_READ_STAT_INC(TN_READ_STAT_PAYLOAD_MISS);
+			payload_size_observe((size_t)res);
+			first = false;
+		}
+		bufsz = (size_t)res;
+	}
+
+	if (first) {
+		TN_READ_STAT_INC(TN_READ_STAT_PAYLOAD_HIT);
+	}
+
+	*data_out = data;
+	*data_len = (size_t)res;
+	return true;
+}
+
+/*
+ * Search for the key with the specified type and description in the
+ * keyring at path (see resolve_keyring_path()) and read its payload.
+ * Does not require GIL.
+ */
+bool lookup_key_payload(key_serial_t root, const char **path, size_t cnt,
+			const char *key_type_str, const char *description,
+			char **data_out, size_t *data_len)
+{
+	key_serial_t ring, serial;
+
+	if (!resolve_keyring_path(root, path, cnt, false, &ring, NULL)) {
+		return false;
+	}
+
+	/*
+	 * The key itself is deliberately not cached: its payload is needed
+	 * anyway, and a failed read is as good as a failed describe.
+	 */
+	serial = tn_keyctl_search(ring, key_type_str, description, 0);
+	if (serial == -1) {
 		return false;
 	}
 
-	if (res % sizeof(key_serial_t) != 0) {
-		// This shouldn't happen, but perhaps we got a short read
-		// or the length of read isn't what's expected for an array of serials
-		errno = EINVAL;
-		PyMem_RawFree(keys);
+	return read_key_payload(serial, data_out, data_len);
+}
+
+/*
+ * Make sure that at least `needed` bytes are free at the end of the
+ * payload set blob. Does not require GIL.
+ */
+static bool
+payload_set_reserve(tn_payload_set_t *set, size_t needed)
+{
+	size_t new_alloc;
+	char *blob;
+
+	if (set->blob_alloc - set->blob_len >= needed) {
+		return true;
+	}
+
+	new_alloc = set->blob_alloc ? set->blob_alloc : 4096;
+	while (new_alloc - set->blob_len < needed) {
+		new_alloc *= 2;
+	}
+
+	/*
+	 * Payloads are secrets. Rather than realloc() and leave a copy
+	 * behind in freed memory, move to new scratch buffer (which is
+	 * scrubbed on release).
+	 */
+	blob = scratch_alloc(new_alloc);
+	if (blob == NULL) {
 		return false;
 	}
 
-	*keys_out = (key_serial_t *)keys;
-	*cnt_out = res / sizeof(key_serial_t);
+	if (set->blob != NULL) {
+		memcpy(blob, set->blob, set->blob_len);
+		scratch_free(set->blob);
+	}
 
+	set->blob = blob;
+	set->blob_alloc = scratch_size(blob);
 	return true;
 }
 
 /*
- * Retrieve the data for a given serial that's *not* a keyring.
- * data_out must be freed via PyMem_RawFree(). Does not require GIL.
+ * Append description and payload of key to the payload set, reading the
+ * payload straight into the blob. If read_data is false only the
+ * description is appended and the payload is left empty. Does not require GIL.
  */
-bool get_key_data(key_serial_t serial, char **data_out, size_t *data_len)
+static bool
+payload_set_append(tn_payload_set_t *set, key_serial_t serial, const char *description,
+		   bool read_data)
 {
+	tn_payload_entry_t *entry;
+	size_t desc_len = strlen(description) + 1;
+	bool missed = false;
+	size_t avail;
 	long res;
-	size_t bufsz;
-	char *data;
-	bool is_keyring, success;
 
-	/* First check whether the provided serial is actually a keyring */
-	success = check_key_type(serial, KEY_TYPE_STR_KEYRING, &is_keyring);
-	if (!success)
+	if (set->cnt == set->alloc) {
+		size_t new_alloc = set->alloc ? set->alloc * 2 : 16;
+		tn_payload_entry_t *entries;
+
+		entries = PyMem_RawRealloc(set->entries, new_alloc * sizeof(tn_payload_entry_t));
+		if (entries == NULL) {
+			errno = ENOMEM;
+			return false;
+		}
+		set->entries = entries;
+		set->alloc = new_alloc;
+	}
+
+	/* Leave room for the largest payload seen so that most reads succeed first time */
+	if (!payload_set_reserve(set, desc_len + (read_data ? payload_size_hint() : 0))) {
 		return false;
+	}
 
-	/* There's a separate function to get keyring serials */
-	if (is_keyring) {
-		errno = EINVAL;
+	entry = &set->entries[set->cnt];
+	entry->serial = serial;
+	entry->desc_off = set->blob_len;
+	memcpy(set->blob + entry->desc_off, description, desc_len);
+	entry->data_off = entry->desc_off + desc_len;
+
+	if (!read_data) {
+		entry->data_len = 0;
+		set->blob_len = entry->data_off;
+		set->cnt++;
+		return true;
+	}
+
+	for (;;) {
+		avail = set->blob_alloc - entry->data_off;
+		res = tn_keyctl_read(serial, set->blob + entry->data_off, avail);
+		if (res == -1) {
+			set->blob_len = entry->desc_off;
+			return false;
+		}
+
+		if ((size_t)res <= avail) {
+			break;
+		}
+
+		/* Kernel didn't copy anything; make room and retry */
+		if (!missed) {
+			TN_READ_STAT_INC(TN_READ_STAT_PAYLOAD_MISS);
+			payload_size_observe((size_t)res);
+			missed = true;
+		}
+		set->blob_len = entry->data_off;
+		if (!payload_set_reserve(set, (size_t)res)) {
+			set->blob_len = entry->desc_off;
+			return false;
+		}
+	}
+
+	if (!missed) {
+		TN_READ_STAT_INC(TN_READ_STAT_PAYLOAD_HIT);
+	}
+
+	entry->data_len = (size_t)res;
+	set->blob_len = entry->data_off + entry->data_len;
+	set->cnt++;
+
+	return true;
+}
+
+static bool
+collect_keyring_entries(key_serial_t serial, const char *key_type_str,
+			bool unlink_expired, bool unlink_revoked, bool read_data,
+			tn_payload_set_t *set)
+{
+	tn_key_info_t info = { 0 };
+	key_serial_t *keys = NULL;
+	size_t i, key_cnt;
+	bool vanished = false;
+	bool success = false;
+
+	if (!get_keyring_serials(serial, &keys, &key_cnt)) {
 		return false;
 	}
 
-	res = keyctl_read(serial, NULL, 0);
-	if (res == -1) {
+	for (i = 0; i < key_cnt; i++) {
+		if (!describe_key(keys[i], &info)) {
+			if (errno == ENOKEY) {
+				/* key was unlinked so skip */
+				vanished = true;
+				continue;
+			} else if (((errno == EKEYEXPIRED) && unlink_expired) ||
+				   ((errno == EKEYREVOKED) && unlink_revoked)) {
+				tn_keyctl_unlink(keys[i], serial);
+				continue;
+			} else if ((errno == EKEYEXPIRED) || (errno == EKEYREVOKED)) {
+				continue;
+			}
+			goto out;
+		}
+
+		/* There's a separate function to get keyring serials */
+		if (strcmp(info.key_type_str, KEY_TYPE_STR_KEYRING) == 0) {
+			continue;
+		}
+
+		if ((key_type_str != NULL) && (strcmp(info.key_type_str, key_type_str) != 0)) {
+			continue;
+		}
+
+		if (!payload_set_append(set, keys[i], info.description, read_data)) {
+			/* potentially TOCTOU (though very unlikely) */
+			if ((errno == ENOKEY) ||
+			    (errno == EKEYEXPIRED) ||
+			    (errno == EKEYREVOKED)) {
+				vanished = true;
+				continue;
+			}
+			goto out;
+		}
+	}
+
+	/*
+	 * Keys also disappear when the keyring itself is released (for example
+	 * after being displaced by swap_in_keyring()). Make sure that we don't
+	 * present the remnants of a dead keyring as its contents.
+	 */
+	if (vanished && !describe_key(serial, &info)) {
+		goto out;
+	}
+
+	success = true;
+out:
+	free_key_info(&info);
+	PyMem_RawFree(keys);
+	return success;
+}
+
+/*
+ * Read the payloads of all non-keyring keys in the specified keyring into
+ * set. If key_type_str is not NULL then only keys of that type are read.
+ * Expired and revoked keys are skipped (and optionally unlinked) in the same
+ * manner as the keyring iterator. On failure errno is set and set must still
+ * be released via free_payload_set().
+ *
+ * Does not require GIL.
+ */
+bool read_keyring_payloads(key_serial_t serial, const char *key_type_str,
+			   bool unlink_expired, bool unlink_revoked,
+			   tn_payload_set_t *set)
+{
+	return collect_keyring_entries(serial, key_type_str, unlink_expired,
+				       unlink_revoked, true, set);
+}
+
+/*
+ * As read_keyring_payloads() but only the descriptions of the keys are
+ * collected. Payloads are left empty and are never read, so this also
+ * works for key types whose payload can't be read (e.g. logon).
+ *
+ * Does not require GIL.
+ */
+bool read_keyring_descriptions(key_serial_t serial, const char *key_type_str,
+			       tn_payload_set_t *set)
+{
+	return collect_keyring_entries(serial, key_type_str, false, false, false, set);
+}
+
+/*
+ * Release memory held by payload set, scrubbing payloads. Does not require GIL.
+ */
+void free_payload_set(tn_payload_set_t *set)
+{
+	scratch_free(set->blob);
+	PyMem_RawFree(set->entries);
+	memset(set, 0, sizeof(*set));
+}
+
+/*
+ * Convert payload set into dict mapping description to payload bytes.
+ * Requires GIL.
+ */
+PyObject *payload_set_to_dict(const tn_payload_set_t *set)
+{
+	PyObject *out;
+	size_t i;
+
+	out = PyDict_New();
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < set->cnt; i++) {
+		const tn_payload_entry_t *entry = &set->entries[i];
+		PyObject *data;
+		int err;
+
+		data = PyBytes_FromStringAndSize(set->blob + entry->data_off, entry->data_len);
+		if (data == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		err = PyDict_SetItemString(out, set->blob + entry->desc_off, data);
+		Py_DECREF(data);
+		if (err < 0) {
+			Py_DECREF(out);
+			return NULL;
+		}
+	}
+
+	return out;
+}
+
+/*
+ * Convert path (a sequence of str) into an array of keyring descriptions
+ * and root (int or None) into a serial, with 0 meaning the persistent
+ * keyring. The array references memory owned by *path_fast, which must be
+ * kept alive (and the array freed via PyMem_RawFree()) by the caller.
+ * Requires GIL.
+ */
+bool parse_keyring_path(PyObject *path_obj, PyObject *root_obj, PyObject **path_fast,
+			const char ***path_out, size_t *cnt_out, key_serial_t *root_out)
+{
+	const char **path;
+	PyObject *fast;
+	Py_ssize_t i, cnt;
+
+	*root_out = 0;
+	if (root_obj != Py_None) {
+		long root = PyLong_AsLong(root_obj);
+		if ((root == -1) && PyErr_Occurred()) {
+			return false;
+		}
+		*root_out = (key_serial_t)root;
+	}
+
+	if (PyUnicode_Check(path_obj)) {
+		PyErr_SetString(PyExc_TypeError, "path must be a sequence of strings");
 		return false;
 	}
-	bufsz = (size_t)res;
 
-	data = PyMem_RawMalloc(bufsz);
-	if (data == NULL) {
-		errno = ENOMEM;
+	fast = PySequence_Fast(path_obj, "path must be a sequence of strings");
+	if (fast == NULL) {
 		return false;
 	}
 
-	res = keyctl_read(serial, data, bufsz);
-	if (res == -1) {
-		PyMem_RawFree(data);
+	cnt = PySequence_Fast_GET_SIZE(fast);
+	path = PyMem_RawCalloc(cnt ? cnt : 1, sizeof(char *));
+	if (path == NULL) {
+		Py_DECREF(fast);
+		PyErr_NoMemory();
 		return false;
 	}
 
-	*data_out = data;
-	*data_len = bufsz;
+	for (i = 0; i < cnt; i++) {
+		PyObject *item = PySequence_Fast_GET_ITEM(fast, i);
+
+		if (!PyUnicode_Check(item)) {
+			PyErr_SetString(PyExc_TypeError, "path must be a sequence of strings");
+			goto fail;
+		}
+
+		/* UTF-8 buffer lives as long as the str object held by fast */
+		path[i] = PyUnicode_AsUTF8(item);
+		if (path[i] == NULL) {
+			goto fail;
+		}
+	}
+
+	*path_fast = fast;
+	*path_out = path;
+	*cnt_out = (size_t)cnt;
+	return true;
+
+fail:
+	PyMem_RawFree(path);
+	Py_DECREF(fast);
+	return false;
+}
+
+/*
+ * Convert an iterable of (description, data, timeout) tuples into an array
+ * of tn_add_entry_t. timeout may be None to leave key expiry untouched.
+ *
+ * The returned array references memory owned by the items of *entries_fast,
+ * which must be kept alive (and the array freed via PyMem_RawFree()) by
+ * the caller. Requires GIL.
+ */
+bool parse_add_entries(PyObject *entries, PyObject **entries_fast,
+		       tn_add_entry_t **entries_out, size_t *cnt_out)
+{
+	PyObject *fast;
+	tn_add_entry_t *out;
+	Py_ssize_t i, cnt;
+
+	fast = PySequence_Fast(entries, "entries must be iterable");
+	if (fast == NULL) {
+		return false;
+	}
+
+	cnt = PySequence_Fast_GET_SIZE(fast);
+	out = PyMem_RawCalloc(cnt ? cnt : 1, sizeof(tn_add_entry_t));
+	if (out == NULL) {
+		Py_DECREF(fast);
+		PyErr_NoMemory();
+		return false;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *item = PySequence_Fast_GET_ITEM(fast, i);
+		PyObject *py_desc, *py_data, *py_timeout;
+		Py_ssize_t data_len;
+		char *data;
+
+		if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 3) {
+			PyErr_Format(PyExc_TypeError,
+				     "entry %zd: expected (description, data, timeout) tuple", i);
+			goto fail;
+		}
+
+		py_desc = PyTuple_GET_ITEM(item, 0);
+		py_data = PyTuple_GET_ITEM(item, 1);
+		py_timeout = PyTuple_GET_ITEM(item, 2);
+
+		if (!PyUnicode_Check(py_desc)) {
+			PyErr_Format(PyExc_TypeError, "entry %zd: description must be str", i);
+			goto fail;
+		}
+
+		out[i].description = PyUnicode_AsUTF8(py_desc);
+		if (out[i].description == NULL) {
+			goto fail;
+		}
+
+		if (!PyBytes_Check(py_data)) {
+			PyErr_Format(PyExc_TypeError, "entry %zd: data must be bytes", i);
+			goto fail;
+		}
+
+		if (PyBytes_AsStringAndSize(py_data, &data, &data_len) < 0) {
+			goto fail;
+		}
+		out[i].data = data;
+		out[i].data_len = (size_t)data_len;
+
+		if (py_timeout == Py_None) {
+			out[i].timeout = TN_NO_TIMEOUT;
+		} else {
+			long long timeout = PyLong_AsLongLong(py_timeout);
+			if (timeout == -1 && PyErr_Occurred()) {
+				goto fail;
+			}
+			if (timeout < 0 || timeout > UINT_MAX) {
+				PyErr_Format(PyExc_ValueError, "entry %zd: invalid timeout", i);
+				goto fail;
+			}
+			out[i].timeout = (int64_t)timeout;
+		}
+	}
+
+	*entries_fast = fast;
+	*entries_out = out;
+	*cnt_out = (size_t)cnt;
+	return true;
+
+fail:
+	PyMem_RawFree(out);
+	Py_DECREF(fast);
+	return false;
+}
+
+/*
+ * Add the specified keys to the target keyring and apply their timeouts.
+ * The serial of each added key is stored in its entry. On failure errno is
+ * set and *done is set to the index of the entry that failed; keys before
+ * it remain in the keyring.
+ *
+ * Does not require GIL.
+ */
+bool add_key_entries(const char *key_type_str, key_serial_t target,
+		     tn_add_entry_t *entries, size_t cnt, size_t *done)
+{
+	size_t i;
+
+	for (i = 0; i < cnt; i++) {
+		tn_add_entry_t *entry = &entries[i];
 
+		entry->serial = tn_sys_add_key(key_type_str, entry->description,
+					       entry->data, entry->data_len, target);
+		if (entry->serial == -1) {
+			*done = i;
+			return false;
+		}
+
+		if (entry->timeout != TN_NO_TIMEOUT) {
+			if (tn_keyctl_set_timeout(entry->serial, (unsigned int)entry->timeout) == -1) {
+				*done = i;
+				return false;
+			}
+		}
+	}
+
+	*done = cnt;
 	return true;
 }
 
+/*
+ * Move key from one keyring to another. If the running kernel predates
+ * keyctl_move() (added in 5.1) fall back to link followed by unlink. The
+ * fallback cannot honor exclusive atomically and so it is checked with a
+ * search beforehand. Does not require GIL.
+ */
+bool move_key(key_serial_t serial, key_serial_t from_ring, key_serial_t to_ring,
+	      bool exclusive)
+{
+	unsigned int flags = exclusive ? KEYCTL_MOVE_EXCL : 0;
+
+	if (tn_keyctl_move(serial, from_ring, to_ring, flags) == 0) {
+		return true;
+	}
+
+	if ((errno != ENOSYS) && (errno != EOPNOTSUPP)) {
+		return false;
+	}
+
+	if (exclusive) {
+		tn_key_info_t info = { 0 };
+		long found;
+
+		if (!describe_key(serial, &info)) {
+			free_key_info(&info);
+			return false;
+		}
+
+		found = tn_keyctl_search(to_ring, info.key_type_str, info.description, 0);
+		free_key_info(&info);
+		if (found != -1) {
+			errno = EEXIST;
+			return false;
+		}
+	}
+
+	if (tn_keyctl_link(serial, to_ring) == -1) {
+		return false;
+	}
+
+	if ((tn_keyctl_unlink(serial, from_ring) == -1) && (errno != ENOKEY)) {
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Atomically replace the keyring with the specified description in parent
+ * with a new keyring containing entries.
+ *
+ * The new keyring is built aside in the calling thread's keyring (so that
+ * concurrent swaps from other threads don't collide) and then moved into
+ * parent. Linking a keyring into parent displaces any existing keyring with
+ * the same description in a single operation, so readers searching parent
+ * find either the complete old keyring or the complete new one.
+ *
+ * The displaced keyring is then invalidated, so that a process still
+ * holding its serial (e.g. from an earlier search) gets an error rather
+ * than going on reading revoked or rotated payloads. It is looked up
+ * before the move, and so a keyring that another process swaps in between
+ * the lookup and the move is displaced without being invalidated.
+ *
+ * Does not require GIL. On failure errno is set and parent is unchanged.
+ */
+bool swap_in_keyring(key_serial_t parent, const char *description,
+		     const char *key_type_str, tn_add_entry_t *entries,
+		     size_t cnt, key_serial_t *new_out)
+{
+	key_serial_t staging, old;
+	size_t done;
+	bool linked = false;
+	int err;
+
+	old = tn_keyctl_search(parent, KEY_TYPE_STR_KEYRING, description, 0);
+	if ((old != -1) && !keyring_links(parent, old, &linked)) {
+		linked = false;
+	}
+
+	staging = tn_sys_add_key(KEY_TYPE_STR_KEYRING, description, NULL, 0,
+				 KEY_SPEC_THREAD_KEYRING);
+	if (staging == -1) {
+		return false;
+	}
+
+	if (!add_key_entries(key_type_str, staging, entries, cnt, &done)) {
+		goto fail;
+	}
+
+	if (!move_key(staging, KEY_SPEC_THREAD_KEYRING, parent, false)) {
+		goto fail;
+	}
+
+	/* Retire the displaced keyring. The swap itself has already succeeded. */
+	if (linked) {
+		(void)keyctl_invalidate(old);
+	}
+
+	/* The new keyring is a direct child of parent, so save the next search */
+	key_cache_insert(parent, KEY_TYPE_STR_KEYRING, description, staging);
+
+	*new_out = staging;
+	return true;
+
+fail:
+	err = errno;
+	keyctl_invalidate(staging);
+	errno = err;
+	return false;
+}
+
+/*
+ * Walk path (a list of keyring descriptions) starting at root, returning the
+ * serial of the final keyring in out. If root is 0 then the walk starts at
+ * the persistent keyring of the caller. Missing keyrings are created if
+ * create is set, otherwise the walk fails with ENOKEY.
+ *
+ * Does not require GIL.
+ */
+bool resolve_keyring_path(key_serial_t root, const char **path, size_t cnt,
+			  bool create, key_serial_t *out, tn_key_info_t *info)
+{
+	key_serial_t *chain;
+	bool created = false;
+	bool success = false;
+	size_t i;
+
+	/* chain[i] is the parent of path[i], chain[cnt] the final keyring */
+	chain = PyMem_RawMalloc((cnt + 1) * sizeof(key_serial_t));
+	if (chain == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	chain[0] = root;
+	if (chain[0] == 0) {
+		/*
+		 * Not cached: getting the persistent keyring is what resets its
+		 * expiry timer (see persistent-keyring(7)), and a process that
+		 * only ever resolves paths must keep the tree below it alive.
+		 */
+		chain[0] = keyctl_get_persistent((uid_t)-1, KEY_SPEC_PROCESS_KEYRING);
+		if (chain[0] == -1) {
+			goto out;
+		}
+	}
+
+	for (i = 0; i < cnt; i++) {
+		/* Only the final keyring needs to be described for the caller */
+		tn_key_info_t *pinfo = (i == cnt - 1) ? info : NULL;
+
+		chain[i + 1] = cached_keyring_search(chain[i], KEY_TYPE_STR_KEYRING,
+						     path[i], pinfo);
+		if ((chain[i + 1] == -1) && (errno == ENOKEY) && create) {
+			chain[i + 1] = tn_sys_add_key(KEY_TYPE_STR_KEYRING, path[i],
+						      NULL, 0, chain[i]);
+			if (chain[i + 1] == -1) {
+				goto out;
+			}
+
+			created = true;
+			if ((pinfo != NULL) && !describe_key(chain[i + 1], pinfo)) {
+				goto out;
+			}
+		}
+
+		if (chain[i + 1] == -1) {
+			goto out;
+		}
+	}
+
+	if ((cnt == 0) && (info != NULL) && !describe_key(chain[0], info)) {
+		goto out;
+	}
+
+	/*
+	 * Adding a keyring flushes the search cache. The keyrings created
+	 * above didn't displace anything, so repopulate it with the whole path.
+	 */
+	if (created) {
+		for (i = 0; i < cnt; i++) {
+			key_cache_insert(chain[i], KEY_TYPE_STR_KEYRING, path[i], chain[i + 1]);
+		}
+	}
+
+	*out = chain[cnt];
+	success = true;
+out:
+	PyMem_RawFree(chain);
+	return success;
+}
+
+static int
+payload_entry_cmp(const void *a, const void *b, void *blob)
+{
+	const tn_payload_entry_t *ea = a;
+	const tn_payload_entry_t *eb = b;
+
+	return strcmp((char *)blob + ea->desc_off, (char *)blob + eb->desc_off);
+}
+
+/*
+ * Binary search sorted payload set for description. Returns index or -1.
+ */
+static ssize_t
+payload_set_find(const tn_payload_set_t *set, const char *description)
+{
+	size_t lo = 0, hi = set->cnt;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(description, set->blob + set->entries[mid].desc_off);
+
+		if (cmp == 0) {
+			return (ssize_t)mid;
+		} else if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Bring the keys of the given type in the keyring in line with entries
+ * by comparing descriptions and payloads against a single read pass of
+ * the keyring:
+ *
+ * - keys with new descriptions are added
+ * - keys with changed payloads are updated in place via keyctl_update()
+ * - keys not present in entries are unlinked
+ * - keys with identical payloads are left untouched (including expiry)
+ *
+ * Additions and updates happen before removals so that the keyring never
+ * transiently loses keys that are present in both sets. Timeouts are only
+ * applied to keys that were added or updated. If dry_run is set then only
+ * stats are generated.
+ *
+ * Does not require GIL. On failure errno is set.
+ */
+bool reconcile_keyring(key_serial_t serial, const char *key_type_str,
+		       tn_add_entry_t *entries, size_t cnt, bool dry_run,
+		       tn_reconcile_stats_t *stats)
+{
+	tn_payload_set_t current = { 0 };
+	bool *matched = NULL;
+	bool success = false;
+	size_t i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	if (!read_keyring_payloads(serial, key_type_str, !dry_run, !dry_run, &current)) {
+		goto out;
+	}
+
+	qsort_r(current.entries, current.cnt, sizeof(tn_payload_entry_t),
+		payload_entry_cmp, current.blob);
+
+	matched = PyMem_RawCalloc(current.cnt ? current.cnt : 1, sizeof(bool));
+	if (matched == NULL) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		tn_add_entry_t *entry = &entries[i];
+		tn_payload_entry_t *cur;
+		ssize_t idx;
+
+		idx = payload_set_find(&current, entry->description);
+		if (idx == -1) {
+			stats->added++;
+			if (!dry_run) {
+				size_t done;
+				if (!add_key_entries(key_type_str, serial, entry, 1, &done)) {
+					goto out;
+				}
+			}
+			continue;
+		}
+
+		matched[idx] = true;
+		cur = &current.entries[idx];
+		entry->serial = cur->serial;
+
+		if ((cur->data_len == entry->data_len) &&
+		    (memcmp(current.blob + cur->data_off, entry->data, entry->data_len) == 0)) {
+			stats->unchanged++;
+			continue;
+		}
+
+		stats->updated++;
+		if (dry_run) {
+			continue;
+		}
+
+		if (tn_keyctl_update(cur->serial, entry->data, entry->data_len) == -1) {
+			size_t done;
+
+			if (errno != EOPNOTSUPP) {
+				goto out;
+			}
+
+			/* Key type doesn't support update. add_key() replaces the key. */
+			if (!add_key_entries(key_type_str, serial, entry, 1, &done)) {
+				goto out;
+			}
+			continue;
+		}
+
+		if ((entry->timeout != TN_NO_TIMEOUT) &&
+		    (tn_keyctl_set_timeout(cur->serial, (unsigned int)entry->timeout) == -1)) {
+			goto out;
+		}
+	}
+
+	for (i = 0; i < current.cnt; i++) {
+		if (matched[i]) {
+			continue;
+		}
+
+		stats->removed++;
+		if (dry_run) {
+			continue;
+		}
+
+		if ((tn_keyctl_unlink(current.entries[i].serial, serial) == -1) &&
+		    (errno != ENOKEY)) {
+			goto out;
+		}
+	}
+
+	success = true;
+out:
+	PyMem_RawFree(matched);
+	free_payload_set(&current);
+	return success;
+}
+
+/*
+ * Create appropriate Python key object (TNKey or TNKeyring) from an already
+ * described key. On success ownership of info->desc_buf passes to the new
+ * object. On failure info is left untouched for the caller to free.
+ *
+ * This bypasses tp_init of the key types so that the key is not described
+ * a second time. Requires GIL to be held when calling this function.
+ */
+PyObject *
+create_key_object_from_info(key_serial_t key_serial, tn_key_info_t *info,
+			    PyObject *module_obj)
+{
+	py_tnkey_t *py_key;
+	PyObject *py_keyring;
+
+	py_key = py_tnkey_from_info(key_serial, info, module_obj);
+	if (py_key == NULL) {
+		return NULL;
+	}
+
+	if (strcmp(py_key->c_key_type_str, KEY_TYPE_STR_KEYRING) != 0) {
+		return (PyObject *)py_key;
+	}
+
+	py_keyring = py_tn_keyring_from_key(py_key);
+	Py_DECREF(py_key);
+
+	return py_keyring;
+}
+
 /*
  * Create appropriate Python key object (TNKey or TNKeyring) from a serial number.
- * Requires GIL to be held when calling this function.
+ * The key is described exactly once. Requires GIL to be held when calling
+ * this function.
  */
 PyObject *
 create_key_object_from_serial(key_serial_t key_serial, PyObject *module_obj)
 {
-	bool is_keyring, success;
+	tn_key_info_t info = { 0 };
+	bool success;
 	PyObject *py_key_obj;
 
 	Py_BEGIN_ALLOW_THREADS
-	success = check_key_type(key_serial, KEY_TYPE_STR_KEYRING, &is_keyring);
+	success = describe_key(key_serial, &info);
 	Py_END_ALLOW_THREADS
 	if (!success) {
+		/* preserve errno for callers that check for TOCTOU races */
+		int err = errno;
+		free_key_info(&info);
+		errno = err;
 		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
 		return NULL;
 	}
 
-	/*
-	 * The following will initialize new TNKey or TNKeyring objects. The parameters are passed
-	 * to the tp_init (init) functions of the objects. We need to store a reference to the
-	 * module oject so that the object's type methods will be able to access data stored in the
-	 * module state.
-	 */
-	if (is_keyring) {
-		py_key_obj = PyObject_CallFunction((PyObject *)&TNKeyringType, "iO", key_serial, module_obj);
-	} else {
-		py_key_obj = PyObject_CallFunction((PyObject *)&TNKeyType, "iO", key_serial, module_obj);
-	}
+	py_key_obj = create_key_object_from_info(key_serial, &info, module_obj);
+	free_key_info(&info);
 
 	return py_key_obj;
 }
@@ -0,0 +1,200 @@
+/* Batch AES-256-GCM sealing of key payloads */
+
+#include "truenas_keyring.h"
+#include <pthread.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+/* Don't bother spawning threads for fewer payloads than this per thread */
+#define TN_SEAL_MIN_PER_THREAD 16
+
+/* Nonces are drawn from the CSPRNG in chunks of this many payloads */
+#define TN_SEAL_IV_CHUNK 64
+
+typedef struct {
+	const unsigned char *key;
+	tn_seal_item_t *items;
+	size_t cnt;
+	bool decrypt;
+	int error;
+} tn_seal_job_t;
+
+/*
+ * ctx has already been initialized with the cipher and key by seal_worker()
+ * so that the key schedule is computed once per batch rather than per payload.
+ */
+static bool
+seal_one(EVP_CIPHER_CTX *ctx, const unsigned char *nonce, tn_seal_item_t *item)
+{
+	unsigned char *iv = item->out + 1;
+	unsigned char *ct = iv + TN_SEAL_IV_LEN;
+	int len, final_len;
+
+	item->out[0] = TN_SEAL_VERSION;
+	memcpy(iv, nonce, TN_SEAL_IV_LEN);
+
+	if ((EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv) != 1) ||
+	    (EVP_EncryptUpdate(ctx, ct, &len, item->in, (int)item->in_len) != 1) ||
+	    (EVP_EncryptFinal_ex(ctx, ct + len, &final_len) != 1) ||
+	    (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TN_SEAL_TAG_LEN,
+				 ct + len + final_len) != 1)) {
+		return false;
+	}
+
+	item->out_len = TN_SEAL_OVERHEAD + item->in_len;
+	item->ok = true;
+	return true;
+}
+
+/*
+ * Returns false only on libcrypto failure. A payload that is malformed or
+ * fails authentication is left with ok set to false.
+ */
+static bool
+open_one(EVP_CIPHER_CTX *ctx, tn_seal_item_t *item)
+{
+	const unsigned char *iv = item->in + 1;
+	const unsigned char *ct = iv + TN_SEAL_IV_LEN;
+	size_t ct_len;
+	int len, final_len;
+
+	if ((item->in_len < TN_SEAL_OVERHEAD) || (item->in[0] != TN_SEAL_VERSION)) {
+		return true;
+	}
+
+	ct_len = item->in_len - TN_SEAL_OVERHEAD;
+
+	if ((EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, iv) != 1) ||
+	    (EVP_DecryptUpdate(ctx, item->out, &len, ct, (int)ct_len) != 1) ||
+	    (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TN_SEAL_TAG_LEN,
+				 (void *)(ct + ct_len)) != 1)) {
+		return false;
+	}
+
+	if (EVP_DecryptFinal_ex(ctx, item->out + len, &final_len) != 1) {
+		/* authentication failure. Don't hand back unverified plaintext. */
+		OPENSSL_cleanse(item->out, ct_len);
+		return true;
+	}
+
+	item->out_len = ct_len;
+	item->ok = true;
+	return true;
+}
+
+static void *
+seal_worker(void *arg)
+{
+	tn_seal_job_t *job = arg;
+	unsigned char nonces[TN_SEAL_IV_CHUNK][TN_SEAL_IV_LEN];
+	EVP_CIPHER_CTX *ctx;
+	bool ok;
+	size_t i;
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL) {
+		job->error = ENOMEM;
+		return NULL;
+	}
+
+	if (job->decrypt) {
+		ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, job->key, NULL) == 1;
+	} else {
+		ok = EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, job->key, NULL) == 1;
+	}
+
+	if (!ok) {
+		job->error = EIO;
+		goto out;
+	}
+
+	for (i = 0; i < job->cnt; i++) {
+		if (job->decrypt) {
+			ok = open_one(ctx, &job->items[i]);
+		} else {
+			if (((i % TN_SEAL_IV_CHUNK) == 0) &&
+			    (RAND_bytes((unsigned char *)nonces, sizeof(nonces)) != 1)) {
+				job->error = EIO;
+				break;
+			}
+			ok = seal_one(ctx, nonces[i % TN_SEAL_IV_CHUNK], &job->items[i]);
+		}
+
+		if (!ok) {
+			job->error = EIO;
+			break;
+		}
+	}
+
+out:
+	EVP_CIPHER_CTX_free(ctx);
+	return NULL;
+}
+
+/*
+ * Seal cnt payloads (or open them if decrypt is set) with the specified
+ * TN_SEAL_KEY_LEN byte key. Output buffers must be sized by caller:
+ * TN_SEAL_OVERHEAD + in_len for sealing and in_len - TN_SEAL_OVERHEAD for
+ * opening. The work is split into contiguous ranges across up to nthreads
+ * threads (the calling thread handles the first range). If a thread can't
+ * be created its range is handled by the calling thread.
+ *
+ * Returns false with errno set on libcrypto failure.
+ * Payloads that fail to open are reported via item->ok. Does not require GIL.
+ */
+bool
+seal_payloads(const unsigned char *key, tn_seal_item_t *items, size_t cnt,
+	      size_t nthreads, bool decrypt)
+{
+	tn_seal_job_t jobs[TN_SEAL_THREADS_MAX];
+	pthread_t tids[TN_SEAL_THREADS_MAX];
+	size_t i, per_thread, started = 0, offset = 0;
+	int error = 0;
+
+	if (nthreads > cnt / TN_SEAL_MIN_PER_THREAD) {
+		nthreads = cnt / TN_SEAL_MIN_PER_THREAD;
+	}
+	if (nthreads == 0) {
+		nthreads = 1;
+	}
+
+	per_thread = (cnt + nthreads - 1) / nthreads;
+
+	for (i = 0; i < nthreads; i++) {
+		jobs[i] = (tn_seal_job_t) {
+			.key = key,
+			.items = items + offset,
+			.cnt = (cnt - offset) < per_thread ? (cnt - offset) : per_thread,
+			.decrypt = decrypt,
+		};
+		offset += jobs[i].cnt;
+	}
+
+	for (i = 1; i < nthreads; i++) {
+		error = pthread_create(&tids[i], NULL, seal_worker, &jobs[i]);
+		if (error) {
+			/* Handle remaining ranges in this thread */
+			break;
+		}
+		started++;
+	}
+
+	seal_worker(&jobs[0]);
+	for (i = started + 1; i < nthreads; i++) {
+		seal_worker(&jobs[i]);
+	}
+
+	for (i = 1; i <= started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		if (jobs[i].error) {
+			errno = jobs[i].error;
+			return false;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,179 @@
+/* SCRAM-SHA-512 proof verification (RFC 5802 / RFC 7677) */
+
+#include "truenas_keyring.h"
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+/*
+ * Verify a SCRAM client proof against the stored credentials.
+ *
+ *   ClientSignature := HMAC(StoredKey, AuthMessage)
+ *   ClientKey       := ClientProof XOR ClientSignature
+ *   valid           := H(ClientKey) == StoredKey
+ *   ServerSignature := HMAC(ServerKey, AuthMessage)
+ *
+ * stored_key, server_key and client_proof must be TN_SCRAM_KEY_LEN bytes.
+ * On success server_sig is filled in. Returns false if the proof doesn't
+ * match. Errors from libcrypto are reported with errno set to EIO, and
+ * so callers must check errno if false is returned. All intermediate
+ * key material is scrubbed. Does not require GIL.
+ */
+bool scram_verify_proof(const unsigned char *stored_key, const unsigned char *server_key,
+			const unsigned char *client_proof, const unsigned char *auth_message,
+			size_t auth_message_len, unsigned char *server_sig)
+{
+	unsigned char client_sig[TN_SCRAM_KEY_LEN];
+	unsigned char client_key[TN_SCRAM_KEY_LEN];
+	unsigned char stored_check[TN_SCRAM_KEY_LEN];
+	unsigned int md_len = 0;
+	bool match = false;
+	size_t i;
+
+	errno = 0;
+
+	if ((HMAC(EVP_sha512(), stored_key, TN_SCRAM_KEY_LEN, auth_message,
+		  auth_message_len, client_sig, &md_len) == NULL) ||
+	    (md_len != TN_SCRAM_KEY_LEN)) {
+		errno = EIO;
+		goto out;
+	}
+
+	for (i = 0; i < TN_SCRAM_KEY_LEN; i++) {
+		client_key[i] = client_proof[i] ^ client_sig[i];
+	}
+
+	if (!EVP_Digest(client_key, TN_SCRAM_KEY_LEN, stored_check, &md_len,
+			EVP_sha512(), NULL) || (md_len != TN_SCRAM_KEY_LEN)) {
+		errno = EIO;
+		goto out;
+	}
+
+	if (CRYPTO_memcmp(stored_check, stored_key, TN_SCRAM_KEY_LEN) != 0) {
+		goto out;
+	}
+
+	if ((HMAC(EVP_sha512(), server_key, TN_SCRAM_KEY_LEN, auth_message,
+		  auth_message_len, server_sig, &md_len) == NULL) ||
+	    (md_len != TN_SCRAM_KEY_LEN)) {
+		errno = EIO;
+		goto out;
+	}
+
+	match = true;
+out:
+	OPENSSL_cleanse(client_sig, sizeof(client_sig));
+	OPENSSL_cleanse(client_key, sizeof(client_key));
+	OPENSSL_cleanse(stored_check, sizeof(stored_check));
+	return match;
+}
+
+/*
+ * Decode base64 text produced by python's b64encode(). Returns the decoded
+ * length, or -1 if the text is not valid base64.
+ */
+static ssize_t
+scram_b64decode(const unsigned char *in, size_t in_len, unsigned char *out)
+{
+	int len;
+
+	if ((in_len == 0) || (in_len % 4) || (in_len > INT_MAX)) {
+		return -1;
+	}
+
+	len = EVP_DecodeBlock(out, in, (int)in_len);
+	if (len < 0) {
+		return -1;
+	}
+
+	/* EVP_DecodeBlock() counts padding as decoded zero bytes */
+	if (in[in_len - 1] == '=') {
+		len--;
+		if (in[in_len - 2] == '=') {
+			len--;
+		}
+	}
+
+	return len;
+}
+
+/*
+ * Open an API key payload sealed by seal_payloads(), decode the binary
+ * record within it (see encode_api_key()) and verify the client proof
+ * against it, so that the whole check can run with the GIL released.
+ * The record must belong to req->username and req->dbid.
+ *
+ * If the payload holds something other than a binary record (for instance
+ * a JSON entry) TN_SCRAM_SEALED_TEXT is returned and the opened payload is
+ * left in req->plaintext for the caller to handle. Otherwise plaintext is
+ * scrubbed before returning. Does not require GIL.
+ */
+enum tn_scram_sealed_status
+scram_verify_sealed(tn_scram_sealed_t *req)
+{
+	enum tn_scram_sealed_status status;
+	tn_seal_item_t item = {
+		.in = req->payload,
+		.in_len = req->payload_len,
+		.out = req->plaintext,
+	};
+	tn_api_key_record_t rec;
+	unsigned char *raw = NULL;
+	size_t raw_size = 0;
+	ssize_t raw_len;
+
+	if (req->payload_len < TN_SEAL_OVERHEAD) {
+		return TN_SCRAM_SEALED_UNREADABLE;
+	}
+
+	if (!seal_payloads(req->key, &item, 1, 1, true)) {
+		return TN_SCRAM_SEALED_ERROR;
+	}
+
+	if (!item.ok) {
+		return TN_SCRAM_SEALED_UNREADABLE;
+	}
+
+	req->plaintext_len = item.out_len;
+	if ((item.out_len == 0) || (req->plaintext[0] == '{')) {
+		return TN_SCRAM_SEALED_TEXT;
+	}
+
+	raw_size = ((item.out_len / 4) + 1) * 3;
+	raw = PyMem_RawMalloc(raw_size);
+	if (raw == NULL) {
+		errno = ENOMEM;
+		status = TN_SCRAM_SEALED_ERROR;
+		goto out;
+	}
+
+	raw_len = scram_b64decode(req->plaintext, item.out_len, raw);
+	if ((raw_len < 0) || !api_key_record_parse(raw, (size_t)raw_len, &rec) ||
+	    (rec.algorithm != TN_API_KEY_ALG_SHA512) ||
+	    (rec.stored_key.len != TN_SCRAM_KEY_LEN) ||
+	    (rec.server_key.len != TN_SCRAM_KEY_LEN)) {
+		status = TN_SCRAM_SEALED_CORRUPT;
+		goto out;
+	}
+
+	if ((rec.dbid != req->dbid) || (rec.username.len != req->username_len) ||
+	    (memcmp(rec.username.buf, req->username, req->username_len) != 0)) {
+		status = TN_SCRAM_SEALED_WRONG_OWNER;
+		goto out;
+	}
+
+	if (scram_verify_proof(rec.stored_key.buf, rec.server_key.buf, req->client_proof,
+			       req->auth_message, req->auth_message_len, req->server_sig)) {
+		status = TN_SCRAM_SEALED_MATCH;
+	} else {
+		status = errno ? TN_SCRAM_SEALED_ERROR : TN_SCRAM_SEALED_NO_MATCH;
+	}
+
+out:
+	if (raw != NULL) {
+		OPENSSL_cleanse(raw, raw_size);
+		PyMem_RawFree(raw);
+	}
+	OPENSSL_cleanse(req->plaintext, item.out_len);
+	return status;
+}
@@ -0,0 +1,218 @@
+/* Pooled, locked scratch memory for key payloads */
+
+#include "truenas_keyring.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * Buffers that hold key payloads are carved from private anonymous
+ * mappings that are mlock()ed (so that secrets are never written to swap)
+ * and excluded from core dumps. Buffers are zeroed when they are released.
+ * mlock() may fail if RLIMIT_MEMLOCK is exhausted, in which case the
+ * buffer is still used but is not locked.
+ *
+ * Mapping a region for every read would be expensive, so released regions
+ * of up to TN_SCRATCH_POOL_REGION_MAX bytes are kept in a small pool and
+ * handed out again by scratch_alloc().
+ */
+#define TN_SCRATCH_POOL_CNT 8
+#define TN_SCRATCH_POOL_REGION_MAX (1024 * 1024)
+
+/* Region header. Kept in its own cache line ahead of the buffer. */
+typedef struct {
+	size_t size;	/* size of the whole mapping */
+	bool locked;
+} tn_scratch_hdr_t;
+
+#define TN_SCRATCH_HDRSZ 64
+_Static_assert(sizeof(tn_scratch_hdr_t) <= TN_SCRATCH_HDRSZ, "scratch header too large");
+
+static struct {
+	pthread_mutex_t lock;
+	tn_scratch_hdr_t *free[TN_SCRATCH_POOL_CNT];
+	size_t cnt;
+} scratch_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void
+scratch_unmap(tn_scratch_hdr_t *hdr)
+{
+	size_t size = hdr->size;
+
+	if (hdr->locked) {
+		munlock(hdr, size);
+	}
+	munmap(hdr, size);
+}
+
+/*
+ * Allocate a scratch buffer of at least size bytes. The contents are
+ * zeroed. Returns NULL with errno set on failure. Does not require GIL.
+ */
+void *
+scratch_alloc(size_t size)
+{
+	tn_scratch_hdr_t *hdr = NULL;
+	size_t i, best = SIZE_MAX, page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t map_size;
+
+	if (size > SIZE_MAX - TN_SCRATCH_HDRSZ - page) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	map_size = (size + TN_SCRATCH_HDRSZ + page - 1) & ~(page - 1);
+
+	pthread_mutex_lock(&scratch_pool.lock);
+	for (i = 0; i < scratch_pool.cnt; i++) {
+		if ((scratch_pool.free[i]->size >= map_size) &&
+		    ((best == SIZE_MAX) || (scratch_pool.free[i]->size < scratch_pool.free[best]->size))) {
+			best = i;
+		}
+	}
+
+	if (best != SIZE_MAX) {
+		hdr = scratch_pool.free[best];
+		scratch_pool.free[best] = scratch_pool.free[--scratch_pool.cnt];
+	}
+	pthread_mutex_unlock(&scratch_pool.lock);
+
+	if (hdr != NULL) {
+		return (char *)hdr + TN_SCRATCH_HDRSZ;
+	}
+
+	hdr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (hdr == MAP_FAILED) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	madvise(hdr, map_size, MADV_DONTDUMP);
+
+	hdr->size = map_size;
+	hdr->locked = mlock(hdr, map_size) == 0;
+
+	return (char *)hdr + TN_SCRATCH_HDRSZ;
+}
+
+/*
+ * Zero and release a buffer from scratch_alloc(). NULL is ignored.
+ * Does not require GIL.
+ */
+void
+scratch_free(void *ptr)
+{
+	tn_scratch_hdr_t *hdr;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	hdr = (tn_scratch_hdr_t *)((char *)ptr - TN_SCRATCH_HDRSZ);
+	explicit_bzero(ptr, hdr->size - TN_SCRATCH_HDRSZ);
+
+	if (hdr->size <= TN_SCRATCH_POOL_REGION_MAX) {
+		pthread_mutex_lock(&scratch_pool.lock);
+		if (scratch_pool.cnt < TN_SCRATCH_POOL_CNT) {
+			scratch_pool.free[scratch_pool.cnt++] = hdr;
+			hdr = NULL;
+		}
+		pthread_mutex_unlock(&scratch_pool.lock);
+	}
+
+	if (hdr != NULL) {
+		scratch_unmap(hdr);
+	}
+}
+
+/*
+ * Usable size of a buffer from scratch_alloc(). Does not require GIL.
+ */
+size_t
+scratch_size(const void *ptr)
+{
+	const tn_scratch_hdr_t *hdr;
+
+	hdr = (const tn_scratch_hdr_t *)((const char *)ptr - TN_SCRATCH_HDRSZ);
+	return hdr->size - TN_SCRATCH_HDRSZ;
+}
+
+/*
+ * Each thread also keeps one scratch buffer for the optimistic read
+ * helpers so that the common single-syscall read doesn't need to allocate.
+ * Buffers come in power-of-two size classes and only grow, so a thread
+ * settles on the size of the largest payload it sees. Buffers larger than
+ * TN_SCRATCH_TLS_MAX are released after use rather than kept.
+ */
+#define TN_SCRATCH_TLS_MAX (64 * 1024)
+
+static __thread void *scratch_tls_buf;
+static pthread_key_t scratch_tls_key;
+static pthread_once_t scratch_tls_once = PTHREAD_ONCE_INIT;
+
+static void
+scratch_tls_destroy(void *ptr)
+{
+	scratch_free(ptr);
+}
+
+static void
+scratch_tls_init(void)
+{
+	pthread_key_create(&scratch_tls_key, scratch_tls_destroy);
+}
+
+/*
+ * Get this thread's scratch buffer, growing it to hold at least size bytes.
+ * The buffer must be handed back via scratch_tls_put() before it is
+ * requested again. Returns NULL with errno set on failure.
+ * Does not require GIL.
+ */
+void *
+scratch_tls_get(size_t size)
+{
+	void *buf = scratch_tls_buf;
+	size_t class = 4096;
+
+	if ((buf != NULL) && (scratch_size(buf) >= size)) {
+		return buf;
+	}
+
+	while (class - TN_SCRATCH_HDRSZ < size) {
+		if (class > SIZE_MAX / 2) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		class *= 2;
+	}
+
+	buf = scratch_alloc(class - TN_SCRATCH_HDRSZ);
+	if (buf == NULL) {
+		return NULL;
+	}
+
+	pthread_once(&scratch_tls_once, scratch_tls_init);
+	scratch_free(scratch_tls_buf);
+	scratch_tls_buf = buf;
+	pthread_setspecific(scratch_tls_key, buf);
+
+	return buf;
+}
+
+/*
+ * Scrub the first `used` bytes of this thread's scratch buffer once the
+ * caller is done with it. Does not require GIL.
+ */
+void
+scratch_tls_put(void *buf, size_t used)
+{
+	explicit_bzero(buf, used);
+
+	if (scratch_size(buf) > TN_SCRATCH_TLS_MAX) {
+		scratch_tls_buf = NULL;
+		pthread_setspecific(scratch_tls_key, NULL);
+		scratch_free(buf);
+	}
+}
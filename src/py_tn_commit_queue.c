@@ -0,0 +1,873 @@
+/* Write-behind keyring commits with per-name coalescing */
+
+#include "truenas_keyring.h"
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Commit intents are queued in FIFO order and applied by a single writer
+ * thread, which preserves the order of commits for any one name. An
+ * intent for a name that is already queued (and not yet being applied)
+ * replaces the queued contents in place, so a burst of updates for the
+ * same name costs one commit. Each intent waits at least `delay` after it
+ * was first queued before being applied, giving bursts time to coalesce.
+ *
+ * Intents are copied into native memory on submission so the writer never
+ * needs the GIL. Copies are zeroed when released.
+ */
+#define TN_COMMIT_QUEUE_BUCKETS 1024
+
+/* Keys to add for an intent. entries and their strings live in one block */
+typedef struct {
+	tn_add_entry_t *entries;
+	size_t cnt;
+	size_t size;		/* of the whole block */
+} tn_intent_data_t;
+
+typedef struct tn_intent {
+	struct tn_intent *next;		/* FIFO order */
+	struct tn_intent *hnext;	/* hash chain */
+	uint64_t due_ns;
+	uint32_t hash;
+	tn_intent_data_t *data;
+	char name[];
+} tn_intent_t;
+
+/* Most recent failure to commit a name */
+typedef struct tn_commit_failure {
+	struct tn_commit_failure *next;
+	int error;
+	char name[];
+} tn_commit_failure_t;
+
+enum tn_commit_queue_stat {
+	TN_COMMIT_QUEUE_STAT_SUBMITTED = 0,
+	TN_COMMIT_QUEUE_STAT_COALESCED,
+	TN_COMMIT_QUEUE_STAT_COMMITTED,
+	TN_COMMIT_QUEUE_STAT_FAILED,
+	TN_COMMIT_QUEUE_STAT_CNT
+};
+
+static const char *tn_commit_queue_stat_names[TN_COMMIT_QUEUE_STAT_CNT] = {
+	[TN_COMMIT_QUEUE_STAT_SUBMITTED] = "submitted",
+	[TN_COMMIT_QUEUE_STAT_COALESCED] = "coalesced",
+	[TN_COMMIT_QUEUE_STAT_COMMITTED] = "committed",
+	[TN_COMMIT_QUEUE_STAT_FAILED] = "failed",
+};
+
+typedef struct {
+	PyObject_HEAD
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* wakes the writer */
+	pthread_cond_t idle_cond;	/* wakes flush() */
+	pthread_t writer;
+	bool running;
+	bool stopping;
+	bool busy;			/* writer is applying an intent */
+	size_t flushers;		/* threads in flush(), skip delay */
+	tn_intent_t *head, *tail;
+	tn_intent_t *buckets[TN_COMMIT_QUEUE_BUCKETS];
+	size_t pending;
+	uint64_t delay_ns;
+	tn_commit_failure_t *failures;
+	unsigned long stats[TN_COMMIT_QUEUE_STAT_CNT];
+	key_serial_t root;
+	char *description;
+	char *key_type_str;
+	tn_commit_unlink_t *unlink;
+	size_t unlink_cnt;
+	PyObject *module_obj;
+} py_tn_commit_queue_t;
+
+static uint64_t
+commit_queue_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t
+commit_queue_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *name != '\0'; name++) {
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+	}
+
+	return hash;
+}
+
+static char *
+commit_queue_strdup(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *out;
+
+	out = PyMem_RawMalloc(len);
+	if (out != NULL) {
+		memcpy(out, str, len);
+	}
+
+	return out;
+}
+
+/*
+ * Zero and release intent data. NULL is ignored. Does not require GIL.
+ */
+static void
+intent_data_free(tn_intent_data_t *data)
+{
+	if (data != NULL) {
+		explicit_bzero(data, data->size);
+		PyMem_RawFree(data);
+	}
+}
+
+/*
+ * Copy entries parsed by parse_add_entries() into a single block that
+ * does not reference any python objects. Requires GIL.
+ */
+static tn_intent_data_t *
+intent_data_copy(const tn_add_entry_t *entries, size_t cnt)
+{
+	tn_intent_data_t *data;
+	size_t i, size;
+	char *p;
+
+	size = sizeof(tn_intent_data_t) + (cnt * sizeof(tn_add_entry_t));
+	for (i = 0; i < cnt; i++) {
+		size += strlen(entries[i].description) + 1 + entries[i].data_len;
+	}
+
+	data = PyMem_RawMalloc(size);
+	if (data == NULL) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	data->entries = (tn_add_entry_t *)(data + 1);
+	data->cnt = cnt;
+	data->size = size;
+
+	p = (char *)(data->entries + cnt);
+	for (i = 0; i < cnt; i++) {
+		size_t len = strlen(entries[i].description) + 1;
+
+		data->entries[i] = entries[i];
+		data->entries[i].description = memcpy(p, entries[i].description, len);
+		p += len;
+		data->entries[i].data = memcpy(p, entries[i].data, entries[i].data_len);
+		p += entries[i].data_len;
+	}
+
+	return data;
+}
+
+/*
+ * Find the queued intent for name. Called with the queue lock held.
+ */
+static tn_intent_t *
+commit_queue_find_locked(py_tn_commit_queue_t *self, const char *name, uint32_t hash)
+{
+	tn_intent_t *intent;
+
+	for (intent = self->buckets[hash % TN_COMMIT_QUEUE_BUCKETS]; intent != NULL;
+	     intent = intent->hnext) {
+		if ((intent->hash == hash) && (strcmp(intent->name, name) == 0)) {
+			return intent;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Remove the head of the queue. Called with the queue lock held.
+ */
+static tn_intent_t *
+commit_queue_pop_locked(py_tn_commit_queue_t *self)
+{
+	tn_intent_t *intent = self->head, **pp;
+
+	self->head = intent->next;
+	if (self->head == NULL) {
+		self->tail = NULL;
+	}
+
+	for (pp = &self->buckets[intent->hash % TN_COMMIT_QUEUE_BUCKETS]; *pp != intent;
+	     pp = &(*pp)->hnext) {
+		;
+	}
+	*pp = intent->hnext;
+
+	self->pending--;
+	return intent;
+}
+
+/*
+ * Record the outcome of committing name, replacing any earlier failure.
+ * Called with the queue lock held.
+ */
+static void
+commit_queue_record_locked(py_tn_commit_queue_t *self, const char *name, int error)
+{
+	tn_commit_failure_t *failure, **pp;
+	size_t len;
+
+	for (pp = &self->failures; *pp != NULL; pp = &(*pp)->next) {
+		if (strcmp((*pp)->name, name) == 0) {
+			failure = *pp;
+			*pp = failure->next;
+			PyMem_RawFree(failure);
+			break;
+		}
+	}
+
+	if (error == 0) {
+		self->stats[TN_COMMIT_QUEUE_STAT_COMMITTED]++;
+		return;
+	}
+
+	self->stats[TN_COMMIT_QUEUE_STAT_FAILED]++;
+
+	len = strlen(name) + 1;
+	failure = PyMem_RawMalloc(sizeof(tn_commit_failure_t) + len);
+	if (failure == NULL) {
+		/* still counted in the stats */
+		return;
+	}
+
+	failure->error = error;
+	memcpy(failure->name, name, len);
+	failure->next = self->failures;
+	self->failures = failure;
+}
+
+static void *
+commit_queue_writer(void *arg)
+{
+	py_tn_commit_queue_t *self = arg;
+	tn_intent_t *intent;
+	key_serial_t serial;
+	struct timespec ts;
+	uint64_t now;
+	int error;
+
+	pthread_mutex_lock(&self->lock);
+	for (;;) {
+		while (!self->stopping && (self->head == NULL)) {
+			pthread_cond_wait(&self->cond, &self->lock);
+		}
+
+		if (self->head == NULL) {
+			/* stopping with nothing left to apply */
+			break;
+		}
+
+		now = commit_queue_now_ns();
+		if (!self->stopping && (self->flushers == 0) && (now < self->head->due_ns)) {
+			ts.tv_sec = (time_t)(self->head->due_ns / 1000000000ULL);
+			ts.tv_nsec = (long)(self->head->due_ns % 1000000000ULL);
+			pthread_cond_timedwait(&self->cond, &self->lock, &ts);
+			continue;
+		}
+
+		intent = commit_queue_pop_locked(self);
+		self->busy = true;
+		pthread_mutex_unlock(&self->lock);
+
+		error = 0;
+		if (!commit_keyring(self->root, intent->name, self->description,
+				    self->key_type_str, self->unlink, self->unlink_cnt,
+				    intent->data->entries, intent->data->cnt, &serial)) {
+			error = errno;
+		}
+
+		pthread_mutex_lock(&self->lock);
+		commit_queue_record_locked(self, intent->name, error);
+		self->busy = false;
+		if (self->head == NULL) {
+			pthread_cond_broadcast(&self->idle_cond);
+		}
+		pthread_mutex_unlock(&self->lock);
+
+		intent_data_free(intent->data);
+		PyMem_RawFree(intent);
+
+		pthread_mutex_lock(&self->lock);
+	}
+	pthread_cond_broadcast(&self->idle_cond);
+	pthread_mutex_unlock(&self->lock);
+
+	return NULL;
+}
+
+/*
+ * Apply everything that is queued and stop the writer. The queue is marked
+ * closed before the GIL is dropped so that a concurrent close() returns
+ * without joining the writer again, and stopping is set under the lock so
+ * that submit() can't queue an intent that the writer will never apply.
+ * Requires GIL (released while waiting).
+ */
+static void
+py_tn_commit_queue_shutdown(py_tn_commit_queue_t *self)
+{
+	if (!self->running) {
+		return;
+	}
+
+	self->running = false;
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&self->lock);
+	self->stopping = true;
+	pthread_cond_signal(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+
+	pthread_join(self->writer, NULL);
+	Py_END_ALLOW_THREADS
+}
+
+static void
+py_tn_commit_queue_dealloc(py_tn_commit_queue_t *self)
+{
+	tn_commit_failure_t *failure;
+	tn_intent_t *intent;
+	size_t i;
+
+	py_tn_commit_queue_shutdown(self);
+
+	/* only left over if the writer never started */
+	while ((intent = self->head) != NULL) {
+		self->head = intent->next;
+		intent_data_free(intent->data);
+		PyMem_RawFree(intent);
+	}
+
+	while ((failure = self->failures) != NULL) {
+		self->failures = failure->next;
+		PyMem_RawFree(failure);
+	}
+
+	if (self->unlink != NULL) {
+		for (i = 0; i < self->unlink_cnt; i++) {
+			PyMem_RawFree((char *)self->unlink[i].key_type_str);
+			PyMem_RawFree((char *)self->unlink[i].description);
+		}
+		PyMem_RawFree(self->unlink);
+	}
+
+	PyMem_RawFree(self->description);
+	PyMem_RawFree(self->key_type_str);
+	pthread_cond_destroy(&self->idle_cond);
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	Py_CLEAR(self->module_obj);
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+py_tn_commit_queue_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+	py_tn_commit_queue_t *self;
+	pthread_condattr_t attr;
+
+	self = (py_tn_commit_queue_t *)type->tp_alloc(type, 0);
+	if (self != NULL) {
+		pthread_mutex_init(&self->lock, NULL);
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&self->cond, &attr);
+		pthread_cond_init(&self->idle_cond, &attr);
+		pthread_condattr_destroy(&attr);
+	}
+
+	return (PyObject *)self;
+}
+
+/*
+ * Create a queue committing keyrings `description` within children of root
+ * and start its writer. The strings and unlink specs are copied.
+ * Requires GIL.
+ */
+PyObject *
+py_tn_commit_queue_create(PyObject *module_obj, key_serial_t root, const char *description,
+			  const char *key_type_str, const tn_commit_unlink_t *unlink,
+			  size_t unlink_cnt, double delay)
+{
+	py_tn_commit_queue_t *self;
+	size_t i;
+	int err;
+
+	self = (py_tn_commit_queue_t *)PyObject_CallFunction((PyObject *)&TNCommitQueueType, NULL);
+	if (self == NULL) {
+		return NULL;
+	}
+
+	self->module_obj = Py_NewRef(module_obj);
+	self->root = root;
+	self->delay_ns = (uint64_t)(delay * 1000000000.0);
+	self->description = commit_queue_strdup(description);
+	self->key_type_str = commit_queue_strdup(key_type_str);
+	self->unlink = PyMem_RawCalloc(unlink_cnt ? unlink_cnt : 1, sizeof(tn_commit_unlink_t));
+	if ((self->description == NULL) || (self->key_type_str == NULL) || (self->unlink == NULL)) {
+		goto nomem;
+	}
+
+	for (; self->unlink_cnt < unlink_cnt; self->unlink_cnt++) {
+		i = self->unlink_cnt;
+		self->unlink[i].key_type_str = commit_queue_strdup(unlink[i].key_type_str);
+		self->unlink[i].description = commit_queue_strdup(unlink[i].description);
+		if ((self->unlink[i].key_type_str == NULL) || (self->unlink[i].description == NULL)) {
+			/* dealloc frees the partially copied entry */
+			self->unlink_cnt++;
+			goto nomem;
+		}
+	}
+
+	err = pthread_create(&self->writer, NULL, commit_queue_writer, self);
+	if (err) {
+		errno = err;
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	self->running = true;
+	return (PyObject *)self;
+
+nomem:
+	PyErr_NoMemory();
+	Py_DECREF(self);
+	return NULL;
+}
+
+static bool
+py_tn_commit_queue_check_open(py_tn_commit_queue_t *self)
+{
+	if (!self->running) {
+		PyErr_SetString(PyExc_ValueError, "I/O operation on closed commit queue");
+		return false;
+	}
+
+	return true;
+}
+
+PyDoc_STRVAR(py_tn_commit_queue_submit__doc__,
+"submit(*, name, entries) -> bool\n"
+"--------------------------------\n\n"
+"Queue replacing the keyring of the child called name with one holding\n"
+"entries. If a commit for name is already queued and has not started, its\n"
+"entries are replaced by these and it keeps its place in the queue.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"name: str, required\n"
+"    Description of the child keyring, e.g. a username.\n\n"
+"entries: Iterable[tuple[str, bytes, int | None]], required\n"
+"    (description, data, timeout) for each key. See add_keys().\n\n"
+""
+"Returns\n"
+"-------\n"
+"bool\n"
+"    True if the commit was coalesced with one already queued.\n\n"
+""
+"Raises\n"
+"------\n"
+"TypeError:\n"
+"    Invalid entries.\n"
+"ValueError:\n"
+"    Queue is closed, missing required parameter or invalid timeout.\n\n"
+);
+
+static PyObject *
+py_tn_commit_queue_submit(py_tn_commit_queue_t *self, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"name", "entries", NULL};
+	const char *name = NULL;
+	PyObject *entries_obj = NULL, *entries_fast;
+	tn_add_entry_t *entries;
+	tn_intent_data_t *data;
+	tn_intent_t *intent, *queued;
+	size_t cnt, len;
+	uint32_t hash;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$sO:submit",
+					 kwlist, &name, &entries_obj)) {
+		return NULL;
+	}
+
+	if ((name == NULL) || (entries_obj == NULL)) {
+		PyErr_SetString(PyExc_ValueError, "name and entries arguments are required");
+		return NULL;
+	}
+
+	if (!py_tn_commit_queue_check_open(self)) {
+		return NULL;
+	}
+
+	if (!parse_add_entries(entries_obj, &entries_fast, &entries, &cnt)) {
+		return NULL;
+	}
+
+	data = intent_data_copy(entries, cnt);
+	PyMem_RawFree(entries);
+	Py_DECREF(entries_fast);
+	if (data == NULL) {
+		return NULL;
+	}
+
+	len = strlen(name) + 1;
+	intent = PyMem_RawCalloc(1, sizeof(tn_intent_t) + len);
+	if (intent == NULL) {
+		intent_data_free(data);
+		return PyErr_NoMemory();
+	}
+
+	hash = commit_queue_hash(name);
+	intent->hash = hash;
+	intent->data = data;
+	intent->due_ns = commit_queue_now_ns() + self->delay_ns;
+	memcpy(intent->name, name, len);
+
+	pthread_mutex_lock(&self->lock);
+	if (self->stopping) {
+		/* closed while entries were being parsed */
+		pthread_mutex_unlock(&self->lock);
+		intent_data_free(data);
+		PyMem_RawFree(intent);
+		PyErr_SetString(PyExc_ValueError, "I/O operation on closed commit queue");
+		return NULL;
+	}
+
+	self->stats[TN_COMMIT_QUEUE_STAT_SUBMITTED]++;
+	queued = commit_queue_find_locked(self, name, hash);
+	if (queued != NULL) {
+		/* swap in the new entries, the old ones are released below */
+		intent->data = queued->data;
+		queued->data = data;
+		self->stats[TN_COMMIT_QUEUE_STAT_COALESCED]++;
+	} else {
+		if (self->tail != NULL) {
+			self->tail->next = intent;
+		} else {
+			self->head = intent;
+		}
+		self->tail = intent;
+		intent->hnext = self->buckets[hash % TN_COMMIT_QUEUE_BUCKETS];
+		self->buckets[hash % TN_COMMIT_QUEUE_BUCKETS] = intent;
+		self->pending++;
+		pthread_cond_signal(&self->cond);
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	if (queued != NULL) {
+		intent_data_free(intent->data);
+		PyMem_RawFree(intent);
+	}
+
+	return PyBool_FromLong(queued != NULL);
+}
+
+PyDoc_STRVAR(py_tn_commit_queue_flush__doc__,
+"flush(*, timeout=None) -> bool\n"
+"------------------------------\n\n"
+"Wait for all queued commits to be applied. Commits still waiting out\n"
+"the queue's delay are applied immediately.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"timeout: float, optional\n"
+"    Maximum number of seconds to wait. Default: None (wait forever).\n\n"
+""
+"Returns\n"
+"-------\n"
+"bool\n"
+"    True if the queue was drained, False if the timeout expired first.\n"
+"    Failed commits count as applied, see pop_errors().\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Negative timeout.\n\n"
+);
+
+static PyObject *
+py_tn_commit_queue_flush(py_tn_commit_queue_t *self, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"timeout", NULL};
+	PyObject *timeout_obj = Py_None;
+	double timeout = -1;
+	struct timespec ts;
+	uint64_t deadline = 0;
+	bool drained;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$O:flush",
+					 kwlist, &timeout_obj)) {
+		return NULL;
+	}
+
+	if (timeout_obj != Py_None) {
+		timeout = PyFloat_AsDouble(timeout_obj);
+		if ((timeout == -1) && PyErr_Occurred()) {
+			return NULL;
+		}
+
+		if (timeout < 0) {
+			PyErr_SetString(PyExc_ValueError, "timeout must not be negative");
+			return NULL;
+		}
+
+		deadline = commit_queue_now_ns() + (uint64_t)(timeout * 1000000000.0);
+		ts.tv_sec = (time_t)(deadline / 1000000000ULL);
+		ts.tv_nsec = (long)(deadline % 1000000000ULL);
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&self->lock);
+	self->flushers++;
+	pthread_cond_signal(&self->cond);
+	while ((self->head != NULL) || self->busy) {
+		if (deadline == 0) {
+			pthread_cond_wait(&self->idle_cond, &self->lock);
+		} else if (pthread_cond_timedwait(&self->idle_cond, &self->lock, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+	drained = (self->head == NULL) && !self->busy;
+	self->flushers--;
+	pthread_mutex_unlock(&self->lock);
+	Py_END_ALLOW_THREADS
+
+	return PyBool_FromLong(drained);
+}
+
+PyDoc_STRVAR(py_tn_commit_queue_pop_errors__doc__,
+"pop_errors() -> dict[str, truenas_keyring.KeyringError]\n"
+"-------------------------------------------------------\n\n"
+"Return and forget the commits that failed. Only the most recent failure\n"
+"is kept for each name, and it is dropped if a later commit for the name\n"
+"succeeds.\n\n"
+""
+"Returns\n"
+"-------\n"
+"dict[str, truenas_keyring.KeyringError]\n"
+"    The error that prevented each name from being committed.\n\n"
+);
+
+static PyObject *
+py_tn_commit_queue_pop_errors(py_tn_commit_queue_t *self, PyObject *Py_UNUSED(ignored))
+{
+	tn_commit_failure_t *failures, *failure;
+	PyObject *exc = get_keyring_error_from_module(self->module_obj);
+	PyObject *out;
+
+	out = PyDict_New();
+	if (out == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&self->lock);
+	failures = self->failures;
+	self->failures = NULL;
+	pthread_mutex_unlock(&self->lock);
+
+	while ((failure = failures) != NULL) {
+		failures = failure->next;
+
+		if (out != NULL) {
+			PyObject *err = PyObject_CallFunction(exc, "is", failure->error,
+							      strerror(failure->error));
+			if ((err == NULL) || (PyDict_SetItemString(out, failure->name, err) < 0)) {
+				/* keep freeing the remaining failures */
+				Py_CLEAR(out);
+			}
+			Py_XDECREF(err);
+		}
+		PyMem_RawFree(failure);
+	}
+
+	return out;
+}
+
+PyDoc_STRVAR(py_tn_commit_queue_get_stats__doc__,
+"get_stats(*, reset=False) -> dict\n"
+"---------------------------------\n\n"
+"Return counters for the queue: \"submitted\" commits, commits that were\n"
+"\"coalesced\" with one already queued, and commits applied by the writer\n"
+"(\"committed\" and \"failed\"). \"pending\" is the current queue depth. The\n"
+"ratio of applied to submitted commits is the write amplification.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"reset: bool, optional, default=False\n"
+"    Reset all counters to zero after reading them.\n\n"
+""
+"Returns\n"
+"-------\n"
+"dict\n"
+"    Mapping of counter name to value.\n\n"
+);
+
+static PyObject *
+py_tn_commit_queue_get_stats(py_tn_commit_queue_t *self, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"reset", NULL};
+	unsigned long stats[TN_COMMIT_QUEUE_STAT_CNT];
+	size_t i, pending;
+	int reset = false;
+	PyObject *out;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$p:get_stats",
+					 kwlist, &reset)) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&self->lock);
+	memcpy(stats, self->stats, sizeof(stats));
+	pending = self->pending;
+	if (reset) {
+		memset(self->stats, 0, sizeof(self->stats));
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	out = PyDict_New();
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i <= TN_COMMIT_QUEUE_STAT_CNT; i++) {
+		PyObject *val;
+		int err;
+
+		val = PyLong_FromUnsignedLong(i < TN_COMMIT_QUEUE_STAT_CNT ? stats[i] : pending);
+		if (val == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		err = PyDict_SetItemString(out, i < TN_COMMIT_QUEUE_STAT_CNT ?
+					   tn_commit_queue_stat_names[i] : "pending", val);
+		Py_DECREF(val);
+		if (err) {
+			Py_DECREF(out);
+			return NULL;
+		}
+	}
+
+	return out;
+}
+
+static PyObject *
+py_tn_commit_queue_close(py_tn_commit_queue_t *self, PyObject *Py_UNUSED(ignored))
+{
+	py_tn_commit_queue_shutdown(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_tn_commit_queue_enter(py_tn_commit_queue_t *self, PyObject *Py_UNUSED(ignored))
+{
+	if (!py_tn_commit_queue_check_open(self)) {
+		return NULL;
+	}
+
+	return Py_NewRef((PyObject *)self);
+}
+
+static PyObject *
+py_tn_commit_queue_exit(py_tn_commit_queue_t *self, PyObject *args)
+{
+	py_tn_commit_queue_shutdown(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_tn_commit_queue_get_pending(py_tn_commit_queue_t *self, void *closure)
+{
+	size_t pending;
+
+	pthread_mutex_lock(&self->lock);
+	pending = self->pending;
+	pthread_mutex_unlock(&self->lock);
+
+	return PyLong_FromSize_t(pending);
+}
+
+static PyObject *
+py_tn_commit_queue_get_closed(py_tn_commit_queue_t *self, void *closure)
+{
+	return PyBool_FromLong(!self->running);
+}
+
+static PyMethodDef py_tn_commit_queue_methods[] = {
+	{
+		.ml_name = "submit",
+		.ml_meth = (PyCFunction)py_tn_commit_queue_submit,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_commit_queue_submit__doc__
+	},
+	{
+		.ml_name = "flush",
+		.ml_meth = (PyCFunction)py_tn_commit_queue_flush,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_commit_queue_flush__doc__
+	},
+	{
+		.ml_name = "pop_errors",
+		.ml_meth = (PyCFunction)py_tn_commit_queue_pop_errors,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tn_commit_queue_pop_errors__doc__
+	},
+	{
+		.ml_name = "get_stats",
+		.ml_meth = (PyCFunction)py_tn_commit_queue_get_stats,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_commit_queue_get_stats__doc__
+	},
+	{
+		.ml_name = "close",
+		.ml_meth = (PyCFunction)py_tn_commit_queue_close,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "close() -> None\n\nApply all queued commits and stop the writer."
+	},
+	{
+		.ml_name = "__enter__",
+		.ml_meth = (PyCFunction)py_tn_commit_queue_enter,
+		.ml_flags = METH_NOARGS,
+	},
+	{
+		.ml_name = "__exit__",
+		.ml_meth = (PyCFunction)py_tn_commit_queue_exit,
+		.ml_flags = METH_VARARGS,
+	},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef py_tn_commit_queue_getsetters[] = {
+	{
+		.name = "pending",
+		.get = (getter)py_tn_commit_queue_get_pending,
+		.doc = "Number of commits queued and not yet started",
+	},
+	{
+		.name = "closed",
+		.get = (getter)py_tn_commit_queue_get_closed,
+		.doc = "True if the queue has been closed",
+	},
+	{ .name = NULL }
+};
+
+PyTypeObject TNCommitQueueType = {
+	.tp_name = MODULE_NAME ".TNCommitQueue",
+	.tp_doc = "TrueNAS write-behind keyring commit queue",
+	.tp_basicsize = sizeof(py_tn_commit_queue_t),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor) py_tn_commit_queue_dealloc,
+	.tp_new = py_tn_commit_queue_new,
+	.tp_methods = py_tn_commit_queue_methods,
+	.tp_getset = py_tn_commit_queue_getsetters,
+};
@@ -0,0 +1,976 @@
+/* Keyring operations run by native workers with eventfd completion */
+
+#include "truenas_keyring.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/*
+ * Operations are submitted to a FIFO served by a small pool of threads
+ * that live as long as the queue. Each finished job is moved to a done
+ * list, and the eventfd is written only when that list goes from empty to
+ * non-empty. An event loop therefore wakes once for however many jobs
+ * complete before it gets around to calling reap(), and converts all of
+ * them to python objects in one pass.
+ */
+enum tn_aio_op {
+	TN_AIO_SEARCH = 0,
+	TN_AIO_READ_DATA,
+	TN_AIO_READ_ALL,
+	TN_AIO_ADD_KEYS,
+	TN_AIO_LOOKUP_PAYLOAD,
+};
+
+typedef struct tn_aio_job {
+	struct tn_aio_job *next;
+	uint64_t token;
+	enum tn_aio_op op;
+	key_serial_t serial;		/* key or keyring operated on */
+	char *key_type_str;		/* PyMem_RawMalloc, may be NULL */
+	char *description;		/* PyMem_RawMalloc, may be NULL */
+	PyObject *ref;			/* keeps entries / path strings alive */
+	tn_add_entry_t *entries;
+	const char **path;
+	size_t cnt;
+	/* results, filled in by the worker */
+	int error;
+	key_serial_t result;
+	tn_key_info_t info;
+	char *data;			/* scratch_alloc() */
+	size_t data_len;
+	tn_payload_set_t set;
+} tn_aio_job_t;
+
+typedef struct {
+	PyObject_HEAD
+	int efd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t workers[TN_AIO_WORKERS_MAX];
+	size_t nworkers;
+	tn_aio_job_t *submitted, *submitted_tail;
+	tn_aio_job_t *done, *done_tail;
+	bool signalled;		/* eventfd written since last reap() */
+	bool stopping;
+	bool closed;		/* close() has started, set with GIL held */
+	uint64_t next_token;
+	size_t pending;		/* submitted but not yet reaped */
+	PyObject *module_obj;
+} py_tn_completion_queue_t;
+
+static char *
+aio_strdup(const char *str)
+{
+	size_t len;
+	char *out;
+
+	if (str == NULL) {
+		return NULL;
+	}
+
+	len = strlen(str) + 1;
+	out = PyMem_RawMalloc(len);
+	if (out != NULL) {
+		memcpy(out, str, len);
+	}
+
+	return out;
+}
+
+/*
+ * Release a job and everything it references. Requires GIL.
+ */
+static void
+aio_job_free(tn_aio_job_t *job)
+{
+	PyMem_RawFree(job->key_type_str);
+	PyMem_RawFree(job->description);
+	PyMem_RawFree(job->entries);
+	PyMem_RawFree(job->path);
+	Py_XDECREF(job->ref);
+	free_key_info(&job->info);
+	scratch_free(job->data);
+	free_payload_set(&job->set);
+	PyMem_RawFree(job);
+}
+
+/*
+ * Copy a payload out of this thread's read buffer into one that can be
+ * handed to the thread calling reap(). Does not require GIL.
+ */
+static bool
+aio_job_keep_payload(tn_aio_job_t *job, char *data, size_t data_len)
+{
+	job->data = scratch_alloc(data_len ? data_len : 1);
+	if (job->data != NULL) {
+		memcpy(job->data, data, data_len);
+		job->data_len = data_len;
+	}
+	scratch_tls_put(data, data_len);
+
+	return job->data != NULL;
+}
+
+/*
+ * Perform the operation described by job. Does not require GIL.
+ */
+static void
+aio_job_run(tn_aio_job_t *job)
+{
+	char *data = NULL;
+	size_t data_len = 0, done;
+	bool success = false;
+
+	switch (job->op) {
+	case TN_AIO_SEARCH:
+		job->result = cached_keyring_search(job->serial, job->key_type_str,
+						    job->description, &job->info);
+		success = job->result != -1;
+		break;
+	case TN_AIO_READ_DATA:
+		success = read_key_payload(job->serial, &data, &data_len) &&
+			  aio_job_keep_payload(job, data, data_len);
+		break;
+	case TN_AIO_READ_ALL:
+		/* The keyring is a plain serial here, not a TNKeyring */
+		success = check_keyring(job->serial) &&
+			  read_keyring_payloads(job->serial, job->key_type_str,
+						false, false, &job->set);
+		break;
+	case TN_AIO_ADD_KEYS:
+		success = add_key_entries(job->key_type_str, job->serial,
+					  job->entries, job->cnt, &done);
+		break;
+	case TN_AIO_LOOKUP_PAYLOAD:
+		success = lookup_key_payload(job->serial, job->path, job->cnt,
+					     job->key_type_str, job->description,
+					     &data, &data_len) &&
+			  aio_job_keep_payload(job, data, data_len);
+		break;
+	}
+
+	if (!success) {
+		job->error = errno ? errno : EIO;
+	}
+}
+
+/*
+ * Append job to the done list, signalling the eventfd if the list was
+ * drained by the last reap(). Called with the queue lock held.
+ */
+static void
+aio_complete_locked(py_tn_completion_queue_t *self, tn_aio_job_t *job)
+{
+	uint64_t one = 1;
+
+	job->next = NULL;
+	if (self->done_tail != NULL) {
+		self->done_tail->next = job;
+	} else {
+		self->done = job;
+	}
+	self->done_tail = job;
+
+	if (!self->signalled && (self->efd != -1)) {
+		self->signalled = true;
+		(void)!write(self->efd, &one, sizeof(one));
+	}
+}
+
+static void *
+aio_worker(void *arg)
+{
+	py_tn_completion_queue_t *self = arg;
+	tn_aio_job_t *job;
+
+	pthread_mutex_lock(&self->lock);
+	for (;;) {
+		while (!self->stopping && (self->submitted == NULL)) {
+			pthread_cond_wait(&self->cond, &self->lock);
+		}
+
+		if (self->stopping) {
+			break;
+		}
+
+		job = self->submitted;
+		self->submitted = job->next;
+		if (self->submitted == NULL) {
+			self->submitted_tail = NULL;
+		}
+		pthread_mutex_unlock(&self->lock);
+
+		aio_job_run(job);
+
+		pthread_mutex_lock(&self->lock);
+		aio_complete_locked(self, job);
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	return NULL;
+}
+
+/*
+ * Stop the workers, waiting for running jobs to finish. Jobs that were not
+ * started complete with ECANCELED. The queue is marked closed before the
+ * GIL is dropped so that a concurrent close() doesn't join the workers or
+ * close the eventfd a second time. Requires GIL (released while waiting).
+ */
+static void
+py_tn_completion_queue_shutdown(py_tn_completion_queue_t *self)
+{
+	tn_aio_job_t *job;
+	size_t i;
+	int efd;
+
+	if (self->closed) {
+		return;
+	}
+
+	self->closed = true;
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&self->lock);
+	self->stopping = true;
+	while ((job = self->submitted) != NULL) {
+		self->submitted = job->next;
+		job->error = ECANCELED;
+		aio_complete_locked(self, job);
+	}
+	self->submitted_tail = NULL;
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+
+	for (i = 0; i < self->nworkers; i++) {
+		pthread_join(self->workers[i], NULL);
+	}
+
+	/* reap() reads the eventfd under the lock */
+	pthread_mutex_lock(&self->lock);
+	efd = self->efd;
+	self->efd = -1;
+	pthread_mutex_unlock(&self->lock);
+	Py_END_ALLOW_THREADS
+
+	self->nworkers = 0;
+	if (efd != -1) {
+		close(efd);
+	}
+}
+
+static void
+py_tn_completion_queue_dealloc(py_tn_completion_queue_t *self)
+{
+	tn_aio_job_t *job;
+
+	py_tn_completion_queue_shutdown(self);
+
+	while ((job = self->done) != NULL) {
+		self->done = job->next;
+		aio_job_free(job);
+	}
+
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	Py_CLEAR(self->module_obj);
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+py_tn_completion_queue_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+	py_tn_completion_queue_t *self;
+
+	self = (py_tn_completion_queue_t *)type->tp_alloc(type, 0);
+	if (self != NULL) {
+		self->efd = -1;
+		pthread_mutex_init(&self->lock, NULL);
+		pthread_cond_init(&self->cond, NULL);
+	}
+
+	return (PyObject *)self;
+}
+
+/*
+ * Create a new completion queue served by `workers` threads.
+ * Requires GIL.
+ */
+PyObject *
+py_tn_completion_queue_create(PyObject *module_obj, size_t workers)
+{
+	py_tn_completion_queue_t *self;
+	int err = 0;
+
+	self = (py_tn_completion_queue_t *)PyObject_CallFunction(
+		(PyObject *)&TNCompletionQueueType, NULL);
+	if (self == NULL) {
+		return NULL;
+	}
+
+	self->module_obj = Py_NewRef(module_obj);
+
+	self->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (self->efd == -1) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	for (; self->nworkers < workers; self->nworkers++) {
+		err = pthread_create(&self->workers[self->nworkers], NULL, aio_worker, self);
+		if (err) {
+			break;
+		}
+	}
+
+	/* A queue with fewer workers than asked for still works */
+	if (self->nworkers == 0) {
+		errno = err;
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	return (PyObject *)self;
+}
+
+static bool
+py_tn_completion_queue_check_open(py_tn_completion_queue_t *self)
+{
+	if (self->closed) {
+		PyErr_SetString(PyExc_ValueError, "I/O operation on closed completion queue");
+		return false;
+	}
+
+	return true;
+}
+
+static tn_aio_job_t *
+aio_job_new(enum tn_aio_op op, key_serial_t serial, const char *key_type_str,
+	    const char *description)
+{
+	tn_aio_job_t *job;
+
+	job = PyMem_RawCalloc(1, sizeof(tn_aio_job_t));
+	if (job == NULL) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	job->op = op;
+	job->serial = serial;
+	job->key_type_str = aio_strdup(key_type_str);
+	job->description = aio_strdup(description);
+	if (((key_type_str != NULL) && (job->key_type_str == NULL)) ||
+	    ((description != NULL) && (job->description == NULL))) {
+		aio_job_free(job);
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	return job;
+}
+
+/*
+ * Queue job for the workers and return its token. The job is consumed
+ * whether or not this succeeds. Requires GIL.
+ */
+static PyObject *
+py_tn_completion_queue_submit(py_tn_completion_queue_t *self, tn_aio_job_t *job)
+{
+	if (!py_tn_completion_queue_check_open(self)) {
+		aio_job_free(job);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&self->lock);
+	if (self->stopping) {
+		/* closed while the job was being built */
+		pthread_mutex_unlock(&self->lock);
+		aio_job_free(job);
+		PyErr_SetString(PyExc_ValueError, "I/O operation on closed completion queue");
+		return NULL;
+	}
+
+	job->token = ++self->next_token;
+	if (self->submitted_tail != NULL) {
+		self->submitted_tail->next = job;
+	} else {
+		self->submitted = job;
+	}
+	self->submitted_tail = job;
+	self->pending++;
+	pthread_cond_signal(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+
+	return PyLong_FromUnsignedLongLong(job->token);
+}
+
+PyDoc_STRVAR(py_tn_completion_queue_submit_search__doc__,
+"submit_search(*, keyring, key_type, description) -> int\n"
+"-------------------------------------------------------\n\n"
+"Queue a search of keyring (and any nested keyrings) for a key. Completes\n"
+"with the key as TNKeyring.search() would return it.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"keyring: int, required\n"
+"    The serial number of the keyring to search.\n\n"
+"key_type: str, required\n"
+"    The type of key to search for.\n\n"
+"description: str, required\n"
+"    The description to search for.\n\n"
+""
+"Returns\n"
+"-------\n"
+"int\n"
+"    Token identifying the operation in the results of reap().\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Queue is closed.\n\n"
+);
+
+static PyObject *
+py_tn_completion_queue_submit_search(py_tn_completion_queue_t *self, PyObject *args,
+				     PyObject *kwargs)
+{
+	char * const kwlist[] = {"keyring", "key_type", "description", NULL};
+	const char *key_type_str, *description_str;
+	key_serial_t serial;
+	tn_aio_job_t *job;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "$iss:submit_search",
+					 kwlist, &serial, &key_type_str, &description_str)) {
+		return NULL;
+	}
+
+	job = aio_job_new(TN_AIO_SEARCH, serial, key_type_str, description_str);
+	if (job == NULL) {
+		return NULL;
+	}
+
+	return py_tn_completion_queue_submit(self, job);
+}
+
+PyDoc_STRVAR(py_tn_completion_queue_submit_read_data__doc__,
+"submit_read_data(*, serial) -> int\n"
+"----------------------------------\n\n"
+"Queue a read of the payload of a key. Completes with the payload as\n"
+"bytes.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"serial: int, required\n"
+"    The serial number of the key to read.\n\n"
+""
+"Returns\n"
+"-------\n"
+"int\n"
+"    Token identifying the operation in the results of reap().\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Queue is closed.\n\n"
+);
+
+static PyObject *
+py_tn_completion_queue_submit_read_data(py_tn_completion_queue_t *self, PyObject *args,
+					PyObject *kwargs)
+{
+	char * const kwlist[] = {"serial", NULL};
+	key_serial_t serial;
+	tn_aio_job_t *job;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "$i:submit_read_data",
+					 kwlist, &serial)) {
+		return NULL;
+	}
+
+	job = aio_job_new(TN_AIO_READ_DATA, serial, NULL, NULL);
+	if (job == NULL) {
+		return NULL;
+	}
+
+	return py_tn_completion_queue_submit(self, job);
+}
+
+PyDoc_STRVAR(py_tn_completion_queue_submit_read_all__doc__,
+"submit_read_all(*, keyring, key_type=None) -> int\n"
+"-------------------------------------------------\n\n"
+"Queue a read of the payloads of all keys in a keyring. Completes with a\n"
+"dict of description to payload as TNKeyring.read_all() returns.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"keyring: int, required\n"
+"    The serial number of the keyring to read.\n\n"
+"key_type: str, optional\n"
+"    Only read keys of this type. Default: None (all non-keyring keys).\n\n"
+""
+"Returns\n"
+"-------\n"
+"int\n"
+"    Token identifying the operation in the results of reap().\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Queue is closed or missing required parameter.\n\n"
+);
+
+static PyObject *
+py_tn_completion_queue_submit_read_all(py_tn_completion_queue_t *self, PyObject *args,
+				       PyObject *kwargs)
+{
+	char * const kwlist[] = {"keyring", "key_type", NULL};
+	const char *key_type_str = NULL;
+	key_serial_t serial = 0;
+	tn_aio_job_t *job;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$iz:submit_read_all",
+					 kwlist, &serial, &key_type_str)) {
+		return NULL;
+	}
+
+	/* 0 is never a valid key serial */
+	if (serial == 0) {
+		PyErr_SetString(PyExc_ValueError, "keyring argument is required");
+		return NULL;
+	}
+
+	job = aio_job_new(TN_AIO_READ_ALL, serial, key_type_str, NULL);
+	if (job == NULL) {
+		return NULL;
+	}
+
+	return py_tn_completion_queue_submit(self, job);
+}
+
+PyDoc_STRVAR(py_tn_completion_queue_submit_add_keys__doc__,
+"submit_add_keys(*, target_keyring, entries, key_type=KeyType.USER) -> int\n"
+"-------------------------------------------------------------------------\n\n"
+"Queue adding many keys to a keyring. Completes with the list of serial\n"
+"numbers of the keys, in the order of entries.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"target_keyring: int, required\n"
+"    The serial number of the keyring to add the keys to.\n\n"
+"entries: Iterable[tuple[str, bytes, int | None]], required\n"
+"    (description, data, timeout) for each key. See add_keys().\n\n"
+"key_type: str, optional\n"
+"    The type of keys to create. Cannot be \"keyring\".\n"
+"    Default: truenas_keyring.KeyType.USER.\n\n"
+""
+"Returns\n"
+"-------\n"
+"int\n"
+"    Token identifying the operation in the results of reap().\n\n"
+""
+"Raises\n"
+"------\n"
+"TypeError:\n"
+"    Invalid entries.\n"
+"ValueError:\n"
+"    Queue is closed, missing required parameter, \"keyring\" key type or\n"
+"    invalid timeout specified.\n\n"
+);
+
+static PyObject *
+py_tn_completion_queue_submit_add_keys(py_tn_completion_queue_t *self, PyObject *args,
+				       PyObject *kwargs)
+{
+	char * const kwlist[] = {"target_keyring", "entries", "key_type", NULL};
+	const char *key_type_str = KEY_TYPE_STR_USER;
+	PyObject *entries_obj = NULL, *entries_tuple, *entries_fast;
+	key_serial_t serial = 0;
+	tn_aio_job_t *job;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$iOs:submit_add_keys",
+					 kwlist, &serial, &entries_obj, &key_type_str)) {
+		return NULL;
+	}
+
+	if ((serial == 0) || (entries_obj == NULL)) {
+		PyErr_SetString(PyExc_ValueError, "target_keyring and entries arguments are required");
+		return NULL;
+	}
+
+	if (strcmp(key_type_str, KEY_TYPE_STR_KEYRING) == 0) {
+		PyErr_SetString(PyExc_ValueError, "Cannot create keyring with add_keys, use add_keyring instead");
+		return NULL;
+	}
+
+	/* The caller may mutate a list of entries while the job is queued */
+	entries_tuple = PySequence_Tuple(entries_obj);
+	if (entries_tuple == NULL) {
+		return NULL;
+	}
+
+	job = aio_job_new(TN_AIO_ADD_KEYS, serial, key_type_str, NULL);
+	if (job == NULL) {
+		Py_DECREF(entries_tuple);
+		return NULL;
+	}
+
+	if (!parse_add_entries(entries_tuple, &entries_fast, &job->entries, &job->cnt)) {
+		Py_DECREF(entries_tuple);
+		aio_job_free(job);
+		return NULL;
+	}
+
+	job->ref = entries_fast;
+	Py_DECREF(entries_tuple);
+
+	return py_tn_completion_queue_submit(self, job);
+}
+
+PyDoc_STRVAR(py_tn_completion_queue_submit_lookup_payload__doc__,
+"submit_lookup_payload(*, path, description, key_type=KeyType.USER, root=None) -> int\n"
+"------------------------------------------------------------------------------------\n\n"
+"Queue a lookup of the payload of a key within a path of nested keyrings.\n"
+"Completes with the payload, or None if the key does not exist, as\n"
+"lookup_payload() returns.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"path: Sequence[str], required\n"
+"    Descriptions of the keyrings leading to the key.\n\n"
+"description: str, required\n"
+"    The description of the key.\n\n"
+"key_type: str, optional\n"
+"    The type of the key. Default: truenas_keyring.KeyType.USER.\n\n"
+"root: int, optional\n"
+"    The serial number of the keyring to start from.\n"
+"    Default: None (persistent keyring of the current user).\n\n"
+""
+"Returns\n"
+"-------\n"
+"int\n"
+"    Token identifying the operation in the results of reap().\n\n"
+""
+"Raises\n"
+"------\n"
+"TypeError:\n"
+"    Invalid parameter type.\n"
+"ValueError:\n"
+"    Queue is closed or missing required parameter.\n\n"
+);
+
+static PyObject *
+py_tn_completion_queue_submit_lookup_payload(py_tn_completion_queue_t *self, PyObject *args,
+					     PyObject *kwargs)
+{
+	char * const kwlist[] = {"path", "description", "key_type", "root", NULL};
+	const char *key_type_str = KEY_TYPE_STR_USER, *description_str = NULL;
+	PyObject *path_obj = NULL, *path_tuple, *path_fast, *root_obj = Py_None;
+	key_serial_t root;
+	tn_aio_job_t *job;
+	bool success;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$OssO:submit_lookup_payload",
+					 kwlist, &path_obj, &description_str,
+					 &key_type_str, &root_obj)) {
+		return NULL;
+	}
+
+	if ((path_obj == NULL) || (description_str == NULL)) {
+		PyErr_SetString(PyExc_ValueError, "path and description arguments are required");
+		return NULL;
+	}
+
+	path_tuple = PySequence_Tuple(path_obj);
+	if (path_tuple == NULL) {
+		return NULL;
+	}
+
+	job = aio_job_new(TN_AIO_LOOKUP_PAYLOAD, 0, key_type_str, description_str);
+	if (job == NULL) {
+		Py_DECREF(path_tuple);
+		return NULL;
+	}
+
+	success = parse_keyring_path(path_tuple, root_obj, &path_fast, &job->path,
+				     &job->cnt, &root);
+	Py_DECREF(path_tuple);
+	if (!success) {
+		aio_job_free(job);
+		return NULL;
+	}
+
+	job->serial = root;
+	job->ref = path_fast;
+
+	return py_tn_completion_queue_submit(self, job);
+}
+
+/*
+ * Convert the outcome of a finished job to (result, error). Exactly one
+ * of the two is set. Requires GIL.
+ */
+static bool
+aio_job_result(py_tn_completion_queue_t *self, tn_aio_job_t *job,
+	       PyObject **result_out, PyObject **error_out)
+{
+	PyObject *exc = get_keyring_error_from_module(self->module_obj);
+	size_t i;
+
+	*result_out = NULL;
+	*error_out = NULL;
+
+	if (job->error) {
+		if ((job->op == TN_AIO_LOOKUP_PAYLOAD) &&
+		    ((job->error == ENOKEY) || (job->error == EKEYEXPIRED) ||
+		     (job->error == EKEYREVOKED))) {
+			*result_out = Py_NewRef(Py_None);
+			return true;
+		}
+
+		if ((job->op == TN_AIO_SEARCH) && (job->error == ENOKEY)) {
+			*error_out = PyObject_CallFunction(PyExc_FileNotFoundError, "s",
+							   "Key not found in keyring");
+		} else {
+			*error_out = PyObject_CallFunction(exc, "is", job->error,
+							   strerror(job->error));
+		}
+		return *error_out != NULL;
+	}
+
+	switch (job->op) {
+	case TN_AIO_SEARCH:
+		*result_out = create_key_object_from_info(job->result, &job->info,
+							  self->module_obj);
+		break;
+	case TN_AIO_READ_DATA:
+	case TN_AIO_LOOKUP_PAYLOAD:
+		*result_out = PyBytes_FromStringAndSize(job->data, job->data_len);
+		break;
+	case TN_AIO_READ_ALL:
+		*result_out = payload_set_to_dict(&job->set);
+		break;
+	case TN_AIO_ADD_KEYS:
+		*result_out = PyList_New(job->cnt);
+		for (i = 0; (*result_out != NULL) && (i < job->cnt); i++) {
+			PyObject *serial = PyLong_FromLong(job->entries[i].serial);
+			if (serial == NULL) {
+				Py_CLEAR(*result_out);
+				break;
+			}
+			PyList_SET_ITEM(*result_out, i, serial);
+		}
+		break;
+	}
+
+	return *result_out != NULL;
+}
+
+PyDoc_STRVAR(py_tn_completion_queue_reap__doc__,
+"reap() -> list[tuple[int, object, Exception | None]]\n"
+"----------------------------------------------------\n\n"
+"Collect all operations that have completed since the last call without\n"
+"blocking. fileno() becomes readable when completions are available, and\n"
+"stays readable until they are reaped.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"None\n\n"
+""
+"Returns\n"
+"-------\n"
+"list[tuple[int, object, Exception | None]]\n"
+"    (token, result, error) for each completed operation in the order\n"
+"    they finished. result is None if error is set. Operations cancelled\n"
+"    by close() fail with errno ECANCELED.\n\n"
+);
+
+static PyObject *
+py_tn_completion_queue_reap(py_tn_completion_queue_t *self, PyObject *Py_UNUSED(ignored))
+{
+	tn_aio_job_t *done, *job;
+	PyObject *out;
+	uint64_t cnt;
+
+	out = PyList_New(0);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&self->lock);
+	if (self->efd != -1) {
+		/* reset the counter, EAGAIN if nothing was signalled */
+		(void)!read(self->efd, &cnt, sizeof(cnt));
+	}
+	self->signalled = false;
+	done = self->done;
+	self->done = self->done_tail = NULL;
+	pthread_mutex_unlock(&self->lock);
+
+	while ((job = done) != NULL) {
+		PyObject *result, *error, *item = NULL;
+
+		done = job->next;
+		self->pending--;
+
+		if (out != NULL && aio_job_result(self, job, &result, &error)) {
+			item = Py_BuildValue("(KNN)", (unsigned long long)job->token,
+					     result ? result : Py_NewRef(Py_None),
+					     error ? error : Py_NewRef(Py_None));
+		}
+
+		if ((item == NULL) || (PyList_Append(out, item) < 0)) {
+			/* keep freeing the remaining jobs */
+			Py_CLEAR(out);
+		}
+		Py_XDECREF(item);
+		aio_job_free(job);
+	}
+
+	return out;
+}
+
+static PyObject *
+py_tn_completion_queue_fileno(py_tn_completion_queue_t *self, PyObject *Py_UNUSED(ignored))
+{
+	if (!py_tn_completion_queue_check_open(self)) {
+		return NULL;
+	}
+
+	return PyLong_FromLong(self->efd);
+}
+
+static PyObject *
+py_tn_completion_queue_close(py_tn_completion_queue_t *self, PyObject *Py_UNUSED(ignored))
+{
+	py_tn_completion_queue_shutdown(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_tn_completion_queue_enter(py_tn_completion_queue_t *self, PyObject *Py_UNUSED(ignored))
+{
+	if (!py_tn_completion_queue_check_open(self)) {
+		return NULL;
+	}
+
+	return Py_NewRef((PyObject *)self);
+}
+
+static PyObject *
+py_tn_completion_queue_exit(py_tn_completion_queue_t *self, PyObject *args)
+{
+	py_tn_completion_queue_shutdown(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_tn_completion_queue_get_pending(py_tn_completion_queue_t *self, void *closure)
+{
+	return PyLong_FromSize_t(self->pending);
+}
+
+static PyObject *
+py_tn_completion_queue_get_workers(py_tn_completion_queue_t *self, void *closure)
+{
+	return PyLong_FromSize_t(self->nworkers);
+}
+
+static PyObject *
+py_tn_completion_queue_get_closed(py_tn_completion_queue_t *self, void *closure)
+{
+	return PyBool_FromLong(self->closed);
+}
+
+static PyMethodDef py_tn_completion_queue_methods[] = {
+	{
+		.ml_name = "submit_search",
+		.ml_meth = (PyCFunction)py_tn_completion_queue_submit_search,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_completion_queue_submit_search__doc__
+	},
+	{
+		.ml_name = "submit_read_data",
+		.ml_meth = (PyCFunction)py_tn_completion_queue_submit_read_data,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_completion_queue_submit_read_data__doc__
+	},
+	{
+		.ml_name = "submit_read_all",
+		.ml_meth = (PyCFunction)py_tn_completion_queue_submit_read_all,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_completion_queue_submit_read_all__doc__
+	},
+	{
+		.ml_name = "submit_add_keys",
+		.ml_meth = (PyCFunction)py_tn_completion_queue_submit_add_keys,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_completion_queue_submit_add_keys__doc__
+	},
+	{
+		.ml_name = "submit_lookup_payload",
+		.ml_meth = (PyCFunction)py_tn_completion_queue_submit_lookup_payload,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_completion_queue_submit_lookup_payload__doc__
+	},
+	{
+		.ml_name = "reap",
+		.ml_meth = (PyCFunction)py_tn_completion_queue_reap,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tn_completion_queue_reap__doc__
+	},
+	{
+		.ml_name = "fileno",
+		.ml_meth = (PyCFunction)py_tn_completion_queue_fileno,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "fileno() -> int\n\nEventfd that becomes readable when completions are available."
+	},
+	{
+		.ml_name = "close",
+		.ml_meth = (PyCFunction)py_tn_completion_queue_close,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "close() -> None\n\nCancel queued operations and stop the workers once running ones finish."
+	},
+	{
+		.ml_name = "__enter__",
+		.ml_meth = (PyCFunction)py_tn_completion_queue_enter,
+		.ml_flags = METH_NOARGS,
+	},
+	{
+		.ml_name = "__exit__",
+		.ml_meth = (PyCFunction)py_tn_completion_queue_exit,
+		.ml_flags = METH_VARARGS,
+	},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef py_tn_completion_queue_getsetters[] = {
+	{
+		.name = "pending",
+		.get = (getter)py_tn_completion_queue_get_pending,
+		.doc = "Number of operations submitted and not yet reaped",
+	},
+	{
+		.name = "workers",
+		.get = (getter)py_tn_completion_queue_get_workers,
+		.doc = "Number of worker threads serving the queue",
+	},
+	{
+		.name = "closed",
+		.get = (getter)py_tn_completion_queue_get_closed,
+		.doc = "True if the queue has been closed",
+	},
+	{ .name = NULL }
+};
+
+PyTypeObject TNCompletionQueueType = {
+	.tp_name = MODULE_NAME ".TNCompletionQueue",
+	.tp_doc = "TrueNAS keyring operations completed by native worker threads",
+	.tp_basicsize = sizeof(py_tn_completion_queue_t),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor) py_tn_completion_queue_dealloc,
+	.tp_new = py_tn_completion_queue_new,
+	.tp_methods = py_tn_completion_queue_methods,
+	.tp_getset = py_tn_completion_queue_getsetters,
+};
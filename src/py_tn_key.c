@@ -1,84 +1,5 @@
 #include "truenas_keyring.h"
 
-#define TNKEY_NOVAL -2
-#define TNKEY_SEPARATOR ";"
-
-enum tnkeydescfield {
-	TNKEYDESC_KEY_TYPE_NAME = 0,
-	TNKEYDESC_KEY_UID,
-	TNKEYDESC_KEY_GID,
-	TNKEYDESC_KEY_PERM
-};
-
-static bool
-py_tnkey_parse_description(py_tnkey_t *self)
-{
-	char *pdesc;
-	char *token;
-	char *saveptr;
-	char *endptr;
-	int field = 0;
-	unsigned long val;
-
-	/*
-	 * Description has form "%s;%d;%d;%08x;%s"
-	 * new items may be added in future kernels before
-	 * the trailing %s (description) and so we use
-	 * strrchr to reach it.
-	 *
-	 * c.f. man (3) keyctl_describe
-	 */
-	pdesc = strrchr(self->c_desc_buf, ';');
-	if (pdesc == NULL) {
-		errno = EINVAL;
-		return false;
-	}
-	self->c_describe = pdesc + 1;
-
-	token = strtok_r(self->c_desc_buf, TNKEY_SEPARATOR, &saveptr);
-	while (token != NULL && field <= TNKEYDESC_KEY_PERM) {
-		switch (field) {
-		case TNKEYDESC_KEY_TYPE_NAME:
-			self->c_key_type_str = token;
-			break;
-		case TNKEYDESC_KEY_UID:
-			val = strtoul(token, &endptr, 10);
-			if (*endptr != '\0' || endptr == token) {
-				self->c_key_uid = TNKEY_NOVAL;
-			} else {
-				self->c_key_uid = (uid_t)val;
-			}
-			break;
-		case TNKEYDESC_KEY_GID:
-			val = strtoul(token, &endptr, 10);
-			if (*endptr != '\0' || endptr == token) {
-				self->c_key_gid = TNKEY_NOVAL;
-			} else {
-				self->c_key_gid = (gid_t)val;
-			}
-			break;
-		case TNKEYDESC_KEY_PERM:
-			val = strtoul(token, &endptr, 16);
-			if (*endptr != '\0' || endptr == token) {
-				self->c_key_perm = TNKEY_NOVAL;
-			} else {
-				self->c_key_perm = (uint)val;
-			}
-			break;
-		}
-		field++;
-		token = strtok_r(NULL, TNKEY_SEPARATOR, &saveptr);
-	}
-
-	if (field < TNKEYDESC_KEY_PERM) {
-		// Somehow we have a truncated description
-		errno = EINVAL;
-		return false;
-	}
-
-	return true;
-}
-
 static PyObject *
 py_tnkey_get_description(py_tnkey_t *self, void *closure)
 {
@@ -154,22 +75,33 @@ PyDoc_STRVAR(py_tnkey_read_data__doc__,
 "    System call failed (see errno for details).\n\n"
 );
 
-static PyObject *
-py_tnkey_read_data(py_tnkey_t *self, PyObject *args)
+static bool
+py_tnkey_check_readable(py_tnkey_t *self)
 {
-	char *data;
-	size_t data_len;
-	PyObject *result;
-	bool success;
-
 	/* Check if this is a keyring - if so, raise ValueError */
 	if (self->c_key_type_str != NULL && strcmp(self->c_key_type_str, KEY_TYPE_STR_KEYRING) == 0) {
 		PyErr_SetString(PyExc_ValueError, "Cannot read data from keyring key type");
-		return NULL;
+		return false;
 	}
 
+	return true;
+}
+
+/*
+ * Read into this thread's scratch buffer and copy into an exactly sized
+ * bytes object. Used for the first read of a key when its payload turns
+ * out to be larger than any seen before. Requires GIL (released internally).
+ */
+static PyObject *
+py_tnkey_read_data_scratch(py_tnkey_t *self)
+{
+	PyObject *result;
+	char *data;
+	size_t data_len;
+	bool success;
+
 	Py_BEGIN_ALLOW_THREADS
-	success = get_key_data(self->c_serial, &data, &data_len);
+	success = read_key_payload(self->c_serial, &data, &data_len);
 	Py_END_ALLOW_THREADS
 
 	if (!success) {
@@ -178,11 +110,198 @@ py_tnkey_read_data(py_tnkey_t *self, PyObject *args)
 	}
 
 	result = PyBytes_FromStringAndSize(data, data_len);
-	PyMem_RawFree(data);
+	scratch_tls_put(data, data_len);
+
+	if (result != NULL) {
+		self->c_data_len = data_len;
+	}
+
+	return result;
+}
+
+/*
+ * First read of a key, whose payload length isn't known yet. Read straight
+ * into a bytes object sized from the largest payload seen so far (see
+ * payload_size_hint()). A payload of exactly that size is returned as is,
+ * and a shorter one is moved into an exactly sized bytes object, the
+ * oversized one being scrubbed. Only a payload larger than the hint, or a
+ * hint too large to allocate for every read, goes through the scratch
+ * buffer. Requires GIL (released internally).
+ */
+static PyObject *
+py_tnkey_read_data_fresh(py_tnkey_t *self)
+{
+	PyObject *buf, *result;
+	size_t size = payload_size_hint();
+	long res;
+	int err;
+
+	if (size > TN_READ_DATA_DIRECT_MAX) {
+		return py_tnkey_read_data_scratch(self);
+	}
+
+	buf = PyBytes_FromStringAndSize(NULL, size);
+	if (buf == NULL) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	res = tn_keyctl_read(self->c_serial, PyBytes_AS_STRING(buf), size);
+	Py_END_ALLOW_THREADS
+
+	if ((res == -1) || ((size_t)res > size)) {
+		err = errno;
+		explicit_bzero(PyBytes_AS_STRING(buf), size);
+		Py_DECREF(buf);
+
+		if (res == -1) {
+			errno = err;
+			PyErr_SetFromErrno(PyExc_OSError);
+			return NULL;
+		}
+
+		/* Larger than any payload seen so far. The scratch read grows the hint. */
+		return py_tnkey_read_data_scratch(self);
+	}
+
+	TN_READ_STAT_INC(TN_READ_STAT_PAYLOAD_HIT);
+	self->c_data_len = (size_t)res;
+
+	if ((size_t)res == size) {
+		return buf;
+	}
+
+	result = PyBytes_FromStringAndSize(PyBytes_AS_STRING(buf), res);
+	explicit_bzero(PyBytes_AS_STRING(buf), size);
+	Py_DECREF(buf);
 
 	return result;
 }
 
+static PyObject *
+py_tnkey_read_data(py_tnkey_t *self, PyObject *args)
+{
+	PyObject *result;
+	long size, res;
+	int err;
+
+	if (!py_tnkey_check_readable(self)) {
+		return NULL;
+	}
+
+	if (self->c_data_len == 0) {
+		return py_tnkey_read_data_fresh(self);
+	}
+
+	/*
+	 * Payload length is known from the last read. Read straight into the
+	 * bytes object so that no other copy of the payload is made.
+	 */
+	size = (long)self->c_data_len;
+	for (;;) {
+		result = PyBytes_FromStringAndSize(NULL, size);
+		if (result == NULL) {
+			return NULL;
+		}
+
+		Py_BEGIN_ALLOW_THREADS
+		res = tn_keyctl_read(self->c_serial, PyBytes_AS_STRING(result), size);
+		Py_END_ALLOW_THREADS
+
+		if (res == size) {
+			if ((size_t)size == self->c_data_len) {
+				TN_READ_STAT_INC(TN_READ_STAT_DATA_HIT);
+			}
+			self->c_data_len = (size_t)size;
+			return result;
+		}
+
+		/* Error, or the key was updated since. Scrub and retry at new size. */
+		err = errno;
+		explicit_bzero(PyBytes_AS_STRING(result), size);
+		Py_DECREF(result);
+		errno = err;
+
+		if (res == -1) {
+			break;
+		}
+
+		if ((size_t)size == self->c_data_len) {
+			TN_READ_STAT_INC(TN_READ_STAT_DATA_MISS);
+		}
+		size = res;
+	}
+
+	PyErr_SetFromErrno(PyExc_OSError);
+	return NULL;
+}
+
+PyDoc_STRVAR(py_tnkey_read_data_into__doc__,
+"read_data_into(buffer) -> int\n"
+"-----------------------------\n\n"
+"Read the data payload from the key directly into a caller-provided\n"
+"writable buffer such as a bytearray, memoryview or mlock()ed mmap. No\n"
+"intermediate copy of the payload is made.\n"
+"See man (3) keyctl_read for more information.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"buffer : writable bytes-like object\n"
+"    Contiguous buffer to receive the payload.\n\n"
+""
+"Returns\n"
+"-------\n"
+"int\n"
+"    Length of the payload written to the start of buffer.\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    The underlying key type is \"keyring\", or buffer is too small to\n"
+"    hold the payload (nothing is written in this case).\n"
+"TypeError:\n"
+"    buffer does not support the buffer protocol.\n"
+"BufferError:\n"
+"    buffer is read-only.\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details).\n\n"
+);
+
+static PyObject *
+py_tnkey_read_data_into(py_tnkey_t *self, PyObject *arg)
+{
+	Py_buffer view;
+	long res;
+
+	if (!py_tnkey_check_readable(self)) {
+		return NULL;
+	}
+
+	if (PyObject_GetBuffer(arg, &view, PyBUF_WRITABLE) < 0) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	res = tn_keyctl_read(self->c_serial, view.buf, (size_t)view.len);
+	Py_END_ALLOW_THREADS
+
+	PyBuffer_Release(&view);
+
+	if (res == -1) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(self->module_obj));
+		return NULL;
+	}
+
+	if (res > view.len) {
+		/* kernel reports full size and copies nothing if buffer is short */
+		PyErr_Format(PyExc_ValueError,
+			     "buffer too small: payload is %ld bytes", res);
+		return NULL;
+	}
+
+	return PyLong_FromLong(res);
+}
+
 PyDoc_STRVAR(py_tnkey_set_timeout__doc__,
 "set_timeout(timeout) -> None\n"
 "----------------------------\n\n"
@@ -216,7 +335,7 @@ py_tnkey_set_timeout(py_tnkey_t *self, PyObject *args, PyObject *kwargs)
 	}
 
 	Py_BEGIN_ALLOW_THREADS
-	res = keyctl_set_timeout(self->c_serial, timeout);
+	res = tn_keyctl_set_timeout(self->c_serial, timeout);
 	Py_END_ALLOW_THREADS
 
 	if (res == -1) {
@@ -244,59 +363,90 @@ py_tnkey_dealloc(py_tnkey_t *self)
 	Py_TYPE(self)->tp_free((PyObject *) self);
 }
 
+/*
+ * Populate key object fields from parsed description. Ownership of
+ * info->desc_buf is transferred to the key object on success.
+ */
 static int
-py_tnkey_init(py_tnkey_t *self, PyObject *args, PyObject *kwds)
+py_tnkey_set_info(py_tnkey_t *self, key_serial_t serial, tn_key_info_t *info,
+		  PyObject *module_obj)
 {
-	key_serial_t serial;
-	PyObject *module_obj;
+	tn_module_state_t *state;
 
-	if (!PyArg_ParseTuple(args, "iO", &serial, &module_obj)) {
+	state = (tn_module_state_t *)PyModule_GetState(module_obj);
+	if (state == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "Failed to get module state");
+		return -1;
+	}
+
+	/* Cached KeyType member rather than per-key enum(value) lookup */
+	self->key_type = tn_keytype_lookup(state, info->key_type_str);
+	if (self->key_type == NULL) {
 		return -1;
 	}
 
 	self->c_serial = serial;
 	self->module_obj = Py_NewRef(module_obj);
-	self->key_type = NULL;
-
-	Py_BEGIN_ALLOW_THREADS
+	self->c_desc_buf = info->desc_buf;
+	self->c_describe = info->description;
+	self->c_key_type_str = info->key_type_str;
+	self->c_key_uid = info->uid;
+	self->c_key_gid = info->gid;
+	self->c_key_perm = info->perm;
+	info->desc_buf = NULL;
 
-	self->c_desc_buf = get_key_description(serial);
-	if (self->c_desc_buf != NULL) {
-		if (!py_tnkey_parse_description(self)) {
-			PyMem_RawFree(self->c_desc_buf);
-			self->c_desc_buf = NULL;
-			self->c_describe = NULL;
-		}
-	}
+	return 0;
+}
 
-	Py_END_ALLOW_THREADS
+/*
+ * Allocate a new TNKey directly from an already-described key without going
+ * through tp_init. Requires GIL.
+ */
+py_tnkey_t *
+py_tnkey_from_info(key_serial_t serial, tn_key_info_t *info, PyObject *module_obj)
+{
+	py_tnkey_t *self;
 
-	if (self->c_describe == NULL) {
-		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
-		return -1;
+	self = (py_tnkey_t *)TNKeyType.tp_alloc(&TNKeyType, 0);
+	if (self == NULL) {
+		return NULL;
 	}
 
-	/* Set key_type from keytype_enum */
-	tn_module_state_t *state = (tn_module_state_t *)PyModule_GetState(self->module_obj);
-	if (state == NULL) {
-		PyErr_SetString(PyExc_RuntimeError, "Failed to get module state");
-		return -1;
+	if (py_tnkey_set_info(self, serial, info, module_obj) < 0) {
+		Py_DECREF(self);
+		return NULL;
 	}
 
-	if (state->keytype_enum == NULL) {
-		PyErr_SetString(PyExc_RuntimeError, "Module keytype_enum is not initialized");
+	return self;
+}
+
+static int
+py_tnkey_init(py_tnkey_t *self, PyObject *args, PyObject *kwds)
+{
+	key_serial_t serial;
+	PyObject *module_obj;
+	tn_key_info_t info = { 0 };
+	bool success;
+	int ret;
+
+	if (!PyArg_ParseTuple(args, "iO", &serial, &module_obj)) {
 		return -1;
 	}
 
-	/* Use enum(value) constructor to find enum member by value */
-	self->key_type = PyObject_CallFunction(state->keytype_enum, "s", self->c_key_type_str);
-	if (self->key_type == NULL) {
-		PyErr_Clear();  /* Clear any exception from enum lookup */
-		PyErr_Format(PyExc_ValueError, "keyutils returned unexpected key type: '%s'", self->c_key_type_str);
+	Py_BEGIN_ALLOW_THREADS
+	success = describe_key(serial, &info);
+	Py_END_ALLOW_THREADS
+
+	if (!success) {
+		free_key_info(&info);
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
 		return -1;
 	}
 
-	return 0;
+	ret = py_tnkey_set_info(self, serial, &info, module_obj);
+	free_key_info(&info);
+
+	return ret;
 }
 
 static PyGetSetDef py_tnkey_getsetters[] = {
@@ -316,6 +466,12 @@ static PyMethodDef py_tnkey_methods[] = {
 		.ml_flags = METH_NOARGS,
 		.ml_doc = py_tnkey_read_data__doc__
 	},
+	{
+		.ml_name = "read_data_into",
+		.ml_meth = (PyCFunction)py_tnkey_read_data_into,
+		.ml_flags = METH_O,
+		.ml_doc = py_tnkey_read_data_into__doc__
+	},
 	{
 		.ml_name = "set_timeout",
 		.ml_meth = (PyCFunction)py_tnkey_set_timeout,
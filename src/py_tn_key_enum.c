@@ -19,10 +19,23 @@ static const intenum_entry_t spec_keyring_tbl[] = {
 };
 
 static const strenum_entry_t keytype_tbl[] = {
-	{"KEYRING", KEY_TYPE_STR_KEYRING},
-	{"USER", KEY_TYPE_STR_USER},
-	{"LOGON", KEY_TYPE_STR_LOGON},
-	{"BIG_KEY", KEY_TYPE_STR_BIGKEY}
+	[TN_KEYTYPE_KEYRING] = {"KEYRING", KEY_TYPE_STR_KEYRING},
+	[TN_KEYTYPE_USER] = {"USER", KEY_TYPE_STR_USER},
+	[TN_KEYTYPE_LOGON] = {"LOGON", KEY_TYPE_STR_LOGON},
+	[TN_KEYTYPE_BIGKEY] = {"BIG_KEY", KEY_TYPE_STR_BIGKEY}
+};
+
+static const intenum_entry_t key_event_tbl[] = {
+	[TN_KEY_EVENT_INSTANTIATED] = {"INSTANTIATED", TN_KEY_EVENT_INSTANTIATED},
+	[TN_KEY_EVENT_UPDATED] = {"UPDATED", TN_KEY_EVENT_UPDATED},
+	[TN_KEY_EVENT_LINKED] = {"LINKED", TN_KEY_EVENT_LINKED},
+	[TN_KEY_EVENT_UNLINKED] = {"UNLINKED", TN_KEY_EVENT_UNLINKED},
+	[TN_KEY_EVENT_CLEARED] = {"CLEARED", TN_KEY_EVENT_CLEARED},
+	[TN_KEY_EVENT_REVOKED] = {"REVOKED", TN_KEY_EVENT_REVOKED},
+	[TN_KEY_EVENT_INVALIDATED] = {"INVALIDATED", TN_KEY_EVENT_INVALIDATED},
+	[TN_KEY_EVENT_SETATTR] = {"SETATTR", TN_KEY_EVENT_SETATTR},
+	[TN_KEY_EVENT_REMOVED] = {"REMOVED", TN_KEY_EVENT_REMOVED},
+	[TN_KEY_EVENT_LOSS] = {"LOSS", TN_KEY_EVENT_LOSS}
 };
 
 static PyObject *
@@ -115,6 +128,7 @@ tn_key_add_enums_to_module(PyObject *module)
 	PyObject *str_enum_class = NULL;
 	PyObject *enum_obj = NULL;
 	tn_module_state_t *state;
+	size_t i;
 
 	state = (tn_module_state_t *)PyModule_GetState(module);
 	if (state == NULL) {
@@ -157,6 +171,37 @@ tn_key_add_enums_to_module(PyObject *module)
 	state->keytype_enum = Py_NewRef(enum_obj);
 	Py_CLEAR(enum_obj);
 
+	/*
+	 * Cache members so that key objects don't need to do a python-level
+	 * KeyType(value) lookup when they are created.
+	 */
+	for (i = 0; i < ARRAY_SIZE(keytype_tbl); i++) {
+		state->keytype_members[i] = PyObject_GetAttrString(state->keytype_enum,
+								   keytype_tbl[i].name);
+		if (state->keytype_members[i] == NULL) {
+			goto fail;
+		}
+	}
+
+	enum_obj = create_int_enum(int_enum_class,
+				   "KeyEvent",
+				   key_event_tbl,
+				   ARRAY_SIZE(key_event_tbl));
+	if (PyModule_AddObjectRef(module, "KeyEvent", enum_obj) < 0) {
+		goto fail;
+	}
+	state->key_event_enum = Py_NewRef(enum_obj);
+	Py_CLEAR(enum_obj);
+
+	/* Cached so that decoding notifications doesn't need KeyEvent(value) */
+	for (i = 0; i < ARRAY_SIZE(key_event_tbl); i++) {
+		state->key_event_members[i] = PyObject_GetAttrString(state->key_event_enum,
+								     key_event_tbl[i].name);
+		if (state->key_event_members[i] == NULL) {
+			goto fail;
+		}
+	}
+
 	Py_CLEAR(int_enum_class);
 	Py_CLEAR(str_enum_class);
 
@@ -168,4 +213,22 @@ fail:
 	Py_CLEAR(str_enum_class);
 	Py_CLEAR(enum_obj);
 	return -1;
-}
\ No newline at end of file
+}
+/*
+ * Return new reference to the KeyType member for the specified key type
+ * string as returned by keyctl_describe(). Requires GIL.
+ */
+PyObject *
+tn_keytype_lookup(tn_module_state_t *state, const char *key_type_str)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(keytype_tbl); i++) {
+		if (strcmp(keytype_tbl[i].value, key_type_str) == 0) {
+			return Py_NewRef(state->keytype_members[i]);
+		}
+	}
+
+	PyErr_Format(PyExc_ValueError, "keyutils returned unexpected key type: '%s'", key_type_str);
+	return NULL;
+}
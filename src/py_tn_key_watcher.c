@@ -0,0 +1,641 @@
+/* Kernel key change notifications via keyctl_watch_key() */
+
+#include "truenas_keyring.h"
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/watch_queue.h>
+
+/* Largest notification record the kernel will generate */
+#define TN_WATCH_RECORD_MAX (WATCH_INFO_LENGTH + 1)
+
+_Static_assert((int)TN_KEY_EVENT_SETATTR == (int)NOTIFY_KEY_SETATTR,
+	       "enum tn_key_event out of sync with key_notification_subtype");
+
+/* Decoded notification. Built without GIL and converted afterwards */
+typedef struct {
+	enum tn_key_event event;
+	key_serial_t serial;
+	key_serial_t watched;
+	uint32_t aux;
+} tn_key_notification_t;
+
+static PyStructSequence_Field key_notification_fields[] = {
+	{"event", "truenas_keyring.KeyEvent describing the change"},
+	{"serial", "Serial number of the key that changed"},
+	{"aux", "Serial of the key linked or unlinked, or error for INSTANTIATED"},
+	{"watched", "Serial number of the watched key that generated the record"},
+	{NULL}
+};
+
+static PyStructSequence_Desc key_notification_desc = {
+	.name = MODULE_NAME ".KeyNotification",
+	.doc = "Key change notification record",
+	.fields = key_notification_fields,
+	.n_in_sequence = 4,
+};
+
+static void
+py_tn_key_watcher_close_fds(py_tn_key_watcher_t *self)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(self->fds); i++) {
+		if (self->fds[i] != -1) {
+			close(self->fds[i]);
+			self->fds[i] = -1;
+		}
+	}
+
+	memset(self->watches, 0, sizeof(self->watches));
+}
+
+static void
+py_tn_key_watcher_dealloc(py_tn_key_watcher_t *self)
+{
+	py_tn_key_watcher_close_fds(self);
+	Py_CLEAR(self->module_obj);
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+py_tn_key_watcher_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+	py_tn_key_watcher_t *self = NULL;
+
+	self = (py_tn_key_watcher_t *)type->tp_alloc(type, 0);
+	if (self != NULL) {
+		self->fds[0] = -1;
+		self->fds[1] = -1;
+	}
+
+	return (PyObject *)self;
+}
+
+static bool
+py_tn_key_watcher_check_open(py_tn_key_watcher_t *self)
+{
+	if (self->fds[0] == -1) {
+		PyErr_SetString(PyExc_ValueError, "I/O operation on closed key watcher");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Create a new watcher with a notification queue of queue_size records.
+ * Requires GIL.
+ */
+PyObject *
+py_tn_key_watcher_create(PyObject *module_obj, unsigned int queue_size)
+{
+	py_tn_key_watcher_t *self;
+	int ret;
+
+	self = (py_tn_key_watcher_t *)PyObject_CallFunction((PyObject *)&TNKeyWatcherType, NULL);
+	if (self == NULL) {
+		return NULL;
+	}
+
+	self->module_obj = Py_NewRef(module_obj);
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = pipe2(self->fds, O_NOTIFICATION_PIPE | O_CLOEXEC | O_NONBLOCK);
+	if (ret == 0) {
+		ret = ioctl(self->fds[0], IOC_WATCH_QUEUE_SET_SIZE, queue_size);
+	}
+	Py_END_ALLOW_THREADS
+
+	if (ret == -1) {
+		/* ENOPKG means kernel was built without CONFIG_WATCH_QUEUE */
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	return (PyObject *)self;
+}
+
+PyDoc_STRVAR(py_tn_key_watcher_watch__doc__,
+"watch(*, serial) -> int\n"
+"-----------------------\n\n"
+"Subscribe to change notifications for the specified key or keyring.\n"
+"Watching a keyring reports keys linked into and unlinked from it, but\n"
+"not changes to the keys themselves.\n"
+"See man (3) keyctl_watch_key for more information.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"serial: int, required\n"
+"    The serial number of the key or keyring to watch.\n\n"
+""
+"Returns\n"
+"-------\n"
+"int\n"
+"    The watch ID used in notification records for this key.\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Watcher is closed or all watch IDs are in use.\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details).\n\n"
+);
+
+static PyObject *
+py_tn_key_watcher_watch(py_tn_key_watcher_t *self, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"serial", NULL};
+	key_serial_t serial;
+	long result;
+	int watch_id;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "$i:watch",
+					 kwlist, &serial)) {
+		return NULL;
+	}
+
+	if (!py_tn_key_watcher_check_open(self)) {
+		return NULL;
+	}
+
+	for (watch_id = 0; watch_id < TN_WATCH_ID_CNT; watch_id++) {
+		if (self->watches[watch_id] == 0) {
+			break;
+		}
+	}
+
+	if (watch_id == TN_WATCH_ID_CNT) {
+		PyErr_SetString(PyExc_ValueError, "Too many keys watched");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	result = keyctl_watch_key(serial, self->fds[0], watch_id);
+	Py_END_ALLOW_THREADS
+
+	if (result == -1) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(self->module_obj));
+		return NULL;
+	}
+
+	self->watches[watch_id] = serial;
+	return PyLong_FromLong(watch_id);
+}
+
+PyDoc_STRVAR(py_tn_key_watcher_unwatch__doc__,
+"unwatch(*, serial) -> None\n"
+"--------------------------\n\n"
+"Remove the watch on the specified key or keyring.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"serial: int, required\n"
+"    The serial number of the watched key or keyring.\n\n"
+""
+"Returns\n"
+"-------\n"
+"None\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Watcher is closed.\n"
+"FileNotFoundError:\n"
+"    The key is not watched by this watcher.\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details).\n\n"
+);
+
+static PyObject *
+py_tn_key_watcher_unwatch(py_tn_key_watcher_t *self, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"serial", NULL};
+	key_serial_t serial;
+	long result;
+	int watch_id;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "$i:unwatch",
+					 kwlist, &serial)) {
+		return NULL;
+	}
+
+	if (!py_tn_key_watcher_check_open(self)) {
+		return NULL;
+	}
+
+	for (watch_id = 0; watch_id < TN_WATCH_ID_CNT; watch_id++) {
+		if ((serial != 0) && (self->watches[watch_id] == serial)) {
+			break;
+		}
+	}
+
+	if (watch_id == TN_WATCH_ID_CNT) {
+		PyErr_SetString(PyExc_FileNotFoundError, "Key is not watched");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	result = keyctl_watch_key(serial, self->fds[0], -1);
+	Py_END_ALLOW_THREADS
+
+	/* ENOENT means the kernel already removed the watch */
+	if ((result == -1) && (errno != ENOENT)) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(self->module_obj));
+		return NULL;
+	}
+
+	self->watches[watch_id] = 0;
+	Py_RETURN_NONE;
+}
+
+/*
+ * Decode the notification records in buf into out, which must have room
+ * for one entry per minimal record. Returns number of entries. Watches
+ * removed by the kernel are released. Requires GIL, since self->watches
+ * is shared with watch() and unwatch().
+ */
+static size_t
+py_tn_key_watcher_decode(py_tn_key_watcher_t *self, const char *buf, size_t len,
+			 tn_key_notification_t *out)
+{
+	size_t off = 0, cnt = 0;
+
+	while (len - off >= sizeof(struct watch_notification)) {
+		struct watch_notification n;
+		struct key_notification kn;
+		size_t rec_len;
+		uint watch_id;
+
+		memcpy(&n, buf + off, sizeof(n));
+		rec_len = n.info & WATCH_INFO_LENGTH;
+		watch_id = (n.info & WATCH_INFO_ID) >> WATCH_INFO_ID__SHIFT;
+
+		if ((rec_len < sizeof(n)) || (rec_len > len - off)) {
+			/* Malformed record. Nothing after it can be trusted. */
+			break;
+		}
+
+		if ((n.type == WATCH_TYPE_KEY_NOTIFY) && (rec_len >= sizeof(kn)) &&
+		    (n.subtype <= NOTIFY_KEY_SETATTR)) {
+			memcpy(&kn, buf + off, sizeof(kn));
+			out[cnt++] = (tn_key_notification_t) {
+				.event = (enum tn_key_event)n.subtype,
+				.serial = (key_serial_t)kn.key_id,
+				.watched = self->watches[watch_id],
+				.aux = kn.aux,
+			};
+		} else if ((n.type == WATCH_TYPE_META) &&
+			   (n.subtype == WATCH_META_REMOVAL_NOTIFICATION)) {
+			out[cnt++] = (tn_key_notification_t) {
+				.event = TN_KEY_EVENT_REMOVED,
+				.serial = self->watches[watch_id],
+				.watched = self->watches[watch_id],
+			};
+			self->watches[watch_id] = 0;
+		} else if ((n.type == WATCH_TYPE_META) &&
+			   (n.subtype == WATCH_META_LOSS_NOTIFICATION)) {
+			out[cnt++] = (tn_key_notification_t) {
+				.event = TN_KEY_EVENT_LOSS,
+			};
+		}
+
+		off += rec_len;
+	}
+
+	return cnt;
+}
+
+static PyObject *
+py_tn_key_notification_to_py(tn_module_state_t *state, const tn_key_notification_t *n)
+{
+	PyObject *rec;
+	PyObject *val;
+
+	rec = PyStructSequence_New((PyTypeObject *)state->key_notification_type);
+	if (rec == NULL) {
+		return NULL;
+	}
+
+	PyStructSequence_SetItem(rec, 0, Py_NewRef(state->key_event_members[n->event]));
+
+	val = PyLong_FromLong(n->serial);
+	if (val == NULL) {
+		goto fail;
+	}
+	PyStructSequence_SetItem(rec, 1, val);
+
+	val = PyLong_FromUnsignedLong(n->aux);
+	if (val == NULL) {
+		goto fail;
+	}
+	PyStructSequence_SetItem(rec, 2, val);
+
+	val = PyLong_FromLong(n->watched);
+	if (val == NULL) {
+		goto fail;
+	}
+	PyStructSequence_SetItem(rec, 3, val);
+
+	return rec;
+
+fail:
+	Py_DECREF(rec);
+	return NULL;
+}
+
+PyDoc_STRVAR(py_tn_key_watcher_read__doc__,
+"read(*, max_records=512) -> list[truenas_keyring.KeyNotification]\n"
+"----------------------------------------------------------------\n\n"
+"Read the notifications currently queued without blocking. Use fileno()\n"
+"with select / poll / asyncio to wait for notifications to arrive.\n\n"
+"A KeyEvent.REMOVED record is generated when a watched key is destroyed\n"
+"and its watch released. A KeyEvent.LOSS record means notifications were\n"
+"dropped because the queue overflowed, and so cached state should be\n"
+"rebuilt from scratch.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"max_records: int, optional\n"
+"    Maximum number of key notification records to read in this batch.\n"
+"    Remaining notifications stay queued for the next call.\n"
+"    Default: 512.\n\n"
+""
+"Returns\n"
+"-------\n"
+"list[truenas_keyring.KeyNotification]\n"
+"    (event, serial, aux, watched) records in the order they occurred.\n"
+"    Empty if no notifications are queued.\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Watcher is closed or max_records is invalid.\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details).\n\n"
+);
+
+static PyObject *
+py_tn_key_watcher_read(py_tn_key_watcher_t *self, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"max_records", NULL};
+	Py_ssize_t max_records = TN_WATCH_QUEUE_MAX;
+	tn_module_state_t *state;
+	tn_key_notification_t *records = NULL;
+	char *buf = NULL;
+	size_t bufsz, len = 0, cnt = 0, i;
+	PyObject *out = NULL;
+	int err = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$n:read",
+					 kwlist, &max_records)) {
+		return NULL;
+	}
+
+	if (!py_tn_key_watcher_check_open(self)) {
+		return NULL;
+	}
+
+	if ((max_records < 1) || (max_records > TN_WATCH_QUEUE_MAX)) {
+		PyErr_Format(PyExc_ValueError, "max_records must be between 1 and %d",
+			     TN_WATCH_QUEUE_MAX);
+		return NULL;
+	}
+
+	state = (tn_module_state_t *)PyModule_GetState(self->module_obj);
+	if (state == NULL) {
+		return NULL;
+	}
+
+	/*
+	 * Each read() of a notification pipe returns whole records. Size the
+	 * buffer so that the largest record always fits, and decode at most
+	 * one entry per minimal record.
+	 */
+	bufsz = (size_t)max_records * sizeof(struct key_notification);
+	if (bufsz < TN_WATCH_RECORD_MAX) {
+		bufsz = TN_WATCH_RECORD_MAX;
+	}
+
+	buf = PyMem_RawMalloc(bufsz);
+	records = PyMem_RawMalloc(bufsz / sizeof(struct watch_notification) *
+				  sizeof(tn_key_notification_t));
+	if ((buf == NULL) || (records == NULL)) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	while (bufsz - len >= TN_WATCH_RECORD_MAX || len == 0) {
+		ssize_t res = read(self->fds[0], buf + len, bufsz - len);
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				err = errno;
+			}
+			break;
+		}
+
+		if (res == 0) {
+			break;
+		}
+
+		len += (size_t)res;
+	}
+	Py_END_ALLOW_THREADS
+
+	if (len) {
+		cnt = py_tn_key_watcher_decode(self, buf, len, records);
+	}
+
+	if (err) {
+		errno = err;
+		PyErr_SetFromErrno(get_keyring_error_from_module(self->module_obj));
+		goto out;
+	}
+
+	out = PyList_New(cnt);
+	if (out == NULL) {
+		goto out;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *rec = py_tn_key_notification_to_py(state, &records[i]);
+		if (rec == NULL) {
+			Py_CLEAR(out);
+			goto out;
+		}
+		PyList_SET_ITEM(out, i, rec);
+	}
+
+out:
+	PyMem_RawFree(buf);
+	PyMem_RawFree(records);
+	return out;
+}
+
+static PyObject *
+py_tn_key_watcher_fileno(py_tn_key_watcher_t *self, PyObject *Py_UNUSED(ignored))
+{
+	if (!py_tn_key_watcher_check_open(self)) {
+		return NULL;
+	}
+
+	return PyLong_FromLong(self->fds[0]);
+}
+
+static PyObject *
+py_tn_key_watcher_close(py_tn_key_watcher_t *self, PyObject *Py_UNUSED(ignored))
+{
+	py_tn_key_watcher_close_fds(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_tn_key_watcher_enter(py_tn_key_watcher_t *self, PyObject *Py_UNUSED(ignored))
+{
+	if (!py_tn_key_watcher_check_open(self)) {
+		return NULL;
+	}
+
+	return Py_NewRef((PyObject *)self);
+}
+
+static PyObject *
+py_tn_key_watcher_exit(py_tn_key_watcher_t *self, PyObject *args)
+{
+	py_tn_key_watcher_close_fds(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_tn_key_watcher_get_watches(py_tn_key_watcher_t *self, void *closure)
+{
+	PyObject *out;
+	size_t i;
+
+	out = PyDict_New();
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < TN_WATCH_ID_CNT; i++) {
+		PyObject *serial, *watch_id;
+		int err;
+
+		if (self->watches[i] == 0) {
+			continue;
+		}
+
+		serial = PyLong_FromLong(self->watches[i]);
+		watch_id = PyLong_FromSize_t(i);
+		err = (serial == NULL || watch_id == NULL) ? -1 :
+			PyDict_SetItem(out, serial, watch_id);
+		Py_XDECREF(serial);
+		Py_XDECREF(watch_id);
+		if (err < 0) {
+			Py_DECREF(out);
+			return NULL;
+		}
+	}
+
+	return out;
+}
+
+static PyObject *
+py_tn_key_watcher_get_closed(py_tn_key_watcher_t *self, void *closure)
+{
+	return PyBool_FromLong(self->fds[0] == -1);
+}
+
+static PyMethodDef py_tn_key_watcher_methods[] = {
+	{
+		.ml_name = "watch",
+		.ml_meth = (PyCFunction)py_tn_key_watcher_watch,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_key_watcher_watch__doc__
+	},
+	{
+		.ml_name = "unwatch",
+		.ml_meth = (PyCFunction)py_tn_key_watcher_unwatch,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_key_watcher_unwatch__doc__
+	},
+	{
+		.ml_name = "read",
+		.ml_meth = (PyCFunction)py_tn_key_watcher_read,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_key_watcher_read__doc__
+	},
+	{
+		.ml_name = "fileno",
+		.ml_meth = (PyCFunction)py_tn_key_watcher_fileno,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "fileno() -> int\n\nFile descriptor that becomes readable when notifications are queued."
+	},
+	{
+		.ml_name = "close",
+		.ml_meth = (PyCFunction)py_tn_key_watcher_close,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "close() -> None\n\nClose the notification queue, removing all watches."
+	},
+	{
+		.ml_name = "__enter__",
+		.ml_meth = (PyCFunction)py_tn_key_watcher_enter,
+		.ml_flags = METH_NOARGS,
+	},
+	{
+		.ml_name = "__exit__",
+		.ml_meth = (PyCFunction)py_tn_key_watcher_exit,
+		.ml_flags = METH_VARARGS,
+	},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef py_tn_key_watcher_getsetters[] = {
+	{
+		.name = "watches",
+		.get = (getter)py_tn_key_watcher_get_watches,
+		.doc = "Mapping of watched key serial to watch ID",
+	},
+	{
+		.name = "closed",
+		.get = (getter)py_tn_key_watcher_get_closed,
+		.doc = "True if the watcher has been closed",
+	},
+	{ .name = NULL }
+};
+
+PyTypeObject TNKeyWatcherType = {
+	.tp_name = MODULE_NAME ".TNKeyWatcher",
+	.tp_doc = "TrueNAS key change notification queue",
+	.tp_basicsize = sizeof(py_tn_key_watcher_t),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor) py_tn_key_watcher_dealloc,
+	.tp_new = py_tn_key_watcher_new,
+	.tp_methods = py_tn_key_watcher_methods,
+	.tp_getset = py_tn_key_watcher_getsetters,
+};
+
+/*
+ * Create the KeyNotification record type. Requires GIL.
+ */
+int
+tn_key_watcher_add_to_module(PyObject *module)
+{
+	tn_module_state_t *state;
+
+	state = (tn_module_state_t *)PyModule_GetState(module);
+	if (state == NULL) {
+		return -1;
+	}
+
+	state->key_notification_type = (PyObject *)PyStructSequence_NewType(&key_notification_desc);
+	if (state->key_notification_type == NULL) {
+		return -1;
+	}
+
+	return PyModule_AddObjectRef(module, "KeyNotification", state->key_notification_type);
+}
@@ -4,6 +4,7 @@ static void
 py_tn_keyring_dealloc(py_tn_keyring_t *self)
 {
 	Py_CLEAR(self->py_key);
+	Py_CLEAR(self->default_key_type);
 	Py_TYPE(self)->tp_free((PyObject *) self);
 }
 
@@ -31,6 +32,25 @@ py_tn_keyring_init(py_tn_keyring_t *self, PyObject *args, PyObject *kwds)
 	return 0;
 }
 
+/*
+ * Wrap an existing TNKey of type "keyring" in a new TNKeyring without going
+ * through tp_init. A new reference to py_key is taken. Requires GIL.
+ */
+PyObject *
+py_tn_keyring_from_key(py_tnkey_t *py_key)
+{
+	py_tn_keyring_t *self;
+
+	self = (py_tn_keyring_t *)TNKeyringType.tp_alloc(&TNKeyringType, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+
+	self->py_key = (py_tnkey_t *)Py_NewRef((PyObject *)py_key);
+
+	return (PyObject *)self;
+}
+
 static PyObject *
 py_tn_keyring_key(py_tn_keyring_t *self, PyObject *Py_UNUSED(ignored))
 {
@@ -64,7 +84,7 @@ py_tn_keyring_clear(py_tn_keyring_t *self, PyObject *args)
 	long result;
 
 	Py_BEGIN_ALLOW_THREADS
-	result = keyctl_clear(self->py_key->c_serial);
+	result = tn_keyctl_clear(self->py_key->c_serial);
 	Py_END_ALLOW_THREADS
 
 	if (result == -1) {
@@ -76,10 +96,14 @@ py_tn_keyring_clear(py_tn_keyring_t *self, PyObject *args)
 }
 
 PyDoc_STRVAR(py_tn_keyring_iter_keyring_contents__doc__,
-"iter_keyring_contents(*, unlink_expired=False, unlink_revoked=False)\n"
+"iter_keyring_contents(*, unlink_expired=False, unlink_revoked=False, prefetch=64,\n"
+"                      key_type=None, description=None, description_prefix=None,\n"
+"                      uid=None, gid=None, perm_mask=0)\n"
 "    -> Iterator[truenas_keyring.TNKey | truenas_keyring.TNKeyring]\n"
-"---------------------------------------------------------------------\n\n"
+"----------------------------------------------------------------------------------\n\n"
 "Return an iterator over all keys contained within the keyring.\n"
+"Filters are evaluated in C against the key description so that keys\n"
+"that don't match are never turned into python objects.\n"
 "See man (3) keyctl_read for more information.\n\n"
 ""
 "Parameters\n"
@@ -90,25 +114,51 @@ PyDoc_STRVAR(py_tn_keyring_iter_keyring_contents__doc__,
 "unlink_revoked: bool, optional\n"
 "    If True, automatically unlink revoked keys from the keyring.\n"
 "    Default: False.\n\n"
+"prefetch: int, optional\n"
+"    Number of keys to describe (and check for expiry / revocation)\n"
+"    per batch with the GIL released. Larger values reduce GIL\n"
+"    churn at the cost of returning slightly staler metadata.\n"
+"    Default: 64.\n\n"
+"key_type: str, optional\n"
+"    Only include keys of this type (e.g. truenas_keyring.KeyType.KEYRING).\n"
+"    Default: None (all types).\n\n"
+"description: str, optional\n"
+"    Only include keys with exactly this description. Default: None.\n\n"
+"description_prefix: str, optional\n"
+"    Only include keys whose description starts with this prefix.\n"
+"    Default: None.\n\n"
+"uid: int, optional\n"
+"    Only include keys owned by this uid. Default: None.\n\n"
+"gid: int, optional\n"
+"    Only include keys with this group. Default: None.\n\n"
+"perm_mask: int, optional\n"
+"    Only include keys that have all of these permission bits set\n"
+"    (see truenas_keyring.TNKey.permissions). Default: 0.\n\n"
 ""
 "Returns\n"
 "-------\n"
 "Iterator[truenas_keyring.TNKey | truenas_keyring.TNKeyring]\n"
-"    An iterator over key objects contained in this keyring.\n"
+"    An iterator over matching key objects contained in this keyring.\n"
 "    Each item is either a truenas_keyring.TNKey or truenas_keyring.TNKeyring\n"
 "    depending on the type of the contained key.\n\n"
 ""
 "Raises\n"
 "------\n"
+"ValueError:\n"
+"    prefetch is not a positive integer, or invalid uid / gid.\n"
 "truenas_keyring.KeyringError:\n"
 "    System call failed (see errno for details).\n\n"
 );
 
 PyDoc_STRVAR(py_tn_keyring_list_keyring_contents__doc__,
-"list_keyring_contents(*, unlink_expired=False, unlink_revoked=False)\n"
+"list_keyring_contents(*, unlink_expired=False, unlink_revoked=False,\n"
+"                      key_type=None, description=None, description_prefix=None,\n"
+"                      uid=None, gid=None, perm_mask=0)\n"
 "    -> list[truenas_keyring.TNKey | truenas_keyring.TNKeyring]\n"
 "---------------------------------------------------------------------\n\n"
-"List all keys contained within the keyring.\n"
+"List all keys contained within the keyring. Filters are evaluated in C\n"
+"against the key description so that keys that don't match are never\n"
+"turned into python objects.\n"
 "See man (3) keyctl_read for more information.\n\n"
 ""
 "Parameters\n"
@@ -119,138 +169,319 @@ PyDoc_STRVAR(py_tn_keyring_list_keyring_contents__doc__,
 "unlink_revoked: bool, optional\n"
 "    If True, automatically unlink revoked keys from the keyring.\n"
 "    Default: False.\n\n"
+"key_type: str, optional\n"
+"    Only include keys of this type (e.g. truenas_keyring.KeyType.KEYRING).\n"
+"    Default: None (all types).\n\n"
+"description: str, optional\n"
+"    Only include keys with exactly this description. Default: None.\n\n"
+"description_prefix: str, optional\n"
+"    Only include keys whose description starts with this prefix.\n"
+"    Default: None.\n\n"
+"uid: int, optional\n"
+"    Only include keys owned by this uid. Default: None.\n\n"
+"gid: int, optional\n"
+"    Only include keys with this group. Default: None.\n\n"
+"perm_mask: int, optional\n"
+"    Only include keys that have all of these permission bits set\n"
+"    (see truenas_keyring.TNKey.permissions). Default: 0.\n\n"
 ""
 "Returns\n"
 "-------\n"
 "list[truenas_keyring.TNKey | truenas_keyring.TNKeyring]\n"
-"    A list of key objects contained in this keyring.\n"
+"    A list of matching key objects contained in this keyring.\n"
 "    Each item is either a truenas_keyring.TNKey or truenas_keyring.TNKeyring\n"
 "    depending on the type of the contained key.\n\n"
 ""
 "Raises\n"
 "------\n"
+"ValueError:\n"
+"    Invalid uid / gid.\n"
 "truenas_keyring.KeyringError:\n"
 "    System call failed (see errno for details).\n\n"
 );
 
+static bool
+parse_filter_id(PyObject *obj, const char *name, unsigned int *out)
+{
+	unsigned long val;
+
+	if ((obj == NULL) || (obj == Py_None)) {
+		*out = UINT_MAX;
+		return true;
+	}
+
+	val = PyLong_AsUnsignedLong(obj);
+	if ((val == (unsigned long)-1) && PyErr_Occurred()) {
+		if (PyErr_ExceptionMatches(PyExc_OverflowError)) {
+			PyErr_Clear();
+			PyErr_Format(PyExc_ValueError, "invalid %s", name);
+		}
+		return false;
+	}
+
+	if (val >= UINT_MAX) {
+		PyErr_Format(PyExc_ValueError, "%lu: invalid %s", val, name);
+		return false;
+	}
+
+	*out = (unsigned int)val;
+	return true;
+}
+
+static char *
+filter_strdup(const char *str)
+{
+	char *out;
+
+	if (str == NULL) {
+		return NULL;
+	}
+
+	out = PyMem_RawMalloc(strlen(str) + 1);
+	if (out != NULL) {
+		strcpy(out, str);
+	}
+
+	return out;
+}
+
+/*
+ * Build a listing filter from python arguments. On success the caller owns
+ * the strings in filter_out. Requires GIL.
+ */
+static bool
+parse_key_filter(const char *key_type_str, const char *description,
+		 const char *description_prefix, PyObject *uid_obj,
+		 PyObject *gid_obj, unsigned int perm_mask,
+		 tn_key_filter_t *filter_out)
+{
+	tn_key_filter_t filter = { .perm_mask = perm_mask };
+	unsigned int uid, gid;
+
+	if (!parse_filter_id(uid_obj, "uid", &uid) ||
+	    !parse_filter_id(gid_obj, "gid", &gid)) {
+		return false;
+	}
+
+	filter.uid = (uid_t)uid;
+	filter.gid = (gid_t)gid;
+	filter.key_type_str = filter_strdup(key_type_str);
+	filter.description = filter_strdup(description);
+	filter.description_prefix = filter_strdup(description_prefix);
+
+	if (((key_type_str != NULL) && (filter.key_type_str == NULL)) ||
+	    ((description != NULL) && (filter.description == NULL)) ||
+	    ((description_prefix != NULL) && (filter.description_prefix == NULL))) {
+		free_key_filter(&filter);
+		PyErr_NoMemory();
+		return false;
+	}
+
+	if (description_prefix != NULL) {
+		filter.prefix_len = strlen(description_prefix);
+	}
+
+	*filter_out = filter;
+	return true;
+}
+
 static PyObject *
 py_tn_keyring_iter_keyring_contents(py_tn_keyring_t *self, PyObject *args, PyObject *kwargs)
 {
-	py_tn_keyring_iter_t *iter;
-	bool success;
-	char * const kwlist[] = {"unlink_expired", "unlink_revoked", NULL};
-	bool del_exp = false;
-	bool del_rev = false;
+	char * const kwlist[] = {
+		"unlink_expired", "unlink_revoked", "prefetch", "key_type", "description",
+		"description_prefix", "uid", "gid", "perm_mask", NULL
+	};
+	int del_exp = false;
+	int del_rev = false;
+	Py_ssize_t prefetch = TN_ITER_PREFETCH_DEFAULT;
+	const char *key_type_str = NULL, *description = NULL, *prefix = NULL;
+	PyObject *uid_obj = NULL, *gid_obj = NULL;
+	unsigned int perm_mask = 0;
+	tn_key_filter_t filter;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$pp:iter_keyring_contents",
-					 kwlist, &del_exp, &del_rev)) {
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$ppnzzzOOI:iter_keyring_contents",
+					 kwlist, &del_exp, &del_rev, &prefetch,
+					 &key_type_str, &description, &prefix,
+					 &uid_obj, &gid_obj, &perm_mask)) {
 		return NULL;
 	}
 
-	iter = (py_tn_keyring_iter_t *)PyObject_CallFunction((PyObject *)&TNKeyringIterType, NULL);
-	if (iter == NULL) {
+	if (prefetch < 1) {
+		PyErr_SetString(PyExc_ValueError, "prefetch must be a positive integer");
 		return NULL;
 	}
 
-	Py_BEGIN_ALLOW_THREADS
-	success = get_keyring_serials(self->py_key->c_serial, &iter->keys, &iter->key_count);
-	Py_END_ALLOW_THREADS
-
-	if (!success) {
-		Py_DECREF(iter);
-		PyErr_SetFromErrno(PyExc_OSError);
+	if (!parse_key_filter(key_type_str, description, prefix, uid_obj, gid_obj,
+			      perm_mask, &filter)) {
 		return NULL;
 	}
 
-	iter->keyring = (py_tn_keyring_t *)Py_NewRef(self);
-	iter->current_index = 0;
-	iter->unlink_expired = del_exp;
-	iter->unlink_revoked = del_rev;
-
-	return (PyObject *)iter;
+	return py_tn_keyring_iter_create(self, del_exp, del_rev, (size_t)prefetch, &filter);
 }
 
 static PyObject *
 py_tn_keyring_list_keyring_contents(py_tn_keyring_t *self, PyObject *args, PyObject *kwargs)
 {
-	size_t i, key_cnt;
-	key_serial_t *keys;
-	PyObject *py_list, *py_key_obj;
-	bool success;
-	char * const kwlist[] = {"unlink_expired", "unlink_revoked", NULL};
-	bool del_exp = false;
-	bool del_rev = false;
+	PyObject *iter, *py_list;
+	char * const kwlist[] = {
+		"unlink_expired", "unlink_revoked", "key_type", "description",
+		"description_prefix", "uid", "gid", "perm_mask", NULL
+	};
+	int del_exp = false;
+	int del_rev = false;
+	const char *key_type_str = NULL, *description = NULL, *prefix = NULL;
+	PyObject *uid_obj = NULL, *gid_obj = NULL;
+	unsigned int perm_mask = 0;
+	tn_key_filter_t filter;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$pp:list_keyring_contents",
-					 kwlist, &del_exp, &del_rev)) {
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$ppzzzOOI:list_keyring_contents",
+					 kwlist, &del_exp, &del_rev, &key_type_str,
+					 &description, &prefix, &uid_obj, &gid_obj,
+					 &perm_mask)) {
 		return NULL;
 	}
 
-	Py_BEGIN_ALLOW_THREADS
-	success = get_keyring_serials(self->py_key->c_serial, &keys, &key_cnt);
-	Py_END_ALLOW_THREADS
-
-	if (!success) {
-		PyErr_SetFromErrno(PyExc_OSError);
+	if (!parse_key_filter(key_type_str, description, prefix, uid_obj, gid_obj,
+			      perm_mask, &filter)) {
 		return NULL;
 	}
 
-	py_list = PyList_New(key_cnt);
-	if (py_list == NULL) {
-		PyMem_RawFree(keys);
+	/* Describe the entire keyring in a single GIL-released batch */
+	iter = py_tn_keyring_iter_create(self, del_exp, del_rev, SIZE_MAX, &filter);
+	if (iter == NULL) {
 		return NULL;
 	}
 
-	for (i = 0; i < key_cnt; i++) {
-		/* Peek at key to see whether it's revoked */
-		long ret;
-		Py_BEGIN_ALLOW_THREADS
-		ret = keyctl_read(keys[i], NULL, 0);
-		Py_END_ALLOW_THREADS
+	py_list = PySequence_List(iter);
+	Py_DECREF(iter);
 
-		if (ret == -1) {
-			if (errno == ENOKEY) {
-				/* key was unlinked so skip */
-				continue;
-			} else if (((errno == EKEYEXPIRED) && del_exp) ||
-				   ((errno == EKEYREVOKED) && del_rev)){
-				/*
-				 * key was revoked or expired and kwarg specified
-				 * to delete them
-				 */
-				Py_BEGIN_ALLOW_THREADS
-				keyctl_unlink(keys[i], self->py_key->c_serial);
-				Py_END_ALLOW_THREADS
-				continue;
-			} else if ((errno == EKEYEXPIRED) || (errno == EKEYREVOKED)) {
-				/*
-				 * Don't present this key to API user since we can't
-				 * use it for anything
-				 */
-				continue;
-			}
-		}
+	return py_list;
+}
+
+PyDoc_STRVAR(py_tn_keyring_walk__doc__,
+"walk(*, max_depth=None, key_type=None)\n"
+"    -> Iterator[tuple[tuple[str, ...], int, list[int], list[int]]]\n"
+"-----------------------------------------------------------------\n\n"
+"Walk the tree of keyrings rooted at this keyring breadth-first, similar\n"
+"to os.walk(). Each level of the tree is read and described in a single\n"
+"batch with the GIL released. A keyring that is linked in more than one\n"
+"place is only descended into the first time it is reached, which also\n"
+"guards against cycles. Expired and revoked keys are skipped.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"max_depth: int, optional\n"
+"    Maximum depth to descend to. 0 only reports this keyring.\n"
+"    Default: None (unlimited).\n\n"
+"key_type: str, optional\n"
+"    Only report leaf keys of this type. Default: None (all types).\n\n"
+""
+"Returns\n"
+"-------\n"
+"Iterator[tuple[tuple[str, ...], int, list[int], list[int]]]\n"
+"    (path, keyring_serial, child_keyring_serials, leaf_serials) for each\n"
+"    keyring. path holds the descriptions of the keyrings leading from\n"
+"    this keyring (which has path ()) and can be passed to resolve_path().\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    max_depth is negative.\n"
+"truenas_keyring.KeyringError:\n"
+"    Reading or describing the contents of a keyring failed (see errno for\n"
+"    details). Raised when the iterator reaches that keyring.\n\n"
+);
+
+PyDoc_STRVAR(py_tn_keyring_walk_flat__doc__,
+"walk_flat(*, max_depth=None, key_type=None)\n"
+"    -> tuple[memoryview, memoryview, memoryview, memoryview]\n"
+"-----------------------------------------------------------\n\n"
+"Walk the whole tree as walk() does, but with the GIL released for the\n"
+"entire traversal, and return a packed snapshot instead of per-keyring\n"
+"tuples. The four views share a single buffer and have format 'i'.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"max_depth: int, optional\n"
+"    Maximum depth to descend to. Default: None (unlimited).\n\n"
+"key_type: str, optional\n"
+"    Only report leaf keys of this type. Default: None (all types).\n\n"
+""
+"Returns\n"
+"-------\n"
+"tuple[memoryview, memoryview, memoryview, memoryview]\n"
+"    (keyrings, parents, leaves, leaf_parents). keyrings lists keyring\n"
+"    serials in breadth-first order starting with this keyring and\n"
+"    parents[i] is the keyring keyrings[i] was reached from (0 for this\n"
+"    keyring). leaf_parents[i] is the keyring containing leaves[i].\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    max_depth is negative.\n"
+"truenas_keyring.KeyringError:\n"
+"    Reading or describing the contents of a keyring failed (see errno for\n"
+"    details).\n\n"
+);
 
-		errno = 0;
+static bool
+parse_walk_args(PyObject *args, PyObject *kwargs, const char *fmt,
+		size_t *max_depth_out, const char **key_type_out)
+{
+	char * const kwlist[] = {"max_depth", "key_type", NULL};
+	PyObject *max_depth_obj = Py_None;
+	Py_ssize_t max_depth;
 
-		py_key_obj = create_key_object_from_serial(keys[i], self->py_key->module_obj);
-		if (py_key_obj == NULL) {
-			/* potentially TOCTOU (though very unlikely) */
-			if ((errno == ENOKEY) ||
-			    (errno == EKEYEXPIRED) ||
-			    (errno == EKEYREVOKED)) {
-				PyErr_Clear();
-				continue;
-			}
-			Py_DECREF(py_list);
-			PyMem_RawFree(keys);
-			return NULL;
-		}
-		PyList_SetItem(py_list, i, py_key_obj);
+	*key_type_out = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, fmt, kwlist,
+					 &max_depth_obj, key_type_out)) {
+		return false;
 	}
 
-	PyMem_RawFree(keys);
-	return py_list;
+	if (max_depth_obj == Py_None) {
+		*max_depth_out = SIZE_MAX;
+		return true;
+	}
+
+	max_depth = PyLong_AsSsize_t(max_depth_obj);
+	if ((max_depth == -1) && PyErr_Occurred()) {
+		return false;
+	}
+
+	if (max_depth < 0) {
+		PyErr_SetString(PyExc_ValueError, "max_depth must not be negative");
+		return false;
+	}
+
+	*max_depth_out = (size_t)max_depth;
+	return true;
+}
+
+static PyObject *
+py_tn_keyring_walk(py_tn_keyring_t *self, PyObject *args, PyObject *kwargs)
+{
+	const char *key_type_str;
+	size_t max_depth;
+
+	if (!parse_walk_args(args, kwargs, "|$Oz:walk", &max_depth, &key_type_str)) {
+		return NULL;
+	}
+
+	return py_tn_keyring_walk_create(self, max_depth, key_type_str);
+}
+
+static PyObject *
+py_tn_keyring_walk_flat_impl(py_tn_keyring_t *self, PyObject *args, PyObject *kwargs)
+{
+	const char *key_type_str;
+	size_t max_depth;
+
+	if (!parse_walk_args(args, kwargs, "|$Oz:walk_flat", &max_depth, &key_type_str)) {
+		return NULL;
+	}
+
+	return py_tn_keyring_walk_flat(self, max_depth, key_type_str);
 }
 
 PyDoc_STRVAR(py_tn_keyring_search__doc__,
@@ -285,6 +516,7 @@ py_tn_keyring_search(py_tn_keyring_t *self, PyObject *args, PyObject *kwargs)
 	char * const kwlist[] = {"key_type", "description", NULL};
 	const char *key_type_str;
 	const char *description_str;
+	tn_key_info_t info = { 0 };
 	key_serial_t found_serial;
 	PyObject *key_instance;
 
@@ -294,10 +526,12 @@ py_tn_keyring_search(py_tn_keyring_t *self, PyObject *args, PyObject *kwargs)
 	}
 
 	Py_BEGIN_ALLOW_THREADS
-	found_serial = keyctl_search(self->py_key->c_serial, key_type_str, description_str, 0);
+	found_serial = cached_keyring_search(self->py_key->c_serial, key_type_str,
+					     description_str, &info);
 	Py_END_ALLOW_THREADS
 
 	if (found_serial == -1) {
+		free_key_info(&info);
 		if (errno == ENOKEY) {
 			PyErr_SetString(PyExc_FileNotFoundError, "Key not found in keyring");
 		} else {
@@ -306,54 +540,1022 @@ py_tn_keyring_search(py_tn_keyring_t *self, PyObject *args, PyObject *kwargs)
 		return NULL;
 	}
 
-	key_instance = create_key_object_from_serial(found_serial, self->py_key->module_obj);
+	key_instance = create_key_object_from_info(found_serial, &info, self->py_key->module_obj);
+	free_key_info(&info);
+
+	return key_instance;
+}
+
+PyDoc_STRVAR(py_tn_keyring_try_search__doc__,
+"try_search(*, key_type, description, objects=True)\n"
+"    -> truenas_keyring.TNKey | truenas_keyring.TNKeyring | int | None\n"
+"------------------------------------------------------------------\n\n"
+"Search for a key within the keyring and any nested keyrings. Unlike\n"
+"search(), a missing key is not an error and None is returned instead,\n"
+"which avoids the cost of raising an exception on the miss path.\n"
+"See man (3) keyctl_search for more information.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"key_type: str, required\n"
+"    The type of key to search for (e.g., \"user\", \"keyring\").\n\n"
+"description: str, required\n"
+"    The description to search for.\n\n"
+"objects: bool, optional\n"
+"    If False, return the serial number of the key rather than a key object.\n"
+"    Default: True.\n\n"
+""
+"Returns\n"
+"-------\n"
+"truenas_keyring.TNKey | truenas_keyring.TNKeyring | int | None\n"
+"    The matching key, keyring or serial, or None if not found.\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Missing required parameter.\n"
+"truenas_keyring.KeyringError:\n"
+"    Other system call errors (see errno for details).\n\n"
+);
+
+static PyObject *
+py_tn_keyring_try_search(py_tn_keyring_t *self, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"key_type", "description", "objects", NULL};
+	const char *key_type_str = NULL;
+	const char *description_str = NULL;
+	int objects = true;
+	tn_key_info_t info = { 0 };
+	key_serial_t found_serial;
+	PyObject *key_instance;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$ssp:try_search",
+					 kwlist, &key_type_str, &description_str,
+					 &objects)) {
+		return NULL;
+	}
+
+	if ((key_type_str == NULL) || (description_str == NULL)) {
+		PyErr_SetString(PyExc_ValueError, "key_type and description arguments are required");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	found_serial = cached_keyring_search(self->py_key->c_serial, key_type_str,
+					     description_str, objects ? &info : NULL);
+	Py_END_ALLOW_THREADS
+
+	if (found_serial == -1) {
+		free_key_info(&info);
+		if (errno == ENOKEY) {
+			Py_RETURN_NONE;
+		}
+		PyErr_SetFromErrno(get_keyring_error_from_module(self->py_key->module_obj));
+		return NULL;
+	}
+
+	if (!objects) {
+		return PyLong_FromLong(found_serial);
+	}
+
+	key_instance = create_key_object_from_info(found_serial, &info, self->py_key->module_obj);
+	free_key_info(&info);
 
 	return key_instance;
 }
 
+PyDoc_STRVAR(py_tn_keyring_read_all__doc__,
+"read_all(*, key_type=None, unlink_expired=False, unlink_revoked=False)\n"
+"    -> dict[str, bytes]\n"
+"---------------------------------------------------------------------\n\n"
+"Read the payloads of all keys contained within the keyring in a single\n"
+"pass with the GIL released. Nested keyrings are not included.\n"
+"Expired and revoked keys are skipped.\n"
+"See man (3) keyctl_read for more information.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"key_type: str, optional\n"
+"    Only read keys of this type (e.g. truenas_keyring.KeyType.USER).\n"
+"    Default: None (all non-keyring keys).\n\n"
+"unlink_expired: bool, optional\n"
+"    If True, automatically unlink expired keys from the keyring.\n"
+"    Default: False.\n\n"
+"unlink_revoked: bool, optional\n"
+"    If True, automatically unlink revoked keys from the keyring.\n"
+"    Default: False.\n\n"
+""
+"Returns\n"
+"-------\n"
+"dict[str, bytes]\n"
+"    Mapping of key description to key payload. If the keyring contains\n"
+"    keys of different types with the same description then key_type\n"
+"    should be specified.\n\n"
+""
+"Raises\n"
+"------\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details). This includes the keyring\n"
+"    being released while it is read (e.g. after truenas_keyring.swap_keyring()).\n\n"
+);
+
 static PyObject *
-py_tn_keyring_repr(py_tn_keyring_t *self)
+py_tn_keyring_read_all(py_tn_keyring_t *self, PyObject *args, PyObject *kwargs)
 {
-	const char *description = self->py_key->c_describe ? self->py_key->c_describe : "";
-	return PyUnicode_FromFormat("TNKeyring(serial=%d, description=\"%s\")",
-				    self->py_key->c_serial, description);
+	char * const kwlist[] = {"key_type", "unlink_expired", "unlink_revoked", NULL};
+	const char *key_type_str = NULL;
+	int del_exp = false;
+	int del_rev = false;
+	tn_payload_set_t set = { 0 };
+	PyObject *out;
+	bool success;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$zpp:read_all",
+					 kwlist, &key_type_str, &del_exp, &del_rev)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	success = read_keyring_payloads(self->py_key->c_serial, key_type_str,
+					del_exp, del_rev, &set);
+	Py_END_ALLOW_THREADS
+
+	if (!success) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(self->py_key->module_obj));
+		free_payload_set(&set);
+		return NULL;
+	}
+
+	out = payload_set_to_dict(&set);
+	free_payload_set(&set);
+
+	return out;
 }
 
-static PyGetSetDef py_tn_keyring_getsetters[] = {
-	{
-		.name = "key",
-		.get = (getter)py_tn_keyring_key,
-		.set = NULL,
-		.doc = "Reference to the TNKey object for the keyring",
-		.closure = NULL
-	},
-	{NULL}
-};
+PyDoc_STRVAR(py_tn_keyring_reconcile__doc__,
+"reconcile(*, entries, key_type=KeyType.USER, dry_run=False) -> dict\n"
+"--------------------------------------------------------------------\n\n"
+"Bring the keys of the specified type in this keyring in line with entries\n"
+"using the minimal set of changes. The current contents are read once and\n"
+"compared by description and payload:\n\n"
+"- keys with new descriptions are added\n"
+"- keys with changed payloads are updated in place (keyctl_update)\n"
+"- keys not present in entries are unlinked\n"
+"- keys with unchanged payloads are not modified (including expiry)\n\n"
+"Expired and revoked keys are unlinked. Nested keyrings and keys of\n"
+"other types are not touched.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"entries: Iterable[tuple[str, bytes, int | None]], required\n"
+"    Desired (description, data, timeout) for each key. timeout is only\n"
+"    applied to keys that are added or updated. Descriptions should be\n"
+"    unique.\n\n"
+"key_type: str, optional\n"
+"    The type of keys to manage. Cannot be \"keyring\".\n"
+"    Default: truenas_keyring.KeyType.USER.\n\n"
+"dry_run: bool, optional\n"
+"    If True, only report the changes that would be made.\n"
+"    Default: False.\n\n"
+""
+"Returns\n"
+"-------\n"
+"dict\n"
+"    Number of keys \"added\", \"updated\", \"removed\" and \"unchanged\".\n\n"
+""
+"Raises\n"
+"------\n"
+"TypeError:\n"
+"    Invalid parameter type.\n"
+"ValueError:\n"
+"    Missing required parameter, \"keyring\" key type or invalid timeout specified.\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details). Changes made prior to the\n"
+"    failure are not rolled back.\n\n"
+);
 
-static PyMethodDef py_tn_keyring_methods[] = {
-	{
-		.ml_name = "clear",
-		.ml_meth = (PyCFunction)py_tn_keyring_clear,
-		.ml_flags = METH_NOARGS,
-		.ml_doc = py_tn_keyring_clear__doc__
-	},
-	{
-		.ml_name = "iter_keyring_contents",
-		.ml_meth = (PyCFunction)py_tn_keyring_iter_keyring_contents,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
-		.ml_doc = py_tn_keyring_iter_keyring_contents__doc__
-	},
-	{
-		.ml_name = "list_keyring_contents",
-		.ml_meth = (PyCFunction)py_tn_keyring_list_keyring_contents,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
-		.ml_doc = py_tn_keyring_list_keyring_contents__doc__
-	},
-	{
-		.ml_name = "search",
-		.ml_meth = (PyCFunction)py_tn_keyring_search,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
-		.ml_doc = py_tn_keyring_search__doc__
+static PyObject *
+py_tn_keyring_reconcile(py_tn_keyring_t *self, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"entries", "key_type", "dry_run", NULL};
+	PyObject *entries_obj = NULL;
+	const char *key_type_str = KEY_TYPE_STR_USER;
+	int dry_run = false;
+	PyObject *entries_fast = NULL;
+	tn_add_entry_t *entries = NULL;
+	tn_reconcile_stats_t stats;
+	size_t cnt;
+	bool success;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$Osp:reconcile",
+					 kwlist, &entries_obj, &key_type_str, &dry_run)) {
+		return NULL;
+	}
+
+	if (entries_obj == NULL) {
+		PyErr_SetString(PyExc_ValueError, "entries argument is required");
+		return NULL;
+	}
+
+	if (strcmp(key_type_str, KEY_TYPE_STR_KEYRING) == 0) {
+		PyErr_SetString(PyExc_ValueError, "Cannot reconcile nested keyrings");
+		return NULL;
+	}
+
+	if (!parse_add_entries(entries_obj, &entries_fast, &entries, &cnt)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	success = reconcile_keyring(self->py_key->c_serial, key_type_str,
+				    entries, cnt, dry_run, &stats);
+	Py_END_ALLOW_THREADS
+
+	PyMem_RawFree(entries);
+	Py_DECREF(entries_fast);
+
+	if (!success) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(self->py_key->module_obj));
+		return NULL;
+	}
+
+	return Py_BuildValue("{s:n,s:n,s:n,s:n}",
+			     "added", (Py_ssize_t)stats.added,
+			     "updated", (Py_ssize_t)stats.updated,
+			     "removed", (Py_ssize_t)stats.removed,
+			     "unchanged", (Py_ssize_t)stats.unchanged);
+}
+
+PyDoc_STRVAR(py_tn_keyring_serials__doc__,
+"serials() -> memoryview\n"
+"-----------------------\n\n"
+"Return the serial numbers of all keys linked into the keyring as read\n"
+"by a single keyctl_read(). No per-key objects are created and the keys\n"
+"are not described, so the result may include expired or revoked keys.\n"
+"See man (3) keyctl_read for more information.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"None\n\n"
+""
+"Returns\n"
+"-------\n"
+"memoryview\n"
+"    Read-only view with format 'i' over the packed key_serial_t array.\n"
+"    Use tolist() or array.array('i', view) if a copy is required.\n\n"
+""
+"Raises\n"
+"------\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details).\n\n"
+);
+
+_Static_assert(sizeof(key_serial_t) == sizeof(int), "key_serial_t must match memoryview format 'i'");
+
+static PyObject *
+py_tn_keyring_serials(py_tn_keyring_t *self, PyObject *Py_UNUSED(ignored))
+{
+	key_serial_t *keys;
+	PyObject *data, *view, *out;
+	size_t cnt;
+	bool success;
+
+	Py_BEGIN_ALLOW_THREADS
+	success = read_keyring_serials(self->py_key->c_serial, &keys, &cnt);
+	Py_END_ALLOW_THREADS
+
+	if (!success) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(self->py_key->module_obj));
+		return NULL;
+	}
+
+	data = PyBytes_FromStringAndSize((const char *)keys, cnt * sizeof(key_serial_t));
+	scratch_tls_put(keys, cnt * sizeof(key_serial_t));
+	if (data == NULL) {
+		return NULL;
+	}
+
+	view = PyMemoryView_FromObject(data);
+	Py_DECREF(data);
+	if (view == NULL) {
+		return NULL;
+	}
+
+	out = PyObject_CallMethod(view, "cast", "s", "i");
+	Py_DECREF(view);
+
+	return out;
+}
+
+/*
+ * len(keyring): number of linked keys. keyctl_read() with no buffer
+ * reports the size of the serial array without copying it.
+ */
+static Py_ssize_t
+py_tn_keyring_len(py_tn_keyring_t *self)
+{
+	long res;
+
+	Py_BEGIN_ALLOW_THREADS
+	res = tn_keyctl_read(self->py_key->c_serial, NULL, 0);
+	Py_END_ALLOW_THREADS
+
+	if (res == -1) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(self->py_key->module_obj));
+		return -1;
+	}
+
+	return (Py_ssize_t)(res / sizeof(key_serial_t));
+}
+
+/*
+ * Get the key type used for mapping access. Returns a new reference so
+ * that the string stays valid while the GIL is released even if
+ * default_key_type is changed by another thread. Requires GIL.
+ */
+static PyObject *
+py_tn_keyring_mapping_type(py_tn_keyring_t *self, const char **key_type_str)
+{
+	PyObject *key_type;
+
+	if (self->default_key_type == NULL) {
+		key_type = PyUnicode_FromString(KEY_TYPE_STR_USER);
+	} else {
+		key_type = Py_NewRef(self->default_key_type);
+	}
+
+	if (key_type == NULL) {
+		return NULL;
+	}
+
+	*key_type_str = PyUnicode_AsUTF8(key_type);
+	if (*key_type_str == NULL) {
+		Py_DECREF(key_type);
+		return NULL;
+	}
+
+	return key_type;
+}
+
+static const char *
+py_tn_keyring_mapping_desc(PyObject *desc)
+{
+	if (!PyUnicode_Check(desc)) {
+		PyErr_Format(PyExc_TypeError, "%s: keyring keys must be str descriptions",
+			     Py_TYPE(desc)->tp_name);
+		return NULL;
+	}
+
+	return PyUnicode_AsUTF8(desc);
+}
+
+static inline bool
+py_tn_keyring_is_missing(int err)
+{
+	return (err == ENOKEY) || (err == EKEYEXPIRED) || (err == EKEYREVOKED);
+}
+
+/*
+ * Find the key of the specified type and description linked directly into
+ * ring. keyctl_search() is recursive, but it looks in ring itself before
+ * descending, and so a result that isn't a direct child means that there
+ * is none. The search cache only holds direct children, so a cached result
+ * never hides one. Returns -1 with errno set to ENOKEY if there is no such
+ * key. Does not require GIL.
+ */
+static key_serial_t
+keyring_find_child(key_serial_t ring, const char *key_type_str, const char *desc,
+		   bool cached)
+{
+	key_serial_t serial;
+	bool linked;
+
+	if (cached) {
+		serial = cached_keyring_search(ring, key_type_str, desc, NULL);
+	} else {
+		serial = tn_keyctl_search(ring, key_type_str, desc, 0);
+	}
+
+	if ((serial == -1) || !keyring_links(ring, serial, &linked)) {
+		return -1;
+	}
+
+	if (!linked) {
+		errno = ENOKEY;
+		return -1;
+	}
+
+	return serial;
+}
+
+/*
+ * Find the key of the mapping key type with the given description linked
+ * directly into this keyring. Returns 0 if found, 1 if missing and -1 with
+ * exception set on error. Requires GIL (released internally).
+ */
+static int
+py_tn_keyring_mapping_search(py_tn_keyring_t *self, PyObject *desc,
+			     key_serial_t *serial_out)
+{
+	const char *key_type_str, *desc_str;
+	PyObject *key_type;
+	key_serial_t serial;
+	int err;
+
+	desc_str = py_tn_keyring_mapping_desc(desc);
+	if (desc_str == NULL) {
+		return -1;
+	}
+
+	key_type = py_tn_keyring_mapping_type(self, &key_type_str);
+	if (key_type == NULL) {
+		return -1;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	serial = keyring_find_child(self->py_key->c_serial, key_type_str, desc_str, true);
+	err = errno;
+	Py_END_ALLOW_THREADS
+
+	Py_DECREF(key_type);
+
+	if (serial == -1) {
+		if (py_tn_keyring_is_missing(err)) {
+			return 1;
+		}
+		errno = err;
+		PyErr_SetFromErrno(get_keyring_error_from_module(self->py_key->module_obj));
+		return -1;
+	}
+
+	*serial_out = serial;
+	return 0;
+}
+
+/*
+ * `item in keyring`: item may be a str description (looked up with the
+ * mapping key type), or an int serial, TNKey or TNKeyring in which case
+ * the serial array is scanned in C with the GIL released.
+ */
+static int
+py_tn_keyring_contains(py_tn_keyring_t *self, PyObject *item)
+{
+	key_serial_t target;
+	bool success, found;
+	long val;
+	int res;
+
+	if (PyUnicode_Check(item)) {
+		res = py_tn_keyring_mapping_search(self, item, &target);
+		return res == -1 ? -1 : res == 0;
+	} else if (PyObject_TypeCheck(item, &TNKeyType)) {
+		target = ((py_tnkey_t *)item)->c_serial;
+	} else if (PyObject_TypeCheck(item, &TNKeyringType)) {
+		target = ((py_tn_keyring_t *)item)->py_key->c_serial;
+	} else {
+		val = PyLong_AsLong(item);
+		if ((val == -1) && PyErr_Occurred()) {
+			return -1;
+		}
+		if ((val < INT32_MIN) || (val > INT32_MAX)) {
+			return 0;
+		}
+		target = (key_serial_t)val;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	success = keyring_links(self->py_key->c_serial, target, &found);
+	Py_END_ALLOW_THREADS
+
+	if (!success) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(self->py_key->module_obj));
+		return -1;
+	}
+
+	return found;
+}
+
+/*
+ * Read the payload of the key with the specified description linked
+ * directly into this keyring. Returns NULL without an exception set if the
+ * key doesn't exist. Requires GIL (released internally).
+ */
+static PyObject *
+py_tn_keyring_mapping_read(py_tn_keyring_t *self, PyObject *desc)
+{
+	const char *key_type_str, *desc_str;
+	PyObject *key_type, *out;
+	key_serial_t serial;
+	char *data = NULL;
+	size_t data_len = 0;
+	bool success = false;
+	int err;
+
+	desc_str = py_tn_keyring_mapping_desc(desc);
+	if (desc_str == NULL) {
+		return NULL;
+	}
+
+	key_type = py_tn_keyring_mapping_type(self, &key_type_str);
+	if (key_type == NULL) {
+		return NULL;
+	}
+
+	/*
+	 * As with lookup_payload() the key is not cached: its payload is needed
+	 * anyway, and a failed read is as good as a failed describe.
+	 */
+	Py_BEGIN_ALLOW_THREADS
+	serial = keyring_find_child(self->py_key->c_serial, key_type_str, desc_str, false);
+	if (serial != -1) {
+		success = read_key_payload(serial, &data, &data_len);
+	}
+	err = errno;
+	Py_END_ALLOW_THREADS
+
+	Py_DECREF(key_type);
+
+	if (!success) {
+		if (!py_tn_keyring_is_missing(err)) {
+			errno = err;
+			PyErr_SetFromErrno(get_keyring_error_from_module(self->py_key->module_obj));
+		}
+		return NULL;
+	}
+
+	out = PyBytes_FromStringAndSize(data, data_len);
+	scratch_tls_put(data, data_len);
+
+	return out;
+}
+
+/* keyring[desc] */
+static PyObject *
+py_tn_keyring_subscript(py_tn_keyring_t *self, PyObject *desc)
+{
+	PyObject *out;
+
+	out = py_tn_keyring_mapping_read(self, desc);
+	if ((out == NULL) && !PyErr_Occurred()) {
+		PyErr_SetObject(PyExc_KeyError, desc);
+	}
+
+	return out;
+}
+
+/* keyring[desc] = data, del keyring[desc] */
+static int
+py_tn_keyring_ass_subscript(py_tn_keyring_t *self, PyObject *desc, PyObject *value)
+{
+	const char *key_type_str, *desc_str;
+	PyObject *key_type;
+	key_serial_t serial;
+	Py_buffer data;
+	long res;
+	int err;
+
+	if (value == NULL) {
+		res = py_tn_keyring_mapping_search(self, desc, &serial);
+		if (res == 1) {
+			PyErr_SetObject(PyExc_KeyError, desc);
+			return -1;
+		} else if (res == -1) {
+			return -1;
+		}
+
+		Py_BEGIN_ALLOW_THREADS
+		res = tn_keyctl_unlink(serial, self->py_key->c_serial);
+		err = errno;
+		Py_END_ALLOW_THREADS
+
+		if (res == -1) {
+			if (err == ENOENT) {
+				/* unlinked by someone else since it was found */
+				PyErr_SetObject(PyExc_KeyError, desc);
+			} else {
+				errno = err;
+				PyErr_SetFromErrno(get_keyring_error_from_module(self->py_key->module_obj));
+			}
+			return -1;
+		}
+
+		return 0;
+	}
+
+	desc_str = py_tn_keyring_mapping_desc(desc);
+	if (desc_str == NULL) {
+		return -1;
+	}
+
+	if (PyObject_GetBuffer(value, &data, PyBUF_SIMPLE) < 0) {
+		return -1;
+	}
+
+	key_type = py_tn_keyring_mapping_type(self, &key_type_str);
+	if (key_type == NULL) {
+		PyBuffer_Release(&data);
+		return -1;
+	}
+
+	/* add_key() replaces any key of the same type and description */
+	Py_BEGIN_ALLOW_THREADS
+	serial = tn_sys_add_key(key_type_str, desc_str, data.buf, (size_t)data.len,
+				self->py_key->c_serial);
+	Py_END_ALLOW_THREADS
+
+	Py_DECREF(key_type);
+	PyBuffer_Release(&data);
+
+	if (serial == -1) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(self->py_key->module_obj));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Read all keys of the mapping key type directly linked into the keyring.
+ * Requires GIL (released internally).
+ */
+static PyObject *
+py_tn_keyring_mapping_dict(py_tn_keyring_t *self)
+{
+	const char *key_type_str;
+	tn_payload_set_t set = { 0 };
+	PyObject *key_type, *out;
+	bool success;
+
+	key_type = py_tn_keyring_mapping_type(self, &key_type_str);
+	if (key_type == NULL) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	success = read_keyring_payloads(self->py_key->c_serial, key_type_str,
+					false, false, &set);
+	Py_END_ALLOW_THREADS
+
+	Py_DECREF(key_type);
+
+	if (!success) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(self->py_key->module_obj));
+		free_payload_set(&set);
+		return NULL;
+	}
+
+	out = payload_set_to_dict(&set);
+	free_payload_set(&set);
+
+	return out;
+}
+
+/*
+ * List the descriptions of keys of the mapping key type directly linked
+ * into the keyring. Keys are described but their payloads are not read.
+ * Requires GIL (released internally).
+ */
+static PyObject *
+py_tn_keyring_mapping_keys(py_tn_keyring_t *self)
+{
+	const char *key_type_str;
+	tn_payload_set_t set = { 0 };
+	PyObject *key_type, *out = NULL;
+	bool success;
+	size_t i;
+
+	key_type = py_tn_keyring_mapping_type(self, &key_type_str);
+	if (key_type == NULL) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	success = read_keyring_descriptions(self->py_key->c_serial, key_type_str, &set);
+	Py_END_ALLOW_THREADS
+
+	Py_DECREF(key_type);
+
+	if (!success) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(self->py_key->module_obj));
+		goto out;
+	}
+
+	out = PyList_New(set.cnt);
+	if (out == NULL) {
+		goto out;
+	}
+
+	for (i = 0; i < set.cnt; i++) {
+		PyObject *desc = PyUnicode_FromString(set.blob + set.entries[i].desc_off);
+		if (desc == NULL) {
+			Py_CLEAR(out);
+			goto out;
+		}
+		PyList_SET_ITEM(out, i, desc);
+	}
+
+out:
+	free_payload_set(&set);
+	return out;
+}
+
+static PyObject *
+py_tn_keyring_iter(py_tn_keyring_t *self)
+{
+	PyObject *keys, *out;
+
+	keys = py_tn_keyring_mapping_keys(self);
+	if (keys == NULL) {
+		return NULL;
+	}
+
+	out = PyObject_GetIter(keys);
+	Py_DECREF(keys);
+
+	return out;
+}
+
+PyDoc_STRVAR(py_tn_keyring_get__doc__,
+"get(description, default=None) -> bytes | Any\n"
+"----------------------------------------------\n\n"
+"Return the payload of the key of type default_key_type with the\n"
+"specified description linked directly into the keyring, or default if\n"
+"it doesn't exist. Expired and revoked keys are treated as missing.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"description: str, required\n"
+"    Description of the key.\n\n"
+"default: Any, optional\n"
+"    Value to return if the key doesn't exist. Default: None.\n\n"
+""
+"Returns\n"
+"-------\n"
+"bytes | Any\n"
+"    The key payload or default.\n\n"
+""
+"Raises\n"
+"------\n"
+"TypeError:\n"
+"    description is not a str.\n"
+"truenas_keyring.KeyringError:\n"
+"    Other system call errors (see errno for details).\n\n"
+);
+
+static PyObject *
+py_tn_keyring_get(py_tn_keyring_t *self, PyObject *args)
+{
+	PyObject *desc, *dflt = Py_None, *out;
+
+	if (!PyArg_ParseTuple(args, "O|O:get", &desc, &dflt)) {
+		return NULL;
+	}
+
+	out = py_tn_keyring_mapping_read(self, desc);
+	if ((out == NULL) && !PyErr_Occurred()) {
+		out = Py_NewRef(dflt);
+	}
+
+	return out;
+}
+
+PyDoc_STRVAR(py_tn_keyring_keys__doc__,
+"keys() -> list[str]\n"
+"-------------------\n\n"
+"Return the descriptions of all keys of type default_key_type directly\n"
+"linked into the keyring. Expired and revoked keys are skipped. Keys are\n"
+"described but their payloads are not read.\n\n"
+""
+"Raises\n"
+"------\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details).\n\n"
+);
+
+static PyObject *
+py_tn_keyring_keys(py_tn_keyring_t *self, PyObject *Py_UNUSED(ignored))
+{
+	return py_tn_keyring_mapping_keys(self);
+}
+
+PyDoc_STRVAR(py_tn_keyring_values__doc__,
+"values() -> list[bytes]\n"
+"-----------------------\n\n"
+"Return the payloads of all keys of type default_key_type directly\n"
+"linked into the keyring, read in a single pass as with read_all().\n\n"
+""
+"Raises\n"
+"------\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details).\n\n"
+);
+
+static PyObject *
+py_tn_keyring_values(py_tn_keyring_t *self, PyObject *Py_UNUSED(ignored))
+{
+	PyObject *dict, *out;
+
+	dict = py_tn_keyring_mapping_dict(self);
+	if (dict == NULL) {
+		return NULL;
+	}
+
+	out = PyDict_Values(dict);
+	Py_DECREF(dict);
+
+	return out;
+}
+
+PyDoc_STRVAR(py_tn_keyring_items__doc__,
+"items() -> list[tuple[str, bytes]]\n"
+"----------------------------------\n\n"
+"Return (description, payload) for all keys of type default_key_type\n"
+"directly linked into the keyring, read in a single pass as with\n"
+"read_all().\n\n"
+""
+"Raises\n"
+"------\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details).\n\n"
+);
+
+static PyObject *
+py_tn_keyring_items(py_tn_keyring_t *self, PyObject *Py_UNUSED(ignored))
+{
+	PyObject *dict, *out;
+
+	dict = py_tn_keyring_mapping_dict(self);
+	if (dict == NULL) {
+		return NULL;
+	}
+
+	out = PyDict_Items(dict);
+	Py_DECREF(dict);
+
+	return out;
+}
+
+static PySequenceMethods py_tn_keyring_as_sequence = {
+	.sq_length = (lenfunc)py_tn_keyring_len,
+	.sq_contains = (objobjproc)py_tn_keyring_contains,
+};
+
+static PyMappingMethods py_tn_keyring_as_mapping = {
+	.mp_length = (lenfunc)py_tn_keyring_len,
+	.mp_subscript = (binaryfunc)py_tn_keyring_subscript,
+	.mp_ass_subscript = (objobjargproc)py_tn_keyring_ass_subscript,
+};
+
+static PyObject *
+py_tn_keyring_repr(py_tn_keyring_t *self)
+{
+	const char *description = self->py_key->c_describe ? self->py_key->c_describe : "";
+	return PyUnicode_FromFormat("TNKeyring(serial=%d, description=\"%s\")",
+				    self->py_key->c_serial, description);
+}
+
+static PyObject *
+py_tn_keyring_get_default_key_type(py_tn_keyring_t *self, void *closure)
+{
+	if (self->default_key_type == NULL) {
+		return PyUnicode_FromString(KEY_TYPE_STR_USER);
+	}
+
+	return Py_NewRef(self->default_key_type);
+}
+
+static int
+py_tn_keyring_set_default_key_type(py_tn_keyring_t *self, PyObject *value, void *closure)
+{
+	const char *key_type_str;
+
+	if (value == NULL) {
+		Py_CLEAR(self->default_key_type);
+		return 0;
+	}
+
+	if (!PyUnicode_Check(value)) {
+		PyErr_SetString(PyExc_TypeError, "default_key_type must be a str");
+		return -1;
+	}
+
+	key_type_str = PyUnicode_AsUTF8(value);
+	if (key_type_str == NULL) {
+		return -1;
+	}
+
+	if (strcmp(key_type_str, KEY_TYPE_STR_KEYRING) == 0) {
+		PyErr_SetString(PyExc_ValueError, "Mapping access to nested keyrings is not supported");
+		return -1;
+	}
+
+	Py_XSETREF(self->default_key_type, Py_NewRef(value));
+	return 0;
+}
+
+static PyGetSetDef py_tn_keyring_getsetters[] = {
+	{
+		.name = "key",
+		.get = (getter)py_tn_keyring_key,
+		.set = NULL,
+		.doc = "Reference to the TNKey object for the keyring",
+		.closure = NULL
+	},
+	{
+		.name = "default_key_type",
+		.get = (getter)py_tn_keyring_get_default_key_type,
+		.set = (setter)py_tn_keyring_set_default_key_type,
+		.doc = "Key type used by the mapping interface (keyring[description]).\n"
+		       "Defaults to \"user\". Deleting the attribute restores the default.",
+		.closure = NULL
+	},
+	{NULL}
+};
+
+static PyMethodDef py_tn_keyring_methods[] = {
+	{
+		.ml_name = "clear",
+		.ml_meth = (PyCFunction)py_tn_keyring_clear,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tn_keyring_clear__doc__
+	},
+	{
+		.ml_name = "iter_keyring_contents",
+		.ml_meth = (PyCFunction)py_tn_keyring_iter_keyring_contents,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_keyring_iter_keyring_contents__doc__
+	},
+	{
+		.ml_name = "list_keyring_contents",
+		.ml_meth = (PyCFunction)py_tn_keyring_list_keyring_contents,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_keyring_list_keyring_contents__doc__
+	},
+	{
+		.ml_name = "walk",
+		.ml_meth = (PyCFunction)py_tn_keyring_walk,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_keyring_walk__doc__
+	},
+	{
+		.ml_name = "walk_flat",
+		.ml_meth = (PyCFunction)py_tn_keyring_walk_flat_impl,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_keyring_walk_flat__doc__
+	},
+	{
+		.ml_name = "search",
+		.ml_meth = (PyCFunction)py_tn_keyring_search,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_keyring_search__doc__
+	},
+	{
+		.ml_name = "try_search",
+		.ml_meth = (PyCFunction)py_tn_keyring_try_search,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_keyring_try_search__doc__
+	},
+	{
+		.ml_name = "read_all",
+		.ml_meth = (PyCFunction)py_tn_keyring_read_all,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_keyring_read_all__doc__
+	},
+	{
+		.ml_name = "serials",
+		.ml_meth = (PyCFunction)py_tn_keyring_serials,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tn_keyring_serials__doc__
+	},
+	{
+		.ml_name = "get",
+		.ml_meth = (PyCFunction)py_tn_keyring_get,
+		.ml_flags = METH_VARARGS,
+		.ml_doc = py_tn_keyring_get__doc__
+	},
+	{
+		.ml_name = "keys",
+		.ml_meth = (PyCFunction)py_tn_keyring_keys,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tn_keyring_keys__doc__
+	},
+	{
+		.ml_name = "values",
+		.ml_meth = (PyCFunction)py_tn_keyring_values,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tn_keyring_values__doc__
+	},
+	{
+		.ml_name = "items",
+		.ml_meth = (PyCFunction)py_tn_keyring_items,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tn_keyring_items__doc__
+	},
+	{
+		.ml_name = "reconcile",
+		.ml_meth = (PyCFunction)py_tn_keyring_reconcile,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_tn_keyring_reconcile__doc__
 	},
 	{NULL}
 };
@@ -361,7 +1563,13 @@ static PyMethodDef py_tn_keyring_methods[] = {
 PyTypeObject TNKeyringType = {
 	PyVarObject_HEAD_INIT(NULL, 0)
 	.tp_name = MODULE_NAME ".TNKeyring",
-	.tp_doc = "TrueNAS Keyring object",
+	.tp_doc = "TrueNAS Keyring object\n\n"
+		  "Also acts as a mapping of description to payload for keys of type\n"
+		  "default_key_type: keyring[desc], keyring[desc] = data, del keyring[desc],\n"
+		  "desc in keyring, get(), keys(), values() and items(). All of these act\n"
+		  "only on keys directly linked into this keyring, never nested ones.\n"
+		  "len(keyring) and membership tests with a serial cover every linked key\n"
+		  "regardless of type.",
 	.tp_basicsize = sizeof(py_tn_keyring_t),
 	.tp_itemsize = 0,
 	.tp_flags = Py_TPFLAGS_DEFAULT,
@@ -369,6 +1577,9 @@ PyTypeObject TNKeyringType = {
 	.tp_init = (initproc) py_tn_keyring_init,
 	.tp_dealloc = (destructor) py_tn_keyring_dealloc,
 	.tp_repr = (reprfunc) py_tn_keyring_repr,
+	.tp_as_sequence = &py_tn_keyring_as_sequence,
+	.tp_as_mapping = &py_tn_keyring_as_mapping,
+	.tp_iter = (getiterfunc) py_tn_keyring_iter,
 	.tp_methods = py_tn_keyring_methods,
 	.tp_getset = py_tn_keyring_getsetters,
 };
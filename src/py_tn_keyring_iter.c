@@ -3,9 +3,21 @@
 static void
 py_tn_keyring_iter_dealloc(py_tn_keyring_iter_t *self)
 {
+	size_t i;
+
 	Py_CLEAR(self->keyring);
+	free_key_filter(&self->filter);
 	PyMem_RawFree(self->keys);
 	self->keys = NULL;
+
+	if (self->prefetch != NULL) {
+		for (i = 0; i < self->prefetch_size; i++) {
+			free_key_info(&self->prefetch[i].info);
+		}
+		PyMem_RawFree(self->prefetch);
+		self->prefetch = NULL;
+	}
+
 	Py_TYPE(self)->tp_free((PyObject *) self);
 }
 
@@ -17,64 +29,154 @@ py_tn_keyring_iter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
 	return (PyObject *)self;
 }
 
-static PyObject *
-py_tn_keyring_iter_iternext(py_tn_keyring_iter_t *self)
+/*
+ * Describe the next window of keys. Expired and revoked keys are classified
+ * (and optionally unlinked) here so that iternext only has to convert the
+ * prefetched entries into python objects. keyctl_describe() fails with
+ * EKEYEXPIRED / EKEYREVOKED for such keys, and so no separate keyctl_read()
+ * peek is required. Keys that don't match the iterator's filter are dropped
+ * here as well, reusing their prefetch slot.
+ *
+ * If describing a key fails for any other reason, the window is cut short
+ * at that key so that the error is raised in iteration order.
+ *
+ * Does not require GIL.
+ */
+static void
+py_tn_keyring_iter_prefetch(py_tn_keyring_iter_t *self, key_serial_t keyring_serial)
 {
-	PyObject *py_key_obj = NULL;
+	self->prefetch_cnt = 0;
+	self->prefetch_idx = 0;
 
-	/* Skip expired and revoked keys based on flags */
-	while (self->current_index < self->key_count) {
-		long ret;
+	while ((self->current_index < self->key_count) &&
+	       (self->prefetch_cnt < self->prefetch_size)) {
+		tn_prefetch_entry_t *entry = &self->prefetch[self->prefetch_cnt];
 		key_serial_t current_key = self->keys[self->current_index];
 		self->current_index++;
 
-		/* Peek at key to see whether it's revoked or expired */
-		Py_BEGIN_ALLOW_THREADS
-		ret = keyctl_read(current_key, NULL, 0);
-		Py_END_ALLOW_THREADS
-
-		if (ret == -1) {
-			if (errno == ENOKEY) {
-				/* key was unlinked so skip */
-				continue;
-			} else if (((errno == EKEYEXPIRED) && self->unlink_expired) ||
-				   ((errno == EKEYREVOKED) && self->unlink_revoked)) {
-				/*
-				 * key was revoked or expired and flag specified
-				 * to delete them
-				 */
-				Py_BEGIN_ALLOW_THREADS
-				keyctl_unlink(current_key, self->keyring->py_key->c_serial);
-				Py_END_ALLOW_THREADS
-				continue;
-			} else if ((errno == EKEYEXPIRED) || (errno == EKEYREVOKED)) {
-				/*
-				 * Don't present this key to API user since we can't
-				 * use it for anything
-				 */
+		if (describe_key(current_key, &entry->info)) {
+			if (!key_filter_match(&self->filter, &entry->info)) {
 				continue;
 			}
+			entry->serial = current_key;
+			entry->error = 0;
+			self->prefetch_cnt++;
+			continue;
 		}
 
-		errno = 0;
+		if (errno == ENOKEY) {
+			/* key was unlinked so skip */
+			continue;
+		} else if (((errno == EKEYEXPIRED) && self->unlink_expired) ||
+			   ((errno == EKEYREVOKED) && self->unlink_revoked)) {
+			/*
+			 * key was revoked or expired and flag specified
+			 * to delete them
+			 */
+			tn_keyctl_unlink(current_key, keyring_serial);
+			continue;
+		} else if ((errno == EKEYEXPIRED) || (errno == EKEYREVOKED)) {
+			/*
+			 * Don't present this key to API user since we can't
+			 * use it for anything
+			 */
+			continue;
+		}
 
-		py_key_obj = create_key_object_from_serial(current_key, self->keyring->py_key->module_obj);
-		if (py_key_obj == NULL) {
-			/* potentially TOCTOU (though very unlikely) */
-			if ((errno == ENOKEY) ||
-			    (errno == EKEYEXPIRED) ||
-			    (errno == EKEYREVOKED)) {
-				PyErr_Clear();
-				continue;
-			}
+		entry->serial = current_key;
+		entry->error = errno;
+		self->prefetch_cnt++;
+		break;
+	}
+}
+
+static PyObject *
+py_tn_keyring_iter_iternext(py_tn_keyring_iter_t *self)
+{
+	PyObject *module_obj = self->keyring->py_key->module_obj;
+	tn_prefetch_entry_t *entry;
+
+	if (self->prefetch_busy) {
+		PyErr_SetString(PyExc_ValueError, "keyring iterator already executing");
+		return NULL;
+	}
+
+	while (self->prefetch_idx == self->prefetch_cnt) {
+		if (self->current_index >= self->key_count) {
+			/* No more keys */
 			return NULL;
 		}
 
-		return py_key_obj;
+		self->prefetch_busy = true;
+		Py_BEGIN_ALLOW_THREADS
+		py_tn_keyring_iter_prefetch(self, self->keyring->py_key->c_serial);
+		Py_END_ALLOW_THREADS
+		self->prefetch_busy = false;
+	}
+
+	entry = &self->prefetch[self->prefetch_idx];
+	self->prefetch_idx++;
+
+	if (entry->error) {
+		errno = entry->error;
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		return NULL;
+	}
+
+	return create_key_object_from_info(entry->serial, &entry->info, module_obj);
+}
+
+/*
+ * Create a new iterator over the contents of the specified keyring. Up to
+ * `prefetch` keys are described in each GIL-released batch. The iterator
+ * takes ownership of the strings in filter (even on failure) and zeroes
+ * them in the caller's copy. Requires GIL.
+ */
+PyObject *
+py_tn_keyring_iter_create(py_tn_keyring_t *keyring, bool unlink_expired,
+			  bool unlink_revoked, size_t prefetch,
+			  tn_key_filter_t *filter)
+{
+	py_tn_keyring_iter_t *iter;
+	bool success;
+
+	iter = (py_tn_keyring_iter_t *)PyObject_CallFunction((PyObject *)&TNKeyringIterType, NULL);
+	if (iter == NULL) {
+		free_key_filter(filter);
+		return NULL;
+	}
+
+	iter->filter = *filter;
+	memset(filter, 0, sizeof(*filter));
+
+	Py_BEGIN_ALLOW_THREADS
+	success = get_keyring_serials(keyring->py_key->c_serial, &iter->keys, &iter->key_count);
+	Py_END_ALLOW_THREADS
+
+	if (!success) {
+		Py_DECREF(iter);
+		PyErr_SetFromErrno(PyExc_OSError);
+		return NULL;
 	}
 
-	/* No more keys */
-	return NULL;
+	/* No point in allocating a window larger than the keyring */
+	if (prefetch > iter->key_count) {
+		prefetch = iter->key_count ? iter->key_count : 1;
+	}
+
+	iter->prefetch = PyMem_RawCalloc(prefetch, sizeof(tn_prefetch_entry_t));
+	if (iter->prefetch == NULL) {
+		Py_DECREF(iter);
+		return PyErr_NoMemory();
+	}
+
+	iter->keyring = (py_tn_keyring_t *)Py_NewRef(keyring);
+	iter->current_index = 0;
+	iter->prefetch_size = prefetch;
+	iter->unlink_expired = unlink_expired;
+	iter->unlink_revoked = unlink_revoked;
+
+	return (PyObject *)iter;
 }
 
 PyTypeObject TNKeyringIterType = {
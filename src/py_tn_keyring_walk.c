@@ -0,0 +1,554 @@
+/* Breadth-first walk of nested keyrings */
+
+#include "truenas_keyring.h"
+
+/*
+ * A keyring reached by the walk. The root (the walked keyring) is node 0.
+ * children and leaves are filled in when the node's level is expanded and
+ * released once the node has been handed to python.
+ */
+typedef struct {
+	key_serial_t serial;
+	size_t parent;		/* index of parent node, SIZE_MAX for the root */
+	size_t depth;
+	char *description;	/* path component, NULL for the root */
+	key_serial_t *children;	/* nested keyrings, including already visited ones */
+	size_t child_cnt;
+	key_serial_t *leaves;	/* non-keyring keys matching the key type filter */
+	size_t leaf_cnt;
+	int error;
+} tn_walk_node_t;
+
+struct tn_walk {
+	tn_walk_node_t *nodes;
+	size_t cnt;
+	size_t alloc;
+	size_t expanded;	/* nodes [0, expanded) have been described */
+	size_t max_depth;
+	char *key_type_str;
+	/* open-addressed set of keyring serials already queued */
+	key_serial_t *visited;
+	size_t visited_size;
+	size_t visited_cnt;
+};
+
+#define TN_WALK_VISITED_MIN 64
+
+static inline size_t
+walk_hash(key_serial_t serial, size_t mask)
+{
+	return ((uint32_t)serial * 2654435761u) & mask;
+}
+
+/*
+ * Add serial to the visited set. Returns 1 if it was added, 0 if it was
+ * already present and -1 on allocation failure. Does not require GIL.
+ */
+static int
+walk_visit(tn_walk_t *walk, key_serial_t serial)
+{
+	size_t i, mask;
+
+	if ((walk->visited_cnt + 1) * 2 > walk->visited_size) {
+		size_t new_size = walk->visited_size ? walk->visited_size * 2 : TN_WALK_VISITED_MIN;
+		key_serial_t *set;
+
+		set = PyMem_RawCalloc(new_size, sizeof(key_serial_t));
+		if (set == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		mask = new_size - 1;
+		for (i = 0; i < walk->visited_size; i++) {
+			size_t j;
+
+			if (walk->visited[i] == 0) {
+				continue;
+			}
+
+			for (j = walk_hash(walk->visited[i], mask); set[j] != 0; j = (j + 1) & mask)
+				;
+			set[j] = walk->visited[i];
+		}
+
+		PyMem_RawFree(walk->visited);
+		walk->visited = set;
+		walk->visited_size = new_size;
+	}
+
+	mask = walk->visited_size - 1;
+	for (i = walk_hash(serial, mask); walk->visited[i] != 0; i = (i + 1) & mask) {
+		if (walk->visited[i] == serial) {
+			return 0;
+		}
+	}
+
+	walk->visited[i] = serial;
+	walk->visited_cnt++;
+	return 1;
+}
+
+static bool
+walk_add_node(tn_walk_t *walk, key_serial_t serial, size_t parent, const char *description)
+{
+	tn_walk_node_t *node;
+
+	if (walk->cnt == walk->alloc) {
+		size_t new_alloc = walk->alloc ? walk->alloc * 2 : 16;
+		tn_walk_node_t *nodes;
+
+		nodes = PyMem_RawRealloc(walk->nodes, new_alloc * sizeof(tn_walk_node_t));
+		if (nodes == NULL) {
+			errno = ENOMEM;
+			return false;
+		}
+		walk->nodes = nodes;
+		walk->alloc = new_alloc;
+	}
+
+	node = &walk->nodes[walk->cnt];
+	*node = (tn_walk_node_t) {
+		.serial = serial,
+		.parent = parent,
+		.depth = (parent == SIZE_MAX) ? 0 : walk->nodes[parent].depth + 1,
+	};
+
+	if (description != NULL) {
+		node->description = PyMem_RawMalloc(strlen(description) + 1);
+		if (node->description == NULL) {
+			errno = ENOMEM;
+			return false;
+		}
+		strcpy(node->description, description);
+	}
+
+	walk->cnt++;
+	return true;
+}
+
+/*
+ * Read and describe the contents of node idx. Nested keyrings that haven't
+ * been seen before (and are within max_depth) are queued as new nodes.
+ * Expired, revoked and vanished keys are skipped. Any other failure is
+ * recorded in the node and its contents are left incomplete. Returns false
+ * only on allocation failure. Does not require GIL.
+ */
+static bool
+walk_expand_node(tn_walk_t *walk, size_t idx, tn_key_info_t *info)
+{
+	key_serial_t *keys, *children = NULL, *leaves = NULL;
+	size_t i, cnt, child_cnt = 0, leaf_cnt = 0;
+	bool success = false;
+	int res;
+
+	if (!read_keyring_serials(walk->nodes[idx].serial, &keys, &cnt)) {
+		walk->nodes[idx].error = errno;
+		return true;
+	}
+
+	children = PyMem_RawMalloc(cnt ? cnt * sizeof(key_serial_t) : 1);
+	leaves = PyMem_RawMalloc(cnt ? cnt * sizeof(key_serial_t) : 1);
+	if ((children == NULL) || (leaves == NULL)) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (!describe_key(keys[i], info)) {
+			if ((errno == ENOKEY) || (errno == EKEYEXPIRED) || (errno == EKEYREVOKED)) {
+				continue;
+			} else if (errno == ENOMEM) {
+				goto out;
+			}
+			walk->nodes[idx].error = errno;
+			break;
+		}
+
+		if (strcmp(info->key_type_str, KEY_TYPE_STR_KEYRING) != 0) {
+			if ((walk->key_type_str == NULL) ||
+			    (strcmp(info->key_type_str, walk->key_type_str) == 0)) {
+				leaves[leaf_cnt++] = keys[i];
+			}
+			continue;
+		}
+
+		children[child_cnt++] = keys[i];
+		if (walk->nodes[idx].depth >= walk->max_depth) {
+			continue;
+		}
+
+		res = walk_visit(walk, keys[i]);
+		if (res == -1) {
+			goto out;
+		} else if ((res == 1) && !walk_add_node(walk, keys[i], idx, info->description)) {
+			goto out;
+		}
+	}
+
+	/* nodes may have moved if walk_add_node() grew the array */
+	walk->nodes[idx].children = children;
+	walk->nodes[idx].child_cnt = child_cnt;
+	walk->nodes[idx].leaves = leaves;
+	walk->nodes[idx].leaf_cnt = leaf_cnt;
+	children = leaves = NULL;
+	success = true;
+
+out:
+	scratch_tls_put(keys, cnt * sizeof(key_serial_t));
+	PyMem_RawFree(children);
+	PyMem_RawFree(leaves);
+	return success;
+}
+
+/*
+ * Describe the next level of the tree, i.e. every node queued but not yet
+ * expanded. Returns false with errno set on allocation failure.
+ * Does not require GIL.
+ */
+bool
+keyring_walk_level(tn_walk_t *walk)
+{
+	tn_key_info_t info = { 0 };
+	size_t end = walk->cnt;
+	bool success = true;
+
+	for (; walk->expanded < end; walk->expanded++) {
+		if (!walk_expand_node(walk, walk->expanded, &info)) {
+			success = false;
+			break;
+		}
+	}
+
+	free_key_info(&info);
+	return success;
+}
+
+/*
+ * Start a walk rooted at the specified keyring. key_type_str, if not NULL,
+ * limits the leaves that are reported. Returns NULL with errno set on
+ * failure. Does not require GIL.
+ */
+tn_walk_t *
+keyring_walk_new(key_serial_t root, size_t max_depth, const char *key_type_str)
+{
+	tn_walk_t *walk;
+
+	walk = PyMem_RawCalloc(1, sizeof(tn_walk_t));
+	if (walk == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	walk->max_depth = max_depth;
+
+	if (key_type_str != NULL) {
+		walk->key_type_str = PyMem_RawMalloc(strlen(key_type_str) + 1);
+		if (walk->key_type_str == NULL) {
+			goto fail;
+		}
+		strcpy(walk->key_type_str, key_type_str);
+	}
+
+	if ((walk_visit(walk, root) == -1) || !walk_add_node(walk, root, SIZE_MAX, NULL)) {
+		goto fail;
+	}
+
+	return walk;
+
+fail:
+	keyring_walk_free(walk);
+	errno = ENOMEM;
+	return NULL;
+}
+
+static void
+walk_node_release(tn_walk_node_t *node)
+{
+	PyMem_RawFree(node->children);
+	PyMem_RawFree(node->leaves);
+	node->children = node->leaves = NULL;
+	node->child_cnt = node->leaf_cnt = 0;
+}
+
+void
+keyring_walk_free(tn_walk_t *walk)
+{
+	size_t i;
+
+	if (walk == NULL) {
+		return;
+	}
+
+	for (i = 0; i < walk->cnt; i++) {
+		walk_node_release(&walk->nodes[i]);
+		PyMem_RawFree(walk->nodes[i].description);
+	}
+
+	PyMem_RawFree(walk->nodes);
+	PyMem_RawFree(walk->visited);
+	PyMem_RawFree(walk->key_type_str);
+	PyMem_RawFree(walk);
+}
+
+static PyObject *
+walk_serial_list(const key_serial_t *serials, size_t cnt)
+{
+	PyObject *out;
+	size_t i;
+
+	out = PyList_New(cnt);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *val = PyLong_FromLong(serials[i]);
+		if (val == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+		PyList_SET_ITEM(out, i, val);
+	}
+
+	return out;
+}
+
+/*
+ * Descriptions of the keyrings leading from the root to node idx.
+ * Requires GIL.
+ */
+static PyObject *
+walk_node_path(const tn_walk_t *walk, size_t idx)
+{
+	const tn_walk_node_t *node = &walk->nodes[idx];
+	PyObject *path;
+	size_t pos;
+
+	path = PyTuple_New(node->depth);
+	if (path == NULL) {
+		return NULL;
+	}
+
+	for (pos = node->depth; pos > 0; pos--, node = &walk->nodes[node->parent]) {
+		PyObject *name = PyUnicode_FromString(node->description);
+		if (name == NULL) {
+			Py_DECREF(path);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(path, pos - 1, name);
+	}
+
+	return path;
+}
+
+/*
+ * Convert an expanded node to a (path, serial, children, leaves) tuple and
+ * release its contents. Requires GIL.
+ */
+static PyObject *
+walk_node_to_tuple(tn_walk_t *walk, size_t idx, PyObject *module_obj)
+{
+	tn_walk_node_t *node = &walk->nodes[idx];
+	PyObject *path, *children, *leaves;
+
+	if (node->error) {
+		errno = node->error;
+		walk_node_release(node);
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		return NULL;
+	}
+
+	path = walk_node_path(walk, idx);
+	children = walk_serial_list(node->children, node->child_cnt);
+	leaves = walk_serial_list(node->leaves, node->leaf_cnt);
+	walk_node_release(node);
+
+	if ((path == NULL) || (children == NULL) || (leaves == NULL)) {
+		Py_XDECREF(path);
+		Py_XDECREF(children);
+		Py_XDECREF(leaves);
+		return NULL;
+	}
+
+	return Py_BuildValue("(NiNN)", path, node->serial, children, leaves);
+}
+
+static void
+py_tn_keyring_walk_dealloc(py_tn_keyring_walk_t *self)
+{
+	Py_CLEAR(self->keyring);
+	keyring_walk_free(self->walk);
+	self->walk = NULL;
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+py_tn_keyring_walk_iternext(py_tn_keyring_walk_t *self)
+{
+	tn_walk_t *walk = self->walk;
+	bool success = true;
+
+	if (self->busy) {
+		PyErr_SetString(PyExc_ValueError, "keyring walk already executing");
+		return NULL;
+	}
+
+	if (self->next == walk->expanded) {
+		if (walk->expanded == walk->cnt) {
+			return NULL;
+		}
+
+		self->busy = true;
+		Py_BEGIN_ALLOW_THREADS
+		success = keyring_walk_level(walk);
+		Py_END_ALLOW_THREADS
+		self->busy = false;
+
+		if (!success) {
+			return PyErr_NoMemory();
+		}
+	}
+
+	return walk_node_to_tuple(walk, self->next++, self->keyring->py_key->module_obj);
+}
+
+/*
+ * Create an iterator that walks the keyring tree one level at a time.
+ * Requires GIL.
+ */
+PyObject *
+py_tn_keyring_walk_create(py_tn_keyring_t *keyring, size_t max_depth,
+			  const char *key_type_str)
+{
+	py_tn_keyring_walk_t *self;
+
+	self = (py_tn_keyring_walk_t *)TNKeyringWalkType.tp_alloc(&TNKeyringWalkType, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+
+	self->walk = keyring_walk_new(keyring->py_key->c_serial, max_depth, key_type_str);
+	if (self->walk == NULL) {
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+
+	self->keyring = (py_tn_keyring_t *)Py_NewRef(keyring);
+	return (PyObject *)self;
+}
+
+/*
+ * Walk the whole tree with the GIL released and pack the result into a
+ * single buffer of four key_serial_t arrays: keyrings, their parents,
+ * leaves and their parents. The root's parent is 0. Returns a tuple of
+ * four memoryviews over the buffer. Requires GIL.
+ */
+PyObject *
+py_tn_keyring_walk_flat(py_tn_keyring_t *keyring, size_t max_depth,
+			const char *key_type_str)
+{
+	PyObject *module_obj = keyring->py_key->module_obj;
+	PyObject *data = NULL, *view = NULL, *out = NULL;
+	size_t i, j, leaf_cnt = 0, offsets[5];
+	key_serial_t *buf, *ring_p, *parent_p, *leaf_p, *leaf_parent_p;
+	tn_walk_t *walk;
+	bool success;
+	int error = 0;
+
+	Py_BEGIN_ALLOW_THREADS
+	walk = keyring_walk_new(keyring->py_key->c_serial, max_depth, key_type_str);
+	success = walk != NULL;
+	while (success && (walk->expanded < walk->cnt)) {
+		success = keyring_walk_level(walk);
+	}
+	Py_END_ALLOW_THREADS
+
+	if (!success) {
+		keyring_walk_free(walk);
+		return PyErr_NoMemory();
+	}
+
+	for (i = 0; i < walk->cnt; i++) {
+		if (walk->nodes[i].error) {
+			error = walk->nodes[i].error;
+			break;
+		}
+		leaf_cnt += walk->nodes[i].leaf_cnt;
+	}
+
+	if (error) {
+		keyring_walk_free(walk);
+		errno = error;
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		return NULL;
+	}
+
+	offsets[0] = 0;
+	offsets[1] = walk->cnt;
+	offsets[2] = 2 * walk->cnt;
+	offsets[3] = offsets[2] + leaf_cnt;
+	offsets[4] = offsets[3] + leaf_cnt;
+
+	data = PyBytes_FromStringAndSize(NULL, offsets[4] * sizeof(key_serial_t));
+	if (data == NULL) {
+		goto out;
+	}
+
+	buf = (key_serial_t *)PyBytes_AS_STRING(data);
+	ring_p = buf + offsets[0];
+	parent_p = buf + offsets[1];
+	leaf_p = buf + offsets[2];
+	leaf_parent_p = buf + offsets[3];
+
+	for (i = 0; i < walk->cnt; i++) {
+		tn_walk_node_t *node = &walk->nodes[i];
+
+		*ring_p++ = node->serial;
+		*parent_p++ = (node->parent == SIZE_MAX) ? 0 : walk->nodes[node->parent].serial;
+		for (j = 0; j < node->leaf_cnt; j++) {
+			*leaf_p++ = node->leaves[j];
+			*leaf_parent_p++ = node->serial;
+		}
+	}
+
+	view = PyMemoryView_FromObject(data);
+	if (view == NULL) {
+		goto out;
+	}
+
+	Py_SETREF(view, PyObject_CallMethod(view, "cast", "s", "i"));
+	if (view == NULL) {
+		goto out;
+	}
+
+	out = PyTuple_New(4);
+	if (out == NULL) {
+		goto out;
+	}
+
+	for (i = 0; i < 4; i++) {
+		PyObject *part = PySequence_GetSlice(view, offsets[i], offsets[i + 1]);
+		if (part == NULL) {
+			Py_CLEAR(out);
+			goto out;
+		}
+		PyTuple_SET_ITEM(out, i, part);
+	}
+
+out:
+	Py_XDECREF(view);
+	Py_XDECREF(data);
+	keyring_walk_free(walk);
+	return out;
+}
+
+PyTypeObject TNKeyringWalkType = {
+	.tp_name = MODULE_NAME ".TNKeyringWalk",
+	.tp_doc = "TrueNAS Keyring tree walk iterator",
+	.tp_basicsize = sizeof(py_tn_keyring_walk_t),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor) py_tn_keyring_walk_dealloc,
+	.tp_iter = PyObject_SelfIter,
+	.tp_iternext = (iternextfunc) py_tn_keyring_walk_iternext,
+};
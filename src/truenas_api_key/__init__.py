@@ -5,7 +5,11 @@ This module provides high-level API key management functionality
 built on top of the truenas_keyring C extension.
 """
 
-from .constants import PAM_KEYRING_NAME, PAM_API_KEY_NAME, ApiKeyAlgorithm, UserApiKey
+from .constants import (
+    PAM_KEYRING_NAME, PAM_API_KEY_NAME, PAM_API_KEY_BUNDLE_NAME, ApiKeyAlgorithm, ApiKeyLayout,
+    UserApiKey
+)
+from . import aio
 from . import keyring
 from . import constants
 
@@ -13,9 +17,12 @@ __all__ = [
     # From constants module
     'PAM_KEYRING_NAME',
     'PAM_API_KEY_NAME',
+    'PAM_API_KEY_BUNDLE_NAME',
     'ApiKeyAlgorithm',
+    'ApiKeyLayout',
     'UserApiKey',
     # Submodules
+    'aio',
     'keyring',
     'constants',
 ]
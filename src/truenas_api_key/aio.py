@@ -0,0 +1,155 @@
+"""
+Awaitable keyring operations for asyncio.
+
+Each operation is submitted to a truenas_keyring.TNCompletionQueue whose native
+workers perform the syscalls without the GIL. The queue's eventfd is registered
+with the event loop, and one wakeup resolves the futures of every operation that
+finished since the last one. A queue is created for each event loop on first use.
+"""
+import asyncio
+import truenas_keyring
+import weakref
+
+from . import keyring as api_keyring
+from .constants import PAM_KEYRING_NAME, PAM_API_KEY_NAME, PAM_API_KEY_BUNDLE_NAME, ApiKeyLayout
+
+__all__ = [
+    'CompletionQueue', 'get_completion_queue', 'search', 'read_data', 'read_all', 'add_keys',
+    'lookup_payload', 'lookup_api_key',
+]
+
+_queues = weakref.WeakKeyDictionary()
+
+
+class CompletionQueue:
+    """ truenas_keyring.TNCompletionQueue bound to an asyncio event loop """
+
+    def __init__(self, loop: asyncio.AbstractEventLoop = None, workers: int = 2):
+        loop = loop or asyncio.get_running_loop()
+        # The loop references this queue through its reader. Keep only a weak reference
+        # back so that a queue cached per loop doesn't keep a discarded loop alive.
+        self._loop = weakref.ref(loop)
+        self._queue = truenas_keyring.create_completion_queue(workers=workers)
+        self._futures = {}
+        loop.add_reader(self._queue.fileno(), self._reap)
+
+    def _reap(self) -> None:
+        for token, result, error in self._queue.reap():
+            fut = self._futures.pop(token, None)
+            if fut is None or fut.done():
+                # Cancelled by the caller. The operation itself still ran.
+                continue
+
+            if error is None:
+                fut.set_result(result)
+            else:
+                fut.set_exception(error)
+
+    def _submit(self, submit_fn, **kwargs) -> asyncio.Future:
+        # Check the loop before the native job is queued, so that a job is never left
+        # running without a future to resolve.
+        loop = self._loop()
+        if loop is None or loop.is_closed():
+            raise RuntimeError('Event loop is closed')
+
+        fut = loop.create_future()
+        self._futures[submit_fn(**kwargs)] = fut
+        return fut
+
+    @property
+    def closed(self) -> bool:
+        return self._queue.closed
+
+    def close(self) -> None:
+        """ Stop the workers. Operations that haven't started fail with ECANCELED. """
+        if self._queue.closed:
+            return
+
+        loop = self._loop()
+        if loop is not None and not loop.is_closed():
+            loop.remove_reader(self._queue.fileno())
+        self._queue.close()
+        self._reap()
+
+    async def search(self, keyring, key_type: str, description: str):
+        return await self._submit(
+            self._queue.submit_search, keyring=keyring.key.serial, key_type=key_type,
+            description=description
+        )
+
+    async def read_data(self, key) -> bytes:
+        return await self._submit(self._queue.submit_read_data, serial=key.serial)
+
+    async def read_all(self, keyring, key_type: str = None) -> dict[str, bytes]:
+        return await self._submit(
+            self._queue.submit_read_all, keyring=keyring.key.serial, key_type=key_type
+        )
+
+    async def add_keys(
+        self, keyring, entries, key_type: str = truenas_keyring.KeyType.USER
+    ) -> list[int]:
+        return await self._submit(
+            self._queue.submit_add_keys, target_keyring=keyring.key.serial, entries=entries,
+            key_type=key_type
+        )
+
+    async def lookup_payload(
+        self, path: list[str], description: str, key_type: str = truenas_keyring.KeyType.USER,
+        root: int = None
+    ) -> bytes | None:
+        return await self._submit(
+            self._queue.submit_lookup_payload, path=path, description=description,
+            key_type=key_type, root=root
+        )
+
+
+def get_completion_queue() -> CompletionQueue:
+    """ Get the completion queue of the running event loop, creating it if needed """
+    loop = asyncio.get_running_loop()
+    queue = _queues.get(loop)
+    if queue is None or queue.closed:
+        queue = _queues[loop] = CompletionQueue(loop)
+
+    return queue
+
+
+async def search(keyring, key_type: str, description: str):
+    """ Awaitable TNKeyring.search() """
+    return await get_completion_queue().search(keyring, key_type, description)
+
+
+async def read_data(key) -> bytes:
+    """ Awaitable TNKey.read_data() """
+    return await get_completion_queue().read_data(key)
+
+
+async def read_all(keyring, key_type: str = None) -> dict[str, bytes]:
+    """ Awaitable TNKeyring.read_all() """
+    return await get_completion_queue().read_all(keyring, key_type)
+
+
+async def add_keys(keyring, entries, key_type: str = truenas_keyring.KeyType.USER) -> list[int]:
+    """ Awaitable truenas_keyring.add_keys() returning serial numbers """
+    return await get_completion_queue().add_keys(keyring, entries, key_type)
+
+
+async def lookup_payload(
+    path: list[str], description: str, key_type: str = truenas_keyring.KeyType.USER,
+    root: int = None
+) -> bytes | None:
+    """ Awaitable truenas_keyring.lookup_payload() """
+    return await get_completion_queue().lookup_payload(path, description, key_type, root)
+
+
+async def lookup_api_key(username: str, dbid: int) -> bytes | None:
+    """ Awaitable truenas_api_key.keyring.lookup_api_key() in the deployment's layout """
+    if api_keyring.get_default_layout() == ApiKeyLayout.PER_KEY:
+        return await lookup_payload([PAM_KEYRING_NAME, username, PAM_API_KEY_NAME], str(dbid))
+
+    bundle = await lookup_payload(
+        [PAM_KEYRING_NAME, username], PAM_API_KEY_BUNDLE_NAME, api_keyring.BUNDLE_KEY_TYPE
+    )
+    if bundle is None:
+        return None
+
+    return truenas_keyring.bundle_lookup(data=bundle, dbid=dbid)
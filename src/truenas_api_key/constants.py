@@ -4,6 +4,7 @@ from enum import StrEnum
 
 PAM_KEYRING_NAME = 'PAM_TRUENAS'
 PAM_API_KEY_NAME = 'API_KEYS'
+PAM_API_KEY_BUNDLE_NAME = 'API_KEYS_BUNDLE'
 
 
 class ApiKeyAlgorithm(StrEnum):
@@ -12,6 +13,14 @@ class ApiKeyAlgorithm(StrEnum):
     SHA512 = 'SHA512'
 
 
+class ApiKeyLayout(StrEnum):
+    """ How a user's API keys are stored in their keyring. PER_KEY stores each
+    API key as a separate key in the API_KEYS keyring. BUNDLE stores all of
+    them in a single indexed big_key named API_KEYS_BUNDLE. """
+    PER_KEY = 'PER_KEY'
+    BUNDLE = 'BUNDLE'
+
+
 @dataclass
 class UserApiKey:
     """ Data class for new API keys. This will be converted into kernel keyring entries. """
@@ -1,8 +1,12 @@
 import truenas_keyring
+from base64 import b64decode, b64encode
 from dataclasses import asdict
 from json import dumps, loads
 from datetime import datetime, timezone
-from .constants import PAM_KEYRING_NAME, PAM_API_KEY_NAME, UserApiKey
+from .constants import (
+    PAM_KEYRING_NAME, PAM_API_KEY_NAME, PAM_API_KEY_BUNDLE_NAME, ApiKeyAlgorithm, ApiKeyLayout,
+    UserApiKey
+)
 
 
 """
@@ -17,11 +21,8 @@ Below is a rough diagram of how these are organized:
       │   │   └── ...
       │   ├── SESSIONS/
       │   └── FAILLOG/
-      ├── username_2/
-      │   ├── API_KEYS/
-      │   │   ├── API Key (dbid: 456)
-      │   │   ├── API Key (dbid: 457)
-      │   │   └── ...
+      ├── username_2/  (ApiKeyLayout.BUNDLE)
+      │   ├── API_KEYS_BUNDLE (dbid: 456, 457, ...)
       │   ├── SESSIONS/
       │   └── FAILLOG/
       └── ...
@@ -31,73 +32,291 @@ calling into PAM will be running as UID 0 and therefore
 have a shared persistent keyring.
 """
 
+# Key type used for ApiKeyLayout.BUNDLE. big_key payloads may be up to 1 MiB.
+BUNDLE_KEY_TYPE = truenas_keyring.KeyType.BIG_KEY
 
-def get_pam_keyring():
-    persistent_keyring = truenas_keyring.get_persistent_keyring()
-    try:
-        pam_keyring = persistent_keyring.search(
-            key_type=truenas_keyring.KeyType.KEYRING,
-            description=PAM_KEYRING_NAME
-        )
-    except FileNotFoundError:
-        pam_keyring = truenas_keyring.add_keyring(
-            description=PAM_KEYRING_NAME,
-            target_keyring=persistent_keyring.key.serial
-        )
+# Maximum threads accepted by truenas_keyring.seal_payloads()
+SEAL_THREADS_MAX = 16
+
+# Layout used when none is specified. Chosen once per deployment, see set_default_layout().
+_default_layout = ApiKeyLayout.PER_KEY
+
+
+def set_default_layout(layout: ApiKeyLayout) -> None:
+    """ Select the layout that API keys are committed in and looked up from when no layout is
+    given. Lookups only check this layout, so after changing it every user's API keys should be
+    committed again (which migrates them, see commit_user_entry()). """
+    global _default_layout
+    _default_layout = ApiKeyLayout(layout)
 
-    return pam_keyring
+
+def get_default_layout() -> ApiKeyLayout:
+    return _default_layout
+
+
+def get_pam_keyring():
+    return truenas_keyring.resolve_path(path=[PAM_KEYRING_NAME], create=True)
 
 
 def get_user_keyring(username: str):
-    pam_keyring = get_pam_keyring()
+    return truenas_keyring.resolve_path(path=[PAM_KEYRING_NAME, username], create=True)
 
-    try:
-        user_ring = pam_keyring.search(
-            key_type=truenas_keyring.KeyType.KEYRING, description=username
-        )
-    except FileNotFoundError:
-        # most likely explanation is key ring doesn't exist
-        user_ring = truenas_keyring.add_keyring(
-            description=username,
-            target_keyring=pam_keyring.key.serial
+
+def get_api_keys_keyring(username: str):
+    return truenas_keyring.resolve_path(
+        path=[PAM_KEYRING_NAME, username, PAM_API_KEY_NAME], create=True
+    )
+
+
+def lookup_api_key(username: str, dbid: int, layout: ApiKeyLayout = None) -> bytes | None:
+    """ Return the encrypted payload of the specified API key, or None if it doesn't
+    exist. This is the authentication hot path: the keyring path is resolved, the key
+    searched for and its payload read in a single call without creating key objects.
+
+    If layout is None, the deployment's layout (see set_default_layout()) is used. Only that
+    layout is checked, so a miss costs the same as a hit. """
+    if (layout or _default_layout) == ApiKeyLayout.PER_KEY:
+        return truenas_keyring.lookup_payload(
+            path=[PAM_KEYRING_NAME, username, PAM_API_KEY_NAME],
+            description=str(dbid)
         )
 
-    return user_ring
+    bundle = truenas_keyring.lookup_payload(
+        path=[PAM_KEYRING_NAME, username],
+        description=PAM_API_KEY_BUNDLE_NAME,
+        key_type=BUNDLE_KEY_TYPE
+    )
+    if bundle is None:
+        return None
 
+    return truenas_keyring.bundle_lookup(data=bundle, dbid=dbid)
+
+
+def _find_bundle(user_keyring):
+    return user_keyring.try_search(key_type=BUNDLE_KEY_TYPE, description=PAM_API_KEY_BUNDLE_NAME)
+
+
+def _find_api_keys_ring(user_keyring):
+    return user_keyring.try_search(
+        key_type=truenas_keyring.KeyType.KEYRING, description=PAM_API_KEY_NAME
+    )
+
+
+def _read_layout(user_keyring, layout: ApiKeyLayout) -> dict[str, bytes]:
+    """ Return current encrypted payloads by description in the specified layout """
+    if layout == ApiKeyLayout.BUNDLE:
+        bundle = _find_bundle(user_keyring)
+        if bundle is None:
+            return {}
+
+        return {str(dbid): data for dbid, data in
+                truenas_keyring.unpack_bundle(bundle.read_data()).items()}
+
+    api_keys_ring = _find_api_keys_ring(user_keyring)
+    if api_keys_ring is None:
+        return {}
+
+    return api_keys_ring.read_all(key_type=truenas_keyring.KeyType.USER)
+
+
+def _remove_layout(user_keyring, layout: ApiKeyLayout) -> None:
+    if layout == ApiKeyLayout.BUNDLE:
+        old = _find_bundle(user_keyring)
+        serial = None if old is None else old.serial
+    else:
+        old = _find_api_keys_ring(user_keyring)
+        serial = None if old is None else old.key.serial
+
+    if serial is not None:
+        truenas_keyring.unlink_key(serial=serial, keyring=user_keyring.key.serial)
 
-def get_api_keys_keyring(username: str):
-    user_keyring = get_user_keyring(username)
 
-    try:
-        api_keys_ring = user_keyring.search(
-            key_type=truenas_keyring.KeyType.KEYRING, description=PAM_API_KEY_NAME
+def encode_api_key(entry: UserApiKey, binary: bool = False) -> str:
+    """ Encode an API key as the plaintext passed to encrypt_fn. By default this is JSON.
+    If binary is True, the key is packed into a compact binary record (see
+    truenas_keyring.pack_api_key()) which is base64 encoded, since encrypt_fn operates on
+    text. This shrinks the plaintext by about a quarter and avoids a JSON parse on read. """
+    if not binary:
+        return dumps(asdict(entry))
+
+    return b64encode(truenas_keyring.pack_api_key(
+        username=entry.username,
+        dbid=entry.dbid,
+        algorithm=entry.algorithm,
+        iterations=entry.iterations,
+        expiry=entry.expiry,
+        salt=b64decode(entry.salt),
+        server_key=b64decode(entry.server_key),
+        stored_key=b64decode(entry.stored_key)
+    )).decode()
+
+
+def _decode_record(plaintext: str) -> dict | truenas_keyring.ApiKeyRecord:
+    """ JSON entries are returned as a dict and binary entries as an ApiKeyRecord """
+    if plaintext.startswith('{'):
+        return loads(plaintext)
+
+    return truenas_keyring.unpack_api_key(b64decode(plaintext))
+
+
+def _record_to_dict(record: truenas_keyring.ApiKeyRecord) -> dict:
+    """ Convert a binary record into the same form as a JSON entry """
+    return {
+        'username': record.username,
+        'dbid': record.dbid,
+        'algorithm': record.algorithm,
+        'iterations': record.iterations,
+        'expiry': record.expiry,
+        'salt': b64encode(record.salt).decode(),
+        'server_key': b64encode(record.server_key).decode(),
+        'stored_key': b64encode(record.stored_key).decode(),
+    }
+
+
+def _check_owner(record: dict | truenas_keyring.ApiKeyRecord, username: str, dbid: int) -> None:
+    """ Payloads aren't bound to where they are stored, so a payload copied to another user or
+    dbid would still decrypt. Make sure that the record is the API key it was looked up as. """
+    if isinstance(record, dict):
+        owner = (record['username'], record['dbid'])
+    else:
+        owner = (record.username, record.dbid)
+
+    if owner != (username, int(dbid)):
+        raise ValueError(f'{username}: API key payload for {dbid} belongs to {owner[0]} ({owner[1]})')
+
+
+def decode_api_key(plaintext: str) -> UserApiKey:
+    """ Decode plaintext produced by encode_api_key(). The format is detected so that
+    entries written as JSON continue to be readable. """
+    record = _decode_record(plaintext)
+    if not isinstance(record, dict):
+        record = _record_to_dict(record)
+
+    return UserApiKey(**record)
+
+
+def verify_scram(
+    username: str,
+    dbid: int,
+    client_proof: bytes,
+    auth_message: bytes,
+    decrypt_fn: callable = None,
+    seal_key: bytes = None
+) -> bytes | None:
+    """ Verify a SCRAM-SHA-512 client proof for the specified API key. The key is read
+    with lookup_api_key() and decrypted with decrypt_fn (or seal_key, see
+    commit_user_entry()). Returns the ServerSignature to send to the client, or None if the
+    API key doesn't exist or the proof doesn't match. ValueError is raised if the stored
+    payload can't be decrypted or belongs to another user or API key.
+
+    With seal_key, binary entries are opened, decoded and verified in a single native call
+    with the GIL released (see truenas_keyring.scram_verify_sealed()), and so apart from
+    the lookup the GIL is only held to parse arguments. With decrypt_fn, or for JSON entries,
+    decrypting and decoding the entry run in python with the GIL held and only the proof
+    check itself is done in C. """
+    data = lookup_api_key(username, dbid)
+    if data is None:
+        return None
+
+    if seal_key is not None:
+        result = truenas_keyring.scram_verify_sealed(
+            key=seal_key,
+            payload=data,
+            username=username,
+            dbid=int(dbid),
+            client_proof=client_proof,
+            auth_message=auth_message
         )
-    except FileNotFoundError:
-        # API_KEYS keyring doesn't exist, create it
-        api_keys_ring = truenas_keyring.add_keyring(
-            description=PAM_API_KEY_NAME,
-            target_keyring=user_keyring.key.serial
+        if not isinstance(result, str):
+            return result
+
+        # Not a binary entry. The opened payload is verified below.
+        plaintext = result
+    else:
+        plaintext = _decrypt_batch([data], decrypt_fn, None, 1, strict=True)[0]
+
+    record = _decode_record(plaintext)
+    _check_owner(record, username, dbid)
+    if isinstance(record, dict):
+        if record['algorithm'] != ApiKeyAlgorithm.SHA512:
+            raise ValueError(f'{record["algorithm"]}: unsupported algorithm')
+
+        stored_key = b64decode(record['stored_key'])
+        server_key = b64decode(record['server_key'])
+    else:
+        # unpack_api_key() only accepts supported algorithms
+        stored_key = record.stored_key
+        server_key = record.server_key
+
+    return truenas_keyring.scram_verify(
+        stored_key=stored_key,
+        server_key=server_key,
+        client_proof=client_proof,
+        auth_message=auth_message
+    )
+
+
+def _encrypt_batch(
+    plaintexts: list[str],
+    encrypt_fn: callable,
+    seal_key: bytes | None,
+    threads: int
+) -> list[bytes]:
+    if seal_key is not None:
+        return truenas_keyring.seal_payloads(
+            key=seal_key, payloads=[p.encode() for p in plaintexts], threads=threads
         )
 
-    return api_keys_ring
+    return [encrypt_fn(p).encode() for p in plaintexts]
 
 
-def commit_user_entry(
-    username: str,
-    api_keys: list[UserApiKey],
-    encrypt_fn: callable
-) -> None:
-    """ Creates or replaces existing API keys in the user's API_KEYS keyring with new ones.
-    The API keys are encrypted with the specified encrypt_fn prior to insertion. """
-    api_keys_ring = get_api_keys_keyring(username)
-    # Clear out existing API_KEYS keyring. We'll replace with new entries
-    api_keys_ring.clear()
+def _decrypt_batch(
+    payloads: list[bytes],
+    decrypt_fn: callable,
+    seal_key: bytes | None,
+    threads: int,
+    strict: bool = False
+) -> list[str | None]:
+    """ Unreadable payloads are returned as None unless strict is set """
+    if not payloads:
+        return []
+
+    if seal_key is not None:
+        out = [None if p is None else p.decode() for p in truenas_keyring.open_payloads(
+            key=seal_key, payloads=payloads, threads=threads
+        )]
+        if strict and None in out:
+            raise ValueError('failed to decrypt API key payload')
 
+        return out
+
+    if decrypt_fn is None:
+        raise ValueError('decrypt_fn or seal_key is required')
+
+    if strict:
+        return [decrypt_fn(p.decode()) for p in payloads]
+
+    out = []
+    for data in payloads:
+        try:
+            out.append(decrypt_fn(data.decode()))
+        except Exception:
+            out.append(None)
+
+    return out
+
+
+def _pending_entries(api_keys: list[UserApiKey], binary: bool) -> list[tuple]:
+    """ Return (description, plaintext, timeout, expiry) for each API key that should be
+    in the keyring. Revoked and expired API keys are skipped. """
+    pending = []
     for entry in api_keys:
         # Skip revoked entries
         if entry.expiry == -1:
             continue
 
+        timeout_seconds = None
+
         # Skip expired entries
         if entry.expiry > 0:
             now = datetime.now(timezone.utc)
@@ -105,36 +324,242 @@ def commit_user_entry(
             if expiry_time <= now:
                 continue
 
-        key = truenas_keyring.add_key(
-            key_type=truenas_keyring.KeyType.USER,
-            description=str(entry.dbid),
-            data=encrypt_fn(dumps(asdict(entry))).encode(),
-            target_keyring=api_keys_ring.key.serial
+            # Apply timeout if expiry is set (> 0)
+            timeout_seconds = int((expiry_time - now).total_seconds())
+
+        pending.append((str(entry.dbid), encode_api_key(entry, binary), timeout_seconds,
+                        entry.expiry))
+
+    return pending
+
+
+def commit_user_entry(
+    username: str,
+    api_keys: list[UserApiKey],
+    encrypt_fn: callable = None,
+    decrypt_fn: callable = None,
+    binary: bool = False,
+    seal_key: bytes = None,
+    threads: int = 1,
+    layout: ApiKeyLayout = None
+) -> None:
+    """ Replaces the user's API_KEYS keyring with one containing api_keys.
+    The API keys are encrypted with the specified encrypt_fn prior to insertion.
+
+    When API keys are added or removed, the new API_KEYS keyring is built aside and then
+    swapped in place of the old one in a single operation so that concurrent PAM lookups see
+    either the complete old set of keys or the complete new one. When the existing payloads
+    can be compared and only some of them changed, those keys are instead updated in place
+    (see TNKeyring.reconcile()), which writes only the changed keys. Each update is atomic
+    and the set of keys doesn't change, so readers still never see a partial set.
+
+    Since encrypt_fn generally won't produce the same output twice, decrypt_fn may be
+    provided so that entries whose contents have not changed keep their existing payloads.
+    In this case committing an unchanged set of API keys costs a single read of the keyring
+    and no writes. Without decrypt_fn (or seal_key) the stored payloads can't be compared,
+    and so every commit rebuilds the keyring with one add_key() per API key even if nothing
+    changed. Callers that commit often should pass decrypt_fn.
+
+    If binary is True, API keys are stored in the compact binary format rather than as
+    JSON. See encode_api_key(). Readers accept either format.
+
+    As an alternative to encrypt_fn / decrypt_fn, a 32 byte seal_key may be supplied.
+    All payloads are then encrypted (and existing ones decrypted for comparison) with
+    AES-256-GCM in a single batch with the GIL released, spread over up to `threads`
+    threads. Readers must use the same seal_key.
+
+    If layout is None, the deployment's layout is used (see set_default_layout()).
+    If layout is ApiKeyLayout.BUNDLE, the API keys are instead packed into a single indexed
+    big_key (see truenas_keyring.pack_bundle()) which is written with one add_key(). Expiry
+    is then enforced by readers rather than by key timeouts. API keys stored in the other
+    layout are removed once the new set is in place, and so switching layout migrates the
+    user's keys. """
+    if encrypt_fn is None and seal_key is None:
+        raise ValueError('encrypt_fn or seal_key is required')
+
+    layout = layout or _default_layout
+    user_keyring = get_user_keyring(username)
+    current = {}
+
+    check_current = decrypt_fn is not None or seal_key is not None
+    if check_current:
+        current = _read_layout(user_keyring, layout)
+
+    pending = _pending_entries(api_keys, binary)
+
+    # Entries whose existing payload decrypts to the same plaintext are kept as-is.
+    existing = [(i, current[p[0]]) for i, p in enumerate(pending) if p[0] in current]
+    decrypted = _decrypt_batch([data for _, data in existing], decrypt_fn, seal_key, threads)
+    payloads = [None] * len(pending)
+    for (i, data), plaintext in zip(existing, decrypted):
+        if plaintext == pending[i][1]:
+            payloads[i] = data
+
+    unchanged = len(pending) - payloads.count(None)
+    other_layout = ApiKeyLayout.PER_KEY if layout == ApiKeyLayout.BUNDLE else ApiKeyLayout.BUNDLE
+    if check_current and unchanged == len(pending) == len(current):
+        # Keyring already contains exactly these API keys
+        _remove_layout(user_keyring, other_layout)
+        return
+
+    changed = [i for i, data in enumerate(payloads) if data is None]
+    sealed = _encrypt_batch([pending[i][1] for i in changed], encrypt_fn, seal_key, threads)
+    for i, data in zip(changed, sealed):
+        payloads[i] = data
+
+    if layout == ApiKeyLayout.BUNDLE:
+        truenas_keyring.add_key(
+            key_type=BUNDLE_KEY_TYPE,
+            description=PAM_API_KEY_BUNDLE_NAME,
+            data=truenas_keyring.pack_bundle(entries=[
+                (int(desc), data, expiry) for (desc, _, _, expiry), data in zip(pending, payloads)
+            ]),
+            target_keyring=user_keyring.key.serial
         )
+    else:
+        entries = [(desc, data, timeout) for (desc, _, timeout, _), data in zip(pending, payloads)]
+        api_keys_ring = None
+        if check_current and current.keys() == {desc for desc, _, _ in entries}:
+            api_keys_ring = _find_api_keys_ring(user_keyring)
 
-        # Apply timeout if expiry is set (> 0)
-        if entry.expiry > 0:
-            timeout_seconds = int((expiry_time - now).total_seconds())
-            key.set_timeout(timeout=timeout_seconds)
+        if api_keys_ring is not None:
+            api_keys_ring.reconcile(entries=entries)
+        else:
+            truenas_keyring.swap_keyring(
+                target_keyring=user_keyring.key.serial,
+                description=PAM_API_KEY_NAME,
+                entries=entries
+            )
+
+    _remove_layout(user_keyring, other_layout)
+
+
+def commit_many(
+    entries: dict[str, list[UserApiKey]],
+    encrypt_fn: callable = None,
+    binary: bool = False,
+    seal_key: bytes = None,
+    workers: int = 1
+) -> dict[str, Exception | None]:
+    """ Commit the API keys of many users at once, e.g. at boot or after a database restore.
+    Each user's API_KEYS keyring is replaced as commit_user_entry() does with the per-key
+    layout, but the keyring work for all users is spread over `workers` native threads with
+    the GIL released (see truenas_keyring.commit_keyrings()). If seal_key is given, the
+    payloads of all users are encrypted in a single batch over the same number of threads.
+
+    Existing payloads are not compared, so every keyring is rewritten, and any bundle left
+    over from ApiKeyLayout.BUNDLE is removed. Returns None for each user that was committed
+    and the exception for each user that wasn't. Only available when the deployment's
+    layout is ApiKeyLayout.PER_KEY. """
+    if encrypt_fn is None and seal_key is None:
+        raise ValueError('encrypt_fn or seal_key is required')
+
+    if _default_layout != ApiKeyLayout.PER_KEY:
+        raise ValueError('commit_many() requires the ApiKeyLayout.PER_KEY layout')
+
+    pending = {username: _pending_entries(api_keys, binary) for username, api_keys in entries.items()}
+    sealed = iter(_encrypt_batch(
+        [plaintext for user_pending in pending.values() for _, plaintext, _, _ in user_pending],
+        encrypt_fn, seal_key, min(workers, SEAL_THREADS_MAX)
+    ))
 
+    results = truenas_keyring.commit_keyrings(
+        path=[PAM_KEYRING_NAME],
+        description=PAM_API_KEY_NAME,
+        entries={
+            username: [(desc, next(sealed), timeout) for desc, _, timeout, _ in user_pending]
+            for username, user_pending in pending.items()
+        },
+        unlink=[(BUNDLE_KEY_TYPE, PAM_API_KEY_BUNDLE_NAME)],
+        workers=workers
+    )
 
-def clear_all_api_keys() -> None:
-    """ Clear out all user api keys in the PAM_TRUENAS keyring """
-    pam_keyring = get_pam_keyring()
+    return {username: None if isinstance(res, int) else res for username, res in results.items()}
+
+
+class CommitQueue:
+    """ Write-behind commits of users' API keys. submit() encrypts the API keys and queues
+    them, and a native writer thread applies them as commit_user_entry() does with the
+    per-key layout. Commits for a user that is already queued replace the queued keys, so a
+    burst of updates to one user's API keys results in a single rebuild of their keyring.
+    Each commit waits `delay` seconds before being applied to give bursts time to coalesce.
+
+    As with commit_many(), existing payloads are not compared, and any bundle left over from
+    ApiKeyLayout.BUNDLE is removed. Failures are reported by errors(). Closing the queue
+    applies any commits still queued. Only available when the deployment's layout is
+    ApiKeyLayout.PER_KEY. See truenas_keyring.create_commit_queue(). """
+
+    def __init__(
+        self,
+        encrypt_fn: callable = None,
+        binary: bool = False,
+        seal_key: bytes = None,
+        delay: float = 0.1
+    ):
+        if encrypt_fn is None and seal_key is None:
+            raise ValueError('encrypt_fn or seal_key is required')
+
+        if _default_layout != ApiKeyLayout.PER_KEY:
+            raise ValueError('CommitQueue requires the ApiKeyLayout.PER_KEY layout')
+
+        self._encrypt_fn = encrypt_fn
+        self._binary = binary
+        self._seal_key = seal_key
+        self._queue = truenas_keyring.create_commit_queue(
+            path=[PAM_KEYRING_NAME],
+            description=PAM_API_KEY_NAME,
+            unlink=[(BUNDLE_KEY_TYPE, PAM_API_KEY_BUNDLE_NAME)],
+            delay=delay
+        )
 
-    # Iterate through all user keyrings (unlink expired/revoked while iterating)
-    for item in pam_keyring.iter_keyring_contents(unlink_expired=True, unlink_revoked=True):
-        # Check if this is a keyring (user keyring)
-        if item.key.key_type == "keyring":
-            # For each user keyring, try to get and clear their API_KEYS sub-keyring
-            try:
-                api_keys_ring = item.search(
-                    key_type=truenas_keyring.KeyType.KEYRING, description=PAM_API_KEY_NAME
-                )
-                api_keys_ring.clear()
-            except FileNotFoundError:
-                # No API_KEYS keyring for this user, skip
-                pass
+    def submit(self, username: str, api_keys: list[UserApiKey]) -> bool:
+        """ Queue replacing the user's API keys. Returns True if coalesced with a queued commit """
+        pending = _pending_entries(api_keys, self._binary)
+        sealed = _encrypt_batch([p[1] for p in pending], self._encrypt_fn, self._seal_key, 1)
+        return self._queue.submit(name=username, entries=[
+            (desc, data, timeout) for (desc, _, timeout, _), data in zip(pending, sealed)
+        ])
+
+    def flush(self, timeout: float = None) -> bool:
+        """ Wait for queued commits to be applied. Returns False if timeout expired first """
+        return self._queue.flush(timeout=timeout)
+
+    @property
+    def pending(self) -> int:
+        """ Number of commits queued and not yet started """
+        return self._queue.pending
+
+    def stats(self, reset: bool = False) -> dict[str, int]:
+        return self._queue.get_stats(reset=reset)
+
+    def errors(self) -> dict[str, Exception]:
+        """ Return and forget the most recent failure for each user whose commit failed """
+        return self._queue.pop_errors()
+
+    def close(self) -> None:
+        self._queue.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+
+def clear_all_api_keys(workers: int = 1) -> None:
+    """ Clear out all user api keys in the PAM_TRUENAS keyring. The API_KEYS keyrings of
+    all users are cleared (and any bundles removed) by up to `workers` native threads
+    with the GIL released. See truenas_keyring.clear_descendants(). """
+    results = truenas_keyring.clear_descendants(
+        root=get_pam_keyring().key.serial,
+        child_description=PAM_API_KEY_NAME,
+        unlink=[(BUNDLE_KEY_TYPE, PAM_API_KEY_BUNDLE_NAME)],
+        workers=workers
+    )
+
+    if results['errors']:
+        # Report the first failure, the remaining users have been cleared
+        raise next(iter(results['errors'].values()))
 
 
 def clear_user_keyring(username: str) -> None:
@@ -142,16 +567,35 @@ def clear_user_keyring(username: str) -> None:
     api_keys_ring = get_api_keys_keyring(username)
     # Clear out existing API_KEYS keyring
     api_keys_ring.clear()
+    _remove_layout(get_user_keyring(username), ApiKeyLayout.BUNDLE)
 
 
-def dump_user_keyring(username: str, decrypt_fn: callable) -> list:
+def dump_user_keyring(
+    username: str,
+    decrypt_fn: callable = None,
+    seal_key: bytes = None,
+    threads: int = 1
+) -> list:
     """ dump user API key keyring contents. The API keys are
-    decrypted with the specified decrypt_fn after read. """
-    api_keys_ring = get_api_keys_keyring(username)
+    decrypted with the specified decrypt_fn after read, or in a single
+    batch with seal_key (see commit_user_entry()). Either layout is read. """
     out = []
 
-    for entry in api_keys_ring.list_keyring_contents(unlink_expired=True, unlink_revoked=True):
-        data = entry.read_data()
-        out.append(loads(decrypt_fn(data.decode())))
+    bundle = _find_bundle(get_user_keyring(username))
+    if bundle is not None:
+        payloads = truenas_keyring.unpack_bundle(bundle.read_data())
+    else:
+        payloads = get_api_keys_keyring(username).read_all(
+            key_type=truenas_keyring.KeyType.USER, unlink_expired=True, unlink_revoked=True
+        )
+
+    plaintexts = _decrypt_batch(list(payloads.values()), decrypt_fn, seal_key, threads, strict=True)
+    for dbid, plaintext in zip(payloads, plaintexts):
+        record = _decode_record(plaintext)
+        _check_owner(record, username, dbid)
+        if not isinstance(record, dict):
+            record = _record_to_dict(record)
+
+        out.append(record)
 
     return out
@@ -126,6 +126,7 @@ tn_revoke_key(PyObject *module_obj, PyObject *args, PyObject *kwargs)
 
 	Py_BEGIN_ALLOW_THREADS
 	result = keyctl_revoke(serial);
+	key_cache_flush();
 	Py_END_ALLOW_THREADS
 
 	if (result == -1) {
@@ -172,6 +173,7 @@ tn_invalidate_key(PyObject *module_obj, PyObject *args, PyObject *kwargs)
 
 	Py_BEGIN_ALLOW_THREADS
 	result = keyctl_invalidate(serial);
+	key_cache_flush();
 	Py_END_ALLOW_THREADS
 
 	if (result == -1) {
@@ -294,7 +296,7 @@ tn_add_key(PyObject *module_obj, PyObject *args, PyObject *kwargs)
 	}
 
 	Py_BEGIN_ALLOW_THREADS
-	serial = add_key(key_type_str, description_str, data_buf, data_len, target_keyring);
+	serial = tn_sys_add_key(key_type_str, description_str, data_buf, data_len, target_keyring);
 	Py_END_ALLOW_THREADS
 
 	if (serial == -1) {
@@ -348,7 +350,7 @@ tn_add_keyring(PyObject *module_obj, PyObject *args, PyObject *kwargs)
 	}
 
 	Py_BEGIN_ALLOW_THREADS
-	serial = add_key(KEY_TYPE_STR_KEYRING, description_str, NULL, 0, target_keyring);
+	serial = tn_sys_add_key(KEY_TYPE_STR_KEYRING, description_str, NULL, 0, target_keyring);
 	Py_END_ALLOW_THREADS
 
 	if (serial == -1) {
@@ -361,6 +363,2245 @@ tn_add_keyring(PyObject *module_obj, PyObject *args, PyObject *kwargs)
 	return keyring_instance;
 }
 
+PyDoc_STRVAR(tn_add_keys__doc__,
+"add_keys(*, target_keyring, entries, key_type=KeyType.USER, objects=False)\n"
+"    -> list[int] | list[truenas_keyring.TNKey]\n"
+"------------------------------------------------------------------------\n\n"
+"Add multiple keys to the specified keyring and apply their timeouts\n"
+"in a single call with the GIL released.\n"
+"See man (2) add_key and man (3) keyctl_set_timeout for more information.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"target_keyring: int, required\n"
+"    The serial number of the keyring to add the keys to.\n\n"
+"entries: Iterable[tuple[str, bytes, int | None]], required\n"
+"    (description, data, timeout) for each key. timeout is in seconds\n"
+"    from now. If timeout is None then the expiry of the key is left\n"
+"    untouched.\n\n"
+"key_type: str, optional\n"
+"    The type of keys to create (e.g., \"user\", \"logon\"). Cannot be \"keyring\".\n"
+"    Default: truenas_keyring.KeyType.USER.\n\n"
+"objects: bool, optional\n"
+"    If True, return TNKey objects for the new keys rather than serials.\n"
+"    Default: False.\n\n"
+""
+"Returns\n"
+"-------\n"
+"list[int] | list[truenas_keyring.TNKey]\n"
+"    Serial numbers (or key objects) of the added keys in the order of entries.\n\n"
+""
+"Raises\n"
+"------\n"
+"TypeError:\n"
+"    Invalid parameter type.\n"
+"ValueError:\n"
+"    Missing required parameter, \"keyring\" key type or invalid timeout specified.\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details). Keys preceding the failed\n"
+"    entry remain in the target keyring.\n\n"
+);
+
+static PyObject *
+tn_add_keys(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"target_keyring", "entries", "key_type", "objects", NULL};
+	int target_keyring = 0;
+	PyObject *entries_obj = NULL;
+	const char *key_type_str = KEY_TYPE_STR_USER;
+	int objects = false;
+	PyObject *entries_fast = NULL;
+	tn_add_entry_t *entries = NULL;
+	size_t i, cnt, done;
+	PyObject *out = NULL;
+	bool success;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$iOsp:add_keys",
+					 kwlist, &target_keyring, &entries_obj,
+					 &key_type_str, &objects)) {
+		return NULL;
+	}
+
+	/* 0 is never a valid key serial */
+	if (target_keyring == 0) {
+		PyErr_SetString(PyExc_ValueError, "target_keyring argument is required");
+		return NULL;
+	}
+
+	if (entries_obj == NULL) {
+		PyErr_SetString(PyExc_ValueError, "entries argument is required");
+		return NULL;
+	}
+
+	if (strcmp(key_type_str, KEY_TYPE_STR_KEYRING) == 0) {
+		PyErr_SetString(PyExc_ValueError, "Cannot create keyring with add_keys, use add_keyring instead");
+		return NULL;
+	}
+
+	if (!parse_add_entries(entries_obj, &entries_fast, &entries, &cnt)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	success = add_key_entries(key_type_str, target_keyring, entries, cnt, &done);
+	Py_END_ALLOW_THREADS
+
+	if (!success) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		goto out;
+	}
+
+	out = PyList_New(cnt);
+	if (out == NULL) {
+		goto out;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *item;
+
+		if (objects) {
+			item = create_key_object_from_serial(entries[i].serial, module_obj);
+		} else {
+			item = PyLong_FromLong(entries[i].serial);
+		}
+
+		if (item == NULL) {
+			Py_CLEAR(out);
+			goto out;
+		}
+		PyList_SET_ITEM(out, i, item);
+	}
+
+out:
+	PyMem_RawFree(entries);
+	Py_DECREF(entries_fast);
+	return out;
+}
+
+PyDoc_STRVAR(tn_scram_verify__doc__,
+"scram_verify(*, stored_key, server_key, client_proof, auth_message) -> bytes | None\n"
+"----------------------------------------------------------------------------------\n\n"
+"Verify a SCRAM-SHA-512 client proof (RFC 5802, RFC 7677) against the\n"
+"stored credentials for an API key. The computation runs with the GIL\n"
+"released and the proof is compared in constant time.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"stored_key: bytes, required\n"
+"    The SCRAM StoredKey (64 bytes).\n\n"
+"server_key: bytes, required\n"
+"    The SCRAM ServerKey (64 bytes).\n\n"
+"client_proof: bytes, required\n"
+"    The ClientProof sent by the client (64 bytes).\n\n"
+"auth_message: bytes, required\n"
+"    The AuthMessage for the exchange.\n\n"
+""
+"Returns\n"
+"-------\n"
+"bytes | None\n"
+"    The ServerSignature to send to the client, or None if the proof\n"
+"    does not match.\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Missing parameter or key / proof of the wrong length.\n"
+"truenas_keyring.KeyringError:\n"
+"    libcrypto failure.\n\n"
+);
+
+static PyObject *
+tn_scram_verify(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"stored_key", "server_key", "client_proof", "auth_message", NULL};
+	Py_buffer stored = { 0 }, server = { 0 }, proof = { 0 }, msg = { 0 };
+	unsigned char keys[3][TN_SCRAM_KEY_LEN];
+	unsigned char server_sig[TN_SCRAM_KEY_LEN];
+	unsigned char *auth_message = NULL;
+	size_t auth_message_len;
+	PyObject *out = NULL;
+	bool match;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$y*y*y*y*:scram_verify",
+					 kwlist, &stored, &server, &proof, &msg)) {
+		return NULL;
+	}
+
+	if ((stored.buf == NULL) || (server.buf == NULL) ||
+	    (proof.buf == NULL) || (msg.buf == NULL)) {
+		PyErr_SetString(PyExc_ValueError,
+				"stored_key, server_key, client_proof and auth_message "
+				"arguments are required");
+		goto out;
+	}
+
+	if ((stored.len != TN_SCRAM_KEY_LEN) || (server.len != TN_SCRAM_KEY_LEN) ||
+	    (proof.len != TN_SCRAM_KEY_LEN)) {
+		PyErr_Format(PyExc_ValueError,
+			     "stored_key, server_key and client_proof must be %d bytes",
+			     TN_SCRAM_KEY_LEN);
+		goto out;
+	}
+
+	/* Copy inputs so that they can't change while the GIL is released */
+	auth_message_len = (size_t)msg.len;
+	auth_message = PyMem_RawMalloc(auth_message_len ? auth_message_len : 1);
+	if (auth_message == NULL) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	memcpy(auth_message, msg.buf, auth_message_len);
+	memcpy(keys[0], stored.buf, TN_SCRAM_KEY_LEN);
+	memcpy(keys[1], server.buf, TN_SCRAM_KEY_LEN);
+	memcpy(keys[2], proof.buf, TN_SCRAM_KEY_LEN);
+
+	Py_BEGIN_ALLOW_THREADS
+	match = scram_verify_proof(keys[0], keys[1], keys[2], auth_message,
+				   auth_message_len, server_sig);
+	Py_END_ALLOW_THREADS
+
+	if (match) {
+		out = PyBytes_FromStringAndSize((char *)server_sig, TN_SCRAM_KEY_LEN);
+	} else if (errno) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+	} else {
+		out = Py_NewRef(Py_None);
+	}
+
+	explicit_bzero(keys, sizeof(keys));
+	explicit_bzero(server_sig, sizeof(server_sig));
+out:
+	PyMem_RawFree(auth_message);
+	PyBuffer_Release(&stored);
+	PyBuffer_Release(&server);
+	PyBuffer_Release(&proof);
+	PyBuffer_Release(&msg);
+	return out;
+}
+
+PyDoc_STRVAR(tn_scram_verify_sealed__doc__,
+"scram_verify_sealed(*, key, payload, username, dbid, client_proof,\n"
+"                    auth_message) -> bytes | str | None\n"
+"-----------------------------------------------------------------\n\n"
+"Open an API key payload sealed by seal_payloads(), decode the binary API\n"
+"key record within it and verify a SCRAM-SHA-512 client proof against it.\n"
+"The payload is opened, decoded and verified in one pass with the GIL\n"
+"released, and the decrypted record never becomes a python object.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"key: bytes, required\n"
+"    The 32 byte AES-256 key the payload was sealed with.\n\n"
+"payload: bytes, required\n"
+"    Sealed payload as returned by seal_payloads().\n\n"
+"username: str, required\n"
+"    Name of the user the API key must belong to.\n\n"
+"dbid: int, required\n"
+"    Datastore primary key the API key must have.\n\n"
+"client_proof: bytes, required\n"
+"    The ClientProof sent by the client (64 bytes).\n\n"
+"auth_message: bytes, required\n"
+"    The AuthMessage for the exchange.\n\n"
+""
+"Returns\n"
+"-------\n"
+"bytes | str | None\n"
+"    The ServerSignature to send to the client, or None if the proof\n"
+"    does not match. If the payload holds something other than a binary\n"
+"    API key record (e.g. a JSON entry) the opened payload is returned as\n"
+"    str so that the caller can verify it.\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Missing parameter, key / proof of the wrong length, a payload that\n"
+"    fails to open or holds a corrupt record, or a record belonging to\n"
+"    another user or API key.\n"
+"truenas_keyring.KeyringError:\n"
+"    libcrypto failure.\n\n"
+);
+
+static PyObject *
+tn_scram_verify_sealed(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {
+		"key", "payload", "username", "dbid", "client_proof", "auth_message", NULL
+	};
+	Py_buffer key = { 0 }, payload = { 0 }, proof = { 0 }, msg = { 0 };
+	unsigned char key_copy[TN_SEAL_KEY_LEN];
+	unsigned char proof_copy[TN_SCRAM_KEY_LEN];
+	tn_scram_sealed_t req = { 0 };
+	enum tn_scram_sealed_status status;
+	const char *username = NULL;
+	Py_ssize_t username_len = 0;
+	long long dbid = LLONG_MIN;
+	unsigned char *buf = NULL;
+	size_t buf_len;
+	PyObject *out = NULL;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$y*y*s#Ly*y*:scram_verify_sealed",
+					 kwlist, &key, &payload, &username, &username_len,
+					 &dbid, &proof, &msg)) {
+		return NULL;
+	}
+
+	if ((key.buf == NULL) || (payload.buf == NULL) || (username == NULL) ||
+	    (dbid == LLONG_MIN) || (proof.buf == NULL) || (msg.buf == NULL)) {
+		PyErr_SetString(PyExc_ValueError,
+				"key, payload, username, dbid, client_proof and "
+				"auth_message arguments are required");
+		goto out;
+	}
+
+	if (key.len != TN_SEAL_KEY_LEN) {
+		PyErr_Format(PyExc_ValueError, "key must be %d bytes", TN_SEAL_KEY_LEN);
+		goto out;
+	}
+
+	if (proof.len != TN_SCRAM_KEY_LEN) {
+		PyErr_Format(PyExc_ValueError, "client_proof must be %d bytes", TN_SCRAM_KEY_LEN);
+		goto out;
+	}
+
+	/*
+	 * Copy inputs so that they can't change while the GIL is released. One
+	 * allocation holds the payload, username, auth message and plaintext.
+	 */
+	buf_len = (2 * (size_t)payload.len) + (size_t)username_len + (size_t)msg.len;
+	buf = PyMem_RawMalloc(buf_len ? buf_len : 1);
+	if (buf == NULL) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	memcpy(key_copy, key.buf, TN_SEAL_KEY_LEN);
+	memcpy(proof_copy, proof.buf, TN_SCRAM_KEY_LEN);
+	memcpy(buf, payload.buf, payload.len);
+	memcpy(buf + payload.len, username, username_len);
+	memcpy(buf + payload.len + username_len, msg.buf, msg.len);
+
+	req = (tn_scram_sealed_t) {
+		.key = key_copy,
+		.payload = buf,
+		.payload_len = (size_t)payload.len,
+		.username = (const char *)buf + payload.len,
+		.username_len = (size_t)username_len,
+		.dbid = (int64_t)dbid,
+		.client_proof = proof_copy,
+		.auth_message = buf + payload.len + username_len,
+		.auth_message_len = (size_t)msg.len,
+		.plaintext = buf + payload.len + username_len + msg.len,
+	};
+
+	Py_BEGIN_ALLOW_THREADS
+	status = scram_verify_sealed(&req);
+	Py_END_ALLOW_THREADS
+
+	switch (status) {
+	case TN_SCRAM_SEALED_MATCH:
+		out = PyBytes_FromStringAndSize((char *)req.server_sig, TN_SCRAM_KEY_LEN);
+		break;
+	case TN_SCRAM_SEALED_NO_MATCH:
+		out = Py_NewRef(Py_None);
+		break;
+	case TN_SCRAM_SEALED_TEXT:
+		out = PyUnicode_DecodeUTF8((const char *)req.plaintext, req.plaintext_len, NULL);
+		explicit_bzero(req.plaintext, req.plaintext_len);
+		break;
+	case TN_SCRAM_SEALED_UNREADABLE:
+		PyErr_SetString(PyExc_ValueError, "failed to decrypt API key payload");
+		break;
+	case TN_SCRAM_SEALED_CORRUPT:
+		PyErr_SetString(PyExc_ValueError, "API key record is truncated or corrupt");
+		break;
+	case TN_SCRAM_SEALED_WRONG_OWNER:
+		PyErr_Format(PyExc_ValueError, "%s: API key payload for %lld belongs to "
+			     "another user or API key", username, dbid);
+		break;
+	case TN_SCRAM_SEALED_ERROR:
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		break;
+	}
+
+	explicit_bzero(key_copy, sizeof(key_copy));
+	explicit_bzero(req.server_sig, sizeof(req.server_sig));
+out:
+	PyMem_RawFree(buf);
+	PyBuffer_Release(&key);
+	PyBuffer_Release(&payload);
+	PyBuffer_Release(&proof);
+	PyBuffer_Release(&msg);
+	return out;
+}
+
+PyDoc_STRVAR(tn_pack_api_key__doc__,
+"pack_api_key(*, username, dbid, algorithm, iterations, expiry, salt,\n"
+"             server_key, stored_key) -> bytes\n"
+"-------------------------------------------------------------------\n\n"
+"Encode an API key as a compact versioned binary record. Salt and SCRAM\n"
+"keys are stored as raw bytes rather than base64 text.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"username: str, required\n"
+"    Name of the user.\n\n"
+"dbid: int, required\n"
+"    Datastore primary key of the API key.\n\n"
+"algorithm: str, required\n"
+"    Crypto algorithm used for auth. Currently only \"SHA512\".\n\n"
+"iterations: int, required\n"
+"    Number of pbkdf2_hmac iterations.\n\n"
+"expiry: int, required\n"
+"    Unix timestamp when the API key expires, zero for never.\n\n"
+"salt: bytes, required\n"
+"    Cryptographic salt.\n\n"
+"server_key: bytes, required\n"
+"    SCRAM ServerKey.\n\n"
+"stored_key: bytes, required\n"
+"    SCRAM StoredKey.\n\n"
+""
+"Returns\n"
+"-------\n"
+"bytes\n"
+"    Encoded record. See unpack_api_key().\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Missing parameter, unsupported algorithm or value out of range.\n"
+);
+
+static PyObject *
+tn_pack_api_key(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {
+		"username", "dbid", "algorithm", "iterations", "expiry",
+		"salt", "server_key", "stored_key", NULL
+	};
+	Py_buffer salt = { 0 }, server = { 0 }, stored = { 0 };
+	const char *username = NULL, *algorithm = NULL;
+	Py_ssize_t username_len = 0;
+	long long dbid = LLONG_MIN, expiry = LLONG_MIN, iterations = -1;
+	tn_api_key_record_t rec = { 0 };
+	PyObject *out = NULL;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$s#LsLLy*y*y*:pack_api_key",
+					 kwlist, &username, &username_len, &dbid,
+					 &algorithm, &iterations, &expiry,
+					 &salt, &server, &stored)) {
+		return NULL;
+	}
+
+	if ((username == NULL) || (algorithm == NULL) || (dbid == LLONG_MIN) ||
+	    (expiry == LLONG_MIN) || (iterations == -1) || (salt.buf == NULL) ||
+	    (server.buf == NULL) || (stored.buf == NULL)) {
+		PyErr_SetString(PyExc_ValueError,
+				"username, dbid, algorithm, iterations, expiry, salt, "
+				"server_key and stored_key arguments are required");
+		goto out;
+	}
+
+	if (!api_key_alg_from_name(algorithm, &rec.algorithm)) {
+		PyErr_Format(PyExc_ValueError, "%s: unsupported algorithm", algorithm);
+		goto out;
+	}
+
+	if ((iterations < 0) || (iterations > UINT32_MAX)) {
+		PyErr_Format(PyExc_ValueError, "%lld: iterations out of range", iterations);
+		goto out;
+	}
+
+	if ((username_len > TN_API_KEY_FIELD_MAX) || (salt.len > TN_API_KEY_FIELD_MAX) ||
+	    (server.len > TN_API_KEY_FIELD_MAX) || (stored.len > TN_API_KEY_FIELD_MAX)) {
+		PyErr_Format(PyExc_ValueError, "fields may not exceed %d bytes",
+			     TN_API_KEY_FIELD_MAX);
+		goto out;
+	}
+
+	rec.username = (tn_api_key_field_t){ username, (size_t)username_len };
+	rec.dbid = dbid;
+	rec.iterations = (uint32_t)iterations;
+	rec.expiry = expiry;
+	rec.salt = (tn_api_key_field_t){ salt.buf, (size_t)salt.len };
+	rec.server_key = (tn_api_key_field_t){ server.buf, (size_t)server.len };
+	rec.stored_key = (tn_api_key_field_t){ stored.buf, (size_t)stored.len };
+
+	out = api_key_record_pack(&rec);
+
+out:
+	PyBuffer_Release(&salt);
+	PyBuffer_Release(&server);
+	PyBuffer_Release(&stored);
+	return out;
+}
+
+PyDoc_STRVAR(tn_unpack_api_key__doc__,
+"unpack_api_key(data) -> truenas_keyring.ApiKeyRecord\n"
+"----------------------------------------------------\n\n"
+"Decode an API key record produced by pack_api_key().\n\n"
+""
+"Parameters\n"
+"----------\n"
+"data: bytes, required\n"
+"    Encoded record.\n\n"
+""
+"Returns\n"
+"-------\n"
+"truenas_keyring.ApiKeyRecord\n"
+"    Record with fields in the same order as\n"
+"    truenas_api_key.constants.UserApiKey. salt, server_key and stored_key\n"
+"    are raw bytes.\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    data is not a valid record or uses an unsupported version.\n"
+);
+
+static PyObject *
+tn_unpack_api_key(PyObject *module_obj, PyObject *arg)
+{
+	Py_buffer data;
+	PyObject *out;
+
+	if (PyObject_GetBuffer(arg, &data, PyBUF_SIMPLE) < 0) {
+		return NULL;
+	}
+
+	out = api_key_record_unpack(module_obj, data.buf, (size_t)data.len);
+	PyBuffer_Release(&data);
+	return out;
+}
+
+PyDoc_STRVAR(tn_seal_payloads__doc__,
+"seal_payloads(*, key, payloads, threads=1) -> list[bytes]\n"
+"---------------------------------------------------------\n\n"
+"Encrypt a batch of payloads with AES-256-GCM. Each payload gets a random\n"
+"nonce and the output is a version byte, the nonce, the ciphertext and the\n"
+"authentication tag. The work runs with the GIL released and may be\n"
+"spread across several threads for large batches.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"key: bytes, required\n"
+"    The 32 byte AES-256 key to use for the whole batch.\n\n"
+"payloads: sequence[bytes], required\n"
+"    Payloads to encrypt.\n\n"
+"threads: int, optional, default=1\n"
+"    Maximum number of threads to use. Small batches use fewer.\n\n"
+""
+"Returns\n"
+"-------\n"
+"list[bytes]\n"
+"    Sealed payloads in the same order as payloads.\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Missing parameter, wrong key length or invalid thread count.\n"
+"TypeError:\n"
+"    A payload is not bytes.\n"
+"truenas_keyring.KeyringError:\n"
+"    libcrypto failure.\n\n"
+);
+
+PyDoc_STRVAR(tn_open_payloads__doc__,
+"open_payloads(*, key, payloads, threads=1) -> list[bytes | None]\n"
+"----------------------------------------------------------------\n\n"
+"Decrypt a batch of payloads produced by seal_payloads(). The work runs\n"
+"with the GIL released and may be spread across several threads for\n"
+"large batches.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"key: bytes, required\n"
+"    The 32 byte AES-256 key to use for the whole batch.\n\n"
+"payloads: sequence[bytes], required\n"
+"    Sealed payloads to decrypt.\n\n"
+"threads: int, optional, default=1\n"
+"    Maximum number of threads to use. Small batches use fewer.\n\n"
+""
+"Returns\n"
+"-------\n"
+"list[bytes | None]\n"
+"    Decrypted payloads in the same order as payloads. None is returned\n"
+"    for payloads that are malformed or fail authentication.\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Missing parameter, wrong key length or invalid thread count.\n"
+"TypeError:\n"
+"    A payload is not bytes.\n"
+"truenas_keyring.KeyringError:\n"
+"    libcrypto failure.\n\n"
+);
+
+static PyObject *
+tn_seal_common(PyObject *module_obj, PyObject *args, PyObject *kwargs, bool decrypt)
+{
+	char * const kwlist[] = {"key", "payloads", "threads", NULL};
+	Py_buffer key = { 0 };
+	PyObject *payloads = NULL, *items_tuple = NULL, *out = NULL;
+	unsigned char key_copy[TN_SEAL_KEY_LEN];
+	tn_seal_item_t *items = NULL;
+	unsigned char *blob = NULL;
+	size_t blob_len = 0, offset = 0;
+	Py_ssize_t i, cnt;
+	int threads = 1;
+	bool success;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+					 decrypt ? "|$y*Oi:open_payloads" : "|$y*Oi:seal_payloads",
+					 kwlist, &key, &payloads, &threads)) {
+		return NULL;
+	}
+
+	if ((key.buf == NULL) || (payloads == NULL)) {
+		PyErr_SetString(PyExc_ValueError, "key and payloads arguments are required");
+		goto out;
+	}
+
+	if (key.len != TN_SEAL_KEY_LEN) {
+		PyErr_Format(PyExc_ValueError, "key must be %d bytes", TN_SEAL_KEY_LEN);
+		goto out;
+	}
+
+	if ((threads < 1) || (threads > TN_SEAL_THREADS_MAX)) {
+		PyErr_Format(PyExc_ValueError, "threads must be between 1 and %d",
+			     TN_SEAL_THREADS_MAX);
+		goto out;
+	}
+
+	/* tuple holds references to the payloads while GIL is released */
+	items_tuple = PySequence_Tuple(payloads);
+	if (items_tuple == NULL) {
+		goto out;
+	}
+
+	cnt = PyTuple_GET_SIZE(items_tuple);
+	items = PyMem_RawCalloc(cnt ? cnt : 1, sizeof(tn_seal_item_t));
+	if (items == NULL) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *item = PyTuple_GET_ITEM(items_tuple, i);
+
+		if (!PyBytes_Check(item)) {
+			PyErr_Format(PyExc_TypeError, "payload %zd: expected bytes", i);
+			goto out;
+		}
+
+		items[i].in = (const unsigned char *)PyBytes_AS_STRING(item);
+		items[i].in_len = (size_t)PyBytes_GET_SIZE(item);
+		if (!decrypt) {
+			blob_len += items[i].in_len + TN_SEAL_OVERHEAD;
+		} else if (items[i].in_len > TN_SEAL_OVERHEAD) {
+			blob_len += items[i].in_len - TN_SEAL_OVERHEAD;
+		}
+	}
+
+	/* holds plaintext on one side or the other */
+	blob = scratch_alloc(blob_len);
+	if (blob == NULL) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		items[i].out = blob + offset;
+		if (!decrypt) {
+			offset += items[i].in_len + TN_SEAL_OVERHEAD;
+		} else if (items[i].in_len > TN_SEAL_OVERHEAD) {
+			offset += items[i].in_len - TN_SEAL_OVERHEAD;
+		}
+	}
+
+	memcpy(key_copy, key.buf, TN_SEAL_KEY_LEN);
+
+	Py_BEGIN_ALLOW_THREADS
+	success = seal_payloads(key_copy, items, (size_t)cnt, (size_t)threads, decrypt);
+	Py_END_ALLOW_THREADS
+
+	explicit_bzero(key_copy, sizeof(key_copy));
+
+	if (!success) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		goto out;
+	}
+
+	out = PyList_New(cnt);
+	if (out == NULL) {
+		goto out;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *val;
+
+		if (items[i].ok) {
+			val = PyBytes_FromStringAndSize((char *)items[i].out, items[i].out_len);
+			if (val == NULL) {
+				Py_CLEAR(out);
+				goto out;
+			}
+		} else {
+			val = Py_NewRef(Py_None);
+		}
+		PyList_SET_ITEM(out, i, val);
+	}
+
+out:
+	scratch_free(blob);
+	PyMem_RawFree(items);
+	Py_XDECREF(items_tuple);
+	PyBuffer_Release(&key);
+	return out;
+}
+
+static PyObject *
+tn_seal_payloads(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	return tn_seal_common(module_obj, args, kwargs, false);
+}
+
+static PyObject *
+tn_open_payloads(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	return tn_seal_common(module_obj, args, kwargs, true);
+}
+
+PyDoc_STRVAR(tn_pack_bundle__doc__,
+"pack_bundle(*, entries) -> bytes\n"
+"--------------------------------\n\n"
+"Pack payloads into an indexed bundle that may be stored in a single key.\n"
+"The bundle has an index sorted by dbid so that bundle_lookup() can locate\n"
+"a single payload without decoding the rest.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"entries: Iterable[tuple[int, bytes, int]], required\n"
+"    (dbid, data, expiry) for each payload. expiry is a unix timestamp\n"
+"    after which the entry is ignored by readers, or zero for never.\n\n"
+""
+"Returns\n"
+"-------\n"
+"bytes\n"
+"    The packed bundle.\n\n"
+""
+"Raises\n"
+"------\n"
+"TypeError:\n"
+"    Invalid parameter type.\n"
+"ValueError:\n"
+"    Missing parameter, duplicate dbid or bundle too large.\n"
+);
+
+static PyObject *
+tn_pack_bundle(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"entries", NULL};
+	PyObject *entries_obj = NULL, *entries_tuple = NULL, *out = NULL;
+	tn_bundle_entry_t *entries = NULL;
+	Py_ssize_t i, cnt;
+	size_t size;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$O:pack_bundle",
+					 kwlist, &entries_obj)) {
+		return NULL;
+	}
+
+	if (entries_obj == NULL) {
+		PyErr_SetString(PyExc_ValueError, "entries argument is required");
+		return NULL;
+	}
+
+	entries_tuple = PySequence_Tuple(entries_obj);
+	if (entries_tuple == NULL) {
+		return NULL;
+	}
+
+	cnt = PyTuple_GET_SIZE(entries_tuple);
+	entries = PyMem_RawCalloc(cnt ? cnt : 1, sizeof(tn_bundle_entry_t));
+	if (entries == NULL) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *item = PyTuple_GET_ITEM(entries_tuple, i);
+		long long dbid, expiry;
+		Py_ssize_t data_len;
+		char *data;
+
+		if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 3) {
+			PyErr_Format(PyExc_TypeError,
+				     "entry %zd: expected (dbid, data, expiry) tuple", i);
+			goto out;
+		}
+
+		dbid = PyLong_AsLongLong(PyTuple_GET_ITEM(item, 0));
+		if (dbid == -1 && PyErr_Occurred()) {
+			goto out;
+		}
+
+		if (!PyBytes_Check(PyTuple_GET_ITEM(item, 1))) {
+			PyErr_Format(PyExc_TypeError, "entry %zd: data must be bytes", i);
+			goto out;
+		}
+
+		if (PyBytes_AsStringAndSize(PyTuple_GET_ITEM(item, 1), &data, &data_len) < 0) {
+			goto out;
+		}
+
+		expiry = PyLong_AsLongLong(PyTuple_GET_ITEM(item, 2));
+		if (expiry == -1 && PyErr_Occurred()) {
+			goto out;
+		}
+
+		entries[i] = (tn_bundle_entry_t) {
+			.dbid = dbid,
+			.expiry = expiry,
+			.data = data,
+			.data_len = (size_t)data_len,
+		};
+	}
+
+	if (!bundle_prepare(entries, (size_t)cnt, &size)) {
+		PyErr_SetString(PyExc_ValueError, errno == EEXIST ?
+				"duplicate dbid in entries" : "bundle too large");
+		goto out;
+	}
+
+	out = PyBytes_FromStringAndSize(NULL, size);
+	if (out == NULL) {
+		goto out;
+	}
+
+	bundle_pack(entries, (size_t)cnt, (unsigned char *)PyBytes_AS_STRING(out));
+
+out:
+	PyMem_RawFree(entries);
+	Py_DECREF(entries_tuple);
+	return out;
+}
+
+static bool
+tn_bundle_check(Py_buffer *data, size_t *cnt)
+{
+	if (bundle_check(data->buf, (size_t)data->len, cnt)) {
+		return true;
+	}
+
+	PyErr_SetString(PyExc_ValueError, errno == EINVAL ?
+			"not a key bundle" : "key bundle is corrupt");
+	return false;
+}
+
+PyDoc_STRVAR(tn_unpack_bundle__doc__,
+"unpack_bundle(data) -> dict[int, bytes]\n"
+"---------------------------------------\n\n"
+"Unpack all payloads from a bundle produced by pack_bundle().\n\n"
+""
+"Parameters\n"
+"----------\n"
+"data: bytes, required\n"
+"    The packed bundle.\n\n"
+""
+"Returns\n"
+"-------\n"
+"dict[int, bytes]\n"
+"    Mapping of dbid to payload. Expired entries are omitted.\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    data is not a valid bundle.\n"
+);
+
+static PyObject *
+tn_unpack_bundle(PyObject *module_obj, PyObject *arg)
+{
+	Py_buffer data;
+	PyObject *out = NULL;
+	size_t cnt;
+
+	if (PyObject_GetBuffer(arg, &data, PyBUF_SIMPLE) < 0) {
+		return NULL;
+	}
+
+	if (tn_bundle_check(&data, &cnt)) {
+		out = bundle_to_dict(data.buf, cnt, time(NULL));
+	}
+
+	PyBuffer_Release(&data);
+	return out;
+}
+
+PyDoc_STRVAR(tn_bundle_lookup__doc__,
+"bundle_lookup(*, data, dbid) -> bytes | None\n"
+"--------------------------------------------\n\n"
+"Locate a single payload in a bundle produced by pack_bundle() using its\n"
+"index. Other payloads in the bundle are not decoded.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"data: bytes, required\n"
+"    The packed bundle.\n\n"
+"dbid: int, required\n"
+"    The dbid of the payload to return.\n\n"
+""
+"Returns\n"
+"-------\n"
+"bytes | None\n"
+"    The payload, or None if the entry does not exist or has expired.\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Missing parameter or data is not a valid bundle.\n"
+);
+
+static PyObject *
+tn_bundle_lookup(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"data", "dbid", NULL};
+	Py_buffer data = { 0 };
+	long long dbid = LLONG_MIN;
+	tn_bundle_entry_t entry;
+	PyObject *out = NULL;
+	size_t cnt;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$y*L:bundle_lookup",
+					 kwlist, &data, &dbid)) {
+		return NULL;
+	}
+
+	if ((data.buf == NULL) || (dbid == LLONG_MIN)) {
+		PyErr_SetString(PyExc_ValueError, "data and dbid arguments are required");
+		goto out;
+	}
+
+	if (!tn_bundle_check(&data, &cnt)) {
+		goto out;
+	}
+
+	if (bundle_find(data.buf, cnt, dbid, time(NULL), &entry)) {
+		out = PyBytes_FromStringAndSize(entry.data, entry.data_len);
+	} else {
+		out = Py_NewRef(Py_None);
+	}
+
+out:
+	PyBuffer_Release(&data);
+	return out;
+}
+
+PyDoc_STRVAR(tn_link_key__doc__,
+"link_key(*, serial, target_keyring) -> None\n"
+"-------------------------------------------\n\n"
+"Link a key into the specified keyring. Any key of the same type and\n"
+"description already linked in the target keyring is displaced.\n"
+"See man (3) keyctl_link for more information.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"serial: int, required\n"
+"    The serial number of the key to link.\n\n"
+"target_keyring: int, required\n"
+"    The serial number of the keyring to link the key into.\n\n"
+""
+"Returns\n"
+"-------\n"
+"None\n\n"
+""
+"Raises\n"
+"------\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details).\n\n"
+);
+
+static PyObject *
+tn_link_key(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"serial", "target_keyring", NULL};
+	key_serial_t serial, target_keyring;
+	long result;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "$ii:link_key",
+					 kwlist, &serial, &target_keyring)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	result = tn_keyctl_link(serial, target_keyring);
+	Py_END_ALLOW_THREADS
+
+	if (result == -1) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(tn_unlink_key__doc__,
+"unlink_key(*, serial, keyring) -> None\n"
+"-------------------------------------\n\n"
+"Remove the link to a key from the specified keyring.\n"
+"See man (3) keyctl_unlink for more information.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"serial: int, required\n"
+"    The serial number of the key to unlink.\n\n"
+"keyring: int, required\n"
+"    The serial number of the keyring to unlink the key from.\n\n"
+""
+"Returns\n"
+"-------\n"
+"None\n\n"
+""
+"Raises\n"
+"------\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details).\n\n"
+);
+
+static PyObject *
+tn_unlink_key(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"serial", "keyring", NULL};
+	key_serial_t serial, keyring;
+	long result;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "$ii:unlink_key",
+					 kwlist, &serial, &keyring)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	result = tn_keyctl_unlink(serial, keyring);
+	Py_END_ALLOW_THREADS
+
+	if (result == -1) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(tn_move_key__doc__,
+"move_key(*, serial, from_keyring, to_keyring, exclusive=False) -> None\n"
+"----------------------------------------------------------------------\n\n"
+"Move a key from one keyring to another in a single operation. Any key\n"
+"of the same type and description in the destination keyring is\n"
+"displaced unless exclusive is set. On kernels without keyctl_move()\n"
+"the key is linked into the destination and then unlinked from the source.\n"
+"See man (3) keyctl_move for more information.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"serial: int, required\n"
+"    The serial number of the key to move.\n\n"
+"from_keyring: int, required\n"
+"    The serial number of the keyring the key is currently linked in.\n\n"
+"to_keyring: int, required\n"
+"    The serial number of the keyring to move the key to.\n\n"
+"exclusive: bool, optional\n"
+"    If True, fail with EEXIST rather than displace a matching key.\n"
+"    Default: False.\n\n"
+""
+"Returns\n"
+"-------\n"
+"None\n\n"
+""
+"Raises\n"
+"------\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details).\n\n"
+);
+
+static PyObject *
+tn_move_key(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"serial", "from_keyring", "to_keyring", "exclusive", NULL};
+	key_serial_t serial = 0, from_keyring = 0, to_keyring = 0;
+	int exclusive = false;
+	bool success;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$iiip:move_key",
+					 kwlist, &serial, &from_keyring,
+					 &to_keyring, &exclusive)) {
+		return NULL;
+	}
+
+	/* 0 is never a valid key serial */
+	if (!serial || !from_keyring || !to_keyring) {
+		PyErr_SetString(PyExc_ValueError,
+				"serial, from_keyring and to_keyring arguments are required");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	success = move_key(serial, from_keyring, to_keyring, exclusive);
+	Py_END_ALLOW_THREADS
+
+	if (!success) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(tn_swap_keyring__doc__,
+"swap_keyring(*, target_keyring, description, entries, key_type=KeyType.USER)\n"
+"    -> truenas_keyring.TNKeyring\n"
+"----------------------------------------------------------------------------\n\n"
+"Atomically replace the keyring with the specified description in\n"
+"target_keyring with a new keyring containing entries.\n\n"
+"The new keyring is populated in the calling thread's keyring and then\n"
+"moved into target_keyring, displacing the previous keyring in a single\n"
+"operation. Readers searching target_keyring therefore see either the\n"
+"complete old set of keys or the complete new one, never an empty or\n"
+"partially populated keyring. The old keyring is then invalidated so that\n"
+"its payloads can't be read any longer. Readers that resolved it before\n"
+"the swap get an error and should look it up again.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"target_keyring: int, required\n"
+"    The serial number of the parent keyring.\n\n"
+"description: str, required\n"
+"    The description of the keyring to replace.\n\n"
+"entries: Iterable[tuple[str, bytes, int | None]], required\n"
+"    (description, data, timeout) for each key in the new keyring.\n"
+"    See add_keys() for details.\n\n"
+"key_type: str, optional\n"
+"    The type of keys to create. Cannot be \"keyring\".\n"
+"    Default: truenas_keyring.KeyType.USER.\n\n"
+""
+"Returns\n"
+"-------\n"
+"truenas_keyring.TNKeyring\n"
+"    The new keyring.\n\n"
+""
+"Raises\n"
+"------\n"
+"TypeError:\n"
+"    Invalid parameter type.\n"
+"ValueError:\n"
+"    Missing required parameter, \"keyring\" key type or invalid timeout specified.\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details). target_keyring is unchanged.\n\n"
+);
+
+static PyObject *
+tn_swap_keyring(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"target_keyring", "description", "entries", "key_type", NULL};
+	int target_keyring = 0;
+	const char *description_str = NULL;
+	PyObject *entries_obj = NULL;
+	const char *key_type_str = KEY_TYPE_STR_USER;
+	PyObject *entries_fast = NULL;
+	tn_add_entry_t *entries = NULL;
+	key_serial_t new_serial;
+	size_t cnt;
+	bool success;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$isOs:swap_keyring",
+					 kwlist, &target_keyring, &description_str,
+					 &entries_obj, &key_type_str)) {
+		return NULL;
+	}
+
+	if (!target_keyring || description_str == NULL || entries_obj == NULL) {
+		PyErr_SetString(PyExc_ValueError,
+				"target_keyring, description and entries arguments are required");
+		return NULL;
+	}
+
+	if (strcmp(key_type_str, KEY_TYPE_STR_KEYRING) == 0) {
+		PyErr_SetString(PyExc_ValueError, "Cannot create keyring with swap_keyring entries");
+		return NULL;
+	}
+
+	if (!parse_add_entries(entries_obj, &entries_fast, &entries, &cnt)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	success = swap_in_keyring(target_keyring, description_str, key_type_str,
+				  entries, cnt, &new_serial);
+	Py_END_ALLOW_THREADS
+
+	PyMem_RawFree(entries);
+	Py_DECREF(entries_fast);
+
+	if (!success) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		return NULL;
+	}
+
+	return create_key_object_from_serial(new_serial, module_obj);
+}
+
+/*
+ * Convert an optional iterable of (key_type, description) tuples to an
+ * array of tn_commit_unlink_t. The strings are owned by the tuples held
+ * by *fast_out, which the caller must release along with *unlink_out
+ * (PyMem_RawFree). Requires GIL.
+ */
+static bool
+parse_unlink_specs(PyObject *unlink_obj, PyObject **fast_out,
+		   tn_commit_unlink_t **unlink_out, size_t *cnt_out)
+{
+	tn_commit_unlink_t *unlink;
+	PyObject *fast;
+	Py_ssize_t i, cnt;
+
+	if (unlink_obj == Py_None) {
+		return true;
+	}
+
+	fast = PySequence_Fast(unlink_obj, "unlink must be iterable");
+	if (fast == NULL) {
+		return false;
+	}
+
+	cnt = PySequence_Fast_GET_SIZE(fast);
+	unlink = PyMem_RawCalloc(cnt ? cnt : 1, sizeof(tn_commit_unlink_t));
+	if (unlink == NULL) {
+		Py_DECREF(fast);
+		PyErr_NoMemory();
+		return false;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(fast, i),
+				      "ss;unlink items must be (key_type, description)",
+				      &unlink[i].key_type_str, &unlink[i].description)) {
+			PyMem_RawFree(unlink);
+			Py_DECREF(fast);
+			return false;
+		}
+	}
+
+	*fast_out = fast;
+	*unlink_out = unlink;
+	*cnt_out = (size_t)cnt;
+	return true;
+}
+
+PyDoc_STRVAR(tn_commit_keyrings__doc__,
+"commit_keyrings(*, path, description, entries, key_type=KeyType.USER, root=None,\n"
+"                unlink=None, workers=1) -> dict[str, int | KeyringError]\n"
+"-------------------------------------------------------------------------------\n\n"
+"Replace the keyring with the specified description inside each of many\n"
+"child keyrings of path, spreading the work over a pool of native threads\n"
+"with the GIL released. For each name in entries the keyring path + [name]\n"
+"is resolved (and created if needed) and the keyring `description` within\n"
+"it is swapped for a new one as swap_keyring() does. This is intended for\n"
+"committing the API keys of every user at once.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"path: Sequence[str], required\n"
+"    Descriptions of the keyrings leading to the parent of the per-name\n"
+"    keyrings. Created if they don't exist. See resolve_path().\n\n"
+"description: str, required\n"
+"    The description of the keyring to replace within each child.\n\n"
+"entries: Mapping[str, Iterable[tuple[str, bytes, int | None]]], required\n"
+"    Keys for the new keyring of each child, by child description.\n"
+"    See add_keys() for details.\n\n"
+"key_type: str, optional\n"
+"    The type of keys to create. Cannot be \"keyring\".\n"
+"    Default: truenas_keyring.KeyType.USER.\n\n"
+"root: int, optional\n"
+"    The serial number of the keyring to start from.\n"
+"    Default: None (persistent keyring of the current user).\n\n"
+"unlink: Iterable[tuple[str, str]], optional\n"
+"    (key_type, description) of keys to unlink from each child once its\n"
+"    keyring has been replaced, if present. Default: None.\n\n"
+"workers: int, optional\n"
+"    Number of threads to use, including the calling thread.\n"
+"    Default: 1.\n\n"
+""
+"Returns\n"
+"-------\n"
+"dict[str, int | truenas_keyring.KeyringError]\n"
+"    Serial number of the new keyring for each name, or the error that\n"
+"    prevented it from being committed. A failed name is left unchanged.\n\n"
+""
+"Raises\n"
+"------\n"
+"TypeError:\n"
+"    Invalid parameter type.\n"
+"ValueError:\n"
+"    Missing required parameter, \"keyring\" key type, invalid timeout or\n"
+"    invalid number of workers specified.\n"
+"truenas_keyring.KeyringError:\n"
+"    Resolving path failed (see errno for details).\n\n"
+);
+
+static PyObject *
+tn_commit_keyrings(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {
+		"path", "description", "entries", "key_type", "root", "unlink", "workers", NULL
+	};
+	PyObject *path_obj = NULL, *root_obj = Py_None, *unlink_obj = Py_None;
+	PyObject *entries_obj = NULL, *items = NULL, *unlink_fast = NULL;
+	PyObject *path_fast = NULL, **entries_fast = NULL, *out = NULL;
+	const char *description_str = NULL;
+	const char *key_type_str = KEY_TYPE_STR_USER;
+	const char **path = NULL;
+	tn_commit_unlink_t *unlink = NULL;
+	tn_commit_job_t *jobs = NULL;
+	Py_ssize_t i, cnt = 0;
+	size_t unlink_cnt = 0;
+	key_serial_t root = 0, parent;
+	size_t path_cnt;
+	int workers = 1;
+	bool success;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$OsOsOOi:commit_keyrings",
+					 kwlist, &path_obj, &description_str, &entries_obj,
+					 &key_type_str, &root_obj, &unlink_obj, &workers)) {
+		return NULL;
+	}
+
+	if ((path_obj == NULL) || (description_str == NULL) || (entries_obj == NULL)) {
+		PyErr_SetString(PyExc_ValueError,
+				"path, description and entries arguments are required");
+		return NULL;
+	}
+
+	if (strcmp(key_type_str, KEY_TYPE_STR_KEYRING) == 0) {
+		PyErr_SetString(PyExc_ValueError, "Cannot create keyring with commit_keyrings entries");
+		return NULL;
+	}
+
+	if ((workers < 1) || (workers > TN_COMMIT_WORKERS_MAX)) {
+		PyErr_Format(PyExc_ValueError, "workers must be between 1 and %d",
+			     TN_COMMIT_WORKERS_MAX);
+		return NULL;
+	}
+
+	if (!parse_unlink_specs(unlink_obj, &unlink_fast, &unlink, &unlink_cnt)) {
+		return NULL;
+	}
+
+	items = PyMapping_Items(entries_obj);
+	if (items == NULL) {
+		goto out;
+	}
+
+	cnt = PyList_GET_SIZE(items);
+	jobs = PyMem_RawCalloc(cnt ? cnt : 1, sizeof(tn_commit_job_t));
+	entries_fast = PyMem_RawCalloc(cnt ? cnt : 1, sizeof(PyObject *));
+	if ((jobs == NULL) || (entries_fast == NULL)) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *item = PyList_GET_ITEM(items, i);
+		PyObject *name;
+
+		if (!PyTuple_Check(item) || (PyTuple_GET_SIZE(item) != 2)) {
+			PyErr_SetString(PyExc_TypeError, "entries must be a mapping");
+			goto out;
+		}
+
+		name = PyTuple_GET_ITEM(item, 0);
+		if (!PyUnicode_Check(name)) {
+			PyErr_SetString(PyExc_TypeError, "entries keys must be strings");
+			goto out;
+		}
+
+		jobs[i].name = PyUnicode_AsUTF8(name);
+		if ((jobs[i].name == NULL) ||
+		    !parse_add_entries(PyTuple_GET_ITEM(item, 1), &entries_fast[i],
+				       &jobs[i].entries, &jobs[i].cnt)) {
+			goto out;
+		}
+	}
+
+	if (!parse_keyring_path(path_obj, root_obj, &path_fast, &path, &path_cnt, &root)) {
+		goto out;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	success = resolve_keyring_path(root, path, path_cnt, true, &parent, NULL);
+	if (success) {
+		commit_keyrings(parent, description_str, key_type_str, unlink,
+				unlink_cnt, jobs, (size_t)cnt, (size_t)workers);
+	}
+	Py_END_ALLOW_THREADS
+
+	if (!success) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		goto out;
+	}
+
+	out = PyDict_New();
+	if (out == NULL) {
+		goto out;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *val;
+
+		if (jobs[i].error) {
+			val = PyObject_CallFunction(get_keyring_error_from_module(module_obj), "is",
+						    jobs[i].error, strerror(jobs[i].error));
+		} else {
+			val = PyLong_FromLong(jobs[i].serial);
+		}
+
+		if ((val == NULL) ||
+		    (PyDict_SetItem(out, PyTuple_GET_ITEM(PyList_GET_ITEM(items, i), 0), val) < 0)) {
+			Py_XDECREF(val);
+			Py_CLEAR(out);
+			goto out;
+		}
+		Py_DECREF(val);
+	}
+
+out:
+	if (jobs != NULL) {
+		for (i = 0; i < cnt; i++) {
+			PyMem_RawFree(jobs[i].entries);
+			Py_XDECREF(entries_fast[i]);
+		}
+	}
+	PyMem_RawFree(jobs);
+	PyMem_RawFree(entries_fast);
+	PyMem_RawFree(unlink);
+	PyMem_RawFree(path);
+	Py_XDECREF(path_fast);
+	Py_XDECREF(unlink_fast);
+	Py_XDECREF(items);
+	return out;
+}
+
+PyDoc_STRVAR(tn_clear_descendants__doc__,
+"clear_descendants(*, root, child_description=\"API_KEYS\", unlink=None,\n"
+"                  workers=1) -> dict\n"
+"---------------------------------------------------------------------\n\n"
+"Clear the keyring child_description found within each keyring linked\n"
+"into root. The children of root are collected with a single read and\n"
+"the searches and clears are spread over a pool of native threads with\n"
+"the GIL released. This is intended for revoking the API keys of every\n"
+"user at once.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"root: int, required\n"
+"    The serial number of the keyring whose children to visit.\n\n"
+"child_description: str | None, optional\n"
+"    The description of the keyring to clear within each child. If None,\n"
+"    the children of root are cleared themselves.\n"
+"    Default: \"API_KEYS\".\n\n"
+"unlink: Iterable[tuple[str, str]], optional\n"
+"    (key_type, description) of keys to unlink from each child keyring,\n"
+"    if present, whether or not it contains child_description.\n"
+"    Default: None.\n\n"
+"workers: int, optional\n"
+"    Number of threads to use, including the calling thread.\n"
+"    Default: 1.\n\n"
+""
+"Returns\n"
+"-------\n"
+"dict\n"
+"    \"cleared\": list of serial numbers of the keyrings that were cleared.\n"
+"    \"skipped\": number of children that aren't live keyrings or don't\n"
+"    contain child_description.\n"
+"    \"errors\": dict of child serial number to the\n"
+"    truenas_keyring.KeyringError that prevented it from being cleared.\n\n"
+""
+"Raises\n"
+"------\n"
+"TypeError:\n"
+"    Invalid parameter type.\n"
+"ValueError:\n"
+"    Missing root or invalid number of workers specified.\n"
+"truenas_keyring.KeyringError:\n"
+"    Reading root failed (see errno for details).\n\n"
+);
+
+static PyObject *
+tn_clear_descendants(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"root", "child_description", "unlink", "workers", NULL};
+	PyObject *root_obj = NULL, *unlink_obj = Py_None, *unlink_fast = NULL;
+	PyObject *cleared = NULL, *errors = NULL, *out = NULL;
+	const char *description_str = "API_KEYS";
+	tn_commit_unlink_t *unlink = NULL;
+	tn_clear_job_t *jobs = NULL;
+	size_t i, cnt = 0, unlink_cnt = 0, skipped = 0;
+	key_serial_t root;
+	int workers = 1;
+	bool success;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$OzOi:clear_descendants",
+					 kwlist, &root_obj, &description_str,
+					 &unlink_obj, &workers)) {
+		return NULL;
+	}
+
+	if (root_obj == NULL) {
+		PyErr_SetString(PyExc_ValueError, "root argument is required");
+		return NULL;
+	}
+
+	root = (key_serial_t)PyLong_AsLong(root_obj);
+	if ((root == -1) && PyErr_Occurred()) {
+		return NULL;
+	}
+
+	if ((workers < 1) || (workers > TN_COMMIT_WORKERS_MAX)) {
+		PyErr_Format(PyExc_ValueError, "workers must be between 1 and %d",
+			     TN_COMMIT_WORKERS_MAX);
+		return NULL;
+	}
+
+	if (!parse_unlink_specs(unlink_obj, &unlink_fast, &unlink, &unlink_cnt)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	success = clear_keyrings(root, description_str, unlink, unlink_cnt,
+				 &jobs, &cnt, (size_t)workers);
+	Py_END_ALLOW_THREADS
+
+	if (!success) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		goto out;
+	}
+
+	cleared = PyList_New(0);
+	errors = PyDict_New();
+	if ((cleared == NULL) || (errors == NULL)) {
+		goto out;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *key, *val;
+		int err;
+
+		switch (jobs[i].result) {
+		case TN_CLEAR_CLEARED:
+			val = PyLong_FromLong(jobs[i].target);
+			if (val == NULL) {
+				goto out;
+			}
+			err = PyList_Append(cleared, val);
+			Py_DECREF(val);
+			break;
+		case TN_CLEAR_SKIPPED:
+			skipped++;
+			err = 0;
+			break;
+		default:
+			key = PyLong_FromLong(jobs[i].child);
+			if (key == NULL) {
+				goto out;
+			}
+			val = PyObject_CallFunction(get_keyring_error_from_module(module_obj), "is",
+						    jobs[i].error, strerror(jobs[i].error));
+			if (val == NULL) {
+				Py_DECREF(key);
+				goto out;
+			}
+			err = PyDict_SetItem(errors, key, val);
+			Py_DECREF(key);
+			Py_DECREF(val);
+			break;
+		}
+
+		if (err) {
+			goto out;
+		}
+	}
+
+	out = Py_BuildValue("{sOsnsO}", "cleared", cleared, "skipped", (Py_ssize_t)skipped,
+			    "errors", errors);
+
+out:
+	PyMem_RawFree(jobs);
+	PyMem_RawFree(unlink);
+	Py_XDECREF(unlink_fast);
+	Py_XDECREF(cleared);
+	Py_XDECREF(errors);
+	return out;
+}
+
+PyDoc_STRVAR(tn_resolve_path__doc__,
+"resolve_path(*, path, root=None, create=False) -> truenas_keyring.TNKeyring\n"
+"--------------------------------------------------------------------------\n\n"
+"Resolve a path of nested keyrings in a single call. Each element of path\n"
+"is the description of a keyring to search for within the previous one.\n"
+"The whole walk happens with the GIL released and only the final keyring\n"
+"is returned.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"path: Sequence[str], required\n"
+"    Descriptions of the keyrings to walk, e.g.\n"
+"    [\"PAM_TRUENAS\", \"admin\", \"API_KEYS\"].\n\n"
+"root: int, optional\n"
+"    The serial number of the keyring to start from.\n"
+"    Default: None (persistent keyring of the current user).\n\n"
+"create: bool, optional\n"
+"    If True, create keyrings that don't exist along the path.\n"
+"    Default: False.\n\n"
+""
+"Returns\n"
+"-------\n"
+"truenas_keyring.TNKeyring\n"
+"    The keyring at the end of path.\n\n"
+""
+"Raises\n"
+"------\n"
+"TypeError:\n"
+"    Invalid parameter type.\n"
+"FileNotFoundError:\n"
+"    A keyring along the path does not exist and create is False.\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details).\n\n"
+);
+
+static PyObject *
+tn_resolve_path(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"path", "root", "create", NULL};
+	PyObject *path_obj = NULL;
+	PyObject *root_obj = Py_None;
+	int create = false;
+	PyObject *path_fast = NULL;
+	const char **path = NULL;
+	tn_key_info_t info = { 0 };
+	key_serial_t root = 0, serial;
+	PyObject *out;
+	size_t cnt;
+	bool success;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$OOp:resolve_path",
+					 kwlist, &path_obj, &root_obj, &create)) {
+		return NULL;
+	}
+
+	if (path_obj == NULL) {
+		PyErr_SetString(PyExc_ValueError, "path argument is required");
+		return NULL;
+	}
+
+	if (!parse_keyring_path(path_obj, root_obj, &path_fast, &path, &cnt, &root)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	success = resolve_keyring_path(root, path, cnt, create, &serial, &info);
+	Py_END_ALLOW_THREADS
+
+	PyMem_RawFree(path);
+	Py_DECREF(path_fast);
+
+	if (!success) {
+		free_key_info(&info);
+		if (errno == ENOKEY) {
+			PyErr_SetString(PyExc_FileNotFoundError, "Keyring not found");
+		} else {
+			PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		}
+		return NULL;
+	}
+
+	out = create_key_object_from_info(serial, &info, module_obj);
+	free_key_info(&info);
+	return out;
+}
+
+PyDoc_STRVAR(tn_lookup_payload__doc__,
+"lookup_payload(*, path, description, key_type=KeyType.USER, root=None)\n"
+"    -> bytes | None\n"
+"----------------------------------------------------------------------\n\n"
+"Read the payload of the key with the specified description in the\n"
+"keyring at path. This resolves the keyring path, searches for the key\n"
+"and reads its payload with a single release of the GIL and without\n"
+"creating intermediate key objects. It is intended for authentication\n"
+"hot paths.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"path: Sequence[str], required\n"
+"    Descriptions of the keyrings to walk. See resolve_path().\n\n"
+"description: str, required\n"
+"    The description of the key to read.\n\n"
+"key_type: str, optional\n"
+"    The type of the key to read.\n"
+"    Default: truenas_keyring.KeyType.USER.\n\n"
+"root: int, optional\n"
+"    The serial number of the keyring to start from.\n"
+"    Default: None (persistent keyring of the current user).\n\n"
+""
+"Returns\n"
+"-------\n"
+"bytes | None\n"
+"    The key payload, or None if a keyring along the path or the key does\n"
+"    not exist, or the key has expired or been revoked.\n\n"
+""
+"Raises\n"
+"------\n"
+"TypeError:\n"
+"    Invalid parameter type.\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details).\n\n"
+);
+
+static PyObject *
+tn_lookup_payload(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"path", "description", "key_type", "root", NULL};
+	PyObject *path_obj = NULL;
+	const char *description_str = NULL;
+	const char *key_type_str = KEY_TYPE_STR_USER;
+	PyObject *root_obj = Py_None;
+	PyObject *path_fast = NULL;
+	const char **path = NULL;
+	key_serial_t root = 0;
+	char *data = NULL;
+	size_t cnt, data_len = 0;
+	PyObject *out;
+	bool success;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$OssO:lookup_payload",
+					 kwlist, &path_obj, &description_str,
+					 &key_type_str, &root_obj)) {
+		return NULL;
+	}
+
+	if ((path_obj == NULL) || (description_str == NULL)) {
+		PyErr_SetString(PyExc_ValueError, "path and description arguments are required");
+		return NULL;
+	}
+
+	if (!parse_keyring_path(path_obj, root_obj, &path_fast, &path, &cnt, &root)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	success = lookup_key_payload(root, path, cnt, key_type_str, description_str,
+				     &data, &data_len);
+	Py_END_ALLOW_THREADS
+
+	PyMem_RawFree(path);
+	Py_DECREF(path_fast);
+
+	if (!success) {
+		if ((errno == ENOKEY) || (errno == EKEYEXPIRED) || (errno == EKEYREVOKED)) {
+			Py_RETURN_NONE;
+		}
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		return NULL;
+	}
+
+	out = PyBytes_FromStringAndSize(data, data_len);
+	scratch_tls_put(data, data_len);
+
+	return out;
+}
+
+PyDoc_STRVAR(tn_get_syscall_stats__doc__,
+"get_syscall_stats(*, reset=False) -> dict\n"
+"----------------------------------------\n\n"
+"Return counts of keyctl syscalls issued by this module, keyed by\n"
+"syscall name (e.g. \"describe\", \"read\", \"search\"). Counters are\n"
+"process-wide and are intended for tests and diagnostics.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"reset: bool, optional, default=False\n"
+"    Reset all counters to zero after reading them.\n\n"
+""
+"Returns\n"
+"-------\n"
+"dict\n"
+"    Mapping of syscall name to number of calls.\n\n"
+);
+
+static PyObject *
+tn_get_syscall_stats(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"reset", NULL};
+	int reset = false;
+	PyObject *stats;
+	size_t i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$p:get_syscall_stats",
+					 kwlist, &reset)) {
+		return NULL;
+	}
+
+	stats = PyDict_New();
+	if (stats == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < TN_STAT_CNT; i++) {
+		unsigned long val;
+		PyObject *py_val;
+
+		if (reset) {
+			val = __atomic_exchange_n(&tn_syscall_stats[i], 0, __ATOMIC_RELAXED);
+		} else {
+			val = __atomic_load_n(&tn_syscall_stats[i], __ATOMIC_RELAXED);
+		}
+
+		py_val = PyLong_FromUnsignedLong(val);
+		if (py_val == NULL ||
+		    PyDict_SetItemString(stats, tn_syscall_stat_names[i], py_val) < 0) {
+			Py_XDECREF(py_val);
+			Py_DECREF(stats);
+			return NULL;
+		}
+		Py_DECREF(py_val);
+	}
+
+	return stats;
+}
+
+PyDoc_STRVAR(tn_get_read_stats__doc__,
+"get_read_stats(*, reset=False) -> dict\n"
+"-------------------------------------\n\n"
+"Return hit / miss counters for the optimistic read helpers. Key\n"
+"descriptions, keyring serial lists and payloads are first read into a\n"
+"buffer sized from the largest previously seen result. A hit means the\n"
+"result fit and was retrieved with a single syscall; a miss means the\n"
+"buffer had to be grown and the read retried.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"reset: bool, optional, default=False\n"
+"    Reset all counters to zero after reading them.\n\n"
+""
+"Returns\n"
+"-------\n"
+"dict\n"
+"    describe_hit / describe_miss: key description reads.\n"
+"    serials_hit / serials_miss: keyring serial list reads.\n"
+"    payload_hit / payload_miss: payload reads during keyring listing,\n"
+"    lookup_payload() and the first TNKey.read_data() of a key.\n"
+"    read_data_hit / read_data_miss: TNKey.read_data() of a key whose\n"
+"    payload length is known from a previous read.\n\n"
+);
+
+static PyObject *
+tn_get_read_stats(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"reset", NULL};
+	int reset = false;
+	PyObject *stats, *py_val;
+	size_t i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$p:get_read_stats",
+					 kwlist, &reset)) {
+		return NULL;
+	}
+
+	stats = PyDict_New();
+	if (stats == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < TN_READ_STAT_CNT; i++) {
+		unsigned long val;
+
+		if (reset) {
+			val = __atomic_exchange_n(&tn_read_stats[i], 0, __ATOMIC_RELAXED);
+		} else {
+			val = __atomic_load_n(&tn_read_stats[i], __ATOMIC_RELAXED);
+		}
+
+		py_val = PyLong_FromUnsignedLong(val);
+		if (py_val == NULL ||
+		    PyDict_SetItemString(stats, tn_read_stat_names[i], py_val) < 0) {
+			Py_XDECREF(py_val);
+			Py_DECREF(stats);
+			return NULL;
+		}
+		Py_DECREF(py_val);
+	}
+
+	return stats;
+}
+
+PyDoc_STRVAR(tn_get_cache_stats__doc__,
+"get_cache_stats(*, reset=False) -> dict\n"
+"--------------------------------------\n\n"
+"Return counters for the in-process keyring search cache used by\n"
+"TNKeyring.search() and resolve_path(). Only keys linked directly into\n"
+"the keyring searched are cached. Cached results are revalidated before\n"
+"use with a describe of the key and a read of the keyring, which confirms\n"
+"that the key is still linked there even if another process changed it.\n"
+"The cache is also flushed whenever this module changes keyring topology\n"
+"(adding keyrings, linking, unlinking, moving, clearing, revoking or\n"
+"invalidating keys).\n\n"
+""
+"Parameters\n"
+"----------\n"
+"reset: bool, optional, default=False\n"
+"    Reset all counters to zero after reading them.\n\n"
+""
+"Returns\n"
+"-------\n"
+"dict\n"
+"    hits: lookups answered from the cache.\n"
+"    misses: lookups that required a search.\n"
+"    stale: cached results that failed revalidation or expired.\n"
+"    flushes: number of times the cache was flushed.\n"
+"    negative_hits: failed searches answered from the cache.\n"
+"    entries: current number of cached results.\n\n"
+);
+
+static PyObject *
+tn_get_cache_stats(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"reset", NULL};
+	int reset = false;
+	PyObject *stats, *py_val;
+	size_t i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$p:get_cache_stats",
+					 kwlist, &reset)) {
+		return NULL;
+	}
+
+	stats = PyDict_New();
+	if (stats == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < TN_CACHE_STAT_CNT; i++) {
+		unsigned long val;
+
+		if (reset) {
+			val = __atomic_exchange_n(&tn_cache_stats[i], 0, __ATOMIC_RELAXED);
+		} else {
+			val = __atomic_load_n(&tn_cache_stats[i], __ATOMIC_RELAXED);
+		}
+
+		py_val = PyLong_FromUnsignedLong(val);
+		if (py_val == NULL ||
+		    PyDict_SetItemString(stats, tn_cache_stat_names[i], py_val) < 0) {
+			Py_XDECREF(py_val);
+			Py_DECREF(stats);
+			return NULL;
+		}
+		Py_DECREF(py_val);
+	}
+
+	py_val = PyLong_FromSize_t(key_cache_size());
+	if (py_val == NULL || PyDict_SetItemString(stats, "entries", py_val) < 0) {
+		Py_XDECREF(py_val);
+		Py_DECREF(stats);
+		return NULL;
+	}
+	Py_DECREF(py_val);
+
+	return stats;
+}
+
+PyDoc_STRVAR(tn_set_negative_cache__doc__,
+"set_negative_cache(*, ttl, max_entries=256) -> None\n"
+"---------------------------------------------------\n\n"
+"Configure caching of failed keyring searches. When enabled, a search\n"
+"that finds nothing is remembered for ttl seconds, so repeated lookups of\n"
+"keys that don't exist (e.g. unknown usernames) don't require a syscall.\n"
+"Negative entries are dropped when a key of the same type and description\n"
+"is added through this module. Keys added by other processes are only\n"
+"found once the entry expires. Disabled by default.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"ttl: float, required\n"
+"    Number of seconds to remember a failed search. 0 disables negative\n"
+"    caching.\n\n"
+"max_entries: int, optional\n"
+"    Maximum number of failed searches to remember. When the limit is\n"
+"    reached, all negative entries are dropped.\n"
+"    Default: 256.\n\n"
+""
+"Returns\n"
+"-------\n"
+"None\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Negative ttl or max_entries.\n\n"
+);
+
+static PyObject *
+tn_set_negative_cache(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"ttl", "max_entries", NULL};
+	double ttl = -1;
+	Py_ssize_t max_entries = 256;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$dn:set_negative_cache",
+					 kwlist, &ttl, &max_entries)) {
+		return NULL;
+	}
+
+	if ((ttl < 0) || (max_entries < 0)) {
+		PyErr_SetString(PyExc_ValueError,
+				"ttl argument is required and ttl and max_entries must not be negative");
+		return NULL;
+	}
+
+	key_cache_set_negative((uint64_t)(ttl * 1000000000.0), (size_t)max_entries);
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(tn_clear_cache__doc__,
+"clear_cache() -> None\n"
+"---------------------\n\n"
+"Flush the in-process keyring search cache. This is only required if\n"
+"keyrings were rearranged by another process in a way that leaves the\n"
+"previously found keys alive (e.g. unlinked but still referenced).\n\n"
+""
+"Returns\n"
+"-------\n"
+"None\n\n"
+);
+
+static PyObject *
+tn_clear_cache(PyObject *module_obj, PyObject *Py_UNUSED(ignored))
+{
+	key_cache_flush();
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(tn_create_key_watcher__doc__,
+"create_key_watcher(*, queue_size=256) -> truenas_keyring.TNKeyWatcher\n"
+"--------------------------------------------------------------------\n\n"
+"Create a queue for kernel key change notifications. Keys and keyrings\n"
+"are subscribed to via TNKeyWatcher.watch(), and queued notifications are\n"
+"read in batches via TNKeyWatcher.read(). TNKeyWatcher.fileno() may be\n"
+"registered with selectors or asyncio to wait for notifications.\n"
+"See man (7) keyrings and man (3) keyctl_watch_key for more information.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"queue_size: int, optional\n"
+"    Number of notifications the kernel will queue before reporting\n"
+"    KeyEvent.LOSS. Must be between 1 and 512.\n"
+"    Default: 256.\n\n"
+""
+"Returns\n"
+"-------\n"
+"truenas_keyring.TNKeyWatcher\n"
+"    The new watcher. It should be closed when no longer required.\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Invalid queue_size.\n"
+"truenas_keyring.KeyringError:\n"
+"    System call failed (see errno for details). ENOPKG indicates that\n"
+"    the kernel does not support key change notifications.\n\n"
+);
+
+static PyObject *
+tn_create_key_watcher(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"queue_size", NULL};
+	int queue_size = TN_WATCH_QUEUE_DEFAULT;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$i:create_key_watcher",
+					 kwlist, &queue_size)) {
+		return NULL;
+	}
+
+	if ((queue_size < 1) || (queue_size > TN_WATCH_QUEUE_MAX)) {
+		PyErr_Format(PyExc_ValueError, "queue_size must be between 1 and %d",
+			     TN_WATCH_QUEUE_MAX);
+		return NULL;
+	}
+
+	return py_tn_key_watcher_create(module_obj, (unsigned int)queue_size);
+}
+
+PyDoc_STRVAR(tn_create_completion_queue__doc__,
+"create_completion_queue(*, workers=2) -> truenas_keyring.TNCompletionQueue\n"
+"--------------------------------------------------------------------------\n\n"
+"Create a queue of keyring operations that are performed by a pool of\n"
+"native threads without holding the GIL. Operations are queued via the\n"
+"TNCompletionQueue.submit_*() methods, each of which returns a token, and\n"
+"finished operations are collected in batches via TNCompletionQueue.reap().\n"
+"TNCompletionQueue.fileno() is an eventfd that may be registered with\n"
+"selectors or asyncio to wait for completions. See truenas_api_key.aio\n"
+"for awaitable wrappers.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"workers: int, optional\n"
+"    Number of threads serving the queue. Must be between 1 and 16.\n"
+"    Default: 2.\n\n"
+""
+"Returns\n"
+"-------\n"
+"truenas_keyring.TNCompletionQueue\n"
+"    The new queue. It should be closed when no longer required.\n\n"
+""
+"Raises\n"
+"------\n"
+"ValueError:\n"
+"    Invalid number of workers.\n"
+"truenas_keyring.KeyringError:\n"
+"    Creating the eventfd or worker threads failed (see errno for details).\n\n"
+);
+
+static PyObject *
+tn_create_completion_queue(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {"workers", NULL};
+	int workers = TN_AIO_WORKERS_DEFAULT;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$i:create_completion_queue",
+					 kwlist, &workers)) {
+		return NULL;
+	}
+
+	if ((workers < 1) || (workers > TN_AIO_WORKERS_MAX)) {
+		PyErr_Format(PyExc_ValueError, "workers must be between 1 and %d",
+			     TN_AIO_WORKERS_MAX);
+		return NULL;
+	}
+
+	return py_tn_completion_queue_create(module_obj, (size_t)workers);
+}
+
+PyDoc_STRVAR(tn_create_commit_queue__doc__,
+"create_commit_queue(*, path, description, key_type=KeyType.USER, root=None,\n"
+"                    unlink=None, delay=0.0) -> truenas_keyring.TNCommitQueue\n"
+"----------------------------------------------------------------------------\n\n"
+"Create a write-behind queue of keyring commits. Each commit submitted via\n"
+"TNCommitQueue.submit() replaces the keyring `description` inside the child\n"
+"path + [name] as commit_keyrings() does, but is applied later by a\n"
+"native writer thread. Commits queued for a name that has not yet been\n"
+"applied are coalesced so that only the latest entries are written.\n\n"
+""
+"Parameters\n"
+"----------\n"
+"path: Sequence[str], required\n"
+"    Descriptions of the keyrings leading to the parent of the per-name\n"
+"    keyrings. Resolved once, and created if they don't exist.\n\n"
+"description: str, required\n"
+"    The description of the keyring to replace within each child.\n\n"
+"key_type: str, optional\n"
+"    The type of keys to create. Cannot be \"keyring\".\n"
+"    Default: truenas_keyring.KeyType.USER.\n\n"
+"root: int, optional\n"
+"    The serial number of the keyring to start from.\n"
+"    Default: None (persistent keyring of the current user).\n\n"
+"unlink: Iterable[tuple[str, str]], optional\n"
+"    (key_type, description) of keys to unlink from each child once its\n"
+"    keyring has been replaced, if present. Default: None.\n\n"
+"delay: float, optional\n"
+"    Minimum number of seconds a commit waits before being applied, so\n"
+"    that further commits for the same name can be coalesced with it.\n"
+"    Default: 0.0 (commits only coalesce while the writer is busy).\n\n"
+""
+"Returns\n"
+"-------\n"
+"truenas_keyring.TNCommitQueue\n"
+"    The new queue. Closing it applies any queued commits.\n\n"
+""
+"Raises\n"
+"------\n"
+"TypeError:\n"
+"    Invalid parameter type.\n"
+"ValueError:\n"
+"    Missing required parameter, \"keyring\" key type or negative delay.\n"
+"truenas_keyring.KeyringError:\n"
+"    Resolving path or starting the writer failed (see errno for details).\n\n"
+);
+
+static PyObject *
+tn_create_commit_queue(PyObject *module_obj, PyObject *args, PyObject *kwargs)
+{
+	char * const kwlist[] = {
+		"path", "description", "key_type", "root", "unlink", "delay", NULL
+	};
+	PyObject *path_obj = NULL, *root_obj = Py_None, *unlink_obj = Py_None;
+	PyObject *path_fast = NULL, *unlink_fast = NULL, *out = NULL;
+	const char *description_str = NULL;
+	const char *key_type_str = KEY_TYPE_STR_USER;
+	const char **path = NULL;
+	tn_commit_unlink_t *unlink = NULL;
+	key_serial_t root = 0, parent;
+	size_t path_cnt, unlink_cnt = 0;
+	double delay = 0.0;
+	bool success;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$OssOOd:create_commit_queue",
+					 kwlist, &path_obj, &description_str, &key_type_str,
+					 &root_obj, &unlink_obj, &delay)) {
+		return NULL;
+	}
+
+	if ((path_obj == NULL) || (description_str == NULL)) {
+		PyErr_SetString(PyExc_ValueError, "path and description arguments are required");
+		return NULL;
+	}
+
+	if (strcmp(key_type_str, KEY_TYPE_STR_KEYRING) == 0) {
+		PyErr_SetString(PyExc_ValueError, "Cannot create keyring with commit queue entries");
+		return NULL;
+	}
+
+	if (delay < 0) {
+		PyErr_SetString(PyExc_ValueError, "delay must not be negative");
+		return NULL;
+	}
+
+	if (!parse_unlink_specs(unlink_obj, &unlink_fast, &unlink, &unlink_cnt)) {
+		return NULL;
+	}
+
+	if (!parse_keyring_path(path_obj, root_obj, &path_fast, &path, &path_cnt, &root)) {
+		goto out;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	success = resolve_keyring_path(root, path, path_cnt, true, &parent, NULL);
+	Py_END_ALLOW_THREADS
+
+	if (!success) {
+		PyErr_SetFromErrno(get_keyring_error_from_module(module_obj));
+		goto out;
+	}
+
+	out = py_tn_commit_queue_create(module_obj, parent, description_str, key_type_str,
+					unlink, unlink_cnt, delay);
+
+out:
+	PyMem_RawFree(unlink);
+	PyMem_RawFree(path);
+	Py_XDECREF(path_fast);
+	Py_XDECREF(unlink_fast);
+	return out;
+}
+
 static PyMethodDef tn_module_methods[] = {
 	{
 		.ml_name = "request_key",
@@ -398,6 +2639,162 @@ static PyMethodDef tn_module_methods[] = {
 		.ml_flags = METH_VARARGS | METH_KEYWORDS,
 		.ml_doc = tn_add_keyring__doc__
 	},
+	{
+		.ml_name = "add_keys",
+		.ml_meth = (PyCFunction)tn_add_keys,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_add_keys__doc__
+	},
+	{
+		.ml_name = "resolve_path",
+		.ml_meth = (PyCFunction)tn_resolve_path,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_resolve_path__doc__
+	},
+	{
+		.ml_name = "lookup_payload",
+		.ml_meth = (PyCFunction)tn_lookup_payload,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_lookup_payload__doc__
+	},
+	{
+		.ml_name = "seal_payloads",
+		.ml_meth = (PyCFunction)tn_seal_payloads,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_seal_payloads__doc__
+	},
+	{
+		.ml_name = "open_payloads",
+		.ml_meth = (PyCFunction)tn_open_payloads,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_open_payloads__doc__
+	},
+	{
+		.ml_name = "pack_bundle",
+		.ml_meth = (PyCFunction)tn_pack_bundle,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_pack_bundle__doc__
+	},
+	{
+		.ml_name = "unpack_bundle",
+		.ml_meth = (PyCFunction)tn_unpack_bundle,
+		.ml_flags = METH_O,
+		.ml_doc = tn_unpack_bundle__doc__
+	},
+	{
+		.ml_name = "bundle_lookup",
+		.ml_meth = (PyCFunction)tn_bundle_lookup,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_bundle_lookup__doc__
+	},
+	{
+		.ml_name = "pack_api_key",
+		.ml_meth = (PyCFunction)tn_pack_api_key,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_pack_api_key__doc__
+	},
+	{
+		.ml_name = "unpack_api_key",
+		.ml_meth = (PyCFunction)tn_unpack_api_key,
+		.ml_flags = METH_O,
+		.ml_doc = tn_unpack_api_key__doc__
+	},
+	{
+		.ml_name = "scram_verify",
+		.ml_meth = (PyCFunction)tn_scram_verify,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_scram_verify__doc__
+	},
+	{
+		.ml_name = "scram_verify_sealed",
+		.ml_meth = (PyCFunction)tn_scram_verify_sealed,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_scram_verify_sealed__doc__
+	},
+	{
+		.ml_name = "link_key",
+		.ml_meth = (PyCFunction)tn_link_key,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_link_key__doc__
+	},
+	{
+		.ml_name = "unlink_key",
+		.ml_meth = (PyCFunction)tn_unlink_key,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_unlink_key__doc__
+	},
+	{
+		.ml_name = "move_key",
+		.ml_meth = (PyCFunction)tn_move_key,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_move_key__doc__
+	},
+	{
+		.ml_name = "swap_keyring",
+		.ml_meth = (PyCFunction)tn_swap_keyring,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_swap_keyring__doc__
+	},
+	{
+		.ml_name = "commit_keyrings",
+		.ml_meth = (PyCFunction)tn_commit_keyrings,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_commit_keyrings__doc__
+	},
+	{
+		.ml_name = "clear_descendants",
+		.ml_meth = (PyCFunction)tn_clear_descendants,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_clear_descendants__doc__
+	},
+	{
+		.ml_name = "get_syscall_stats",
+		.ml_meth = (PyCFunction)tn_get_syscall_stats,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_get_syscall_stats__doc__
+	},
+	{
+		.ml_name = "get_read_stats",
+		.ml_meth = (PyCFunction)tn_get_read_stats,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_get_read_stats__doc__
+	},
+	{
+		.ml_name = "create_key_watcher",
+		.ml_meth = (PyCFunction)tn_create_key_watcher,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_create_key_watcher__doc__
+	},
+	{
+		.ml_name = "create_completion_queue",
+		.ml_meth = (PyCFunction)tn_create_completion_queue,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_create_completion_queue__doc__
+	},
+	{
+		.ml_name = "create_commit_queue",
+		.ml_meth = (PyCFunction)tn_create_commit_queue,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_create_commit_queue__doc__
+	},
+	{
+		.ml_name = "get_cache_stats",
+		.ml_meth = (PyCFunction)tn_get_cache_stats,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_get_cache_stats__doc__
+	},
+	{
+		.ml_name = "set_negative_cache",
+		.ml_meth = (PyCFunction)tn_set_negative_cache,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = tn_set_negative_cache__doc__
+	},
+	{
+		.ml_name = "clear_cache",
+		.ml_meth = (PyCFunction)tn_clear_cache,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = tn_clear_cache__doc__
+	},
 	{NULL, NULL, 0, NULL}
 };
 
@@ -406,8 +2803,19 @@ tn_module_clear(PyObject *m)
 {
 	tn_module_state_t *state = (tn_module_state_t *)PyModule_GetState(m);
 	if (state) {
+		size_t i;
+
 		Py_CLEAR(state->special_keyring_enum);
 		Py_CLEAR(state->keytype_enum);
+		for (i = 0; i < ARRAY_SIZE(state->keytype_members); i++) {
+			Py_CLEAR(state->keytype_members[i]);
+		}
+		Py_CLEAR(state->key_event_enum);
+		for (i = 0; i < ARRAY_SIZE(state->key_event_members); i++) {
+			Py_CLEAR(state->key_event_members[i]);
+		}
+		Py_CLEAR(state->key_notification_type);
+		Py_CLEAR(state->api_key_record_type);
 		Py_CLEAR(state->keyring_error);
 	}
 	return 0;
@@ -446,6 +2854,22 @@ PyInit_truenas_keyring(void)
 		return NULL;
 	}
 
+	if (PyType_Ready(&TNKeyringWalkType) < 0) {
+		return NULL;
+	}
+
+	if (PyType_Ready(&TNKeyWatcherType) < 0) {
+		return NULL;
+	}
+
+	if (PyType_Ready(&TNCompletionQueueType) < 0) {
+		return NULL;
+	}
+
+	if (PyType_Ready(&TNCommitQueueType) < 0) {
+		return NULL;
+	}
+
 	m = PyModule_Create(&truenas_keyring_module);
 	if (m == NULL) {
 		return NULL;
@@ -457,6 +2881,16 @@ PyInit_truenas_keyring(void)
 		return NULL;
 	}
 
+	if (tn_key_watcher_add_to_module(m) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	if (tn_api_key_record_add_to_module(m) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
 	/* Create KeyringError exception */
 	tn_module_state_t *state = (tn_module_state_t *)PyModule_GetState(m);
 	if (state == NULL) {
@@ -26,6 +26,25 @@
 #define PYKR_ASSERT(test, message)\
 	__PYKR_ASSERT_IMPL(test, message, __location__);
 
+#define KEY_TYPE_STR_KEYRING "keyring"
+#define KEY_TYPE_STR_USER "user"
+#define KEY_TYPE_STR_LOGON "logon"
+#define KEY_TYPE_STR_BIGKEY "big_key"
+
+/*
+ * Parsed output of keyctl_describe(). The string pointers reference
+ * memory inside desc_buf, which is allocated via PyMem_RawMalloc().
+ */
+typedef struct {
+	char *desc_buf;
+	size_t desc_bufsz;
+	char *description;
+	char *key_type_str;
+	uid_t uid;
+	gid_t gid;
+	uint perm;
+} tn_key_info_t;
+
 typedef struct {
 	PyObject_HEAD
 	key_serial_t c_serial;
@@ -35,6 +54,7 @@ typedef struct {
 	uid_t c_key_uid;
 	gid_t c_key_gid;
 	uint c_key_perm;
+	size_t c_data_len;	/* payload length at last read_data(), 0 if unknown */
 	PyObject *module_obj;
 	PyObject *key_type;
 } py_tnkey_t;
@@ -42,42 +62,646 @@ typedef struct {
 typedef struct {
 	PyObject_HEAD
 	py_tnkey_t *py_key;
+	PyObject *default_key_type;	/* key type for mapping access, NULL for "user" */
 } py_tn_keyring_t;
 
+/*
+ * Key metadata gathered by the iterator while the GIL is released. If
+ * error is non-zero, describing the key failed with that errno and the
+ * error is raised when the iterator reaches this entry.
+ */
+typedef struct {
+	key_serial_t serial;
+	int error;
+	tn_key_info_t info;
+} tn_prefetch_entry_t;
+
+/*
+ * Payloads of keys read from a keyring in a single GIL-released pass.
+ * Descriptions (NUL-terminated) and payloads are packed into blob and
+ * referenced from entries by offset so that the blob may be grown while
+ * it is being filled.
+ */
+typedef struct {
+	key_serial_t serial;
+	size_t desc_off;
+	size_t data_off;
+	size_t data_len;
+} tn_payload_entry_t;
+
+typedef struct {
+	tn_payload_entry_t *entries;
+	size_t cnt;
+	size_t alloc;
+	char *blob;
+	size_t blob_len;
+	size_t blob_alloc;
+} tn_payload_set_t;
+
+/*
+ * Key to be added by add_key_entries(). The description and data pointers
+ * reference memory owned by python objects that must be kept alive while
+ * the GIL is released. A timeout of TN_NO_TIMEOUT leaves the key expiry
+ * untouched.
+ */
+#define TN_NO_TIMEOUT ((int64_t)-1)
+
+typedef struct {
+	const char *description;
+	const char *data;
+	size_t data_len;
+	int64_t timeout;
+	key_serial_t serial;
+} tn_add_entry_t;
+
+/* State of a breadth-first keyring tree walk (see py_tn_keyring_walk.c) */
+typedef struct tn_walk tn_walk_t;
+
+typedef struct {
+	PyObject_HEAD
+	py_tn_keyring_t *keyring;
+	tn_walk_t *walk;
+	size_t next;		/* next node to yield */
+	bool busy;
+} py_tn_keyring_walk_t;
+
+/* Operation counts from reconcile_keyring() */
+typedef struct {
+	size_t added;
+	size_t updated;
+	size_t removed;
+	size_t unchanged;
+} tn_reconcile_stats_t;
+
+/*
+ * Filter applied to the parsed description of each key while listing a
+ * keyring so that non-matching keys never become python objects. Strings
+ * are owned by the filter (see free_key_filter()).
+ */
+typedef struct {
+	char *key_type_str;		/* NULL matches any type */
+	char *description;		/* exact match, NULL matches any */
+	char *description_prefix;	/* NULL matches any */
+	size_t prefix_len;
+	uid_t uid;			/* (uid_t)-1 matches any */
+	gid_t gid;			/* (gid_t)-1 matches any */
+	uint perm_mask;			/* bits that must all be set in perm */
+} tn_key_filter_t;
+
 typedef struct {
 	PyObject_HEAD
 	py_tn_keyring_t *keyring;
+	tn_key_filter_t filter;
 	key_serial_t *keys;
 	size_t key_count;
 	size_t current_index;
+	tn_prefetch_entry_t *prefetch;
+	size_t prefetch_size;
+	size_t prefetch_cnt;
+	size_t prefetch_idx;
+	bool prefetch_busy;
 	bool unlink_expired;
 	bool unlink_revoked;
 } py_tn_keyring_iter_t;
 
+/* Watch IDs are 8 bits wide in notification records */
+#define TN_WATCH_ID_CNT 256
+
+/* Most notifications the kernel allows in a watch queue */
+#define TN_WATCH_QUEUE_MAX 512
+#define TN_WATCH_QUEUE_DEFAULT 256
+
+/*
+ * Key change notification queue. fds is the notification pipe, and
+ * watches maps each watch ID to the serial of the watched key (0 if
+ * the watch ID is unused).
+ */
+typedef struct {
+	PyObject_HEAD
+	int fds[2];
+	key_serial_t watches[TN_WATCH_ID_CNT];
+	PyObject *module_obj;
+} py_tn_key_watcher_t;
+
+/*
+ * Events reported by TNKeyWatcher. The first eight values match the
+ * kernel's enum key_notification_subtype. REMOVED and LOSS are generated
+ * from watch queue meta notifications.
+ */
+enum tn_key_event {
+	TN_KEY_EVENT_INSTANTIATED = 0,
+	TN_KEY_EVENT_UPDATED,
+	TN_KEY_EVENT_LINKED,
+	TN_KEY_EVENT_UNLINKED,
+	TN_KEY_EVENT_CLEARED,
+	TN_KEY_EVENT_REVOKED,
+	TN_KEY_EVENT_INVALIDATED,
+	TN_KEY_EVENT_SETATTR,
+	TN_KEY_EVENT_REMOVED,
+	TN_KEY_EVENT_LOSS,
+	TN_KEY_EVENT_CNT
+};
+
+enum tn_keytype_idx {
+	TN_KEYTYPE_KEYRING = 0,
+	TN_KEYTYPE_USER,
+	TN_KEYTYPE_LOGON,
+	TN_KEYTYPE_BIGKEY,
+	TN_KEYTYPE_CNT
+};
+
 typedef struct {
 	PyObject *special_keyring_enum;
 	PyObject *keytype_enum;
+	PyObject *keytype_members[TN_KEYTYPE_CNT];
+	PyObject *key_event_enum;
+	PyObject *key_event_members[TN_KEY_EVENT_CNT];
+	PyObject *key_notification_type;
+	PyObject *api_key_record_type;
 	PyObject *keyring_error;
 } tn_module_state_t;
 
+/*
+ * Counters for keyctl syscalls issued by this module. These are exposed
+ * via get_syscall_stats() so that tests can verify syscall cost of
+ * the various code paths.
+ */
+enum tn_syscall_stat {
+	TN_STAT_DESCRIBE = 0,
+	TN_STAT_READ,
+	TN_STAT_SEARCH,
+	TN_STAT_ADD,
+	TN_STAT_SET_TIMEOUT,
+	TN_STAT_UPDATE,
+	TN_STAT_UNLINK,
+	TN_STAT_LINK,
+	TN_STAT_MOVE,
+	TN_STAT_CLEAR,
+	TN_STAT_CNT
+};
+
+extern unsigned long tn_syscall_stats[TN_STAT_CNT];
+extern const char *tn_syscall_stat_names[TN_STAT_CNT];
+
+#define TN_STAT_INC(stat) \
+	__atomic_fetch_add(&tn_syscall_stats[stat], 1, __ATOMIC_RELAXED)
+
+/*
+ * Hit / miss counters for the optimistic read helpers in py_key_utils.c.
+ * A hit means that the first syscall returned the complete result; a miss
+ * means that the buffer was too small and the call had to be repeated.
+ * Exposed via get_read_stats().
+ */
+enum tn_read_stat {
+	TN_READ_STAT_DESCRIBE_HIT = 0,
+	TN_READ_STAT_DESCRIBE_MISS,
+	TN_READ_STAT_SERIALS_HIT,
+	TN_READ_STAT_SERIALS_MISS,
+	TN_READ_STAT_PAYLOAD_HIT,
+	TN_READ_STAT_PAYLOAD_MISS,
+	TN_READ_STAT_DATA_HIT,
+	TN_READ_STAT_DATA_MISS,
+	TN_READ_STAT_CNT
+};
+
+extern unsigned long tn_read_stats[TN_READ_STAT_CNT];
+extern const char *tn_read_stat_names[TN_READ_STAT_CNT];
+
+#define TN_READ_STAT_INC(stat) \
+	__atomic_fetch_add(&tn_read_stats[stat], 1, __ATOMIC_RELAXED)
+
+/*
+ * Counters for the keyring search cache (see py_key_cache.c). Exposed via
+ * get_cache_stats().
+ */
+enum tn_cache_stat {
+	TN_CACHE_STAT_HIT = 0,
+	TN_CACHE_STAT_MISS,
+	TN_CACHE_STAT_STALE,
+	TN_CACHE_STAT_FLUSH,
+	TN_CACHE_STAT_NEG_HIT,
+	TN_CACHE_STAT_CNT
+};
+
+extern unsigned long tn_cache_stats[TN_CACHE_STAT_CNT];
+extern const char *tn_cache_stat_names[TN_CACHE_STAT_CNT];
+
+/* from py_scratch.c */
+void *scratch_alloc(size_t size);
+void scratch_free(void *ptr);
+size_t scratch_size(const void *ptr);
+void *scratch_tls_get(size_t size);
+void scratch_tls_put(void *buf, size_t used);
+
+/* from py_key_cache.c */
+void key_cache_insert(key_serial_t parent, const char *key_type_str,
+		      const char *description, key_serial_t serial);
+void key_cache_forget(const char *key_type_str, const char *description);
+void key_cache_flush(void);
+void key_cache_set_negative(uint64_t ttl_ns, size_t max_entries);
+size_t key_cache_size(void);
+
+static inline long
+tn_keyctl_describe(key_serial_t id, char *buffer, size_t buflen)
+{
+	TN_STAT_INC(TN_STAT_DESCRIBE);
+	return keyctl_describe(id, buffer, buflen);
+}
+
+static inline long
+tn_keyctl_read(key_serial_t id, char *buffer, size_t buflen)
+{
+	TN_STAT_INC(TN_STAT_READ);
+	return keyctl_read(id, buffer, buflen);
+}
+
+static inline long
+tn_keyctl_search(key_serial_t ringid, const char *type,
+		 const char *description, key_serial_t destringid)
+{
+	TN_STAT_INC(TN_STAT_SEARCH);
+	return keyctl_search(ringid, type, description, destringid);
+}
+
+static inline key_serial_t
+tn_sys_add_key(const char *type, const char *description, const void *payload,
+	       size_t plen, key_serial_t ringid)
+{
+	key_serial_t serial;
+
+	TN_STAT_INC(TN_STAT_ADD);
+	serial = add_key(type, description, payload, plen, ringid);
+	if (serial != -1) {
+		/*
+		 * The new key displaces any key of the same type and description
+		 * in ringid. A displaced keyring takes its contents with it, which
+		 * may include cached search results, unless it was a private
+		 * staging keyring in the thread keyring.
+		 */
+		if ((strcmp(type, KEY_TYPE_STR_KEYRING) == 0) && (ringid != KEY_SPEC_THREAD_KEYRING)) {
+			key_cache_flush();
+		} else {
+			key_cache_forget(type, description);
+		}
+	}
+
+	return serial;
+}
+
+static inline long
+tn_keyctl_update(key_serial_t id, const void *payload, size_t plen)
+{
+	TN_STAT_INC(TN_STAT_UPDATE);
+	return keyctl_update(id, payload, plen);
+}
+
+static inline long
+tn_keyctl_unlink(key_serial_t id, key_serial_t ringid)
+{
+	long ret;
+
+	TN_STAT_INC(TN_STAT_UNLINK);
+	ret = keyctl_unlink(id, ringid);
+	if (ret != -1) {
+		key_cache_flush();
+	}
+
+	return ret;
+}
+
+static inline long
+tn_keyctl_link(key_serial_t id, key_serial_t ringid)
+{
+	long ret;
+
+	TN_STAT_INC(TN_STAT_LINK);
+	ret = keyctl_link(id, ringid);
+	if (ret != -1) {
+		key_cache_flush();
+	}
+
+	return ret;
+}
+
+static inline long
+tn_keyctl_move(key_serial_t id, key_serial_t from_ringid,
+	       key_serial_t to_ringid, unsigned int flags)
+{
+	long ret;
+
+	TN_STAT_INC(TN_STAT_MOVE);
+	ret = keyctl_move(id, from_ringid, to_ringid, flags);
+	if (ret != -1) {
+		key_cache_flush();
+	}
+
+	return ret;
+}
+
+static inline long
+tn_keyctl_clear(key_serial_t ringid)
+{
+	long ret;
+
+	TN_STAT_INC(TN_STAT_CLEAR);
+	ret = keyctl_clear(ringid);
+	if (ret != -1) {
+		key_cache_flush();
+	}
+
+	return ret;
+}
+
+static inline long
+tn_keyctl_set_timeout(key_serial_t id, unsigned int timeout)
+{
+	TN_STAT_INC(TN_STAT_SET_TIMEOUT);
+	return keyctl_set_timeout(id, timeout);
+}
+
 extern PyTypeObject TNKeyType;
 extern PyTypeObject TNKeyringType;
 extern PyTypeObject TNKeyringIterType;
+extern PyTypeObject TNKeyringWalkType;
+extern PyTypeObject TNKeyWatcherType;
+extern PyTypeObject TNCompletionQueueType;
+extern PyTypeObject TNCommitQueueType;
 
 int tn_key_add_enums_to_module(PyObject *module);
+PyObject *tn_keytype_lookup(tn_module_state_t *state, const char *key_type_str);
+
+/* from py_tn_key.c */
+py_tnkey_t *py_tnkey_from_info(key_serial_t serial, tn_key_info_t *info, PyObject *module_obj);
+
+/* from py_tn_keyring.c */
+PyObject *py_tn_keyring_from_key(py_tnkey_t *py_key);
+
+/* from py_scram.c */
+#define TN_SCRAM_KEY_LEN 64 /* SHA-512 digest length */
+bool scram_verify_proof(const unsigned char *stored_key, const unsigned char *server_key,
+			const unsigned char *client_proof, const unsigned char *auth_message,
+			size_t auth_message_len, unsigned char *server_sig);
+
+/*
+ * Sealed API key payload to be verified by scram_verify_sealed(). Inputs
+ * must remain valid while the GIL is released. plaintext is allocated by
+ * caller and must be at least payload_len - TN_SEAL_OVERHEAD bytes.
+ */
+typedef struct {
+	const unsigned char *key;
+	const unsigned char *payload;
+	size_t payload_len;
+	const char *username;
+	size_t username_len;
+	int64_t dbid;
+	const unsigned char *client_proof;
+	const unsigned char *auth_message;
+	size_t auth_message_len;
+	unsigned char *plaintext;
+	size_t plaintext_len;
+	unsigned char server_sig[TN_SCRAM_KEY_LEN];
+} tn_scram_sealed_t;
+
+enum tn_scram_sealed_status {
+	TN_SCRAM_SEALED_MATCH,		/* server_sig is filled in */
+	TN_SCRAM_SEALED_NO_MATCH,
+	TN_SCRAM_SEALED_TEXT,		/* not a binary record, see plaintext */
+	TN_SCRAM_SEALED_UNREADABLE,	/* failed to open payload */
+	TN_SCRAM_SEALED_CORRUPT,
+	TN_SCRAM_SEALED_WRONG_OWNER,
+	TN_SCRAM_SEALED_ERROR,		/* errno is set */
+};
+
+enum tn_scram_sealed_status scram_verify_sealed(tn_scram_sealed_t *req);
+
+/* from py_payload_seal.c */
+#define TN_SEAL_VERSION 1
+#define TN_SEAL_KEY_LEN 32 /* AES-256 */
+#define TN_SEAL_IV_LEN 12
+#define TN_SEAL_TAG_LEN 16
+#define TN_SEAL_OVERHEAD (1 + TN_SEAL_IV_LEN + TN_SEAL_TAG_LEN)
+#define TN_SEAL_THREADS_MAX 16
+
+/*
+ * Payload to be sealed or opened by seal_payloads(). in references memory
+ * owned by a python object that must be kept alive while the GIL is
+ * released. out is allocated by caller.
+ */
+typedef struct {
+	const unsigned char *in;
+	size_t in_len;
+	unsigned char *out;
+	size_t out_len;
+	bool ok;
+} tn_seal_item_t;
+
+bool seal_payloads(const unsigned char *key, tn_seal_item_t *items, size_t cnt,
+		   size_t nthreads, bool decrypt);
+
+/* from py_commit_pool.c */
+#define TN_COMMIT_WORKERS_MAX 64
+
+/*
+ * Keyring to be committed by commit_keyrings(): entries replace the
+ * contents of the keyring inside the child of root named `name`. Pointers
+ * reference memory owned by python objects that must be kept alive while
+ * the GIL is released.
+ */
+typedef struct {
+	const char *name;
+	tn_add_entry_t *entries;
+	size_t cnt;
+	key_serial_t serial;	/* new keyring on success */
+	int error;		/* errno on failure */
+} tn_commit_job_t;
+
+/* Key to unlink from each child of root once its keyring is committed */
+typedef struct {
+	const char *key_type_str;
+	const char *description;
+} tn_commit_unlink_t;
+
+bool commit_keyring(key_serial_t root, const char *name, const char *description,
+		    const char *key_type_str, const tn_commit_unlink_t *unlink,
+		    size_t unlink_cnt, tn_add_entry_t *entries, size_t cnt,
+		    key_serial_t *serial_out);
+void commit_keyrings(key_serial_t root, const char *description, const char *key_type_str,
+		     const tn_commit_unlink_t *unlink, size_t unlink_cnt,
+		     tn_commit_job_t *jobs, size_t cnt, size_t workers);
+
+/* Outcome of clear_keyrings() for one child of root */
+enum tn_clear_result {
+	TN_CLEAR_CLEARED = 0,
+	TN_CLEAR_SKIPPED,	/* not a live keyring or description not found */
+	TN_CLEAR_FAILED,	/* see error */
+};
+
+typedef struct {
+	key_serial_t child;
+	key_serial_t target;	/* keyring that was cleared */
+	enum tn_clear_result result;
+	int error;
+} tn_clear_job_t;
+
+bool clear_keyrings(key_serial_t root, const char *description,
+		    const tn_commit_unlink_t *unlink, size_t unlink_cnt,
+		    tn_clear_job_t **jobs_out, size_t *cnt_out, size_t workers);
+
+/* from py_key_bundle.c */
+#define TN_BUNDLE_MAGIC "TNKB"
+#define TN_BUNDLE_VERSION 1
+
+/*
+ * Entry in a key bundle. When packing, data references memory owned by a
+ * python object. When reading, it references the bundle buffer.
+ */
+typedef struct {
+	int64_t dbid;
+	int64_t expiry;
+	const char *data;
+	size_t data_len;
+} tn_bundle_entry_t;
+
+bool bundle_prepare(tn_bundle_entry_t *entries, size_t cnt, size_t *size_out);
+void bundle_pack(const tn_bundle_entry_t *entries, size_t cnt, unsigned char *buf);
+bool bundle_check(const unsigned char *buf, size_t len, size_t *cnt_out);
+void bundle_get(const unsigned char *buf, size_t i, tn_bundle_entry_t *entry);
+bool bundle_find(const unsigned char *buf, size_t cnt, int64_t dbid, time_t now,
+		 tn_bundle_entry_t *entry);
+PyObject *bundle_to_dict(const unsigned char *buf, size_t cnt, time_t now);
+
+/* from py_api_key_record.c */
+#define TN_API_KEY_RECORD_MAGIC "TNAK"
+#define TN_API_KEY_RECORD_VERSION 1
+#define TN_API_KEY_FIELD_MAX UINT16_MAX
+
+enum tn_api_key_alg {
+	TN_API_KEY_ALG_SHA512 = 0,
+	TN_API_KEY_ALG_CNT
+};
+
+typedef struct {
+	const void *buf;
+	size_t len;
+} tn_api_key_field_t;
+
+typedef struct {
+	tn_api_key_field_t username;
+	int64_t dbid;
+	enum tn_api_key_alg algorithm;
+	uint32_t iterations;
+	int64_t expiry;
+	tn_api_key_field_t salt;
+	tn_api_key_field_t server_key;
+	tn_api_key_field_t stored_key;
+} tn_api_key_record_t;
+
+bool api_key_alg_from_name(const char *name, enum tn_api_key_alg *alg_out);
+bool api_key_record_parse(const unsigned char *buf, size_t len, tn_api_key_record_t *rec);
+PyObject *api_key_record_pack(const tn_api_key_record_t *rec);
+PyObject *api_key_record_unpack(PyObject *module_obj, const unsigned char *buf, size_t len);
+int tn_api_key_record_add_to_module(PyObject *module);
+
+/* from py_tn_key_watcher.c */
+int tn_key_watcher_add_to_module(PyObject *module);
+PyObject *py_tn_key_watcher_create(PyObject *module_obj, unsigned int queue_size);
+
+/* from py_tn_completion_queue.c */
+#define TN_AIO_WORKERS_MAX 16
+#define TN_AIO_WORKERS_DEFAULT 2
+PyObject *py_tn_completion_queue_create(PyObject *module_obj, size_t workers);
+
+/* from py_tn_commit_queue.c */
+PyObject *py_tn_commit_queue_create(PyObject *module_obj, key_serial_t root, const char *description,
+				    const char *key_type_str, const tn_commit_unlink_t *unlink,
+				    size_t unlink_cnt, double delay);
+
+/* from py_tn_keyring_iter.c */
+PyObject *py_tn_keyring_iter_create(py_tn_keyring_t *keyring, bool unlink_expired,
+				    bool unlink_revoked, size_t prefetch,
+				    tn_key_filter_t *filter);
+
+/* from py_tn_keyring_walk.c */
+tn_walk_t *keyring_walk_new(key_serial_t root, size_t max_depth, const char *key_type_str);
+bool keyring_walk_level(tn_walk_t *walk);
+void keyring_walk_free(tn_walk_t *walk);
+PyObject *py_tn_keyring_walk_create(py_tn_keyring_t *keyring, size_t max_depth,
+				    const char *key_type_str);
+PyObject *py_tn_keyring_walk_flat(py_tn_keyring_t *keyring, size_t max_depth,
+				  const char *key_type_str);
 
 /* from py_key_utils.c */
-char *get_key_description(key_serial_t serial);
+bool describe_key(key_serial_t serial, tn_key_info_t *info);
+bool parse_key_description(tn_key_info_t *info);
+void free_key_info(tn_key_info_t *info);
+bool key_filter_match(const tn_key_filter_t *filter, const tn_key_info_t *info);
+void free_key_filter(tn_key_filter_t *filter);
 bool check_key_type(key_serial_t serial, const char *key_type_str, bool *match_out);
+bool check_keyring(key_serial_t serial);
+bool read_keyring_serials(key_serial_t serial, key_serial_t **keys_out, size_t *cnt_out);
+bool keyring_links(key_serial_t ring, key_serial_t target, bool *found);
 bool get_keyring_serials(key_serial_t serial, key_serial_t **keys_out, size_t *cnt_out);
-bool get_key_data(key_serial_t serial, char **data_out, size_t *data_len);
+bool read_key_payload(key_serial_t serial, char **data_out, size_t *data_len);
+size_t payload_size_hint(void);
+void payload_size_observe(size_t size);
+bool lookup_key_payload(key_serial_t root, const char **path, size_t cnt,
+			const char *key_type_str, const char *description,
+			char **data_out, size_t *data_len);
+bool parse_keyring_path(PyObject *path_obj, PyObject *root_obj, PyObject **path_fast,
+			const char ***path_out, size_t *cnt_out, key_serial_t *root_out);
+bool read_keyring_payloads(key_serial_t serial, const char *key_type_str,
+			   bool unlink_expired, bool unlink_revoked,
+			   tn_payload_set_t *set);
+bool read_keyring_descriptions(key_serial_t serial, const char *key_type_str,
+			       tn_payload_set_t *set);
+void free_payload_set(tn_payload_set_t *set);
+bool parse_add_entries(PyObject *entries, PyObject **entries_fast,
+		       tn_add_entry_t **entries_out, size_t *cnt_out);
+bool add_key_entries(const char *key_type_str, key_serial_t target,
+		     tn_add_entry_t *entries, size_t cnt, size_t *done);
+bool move_key(key_serial_t serial, key_serial_t from_ring, key_serial_t to_ring,
+	      bool exclusive);
+bool swap_in_keyring(key_serial_t parent, const char *description,
+		     const char *key_type_str, tn_add_entry_t *entries,
+		     size_t cnt, key_serial_t *new_out);
+bool resolve_keyring_path(key_serial_t root, const char **path, size_t cnt,
+			  bool create, key_serial_t *out, tn_key_info_t *info);
+key_serial_t cached_keyring_search(key_serial_t parent, const char *key_type_str,
+				   const char *description, tn_key_info_t *info);
+bool reconcile_keyring(key_serial_t serial, const char *key_type_str,
+		       tn_add_entry_t *entries, size_t cnt, bool dry_run,
+		       tn_reconcile_stats_t *stats);
+PyObject *payload_set_to_dict(const tn_payload_set_t *set);
+PyObject *create_key_object_from_info(key_serial_t key_serial, tn_key_info_t *info,
+				      PyObject *module_obj);
 PyObject *create_key_object_from_serial(key_serial_t key_serial, PyObject *module_obj);
 
 /* Helper function to get KeyringError from module */
 PyObject *get_keyring_error_from_module(PyObject *module_obj);
 
-#define KEY_TYPE_STR_KEYRING "keyring"
-#define KEY_TYPE_STR_USER "user"
-#define KEY_TYPE_STR_LOGON "logon"
-#define KEY_TYPE_STR_BIGKEY "big_key"
+#ifndef KEYCTL_MOVE_EXCL
+#define KEYCTL_MOVE_EXCL 0x00000001
+#endif
+
+/* Initial buffer size for single-read payload lookups */
+#define TN_PAYLOAD_BUFSZ 1024
+
+/*
+ * Largest payload size hint for which the first TNKey.read_data() of a key
+ * reads straight into a bytes object of that size. Above it the read goes
+ * through the scratch buffer rather than allocating the hint for every read.
+ */
+#define TN_READ_DATA_DIRECT_MAX (64 * 1024)
+
+/* Initial buffer size for reading keyring contents (256 serials) */
+#define TN_SERIALS_BUFSZ (256 * sizeof(key_serial_t))
+
+/* Default number of keys described per GIL release by keyring iterators */
+#define TN_ITER_PREFETCH_DEFAULT 64
+
+/* Placeholder for uid / gid / perm that couldn't be parsed from description */
+#define TNKEY_NOVAL -2
+
+/* Initial buffer size for keyctl_describe(). Grown if the kernel needs more. */
+#define TN_DESC_BUFSZ 256
 #endif
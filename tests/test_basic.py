@@ -1,7 +1,24 @@
+import base64
+import errno
+import hashlib
+import hmac
+import os
 import pytest
+import threading
+import time
 import truenas_keyring
 
 
+def libkeyutils():
+    """ The libkeyutils loaded by the extension, for changes made behind its back """
+    import ctypes
+
+    with open('/proc/self/maps') as f:
+        path = next(line.split()[-1] for line in f if 'libkeyutils' in line)
+
+    return ctypes.CDLL(path)
+
+
 def test_module_import():
     """Test that the module can be imported successfully."""
     assert hasattr(truenas_keyring, 'KeyType')
@@ -25,6 +42,34 @@ def test_module_methods_exist():
     assert hasattr(truenas_keyring, 'get_persistent_keyring')
     assert hasattr(truenas_keyring, 'add_key')
     assert hasattr(truenas_keyring, 'add_keyring')
+    assert hasattr(truenas_keyring, 'add_keys')
+    assert hasattr(truenas_keyring, 'get_syscall_stats')
+    assert hasattr(truenas_keyring, 'link_key')
+    assert hasattr(truenas_keyring, 'unlink_key')
+    assert hasattr(truenas_keyring, 'move_key')
+    assert hasattr(truenas_keyring, 'swap_keyring')
+    assert hasattr(truenas_keyring, 'commit_keyrings')
+    assert hasattr(truenas_keyring, 'clear_descendants')
+    assert hasattr(truenas_keyring, 'resolve_path')
+    assert hasattr(truenas_keyring, 'get_cache_stats')
+    assert hasattr(truenas_keyring, 'get_read_stats')
+    assert hasattr(truenas_keyring, 'clear_cache')
+    assert hasattr(truenas_keyring, 'set_negative_cache')
+    assert hasattr(truenas_keyring, 'lookup_payload')
+    assert hasattr(truenas_keyring, 'scram_verify')
+    assert hasattr(truenas_keyring, 'pack_api_key')
+    assert hasattr(truenas_keyring, 'seal_payloads')
+    assert hasattr(truenas_keyring, 'pack_bundle')
+    assert hasattr(truenas_keyring, 'unpack_bundle')
+    assert hasattr(truenas_keyring, 'bundle_lookup')
+    assert hasattr(truenas_keyring, 'open_payloads')
+    assert hasattr(truenas_keyring, 'unpack_api_key')
+    assert hasattr(truenas_keyring, 'ApiKeyRecord')
+    assert hasattr(truenas_keyring, 'create_key_watcher')
+    assert hasattr(truenas_keyring, 'create_completion_queue')
+    assert hasattr(truenas_keyring, 'create_commit_queue')
+    assert hasattr(truenas_keyring, 'KeyEvent')
+    assert hasattr(truenas_keyring, 'KeyNotification')
 
 
 def test_get_persistent_keyring():
@@ -34,6 +79,7 @@ def test_get_persistent_keyring():
     assert hasattr(keyring, 'key')
     assert hasattr(keyring, 'clear')
     assert hasattr(keyring, 'list_keyring_contents')
+    assert hasattr(keyring, 'try_search')
 
     # Test that key returns a TNKey object
     key_obj = keyring.key
@@ -100,6 +146,100 @@ def test_add_key():
     truenas_keyring.revoke_key(serial=new_key.serial)
 
 
+def test_read_data_into():
+    """Test reading key payloads into caller-provided buffers."""
+    import mmap
+
+    parent_serial = truenas_keyring.get_persistent_keyring().key.serial
+    test_data = os.urandom(3000)
+    key = truenas_keyring.add_key(
+        key_type="user", description="test_read_into", data=test_data, target_keyring=parent_serial
+    )
+
+    buf = bytearray(4096)
+    assert key.read_data_into(buf) == len(test_data)
+    assert bytes(buf[:len(test_data)]) == test_data
+
+    view = memoryview(bytearray(len(test_data) + 10))[5:]
+    assert key.read_data_into(view) == len(test_data)
+    assert bytes(view[:len(test_data)]) == test_data
+
+    with mmap.mmap(-1, mmap.PAGESIZE) as m:
+        assert key.read_data_into(m) == len(test_data)
+        assert m[:len(test_data)] == test_data
+
+    # Short buffer is left untouched
+    short = bytearray(10)
+    with pytest.raises(ValueError, match="too small"):
+        key.read_data_into(short)
+    assert short == bytearray(10)
+
+    with pytest.raises(BufferError):
+        key.read_data_into(b"immutable")
+
+    # read_data() follows payload size changes
+    truenas_keyring.add_key(
+        key_type="user", description="test_read_into", data=b"short", target_keyring=parent_serial
+    )
+    assert key.read_data() == b"short"
+
+    with pytest.raises(ValueError):
+        truenas_keyring.get_persistent_keyring().key.read_data_into(buf)
+
+    truenas_keyring.revoke_key(serial=key.serial)
+
+
+def test_read_stats():
+    """Test that repeat reads of known sizes take a single syscall."""
+    parent_keyring = truenas_keyring.get_persistent_keyring()
+    test_keyring = truenas_keyring.add_keyring(
+        description="test_read_stats", target_keyring=parent_keyring.key.serial
+    )
+    keys = [
+        truenas_keyring.add_key(
+            key_type="user", description=f"k{i}", data=os.urandom(100 + i), target_keyring=test_keyring.key.serial
+        )
+        for i in range(4)
+    ]
+
+    # First pass populates size hints
+    test_keyring.list_keyring_contents()
+    for key in keys:
+        key.read_data()
+
+    truenas_keyring.get_read_stats(reset=True)
+    truenas_keyring.get_syscall_stats(reset=True)
+    test_keyring.list_keyring_contents()
+    for key in keys:
+        key.read_data()
+
+    stats = truenas_keyring.get_read_stats(reset=True)
+    assert all(v == 0 for k, v in stats.items() if k.endswith('_miss')), stats
+    assert stats['read_data_hit'] == len(keys)
+    # one serials read for the keyring, one describe and one payload read per key
+    syscalls = truenas_keyring.get_syscall_stats(reset=True)
+    assert syscalls['read'] == 1 + len(keys)
+    assert syscalls['describe'] == len(keys)
+
+    # A larger payload is a miss that grows the buffer, then hits again
+    big = os.urandom(8000)
+    truenas_keyring.add_key(key_type="user", description="k0", data=big, target_keyring=test_keyring.key.serial)
+    assert keys[0].read_data() == big
+    assert keys[0].read_data() == big
+    stats = truenas_keyring.get_read_stats(reset=True)
+    assert stats['read_data_miss'] == 1
+    assert stats['read_data_hit'] == 1
+
+    # First read of a new key object goes straight into a bytes object
+    fresh = test_keyring.search(key_type="user", description="k1")
+    truenas_keyring.get_syscall_stats(reset=True)
+    assert fresh.read_data() == keys[1].read_data()
+    assert truenas_keyring.get_syscall_stats(reset=True)['read'] == 2
+    assert truenas_keyring.get_read_stats(reset=True)['payload_hit'] == 1
+
+    truenas_keyring.revoke_key(serial=test_keyring.key.serial)
+
+
 def test_add_key_rejects_keyring_type():
     """Test that add_key rejects keyring type."""
     parent_keyring = truenas_keyring.get_persistent_keyring()
@@ -135,3 +275,1212 @@ def test_invalidate_invalid_serial():
     """Test invalidating a key with invalid serial."""
     with pytest.raises(truenas_keyring.KeyringError):
         truenas_keyring.invalidate_key(serial=999999999)
+
+
+def test_keyring_serials():
+    """Test serial-only listing of a keyring."""
+    import array
+
+    parent_keyring = truenas_keyring.get_persistent_keyring()
+    test_keyring = truenas_keyring.add_keyring(
+        description="test_keyring_serials", target_keyring=parent_keyring.key.serial
+    )
+    serial = test_keyring.key.serial
+
+    assert len(test_keyring) == 0
+    assert len(test_keyring.serials()) == 0
+
+    keys = [
+        truenas_keyring.add_key(key_type="user", description=f"s{i}", data=b"x", target_keyring=serial)
+        for i in range(300)
+    ]
+    nested = truenas_keyring.add_keyring(description="nested", target_keyring=serial)
+
+    view = test_keyring.serials()
+    assert view.format == 'i'
+    assert view.readonly
+    assert sorted(view.tolist()) == sorted([k.serial for k in keys] + [nested.key.serial])
+    assert array.array('i', view).tolist() == view.tolist()
+    assert {getattr(k, 'key', k).serial for k in test_keyring.list_keyring_contents()} == set(view.tolist())
+
+    assert len(test_keyring) == 301
+    assert keys[5].serial in test_keyring
+    assert keys[5] in test_keyring
+    assert nested in test_keyring
+    assert serial not in test_keyring
+    assert 2 ** 40 not in test_keyring
+    with pytest.raises(TypeError):
+        1.5 in test_keyring
+
+    truenas_keyring.unlink_key(serial=keys[5].serial, keyring=serial)
+    assert keys[5].serial not in test_keyring
+    assert len(test_keyring) == 300
+
+    truenas_keyring.revoke_key(serial=serial)
+    with pytest.raises(truenas_keyring.KeyringError):
+        test_keyring.serials()
+    with pytest.raises(truenas_keyring.KeyringError):
+        len(test_keyring)
+
+
+def test_keyring_mapping():
+    """Test dict-style access to keyring payloads."""
+    parent_keyring = truenas_keyring.get_persistent_keyring()
+    ring = truenas_keyring.add_keyring(description="test_keyring_mapping", target_keyring=parent_keyring.key.serial)
+
+    assert ring.default_key_type == truenas_keyring.KeyType.USER
+    assert ring.keys() == []
+    assert "1" not in ring
+    assert ring.get("1") is None
+    assert ring.get("1", b"dflt") == b"dflt"
+    with pytest.raises(KeyError):
+        ring["1"]
+    with pytest.raises(KeyError):
+        del ring["1"]
+
+    ring["1"] = b"one"
+    ring["2"] = bytearray(b"two")
+    ring["big"] = b"x" * 20000
+    assert ring["1"] == b"one"
+    assert "2" in ring
+    assert ring.get("big") == b"x" * 20000
+    assert dict(ring.items()) == {"1": b"one", "2": b"two", "big": b"x" * 20000}
+    assert sorted(ring.keys()) == sorted(ring) == ["1", "2", "big"]
+    assert sorted(ring.values()) == sorted([b"one", b"two", b"x" * 20000])
+
+    # Assignment replaces the existing key in place
+    serial = ring.search(key_type="user", description="1").serial
+    ring["1"] = b"uno"
+    assert ring["1"] == b"uno"
+    assert ring.search(key_type="user", description="1").serial == serial
+    assert len(ring) == 3
+
+    del ring["2"]
+    assert "2" not in ring
+    assert len(ring) == 2
+
+    # Keys of other types are not visible through the mapping
+    truenas_keyring.add_key(key_type="logon", description="lg:1", data=b"secret", target_keyring=ring.key.serial)
+    assert "lg:1" not in ring
+    ring.default_key_type = truenas_keyring.KeyType.LOGON
+    assert "lg:1" in ring
+    assert ring.keys() == ["lg:1"]
+    assert "1" not in ring
+    del ring.default_key_type
+    assert ring.default_key_type == "user"
+
+    # Only keys linked directly into the keyring are visible, and names are
+    # listed without reading payloads
+    nested = truenas_keyring.add_keyring(description="nested", target_keyring=ring.key.serial)
+    nested["deep"] = b"deep"
+    assert "deep" not in ring
+    assert ring.get("deep") is None
+    with pytest.raises(KeyError):
+        ring["deep"]
+    with pytest.raises(KeyError):
+        del ring["deep"]
+    assert "deep" not in ring.keys()
+    truenas_keyring.get_syscall_stats(reset=True)
+    assert sorted(ring.keys()) == ["1", "big"]
+    assert truenas_keyring.get_syscall_stats(reset=True)['read'] == 1
+
+    with pytest.raises(ValueError):
+        ring.default_key_type = truenas_keyring.KeyType.KEYRING
+    with pytest.raises(TypeError):
+        ring[1]
+    with pytest.raises(TypeError):
+        ring["3"] = "not bytes"
+
+    truenas_keyring.revoke_key(serial=ring.key.serial)
+    with pytest.raises(truenas_keyring.KeyringError):
+        ring.keys()
+
+
+def test_list_keyring_contents_filters():
+    """Test that listing filters are applied before objects are created."""
+    parent_keyring = truenas_keyring.get_persistent_keyring()
+    ring = truenas_keyring.add_keyring(description="test_list_filters", target_keyring=parent_keyring.key.serial)
+    serial = ring.key.serial
+
+    for i in range(5):
+        truenas_keyring.add_key(key_type="user", description=f"api_{i}", data=b"x", target_keyring=serial)
+    truenas_keyring.add_key(key_type="user", description="other", data=b"x", target_keyring=serial)
+    truenas_keyring.add_key(key_type="logon", description="api:logon", data=b"x", target_keyring=serial)
+    nested = truenas_keyring.add_keyring(description="api_nested", target_keyring=serial)
+
+    def descs(**kwargs):
+        listed = ring.list_keyring_contents(**kwargs)
+        iterated = list(ring.iter_keyring_contents(prefetch=2, **kwargs))
+        assert [getattr(k, 'key', k).serial for k in listed] == [getattr(k, 'key', k).serial for k in iterated]
+        return sorted(getattr(k, 'key', k).description for k in listed)
+
+    assert len(descs()) == 8
+    assert descs(key_type="keyring") == ["api_nested"]
+    assert [k.key.serial for k in ring.list_keyring_contents(key_type="keyring")] == [nested.key.serial]
+    assert descs(key_type="user") == ["api_0", "api_1", "api_2", "api_3", "api_4", "other"]
+    assert descs(description="other") == ["other"]
+    assert descs(description_prefix="api_", key_type="user") == [f"api_{i}" for i in range(5)]
+    assert descs(description_prefix="api") == ["api:logon", "api_0", "api_1", "api_2", "api_3", "api_4", "api_nested"]
+    assert descs(description_prefix="zzz") == []
+
+    key = ring.search(key_type="user", description="other")
+    assert len(descs(uid=key.uid, gid=key.gid)) == 8
+    assert descs(uid=key.uid + 1) == []
+    assert descs(gid=key.gid + 1) == []
+    assert len(descs(perm_mask=key.permissions)) >= 6
+    assert descs(perm_mask=0xffffffff) == []
+
+    with pytest.raises(ValueError):
+        ring.list_keyring_contents(uid=-1)
+    with pytest.raises(TypeError):
+        ring.list_keyring_contents(gid="0")
+
+    # The filter only skips keys, it doesn't describe them twice
+    truenas_keyring.get_syscall_stats(reset=True)
+    ring.list_keyring_contents(key_type="keyring")
+    assert truenas_keyring.get_syscall_stats(reset=True)['describe'] == 8
+
+    truenas_keyring.revoke_key(serial=serial)
+
+
+def test_keyring_walk():
+    """Test breadth-first walk of nested keyrings."""
+    parent_keyring = truenas_keyring.get_persistent_keyring()
+    root = truenas_keyring.add_keyring(description="test_walk", target_keyring=parent_keyring.key.serial)
+    a = truenas_keyring.add_keyring(description="a", target_keyring=root.key.serial)
+    b = truenas_keyring.add_keyring(description="b", target_keyring=root.key.serial)
+    a1 = truenas_keyring.add_keyring(description="a1", target_keyring=a.key.serial)
+    # a1 is reachable through both a and b
+    truenas_keyring.link_key(serial=a1.key.serial, target_keyring=b.key.serial)
+
+    def add(ring, desc, key_type="user"):
+        return truenas_keyring.add_key(key_type=key_type, description=desc, data=b"x",
+                                       target_keyring=ring.key.serial).serial
+
+    root_leaf = add(root, "r")
+    a_leaf = add(a, "x")
+    a1_leaves = {add(a1, "y"), add(a1, "z")}
+    b_logon = add(b, "b:logon", "logon")
+
+    walked = list(root.walk())
+    assert [w[0] for w in walked] == [(), ("a",), ("b",), ("a", "a1")]
+    assert [w[1] for w in walked] == [root.key.serial, a.key.serial, b.key.serial, a1.key.serial]
+    assert sorted(walked[0][2]) == sorted([a.key.serial, b.key.serial])
+    assert walked[0][3] == [root_leaf]
+    assert walked[1][2] == [a1.key.serial] and walked[1][3] == [a_leaf]
+    # a1 is listed as a child of b but only descended once
+    assert walked[2][2] == [a1.key.serial] and walked[2][3] == [b_logon]
+    assert set(walked[3][3]) == a1_leaves
+
+    assert [w[1] for w in root.walk(max_depth=1)] == [root.key.serial, a.key.serial, b.key.serial]
+    assert [w[1] for w in root.walk(max_depth=0)] == [root.key.serial]
+    assert [w[3] for w in root.walk(key_type="logon")] == [[], [], [b_logon], []]
+    with pytest.raises(ValueError):
+        root.walk(max_depth=-1)
+
+    keyrings, parents, leaves, leaf_parents = root.walk_flat()
+    assert keyrings.format == 'i'
+    assert keyrings.tolist() == [w[1] for w in walked]
+    assert parents.tolist() == [0, root.key.serial, root.key.serial, a.key.serial]
+    assert sorted(leaves.tolist()) == sorted([root_leaf, a_leaf, b_logon] + list(a1_leaves))
+    assert dict(zip(leaves.tolist(), leaf_parents.tolist()))[b_logon] == b.key.serial
+
+    keyrings, parents, leaves, leaf_parents = root.walk_flat(max_depth=0, key_type="logon")
+    assert keyrings.tolist() == [root.key.serial]
+    assert leaves.tolist() == []
+
+    truenas_keyring.revoke_key(serial=root.key.serial)
+    with pytest.raises(truenas_keyring.KeyringError):
+        root.walk_flat()
+    with pytest.raises(truenas_keyring.KeyringError):
+        next(root.walk())
+
+
+def test_commit_keyrings():
+    """Test replacing keyrings under many parents with a worker pool."""
+    parent_keyring = truenas_keyring.get_persistent_keyring()
+    entries = {
+        f"user_{i}": [(f"{j}", f"data_{i}_{j}".encode(), None) for j in range(i % 4)]
+        for i in range(50)
+    }
+
+    results = truenas_keyring.commit_keyrings(
+        path=["test_commit_keyrings"], description="KEYS", entries=entries,
+        root=parent_keyring.key.serial, workers=8
+    )
+    assert set(results) == set(entries)
+    results_first = results
+    root = truenas_keyring.resolve_path(path=["test_commit_keyrings"], root=parent_keyring.key.serial)
+
+    for name, items in entries.items():
+        ring = truenas_keyring.resolve_path(path=[name, "KEYS"], root=root.key.serial)
+        assert ring.key.serial == results[name]
+        assert ring.read_all() == {desc: data for desc, data, _ in items}
+
+    # Keys listed in unlink are removed from each parent
+    user_0 = truenas_keyring.resolve_path(path=["user_0"], root=root.key.serial)
+    truenas_keyring.add_key(key_type="user", description="stale", data=b"x", target_keyring=user_0.key.serial)
+    old_serial = results["user_0"]
+    results = truenas_keyring.commit_keyrings(
+        path=["test_commit_keyrings"], description="KEYS", entries={"user_0": [("a", b"b", None)]},
+        root=parent_keyring.key.serial, unlink=[("user", "stale")]
+    )
+    assert results["user_0"] != old_serial
+    assert user_0.try_search(key_type="user", description="stale") is None
+    assert user_0.search(key_type="keyring", description="KEYS").read_all() == {"a": b"b"}
+
+    # Entries are validated before any keyring is touched
+    with pytest.raises(ValueError):
+        truenas_keyring.commit_keyrings(
+            path=["test_commit_keyrings"], description="KEYS",
+            entries={"user_1": [], "user_2": [("k", b"v", -5)]},
+            root=parent_keyring.key.serial, workers=2
+        )
+    assert root.search(key_type="keyring", description="user_1").search(
+        key_type="keyring", description="KEYS").key.serial == results_first["user_1"]
+
+    with pytest.raises(ValueError):
+        truenas_keyring.commit_keyrings(path=[], description="KEYS", entries={}, workers=0)
+    with pytest.raises(ValueError):
+        truenas_keyring.commit_keyrings(path=[], entries={})
+    with pytest.raises(TypeError):
+        truenas_keyring.commit_keyrings(path=[], description="KEYS", entries={1: []})
+
+    truenas_keyring.unlink_key(serial=root.key.serial, keyring=parent_keyring.key.serial)
+
+
+def test_clear_descendants():
+    """Test clearing a named keyring within every child of a keyring."""
+    parent_keyring = truenas_keyring.get_persistent_keyring()
+    entries = {f"user_{i}": [("1", b"one", None), ("2", b"two", None)] for i in range(20)}
+    results = truenas_keyring.commit_keyrings(
+        path=["test_clear_descendants"], description="API_KEYS", entries=entries,
+        root=parent_keyring.key.serial, unlink=[]
+    )
+    root = truenas_keyring.resolve_path(path=["test_clear_descendants"], root=parent_keyring.key.serial)
+
+    # Children that aren't keyrings or lack API_KEYS are skipped
+    loose = truenas_keyring.add_key(key_type="user", description="loose", data=b"x", target_keyring=root.key.serial)
+    bare = truenas_keyring.resolve_path(path=["bare"], root=root.key.serial, create=True)
+    truenas_keyring.add_key(key_type="user", description="stale", data=b"x", target_keyring=bare.key.serial)
+    user_0 = truenas_keyring.resolve_path(path=["user_0"], root=root.key.serial)
+    truenas_keyring.add_key(key_type="user", description="stale", data=b"x", target_keyring=user_0.key.serial)
+
+    truenas_keyring.get_syscall_stats(reset=True)
+    out = truenas_keyring.clear_descendants(
+        root=root.key.serial, unlink=[("user", "stale")], workers=4
+    )
+    stats = truenas_keyring.get_syscall_stats(reset=True)
+    assert sorted(out["cleared"]) == sorted(results.values())
+    assert out["skipped"] == 2
+    assert out["errors"] == {}
+    assert stats["clear"] == len(entries)
+
+    for name in entries:
+        api_keys = truenas_keyring.resolve_path(path=[name, "API_KEYS"], root=root.key.serial)
+        assert api_keys.read_all() == {}
+    assert len(user_0) == 1
+    assert len(bare) == 0
+
+    # Without child_description the children are cleared themselves
+    out = truenas_keyring.clear_descendants(root=root.key.serial, child_description=None)
+    assert len(out["cleared"]) == len(entries) + 1
+    assert out["skipped"] == 1
+    assert len(user_0) == 0
+
+    # A root that isn't a keyring must not have its payload read as serials
+    with pytest.raises(truenas_keyring.KeyringError):
+        truenas_keyring.clear_descendants(root=loose.serial, child_description=None)
+
+    with pytest.raises(ValueError):
+        truenas_keyring.clear_descendants(root=root.key.serial, workers=0)
+    with pytest.raises(ValueError):
+        truenas_keyring.clear_descendants()
+
+    truenas_keyring.unlink_key(serial=root.key.serial, keyring=parent_keyring.key.serial)
+
+
+def test_read_all():
+    """Test reading all payloads of a keyring in one call."""
+    parent_keyring = truenas_keyring.get_persistent_keyring()
+    test_keyring = truenas_keyring.add_keyring(
+        description="test_read_all",
+        target_keyring=parent_keyring.key.serial
+    )
+    serial = test_keyring.key.serial
+
+    expected = {f"read_all_{i}": f"data_{i}".encode() * (i + 1) for i in range(20)}
+    # Payload larger than the initial scratch buffer
+    expected["read_all_large"] = b"x" * 20000
+    for description, data in expected.items():
+        truenas_keyring.add_key(
+            key_type=truenas_keyring.KeyType.USER,
+            description=description,
+            data=data,
+            target_keyring=serial
+        )
+
+    logon = truenas_keyring.add_key(
+        key_type=truenas_keyring.KeyType.LOGON,
+        description="read_all_logon:key",
+        data=b"logon_data",
+        target_keyring=serial
+    )
+    revoked = truenas_keyring.add_key(
+        key_type=truenas_keyring.KeyType.USER,
+        description="read_all_revoked",
+        data=b"revoked_data",
+        target_keyring=serial
+    )
+    truenas_keyring.revoke_key(serial=revoked.serial)
+
+    # Nested keyrings are never included
+    truenas_keyring.add_keyring(description="read_all_nested", target_keyring=serial)
+
+    assert test_keyring.read_all(key_type=truenas_keyring.KeyType.USER) == expected
+
+    # logon keys can't be read from userspace and so the read fails
+    with pytest.raises(truenas_keyring.KeyringError):
+        test_keyring.read_all()
+
+    truenas_keyring.invalidate_key(serial=logon.serial)
+    assert test_keyring.read_all() == expected
+
+    assert test_keyring.read_all(unlink_revoked=True) == expected
+
+    # Clean up
+    test_keyring.clear()
+    truenas_keyring.invalidate_key(serial=serial)
+
+
+def test_add_keys():
+    """Test adding multiple keys with timeouts in one call."""
+    parent_keyring = truenas_keyring.get_persistent_keyring()
+    test_keyring = truenas_keyring.add_keyring(
+        description="test_add_keys",
+        target_keyring=parent_keyring.key.serial
+    )
+    serial = test_keyring.key.serial
+
+    entries = [(f"add_keys_{i}", f"data_{i}".encode(), 3600 if i % 2 else None) for i in range(10)]
+
+    truenas_keyring.get_syscall_stats(reset=True)
+    serials = truenas_keyring.add_keys(target_keyring=serial, entries=entries)
+    stats = truenas_keyring.get_syscall_stats(reset=True)
+
+    assert len(serials) == len(entries)
+    assert all(isinstance(s, int) for s in serials)
+    assert stats['add_key'] == len(entries)
+    assert stats['set_timeout'] == len(entries) // 2
+    assert stats['describe'] == 0
+
+    assert test_keyring.read_all() == {desc: data for desc, data, timeout in entries}
+
+    # Request key objects instead of serials
+    keys = truenas_keyring.add_keys(
+        target_keyring=serial,
+        entries=[("add_keys_obj", b"obj_data", None)],
+        objects=True
+    )
+    assert keys[0].description == "add_keys_obj"
+    assert keys[0].read_data() == b"obj_data"
+
+    # Clean up
+    test_keyring.clear()
+    truenas_keyring.invalidate_key(serial=serial)
+
+
+def test_add_keys_invalid_entries():
+    """Test that add_keys validates its entries."""
+    parent_serial = truenas_keyring.get_persistent_keyring().key.serial
+
+    with pytest.raises(TypeError):
+        truenas_keyring.add_keys(target_keyring=parent_serial, entries=[("desc", "not_bytes", None)])
+
+    with pytest.raises(TypeError):
+        truenas_keyring.add_keys(target_keyring=parent_serial, entries=[("desc", b"data")])
+
+    with pytest.raises(ValueError):
+        truenas_keyring.add_keys(target_keyring=parent_serial, entries=[("desc", b"data", -1)])
+
+    with pytest.raises(ValueError):
+        truenas_keyring.add_keys(
+            target_keyring=parent_serial,
+            entries=[],
+            key_type=truenas_keyring.KeyType.KEYRING
+        )
+
+
+def test_reconcile():
+    """Test reconciling keyring contents with the minimal set of changes."""
+    parent_keyring = truenas_keyring.get_persistent_keyring()
+    test_keyring = truenas_keyring.add_keyring(
+        description="test_reconcile",
+        target_keyring=parent_keyring.key.serial
+    )
+    serial = test_keyring.key.serial
+
+    truenas_keyring.add_keys(target_keyring=serial, entries=[
+        ("keep", b"keep_data", None),
+        ("change", b"old_data", None),
+        ("remove", b"remove_data", None),
+    ])
+    nested = truenas_keyring.add_keyring(description="nested", target_keyring=serial)
+
+    desired = [
+        ("keep", b"keep_data", None),
+        ("change", b"new_data", 3600),
+        ("add", b"add_data", 3600),
+    ]
+    expected_stats = {"added": 1, "updated": 1, "removed": 1, "unchanged": 1}
+
+    # dry run makes no changes
+    assert test_keyring.reconcile(entries=desired, dry_run=True) == expected_stats
+    assert test_keyring.read_all()["change"] == b"old_data"
+
+    serials = {getattr(k, 'key', k).serial for k in test_keyring.list_keyring_contents()}
+
+    truenas_keyring.get_syscall_stats(reset=True)
+    assert test_keyring.reconcile(entries=desired) == expected_stats
+    stats = truenas_keyring.get_syscall_stats(reset=True)
+    assert stats['add_key'] == 1
+    assert stats['update'] == 1
+    assert stats['unlink'] == 1
+    assert stats['set_timeout'] == 2
+
+    assert test_keyring.read_all() == {desc: data for desc, data, timeout in desired}
+
+    # Changed key was updated in place and nested keyring is untouched
+    new_serials = {getattr(k, 'key', k).serial for k in test_keyring.list_keyring_contents()}
+    assert nested.key.serial in new_serials
+    assert len(serials & new_serials) == 3
+
+    # Second pass is a no-op
+    assert test_keyring.reconcile(entries=desired) == {
+        "added": 0, "updated": 0, "removed": 0, "unchanged": 3
+    }
+
+    # Clean up
+    test_keyring.clear()
+    truenas_keyring.invalidate_key(serial=serial)
+
+
+def test_link_move_unlink_key():
+    """Test linking, moving and unlinking keys between keyrings."""
+    parent_serial = truenas_keyring.get_persistent_keyring().key.serial
+    ring_a = truenas_keyring.add_keyring(description="test_move_a", target_keyring=parent_serial)
+    ring_b = truenas_keyring.add_keyring(description="test_move_b", target_keyring=parent_serial)
+    ring_a.clear()
+    ring_b.clear()
+
+    key = truenas_keyring.add_key(key_type="user", description="moved", data=b"x",
+                                  target_keyring=ring_a.key.serial)
+
+    truenas_keyring.link_key(serial=key.serial, target_keyring=ring_b.key.serial)
+    assert list(ring_a.read_all()) == ["moved"]
+    assert list(ring_b.read_all()) == ["moved"]
+
+    truenas_keyring.unlink_key(serial=key.serial, keyring=ring_b.key.serial)
+    assert ring_b.read_all() == {}
+
+    truenas_keyring.move_key(serial=key.serial, from_keyring=ring_a.key.serial,
+                             to_keyring=ring_b.key.serial)
+    assert ring_a.read_all() == {}
+    assert ring_b.read_all() == {"moved": b"x"}
+
+    # exclusive move refuses to displace a key with the same description
+    other = truenas_keyring.add_key(key_type="user", description="moved", data=b"y",
+                                    target_keyring=ring_a.key.serial)
+    with pytest.raises(truenas_keyring.KeyringError):
+        truenas_keyring.move_key(serial=other.serial, from_keyring=ring_a.key.serial,
+                                 to_keyring=ring_b.key.serial, exclusive=True)
+
+    truenas_keyring.move_key(serial=other.serial, from_keyring=ring_a.key.serial,
+                             to_keyring=ring_b.key.serial)
+    assert ring_b.read_all() == {"moved": b"y"}
+
+    with pytest.raises(ValueError):
+        truenas_keyring.move_key(serial=other.serial, to_keyring=ring_b.key.serial)
+
+    # Clean up
+    ring_a.clear()
+    ring_b.clear()
+    truenas_keyring.invalidate_key(serial=ring_a.key.serial)
+    truenas_keyring.invalidate_key(serial=ring_b.key.serial)
+
+
+def test_swap_keyring():
+    """Test atomically replacing a keyring with a new one."""
+    parent_serial = truenas_keyring.get_persistent_keyring().key.serial
+    old = truenas_keyring.add_keyring(description="test_swap", target_keyring=parent_serial)
+    truenas_keyring.add_keys(target_keyring=old.key.serial, entries=[("old", b"old_data", None)])
+
+    new = truenas_keyring.swap_keyring(
+        target_keyring=parent_serial,
+        description="test_swap",
+        entries=[("a", b"a_data", None), ("b", b"b_data", 3600)]
+    )
+
+    assert new.key.serial != old.key.serial
+    assert new.key.description == "test_swap"
+    assert new.read_all() == {"a": b"a_data", "b": b"b_data"}
+
+    found = truenas_keyring.get_persistent_keyring().search(
+        key_type=truenas_keyring.KeyType.KEYRING, description="test_swap"
+    )
+    assert found.key.serial == new.key.serial
+
+    # The displaced keyring is retired rather than left readable
+    with pytest.raises(truenas_keyring.KeyringError):
+        old.read_all()
+
+    # A failed swap leaves the existing keyring in place
+    with pytest.raises(ValueError):
+        truenas_keyring.swap_keyring(
+            target_keyring=parent_serial,
+            description="test_swap",
+            entries=[("a", b"a_data", -1)]
+        )
+
+    assert found.read_all() == {"a": b"a_data", "b": b"b_data"}
+
+    # Clean up
+    found.clear()
+    truenas_keyring.invalidate_key(serial=found.key.serial)
+
+
+def test_resolve_path():
+    """Test resolving and creating a path of nested keyrings."""
+    persistent = truenas_keyring.get_persistent_keyring()
+    path = ["test_resolve", "level1", "level2"]
+
+    with pytest.raises(FileNotFoundError):
+        truenas_keyring.resolve_path(path=path + ["missing"])
+
+    created = truenas_keyring.resolve_path(path=path, create=True)
+    assert created.key.description == "level2"
+    assert created.key.key_type == "keyring"
+
+    # Existing keyrings are found rather than recreated
+    assert truenas_keyring.resolve_path(path=path).key.serial == created.key.serial
+    assert truenas_keyring.resolve_path(path=path, create=True).key.serial == created.key.serial
+
+    level1 = truenas_keyring.resolve_path(path=path[:2], root=persistent.key.serial)
+    assert truenas_keyring.resolve_path(path=["level2"], root=level1.key.serial).key.serial == \
+        created.key.serial
+
+    with pytest.raises(TypeError):
+        truenas_keyring.resolve_path(path="test_resolve")
+
+    with pytest.raises(TypeError):
+        truenas_keyring.resolve_path(path=["test_resolve", 1])
+
+    # Clean up
+    top = truenas_keyring.resolve_path(path=path[:1])
+    top.clear()
+    truenas_keyring.invalidate_key(serial=top.key.serial)
+
+
+def test_search_cache():
+    """Test that repeat searches are answered from the cache and invalidated on change."""
+    parent = truenas_keyring.get_persistent_keyring()
+    test_keyring = truenas_keyring.add_keyring(description="test_cache", target_keyring=parent.key.serial)
+    key = truenas_keyring.add_key(key_type="user", description="cached", data=b"data",
+                                  target_keyring=test_keyring.key.serial)
+
+    truenas_keyring.clear_cache()
+    assert test_keyring.search(key_type="user", description="cached").serial == key.serial
+
+    truenas_keyring.get_cache_stats(reset=True)
+    truenas_keyring.get_syscall_stats(reset=True)
+    assert test_keyring.search(key_type="user", description="cached").serial == key.serial
+    stats = truenas_keyring.get_syscall_stats(reset=True)
+    assert stats['search'] == 0
+    assert stats['describe'] == 1
+    assert stats['read'] == 1
+    assert truenas_keyring.get_cache_stats(reset=True)['hits'] == 1
+
+    # Replacing the key drops the cached result
+    new_key = truenas_keyring.add_key(key_type="user", description="cached", data=b"new",
+                                      target_keyring=test_keyring.key.serial)
+    assert test_keyring.search(key_type="user", description="cached").serial == new_key.serial
+
+    # Revoked key fails revalidation
+    truenas_keyring.get_cache_stats(reset=True)
+    truenas_keyring.revoke_key(serial=new_key.serial)
+    with pytest.raises(truenas_keyring.KeyringError):
+        test_keyring.search(key_type="user", description="cached")
+
+    # Unlinked key is no longer found
+    other = truenas_keyring.add_key(key_type="user", description="other", data=b"x",
+                                    target_keyring=test_keyring.key.serial)
+    test_keyring.search(key_type="user", description="other")
+    truenas_keyring.unlink_key(serial=other.serial, keyring=test_keyring.key.serial)
+    with pytest.raises(FileNotFoundError):
+        test_keyring.search(key_type="user", description="other")
+
+    assert truenas_keyring.get_cache_stats()['flushes'] > 0
+
+    # Unlinked behind the cache's back, as another process would
+    other = truenas_keyring.add_key(key_type="user", description="other", data=b"x",
+                                    target_keyring=test_keyring.key.serial)
+    test_keyring.search(key_type="user", description="other")
+    assert libkeyutils().keyctl_unlink(other.serial, test_keyring.key.serial) == 0
+    truenas_keyring.get_cache_stats(reset=True)
+    with pytest.raises(FileNotFoundError):
+        test_keyring.search(key_type="user", description="other")
+    assert truenas_keyring.get_cache_stats()['stale'] == 1
+
+    # Results nested below the keyring searched aren't cached
+    nested = truenas_keyring.add_keyring(description="nested", target_keyring=test_keyring.key.serial)
+    deep = truenas_keyring.add_key(key_type="user", description="deep", data=b"x",
+                                   target_keyring=nested.key.serial)
+    truenas_keyring.get_cache_stats(reset=True)
+    for i in range(2):
+        assert test_keyring.search(key_type="user", description="deep").serial == deep.serial
+    assert truenas_keyring.get_cache_stats()['hits'] == 0
+
+    # Clean up
+    test_keyring.clear()
+    truenas_keyring.invalidate_key(serial=test_keyring.key.serial)
+
+
+def test_resolve_path_cached():
+    """Test that resolving a path repeatedly only revalidates cached keyrings."""
+    path = ["test_resolve_cache", "user", "API_KEYS"]
+    first = truenas_keyring.resolve_path(path=path, create=True)
+
+    truenas_keyring.get_syscall_stats(reset=True)
+    assert truenas_keyring.resolve_path(path=path).key.serial == first.key.serial
+    stats = truenas_keyring.get_syscall_stats(reset=True)
+    assert stats['search'] == 0
+    assert stats['describe'] == len(path)
+    assert stats['read'] == len(path)
+
+    # Swapped keyring is found without searching
+    new = truenas_keyring.swap_keyring(
+        target_keyring=truenas_keyring.resolve_path(path=path[:2]).key.serial,
+        description="API_KEYS",
+        entries=[]
+    )
+    assert truenas_keyring.resolve_path(path=path).key.serial == new.key.serial
+
+    # Clean up
+    top = truenas_keyring.resolve_path(path=path[:1])
+    top.clear()
+    truenas_keyring.invalidate_key(serial=top.key.serial)
+
+
+def test_completion_queue():
+    """Test keyring operations completed by native workers."""
+    import select
+
+    with pytest.raises(ValueError):
+        truenas_keyring.create_completion_queue(workers=0)
+
+    parent_keyring = truenas_keyring.get_persistent_keyring()
+    test_keyring = truenas_keyring.add_keyring(
+        description="test_completion_queue", target_keyring=parent_keyring.key.serial
+    )
+    entries = [(f"key_{i}", f"data_{i}".encode(), None) for i in range(10)]
+
+    with truenas_keyring.create_completion_queue(workers=4) as queue:
+        assert queue.workers == 4
+        assert queue.reap() == []
+
+        token = queue.submit_add_keys(target_keyring=test_keyring.key.serial, entries=entries)
+        select.select([queue.fileno()], [], [], 5)
+        [(done, serials, error)] = queue.reap()
+        assert (done, error) == (token, None)
+        assert len(serials) == len(entries)
+
+        tokens = {
+            queue.submit_read_all(keyring=test_keyring.key.serial): "read_all",
+            queue.submit_read_all(keyring=serials[0]): "read_all_key",
+            queue.submit_read_data(serial=serials[3]): "read_data",
+            queue.submit_search(keyring=test_keyring.key.serial, key_type="user",
+                                description="key_5"): "search",
+            queue.submit_search(keyring=test_keyring.key.serial, key_type="user",
+                                description="missing"): "missing",
+            queue.submit_lookup_payload(path=["test_completion_queue"], description="key_7",
+                                        root=parent_keyring.key.serial): "lookup",
+            queue.submit_lookup_payload(path=["test_completion_queue"], description="missing",
+                                        root=parent_keyring.key.serial): "lookup_missing",
+        }
+        assert queue.pending == len(tokens)
+
+        results = {}
+        while len(results) < len(tokens):
+            select.select([queue.fileno()], [], [], 5)
+            for token, result, error in queue.reap():
+                results[tokens[token]] = (result, error)
+
+        assert queue.pending == 0
+        assert results["read_all"] == ({desc: data for desc, data, _ in entries}, None)
+        assert results["read_all_key"][0] is None
+        assert results["read_all_key"][1].errno == errno.ENOTDIR
+        assert results["read_data"] == (b"data_3", None)
+        assert results["search"][0].serial == serials[5]
+        assert results["missing"][0] is None
+        assert isinstance(results["missing"][1], FileNotFoundError)
+        assert results["lookup"] == (b"data_7", None)
+        assert results["lookup_missing"] == (None, None)
+
+        with pytest.raises(ValueError):
+            queue.submit_add_keys(target_keyring=test_keyring.key.serial, entries=[],
+                                  key_type="keyring")
+        with pytest.raises(TypeError):
+            queue.submit_add_keys(target_keyring=test_keyring.key.serial, entries=[("a", "b", None)])
+
+    assert queue.closed
+    with pytest.raises(ValueError):
+        queue.submit_read_data(serial=serials[0])
+
+    truenas_keyring.revoke_key(serial=test_keyring.key.serial)
+
+
+def test_completion_queue_close_race():
+    """Test that jobs submitted while the queue closes are rejected or completed."""
+    parent_keyring = truenas_keyring.get_persistent_keyring()
+    queue = truenas_keyring.create_completion_queue(workers=2)
+    started = threading.Barrier(5)
+    accepted = []
+
+    def submitter():
+        started.wait()
+        for i in range(100000):
+            try:
+                accepted.append(queue.submit_read_data(serial=parent_keyring.key.serial))
+            except ValueError:
+                return
+
+    def closer():
+        started.wait()
+        time.sleep(0.01)
+        queue.close()
+
+    threads = [threading.Thread(target=submitter) for i in range(3)]
+    threads += [threading.Thread(target=closer) for i in range(2)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    assert queue.closed
+    # Once closed, every accepted job has completed, either run or cancelled
+    done = [token for token, _, _ in queue.reap()]
+    assert sorted(done) == sorted(accepted)
+    assert queue.pending == 0
+
+
+def test_commit_queue():
+    """Test write-behind commits coalesced per name."""
+    parent_keyring = truenas_keyring.get_persistent_keyring()
+
+    with pytest.raises(ValueError):
+        truenas_keyring.create_commit_queue(path=["test_commit_queue"], description="KEYS", delay=-1)
+
+    queue = truenas_keyring.create_commit_queue(
+        path=["test_commit_queue"], description="KEYS", root=parent_keyring.key.serial,
+        unlink=[("user", "stale")], delay=60
+    )
+    root = truenas_keyring.resolve_path(path=["test_commit_queue"], root=parent_keyring.key.serial)
+
+    # Nothing is applied until the delay expires, so all but the first commit per name coalesce
+    for i in range(5):
+        for name in ("user_a", "user_b"):
+            assert queue.submit(name=name, entries=[("v", f"{name}_{i}".encode(), None)]) == (i > 0)
+
+    assert queue.pending == 2
+    assert root.try_search(key_type="keyring", description="user_a") is None
+
+    assert queue.flush(timeout=10)
+    assert queue.pending == 0
+    for name in ("user_a", "user_b"):
+        keys = truenas_keyring.resolve_path(path=[name, "KEYS"], root=root.key.serial)
+        assert keys.read_all() == {"v": f"{name}_4".encode()}
+
+    stats = queue.get_stats(reset=True)
+    assert stats == {"submitted": 10, "coalesced": 8, "committed": 2, "failed": 0, "pending": 0}
+    assert queue.get_stats()["submitted"] == 0
+    assert queue.pop_errors() == {}
+
+    with pytest.raises(ValueError):
+        queue.submit(name="user_a")
+    with pytest.raises(TypeError):
+        queue.submit(name="user_a", entries=[("v", "str", None)])
+
+    # Closing applies what is still queued
+    queue.submit(name="user_a", entries=[("v", b"last", None)])
+    queue.close()
+    assert queue.closed
+    keys = truenas_keyring.resolve_path(path=["user_a", "KEYS"], root=root.key.serial)
+    assert keys.read_all() == {"v": b"last"}
+    with pytest.raises(ValueError):
+        queue.submit(name="user_a", entries=[])
+
+    truenas_keyring.unlink_key(serial=root.key.serial, keyring=parent_keyring.key.serial)
+
+
+def test_commit_queue_close_race():
+    """Test that submits racing close() are either applied or rejected."""
+    parent_keyring = truenas_keyring.get_persistent_keyring()
+    queue = truenas_keyring.create_commit_queue(
+        path=["test_commit_queue_race"], description="KEYS", root=parent_keyring.key.serial
+    )
+    root = truenas_keyring.resolve_path(
+        path=["test_commit_queue_race"], root=parent_keyring.key.serial
+    )
+    last = {}
+    started = threading.Barrier(5)
+
+    def submitter(name):
+        started.wait()
+        for i in range(100000):
+            try:
+                queue.submit(name=name, entries=[("v", str(i).encode(), None)])
+            except ValueError:
+                return
+            last[name] = str(i).encode()
+
+    def closer():
+        started.wait()
+        time.sleep(0.01)
+        queue.close()
+
+    threads = [threading.Thread(target=submitter, args=(f"user_{i}",)) for i in range(3)]
+    threads += [threading.Thread(target=closer) for i in range(2)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    assert queue.closed
+    assert queue.pending == 0
+
+    # Every submit that succeeded was applied
+    for name, data in last.items():
+        keys = truenas_keyring.resolve_path(path=[name, "KEYS"], root=root.key.serial)
+        assert keys.read_all() == {"v": data}
+
+    truenas_keyring.unlink_key(serial=root.key.serial, keyring=parent_keyring.key.serial)
+
+
+def test_key_watcher():
+    """Test key change notifications."""
+    with pytest.raises(ValueError):
+        truenas_keyring.create_key_watcher(queue_size=0)
+
+    try:
+        watcher = truenas_keyring.create_key_watcher()
+    except truenas_keyring.KeyringError as e:
+        if e.errno == errno.ENOPKG:
+            pytest.skip('kernel does not support key notifications')
+        raise
+
+    parent_serial = truenas_keyring.get_persistent_keyring().key.serial
+    test_keyring = truenas_keyring.add_keyring(description="test_watch", target_keyring=parent_serial)
+
+    with watcher:
+        assert watcher.read() == []
+        watcher.watch(serial=test_keyring.key.serial)
+        assert test_keyring.key.serial in watcher.watches
+
+        key = truenas_keyring.add_key(key_type="user", description="watched", data=b"x",
+                                      target_keyring=test_keyring.key.serial)
+        truenas_keyring.unlink_key(serial=key.serial, keyring=test_keyring.key.serial)
+
+        notifications = watcher.read()
+        events = [(n.event, n.aux) for n in notifications]
+        assert (truenas_keyring.KeyEvent.LINKED, key.serial) in events
+        assert (truenas_keyring.KeyEvent.UNLINKED, key.serial) in events
+        assert all(n.watched == test_keyring.key.serial for n in notifications)
+
+        watcher.unwatch(serial=test_keyring.key.serial)
+        assert watcher.watches == {}
+
+    assert watcher.closed
+    with pytest.raises(ValueError):
+        watcher.fileno()
+
+    # Clean up
+    test_keyring.clear()
+    truenas_keyring.invalidate_key(serial=test_keyring.key.serial)
+
+
+def test_try_search():
+    """Test searching without raising on a miss."""
+    parent = truenas_keyring.get_persistent_keyring()
+    test_keyring = truenas_keyring.add_keyring(description="test_try_search", target_keyring=parent.key.serial)
+
+    assert test_keyring.try_search(key_type="user", description="missing") is None
+    assert test_keyring.try_search(key_type="user", description="missing", objects=False) is None
+
+    key = truenas_keyring.add_key(key_type="user", description="present", data=b"x",
+                                  target_keyring=test_keyring.key.serial)
+    assert test_keyring.try_search(key_type="user", description="present").serial == key.serial
+    assert test_keyring.try_search(key_type="user", description="present", objects=False) == key.serial
+
+    with pytest.raises(ValueError):
+        test_keyring.try_search(key_type="user")
+
+    # Clean up
+    test_keyring.clear()
+    truenas_keyring.invalidate_key(serial=test_keyring.key.serial)
+
+
+def test_negative_cache():
+    """Test caching of failed searches."""
+    parent = truenas_keyring.get_persistent_keyring()
+    test_keyring = truenas_keyring.add_keyring(description="test_neg_cache", target_keyring=parent.key.serial)
+
+    truenas_keyring.set_negative_cache(ttl=60)
+    try:
+        assert test_keyring.try_search(key_type="user", description="unknown") is None
+
+        truenas_keyring.get_syscall_stats(reset=True)
+        truenas_keyring.get_cache_stats(reset=True)
+        for i in range(10):
+            assert test_keyring.try_search(key_type="user", description="unknown") is None
+        assert truenas_keyring.get_syscall_stats(reset=True)['search'] == 0
+        assert truenas_keyring.get_cache_stats(reset=True)['negative_hits'] == 10
+
+        # Adding the key drops the negative entry
+        key = truenas_keyring.add_key(key_type="user", description="unknown", data=b"x",
+                                      target_keyring=test_keyring.key.serial)
+        assert test_keyring.try_search(key_type="user", description="unknown").serial == key.serial
+
+        with pytest.raises(FileNotFoundError):
+            test_keyring.search(key_type="user", description="still_unknown")
+        with pytest.raises(FileNotFoundError):
+            test_keyring.search(key_type="user", description="still_unknown")
+        assert truenas_keyring.get_cache_stats()['negative_hits'] == 1
+
+        # Entries expire
+        truenas_keyring.set_negative_cache(ttl=0.01)
+        assert test_keyring.try_search(key_type="user", description="expires") is None
+        time.sleep(0.02)
+        truenas_keyring.get_syscall_stats(reset=True)
+        assert test_keyring.try_search(key_type="user", description="expires") is None
+        assert truenas_keyring.get_syscall_stats(reset=True)['search'] == 1
+    finally:
+        truenas_keyring.set_negative_cache(ttl=0)
+
+    # Clean up
+    test_keyring.clear()
+    truenas_keyring.invalidate_key(serial=test_keyring.key.serial)
+
+
+# RFC 7677 section 3 exchange, with SHA-512 in place of SHA-256
+SCRAM_SALT = 'W22ZaJ0SNY7soEsUEjb6gQ=='
+SCRAM_AUTH_MESSAGE = (
+    b'n=user,r=rOprNGfwEbeRWgbNEkqO,'
+    b'r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF$k0,s=W22ZaJ0SNY7soEsUEjb6gQ==,i=4096,'
+    b'c=biws,r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF$k0'
+)
+SCRAM_CLIENT_PROOF = (
+    'gMGXRcevScNtxZ6/8lQYpGtnsNAc3mGcmNomv+xnoOMw+3R2xNJdMNnzMlTN8PPC6wdp6dybEmDYXYTxwnYPJQ=='
+)
+SCRAM_SERVER_SIGNATURE = (
+    'ZQnYEgWQMFmmsM8aQMF0nDDCy/AgCzkwk8CmMZYcMg0vSVlKDanekLtifDSeVGT4+5ZxXnJq199RVG2rR7N7Zw=='
+)
+
+
+def scram_keys(password, salt, iterations):
+    """ Derive (StoredKey, ServerKey, ClientKey) as per RFC 5802 """
+    salted = hashlib.pbkdf2_hmac('sha512', password, base64.b64decode(salt), iterations)
+    client_key = hmac.new(salted, b'Client Key', 'sha512').digest()
+    server_key = hmac.new(salted, b'Server Key', 'sha512').digest()
+    return hashlib.sha512(client_key).digest(), server_key, client_key
+
+
+def test_scram_verify():
+    """Test SCRAM-SHA-512 proof verification against known vectors."""
+    stored_key, server_key, client_key = scram_keys(b'pencil', SCRAM_SALT, 4096)
+    proof = base64.b64decode(SCRAM_CLIENT_PROOF)
+
+    # Vector is consistent with the RFC 5802 definitions
+    client_sig = hmac.new(stored_key, SCRAM_AUTH_MESSAGE, 'sha512').digest()
+    assert bytes(a ^ b for a, b in zip(client_key, client_sig)) == proof
+
+    server_sig = truenas_keyring.scram_verify(
+        stored_key=stored_key,
+        server_key=server_key,
+        client_proof=proof,
+        auth_message=SCRAM_AUTH_MESSAGE
+    )
+    assert server_sig == base64.b64decode(SCRAM_SERVER_SIGNATURE)
+
+    # Wrong password, tampered proof and different auth message are rejected
+    bad_stored, bad_server, _ = scram_keys(b'pencil2', SCRAM_SALT, 4096)
+    assert truenas_keyring.scram_verify(
+        stored_key=bad_stored, server_key=bad_server,
+        client_proof=proof, auth_message=SCRAM_AUTH_MESSAGE
+    ) is None
+
+    tampered = bytes([proof[0] ^ 1]) + proof[1:]
+    assert truenas_keyring.scram_verify(
+        stored_key=stored_key, server_key=server_key,
+        client_proof=tampered, auth_message=SCRAM_AUTH_MESSAGE
+    ) is None
+
+    assert truenas_keyring.scram_verify(
+        stored_key=stored_key, server_key=server_key,
+        client_proof=proof, auth_message=SCRAM_AUTH_MESSAGE + b'x'
+    ) is None
+
+    with pytest.raises(ValueError):
+        truenas_keyring.scram_verify(
+            stored_key=stored_key[:32], server_key=server_key,
+            client_proof=proof, auth_message=SCRAM_AUTH_MESSAGE
+        )
+
+    with pytest.raises(ValueError):
+        truenas_keyring.scram_verify(stored_key=stored_key, server_key=server_key)
+
+
+def test_scram_verify_sealed():
+    """Test opening, decoding and verifying a sealed API key in one call."""
+    stored_key, server_key, _ = scram_keys(b'pencil', SCRAM_SALT, 4096)
+    proof = base64.b64decode(SCRAM_CLIENT_PROOF)
+    key = os.urandom(32)
+    record = truenas_keyring.pack_api_key(
+        username='user', dbid=7, algorithm='SHA512', iterations=4096, expiry=0,
+        salt=base64.b64decode(SCRAM_SALT), server_key=server_key, stored_key=stored_key
+    )
+    sealed, sealed_json = truenas_keyring.seal_payloads(
+        key=key, payloads=[base64.b64encode(record), b'{"dbid": 7}']
+    )
+    args = {'username': 'user', 'dbid': 7, 'auth_message': SCRAM_AUTH_MESSAGE}
+
+    server_sig = truenas_keyring.scram_verify_sealed(
+        key=key, payload=sealed, client_proof=proof, **args
+    )
+    assert server_sig == base64.b64decode(SCRAM_SERVER_SIGNATURE)
+
+    assert truenas_keyring.scram_verify_sealed(
+        key=key, payload=sealed, client_proof=bytes(64), **args
+    ) is None
+
+    # JSON entries are handed back for the caller to verify
+    assert truenas_keyring.scram_verify_sealed(
+        key=key, payload=sealed_json, client_proof=proof, **args
+    ) == '{"dbid": 7}'
+
+    # Records belonging to another user or API key are rejected
+    for owner in ({'username': 'other'}, {'dbid': 8}):
+        with pytest.raises(ValueError, match='belongs to'):
+            truenas_keyring.scram_verify_sealed(
+                key=key, payload=sealed, client_proof=proof, **(args | owner)
+            )
+
+    corrupt = truenas_keyring.seal_payloads(key=key, payloads=[base64.b64encode(record[:-1])])[0]
+    for bad_key, payload in ((os.urandom(32), sealed), (key, sealed[:-1]), (key, corrupt)):
+        with pytest.raises(ValueError):
+            truenas_keyring.scram_verify_sealed(
+                key=bad_key, payload=payload, client_proof=proof, **args
+            )
+
+    with pytest.raises(ValueError, match='required'):
+        truenas_keyring.scram_verify_sealed(key=key, payload=sealed, client_proof=proof)
+
+
+def test_api_key_record():
+    """Test packing and unpacking binary API key records."""
+    fields = {
+        'username': 'bob\u00e9',
+        'dbid': 12,
+        'algorithm': 'SHA512',
+        'iterations': 500000,
+        'expiry': -1,
+        'salt': os.urandom(16),
+        'server_key': os.urandom(64),
+        'stored_key': os.urandom(64),
+    }
+    data = truenas_keyring.pack_api_key(**fields)
+    assert data[:5] == b'TNAK\x01'
+    assert len(data) == 36 + len(fields['username'].encode()) + 16 + 64 + 64
+
+    record = truenas_keyring.unpack_api_key(data)
+    assert isinstance(record, truenas_keyring.ApiKeyRecord)
+    assert tuple(record) == tuple(fields.values())
+    assert record.stored_key == fields['stored_key']
+
+    for bad in (b'', b'{"username": "bob"}', data[:-1], data + b'x',
+                data[:4] + b'\x02' + data[5:], data[:5] + b'\x07' + data[6:]):
+        with pytest.raises(ValueError):
+            truenas_keyring.unpack_api_key(bad)
+
+    with pytest.raises(ValueError, match='unsupported algorithm'):
+        truenas_keyring.pack_api_key(**(fields | {'algorithm': 'MD5'}))
+
+    with pytest.raises(ValueError, match='required'):
+        truenas_keyring.pack_api_key(username='bob', dbid=1)
+
+
+def test_seal_payloads():
+    """Test batch AES-256-GCM sealing and opening of payloads."""
+    key = os.urandom(32)
+    payloads = [os.urandom(i % 300) for i in range(200)]
+
+    for threads in (1, 4):
+        sealed = truenas_keyring.seal_payloads(key=key, payloads=payloads, threads=threads)
+        assert [len(s) for s in sealed] == [len(p) + 29 for p in payloads]
+        assert truenas_keyring.open_payloads(key=key, payloads=sealed, threads=threads) == payloads
+
+    # Nonces are random, so sealing the same payload twice differs
+    first, second = truenas_keyring.seal_payloads(key=key, payloads=[b'data', b'data'])
+    assert first != second
+
+    tampered = first[:-1] + bytes([first[-1] ^ 1])
+    assert truenas_keyring.open_payloads(
+        key=key, payloads=[first, tampered, b'', b'garbage' * 10]
+    ) == [b'data', None, None, None]
+
+    assert truenas_keyring.open_payloads(key=os.urandom(32), payloads=[first]) == [None]
+
+    with pytest.raises(ValueError):
+        truenas_keyring.seal_payloads(key=key[:16], payloads=[b'data'])
+
+    with pytest.raises(ValueError):
+        truenas_keyring.seal_payloads(key=key, payloads=[b'data'], threads=0)
+
+    with pytest.raises(TypeError):
+        truenas_keyring.seal_payloads(key=key, payloads=['data'])
+
+    with pytest.raises(ValueError):
+        truenas_keyring.open_payloads(payloads=[first])
+
+
+def test_key_bundle():
+    """Test packing payloads into an indexed bundle and looking them up."""
+    now = int(time.time())
+    entries = [(dbid, os.urandom(dbid % 50), 0) for dbid in range(100, 0, -3)]
+    entries.append((5000, b'expired', now - 10))
+    entries.append((5001, b'expiring later', now + 3600))
+
+    bundle = truenas_keyring.pack_bundle(entries=entries)
+    assert bundle[:5] == b'TNKB\x01'
+
+    expected = {dbid: data for dbid, data, expiry in entries if dbid != 5000}
+    assert truenas_keyring.unpack_bundle(bundle) == expected
+
+    for dbid, data in expected.items():
+        assert truenas_keyring.bundle_lookup(data=bundle, dbid=dbid) == data
+
+    assert truenas_keyring.bundle_lookup(data=bundle, dbid=5000) is None
+    assert truenas_keyring.bundle_lookup(data=bundle, dbid=2) is None
+    assert truenas_keyring.unpack_bundle(truenas_keyring.pack_bundle(entries=[])) == {}
+
+    with pytest.raises(ValueError, match='duplicate'):
+        truenas_keyring.pack_bundle(entries=[(1, b'a', 0), (1, b'b', 0)])
+
+    with pytest.raises(TypeError):
+        truenas_keyring.pack_bundle(entries=[(1, 'a', 0)])
+
+    for bad in (b'', b'TNKB', bundle[:-1], b'XXXX' + bundle[4:]):
+        with pytest.raises(ValueError):
+            truenas_keyring.unpack_bundle(bad)
+
+        with pytest.raises(ValueError):
+            truenas_keyring.bundle_lookup(data=bad, dbid=1)
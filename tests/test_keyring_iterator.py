@@ -170,4 +170,107 @@ def test_iterator_multiple_iterations():
 
     # Clean up
     test_keyring.clear()
-    truenas_keyring.invalidate_key(serial=test_keyring.key.serial)
\ No newline at end of file
+    truenas_keyring.invalidate_key(serial=test_keyring.key.serial)
+
+def test_listing_describes_each_key_once():
+    """Test that listing N keys costs about N describe syscalls."""
+    keyring = truenas_keyring.get_persistent_keyring()
+    test_keyring = truenas_keyring.add_keyring(
+        description="test_describe_count",
+        target_keyring=keyring.key.serial
+    )
+
+    key_count = 50
+    for i in range(key_count):
+        truenas_keyring.add_key(
+            key_type=truenas_keyring.KeyType.USER,
+            description=f"describe_count_key_{i}",
+            data=f"data_{i}".encode(),
+            target_keyring=test_keyring.key.serial
+        )
+
+    truenas_keyring.get_syscall_stats(reset=True)
+    list_keys = test_keyring.list_keyring_contents()
+    list_stats = truenas_keyring.get_syscall_stats(reset=True)
+
+    iter_keys = list(test_keyring.iter_keyring_contents())
+    iter_stats = truenas_keyring.get_syscall_stats(reset=True)
+
+    assert len(list_keys) == key_count
+    assert len(iter_keys) == key_count
+
+    # One describe per key plus one to verify the keyring type
+    assert list_stats['describe'] <= key_count + 1
+    assert iter_stats['describe'] <= key_count + 1
+
+    # Clean up
+    test_keyring.clear()
+    truenas_keyring.invalidate_key(serial=test_keyring.key.serial)
+
+
+@pytest.mark.parametrize("prefetch", [1, 2, 7, 1000])
+def test_iter_keyring_contents_prefetch(prefetch):
+    """Test that the prefetch window size doesn't change iteration results."""
+    keyring = truenas_keyring.get_persistent_keyring()
+    test_keyring = truenas_keyring.add_keyring(
+        description="test_iter_prefetch",
+        target_keyring=keyring.key.serial
+    )
+
+    serials = set()
+    for i in range(10):
+        key = truenas_keyring.add_key(
+            key_type=truenas_keyring.KeyType.USER,
+            description=f"prefetch_key_{i}",
+            data=f"data_{i}".encode(),
+            target_keyring=test_keyring.key.serial
+        )
+        serials.add(key.serial)
+
+    iter_serials = {k.serial for k in test_keyring.iter_keyring_contents(prefetch=prefetch)}
+    assert iter_serials == serials
+
+    # Clean up
+    test_keyring.clear()
+    truenas_keyring.invalidate_key(serial=test_keyring.key.serial)
+
+
+def test_iter_keyring_contents_invalid_prefetch():
+    """Test that a non-positive prefetch window is rejected."""
+    keyring = truenas_keyring.get_persistent_keyring()
+
+    with pytest.raises(ValueError, match="prefetch"):
+        keyring.iter_keyring_contents(prefetch=0)
+
+
+def test_iter_keyring_contents_skips_revoked():
+    """Test that revoked keys are skipped and optionally unlinked."""
+    keyring = truenas_keyring.get_persistent_keyring()
+    test_keyring = truenas_keyring.add_keyring(
+        description="test_iter_revoked",
+        target_keyring=keyring.key.serial
+    )
+
+    keys = []
+    for i in range(4):
+        keys.append(truenas_keyring.add_key(
+            key_type=truenas_keyring.KeyType.USER,
+            description=f"revoked_key_{i}",
+            data=f"data_{i}".encode(),
+            target_keyring=test_keyring.key.serial
+        ))
+
+    truenas_keyring.revoke_key(serial=keys[1].serial)
+
+    # Revoked key is hidden but remains linked
+    found = {k.serial for k in test_keyring.iter_keyring_contents(prefetch=2)}
+    assert found == {keys[0].serial, keys[2].serial, keys[3].serial}
+    assert len(test_keyring.list_keyring_contents()) == 3
+
+    # Revoked key is unlinked when requested
+    found = {k.serial for k in test_keyring.iter_keyring_contents(unlink_revoked=True)}
+    assert found == {keys[0].serial, keys[2].serial, keys[3].serial}
+
+    # Clean up
+    test_keyring.clear()
+    truenas_keyring.invalidate_key(serial=test_keyring.key.serial)
@@ -1,7 +1,15 @@
 import truenas_api_key.keyring as api_keyring
-from truenas_api_key.constants import UserApiKey, ApiKeyAlgorithm, PAM_KEYRING_NAME, PAM_API_KEY_NAME
+from truenas_api_key.constants import (
+    UserApiKey, ApiKeyAlgorithm, ApiKeyLayout, PAM_KEYRING_NAME, PAM_API_KEY_NAME
+)
+import truenas_keyring
 import truenas_pypwenc
+import errno
+import pytest
+import threading
 import time
+from dataclasses import asdict
+from json import loads
 
 # Create a pwenc context for encryption/decryption
 pwenc_ctx = truenas_pypwenc.get_context(create=True, secret_path="/tmp/test_pwenc_secret")
@@ -181,7 +189,7 @@ def test_clear_all_api_keys():
     assert len(testuser_keys) > 0
 
     # Clear all API keys
-    api_keyring.clear_all_api_keys()
+    api_keyring.clear_all_api_keys(workers=2)
 
     # Verify API keys are gone but user keyrings still exist
     # The function only clears API_KEYS sub-keyrings, not the user keyrings
@@ -233,6 +241,25 @@ def test_dataclass_serialization():
     assert recovered_key == original_key
 
 
+def test_binary_encoding():
+    """Test that binary-encoded API keys round-trip and coexist with JSON entries."""
+    original_key = MOCK_USER_API_KEYS[0]
+
+    plaintext = api_keyring.encode_api_key(original_key, binary=True)
+    assert len(plaintext) < len(api_keyring.encode_api_key(original_key))
+    assert api_keyring.decode_api_key(plaintext) == original_key
+    assert api_keyring.decode_api_key(api_keyring.encode_api_key(original_key)) == original_key
+
+    api_keyring.commit_user_entry(original_key.username, [original_key], encrypt, binary=True)
+    dumped_keys = api_keyring.dump_user_keyring(original_key.username, decrypt)
+    assert dumped_keys == [asdict(original_key)]
+
+    # Switching format rewrites the entry
+    api_keyring.commit_user_entry(original_key.username, [original_key], encrypt, decrypt)
+    assert loads(decrypt(api_keyring.lookup_api_key(original_key.username, original_key.dbid).decode()))
+    assert api_keyring.dump_user_keyring(original_key.username, decrypt) == dumped_keys
+
+
 def test_api_keys_keyring_structure():
     """Test that API keys are stored in the correct sub-keyring structure."""
     username = "structtest"
@@ -275,7 +302,9 @@ def test_api_keys_keyring_structure():
     api_keys_subrings = [k for k in user_keyring_contents if k.key.description == PAM_API_KEY_NAME]
     assert len(api_keys_subrings) >= 1
 
-    # The API_KEYS keyring should have the actual key
+    # The API_KEYS keyring should have the actual key. Committing replaces the
+    # keyring and so it must be looked up again.
+    api_keys_keyring = api_keyring.get_api_keys_keyring(username)
     api_keys_contents = api_keys_keyring.list_keyring_contents()
     assert len(api_keys_contents) == 1
     assert api_keys_contents[0].description == str(test_key.dbid)
@@ -298,3 +327,422 @@ def test_algorithm_enum():
     )
 
     assert key_sha512.algorithm == "SHA512"
+
+
+def test_commit_unchanged_entry_makes_no_writes():
+    """Test that recommitting unchanged API keys doesn't modify the keyring."""
+    import truenas_keyring
+
+    username = "admin"
+    admin_keys = [key for key in MOCK_USER_API_KEYS if key.username == username]
+
+    api_keyring.commit_user_entry(username, admin_keys, encrypt, decrypt)
+    serials = {k.serial for k in api_keyring.get_api_keys_keyring(username).list_keyring_contents()}
+
+    truenas_keyring.get_syscall_stats(reset=True)
+    api_keyring.commit_user_entry(username, admin_keys, encrypt, decrypt)
+    stats = truenas_keyring.get_syscall_stats(reset=True)
+
+    for op in ('add_key', 'update', 'unlink', 'set_timeout'):
+        assert stats[op] == 0, op
+
+    # Same kernel keys remain in place
+    assert serials == {
+        k.serial for k in api_keyring.get_api_keys_keyring(username).list_keyring_contents()
+    }
+
+    # Changing one entry updates just that key in place
+    changed = [UserApiKey(**{**asdict(admin_keys[0]), 'iterations': 1})] + admin_keys[1:]
+    truenas_keyring.get_syscall_stats(reset=True)
+    api_keyring.commit_user_entry(username, changed, encrypt, decrypt)
+    stats = truenas_keyring.get_syscall_stats(reset=True)
+    assert stats['add_key'] == 0
+    assert stats['move'] + stats['link'] == 0
+    assert stats['update'] == 1
+    assert serials == {
+        k.serial for k in api_keyring.get_api_keys_keyring(username).list_keyring_contents()
+    }
+
+    dumped = {d["dbid"]: d for d in api_keyring.dump_user_keyring(username, decrypt)}
+    assert dumped[admin_keys[0].dbid]["iterations"] == 1
+
+    # Removing an entry swaps in a new API_KEYS keyring
+    truenas_keyring.get_syscall_stats(reset=True)
+    api_keyring.commit_user_entry(username, changed[1:], encrypt, decrypt)
+    stats = truenas_keyring.get_syscall_stats(reset=True)
+    assert stats['add_key'] == len(changed[1:]) + 1
+    assert stats['move'] + stats['link'] == 1
+    assert stats['update'] == 0
+
+
+def test_commit_sealed_entries():
+    """Test committing and reading API keys sealed with a native batch key."""
+    import os
+
+    username = "admin"
+    admin_keys = [key for key in MOCK_USER_API_KEYS if key.username == username]
+    seal_key = os.urandom(32)
+
+    api_keyring.commit_user_entry(username, admin_keys, seal_key=seal_key, threads=2)
+    dumped = api_keyring.dump_user_keyring(username, seal_key=seal_key)
+    assert sorted(dumped, key=lambda d: d["dbid"]) == [asdict(k) for k in admin_keys]
+
+    # Payloads can't be read with another key
+    with pytest.raises(ValueError):
+        api_keyring.dump_user_keyring(username, seal_key=os.urandom(32))
+
+    # Recommitting unchanged entries makes no writes
+    truenas_keyring.get_syscall_stats(reset=True)
+    api_keyring.commit_user_entry(username, admin_keys, seal_key=seal_key, binary=False)
+    stats = truenas_keyring.get_syscall_stats(reset=True)
+    assert stats['add_key'] == 0
+
+    # Changing the encoding rewrites the entries
+    api_keyring.commit_user_entry(username, admin_keys, seal_key=seal_key, binary=True)
+    assert api_keyring.dump_user_keyring(username, seal_key=seal_key) == dumped
+
+    with pytest.raises(ValueError):
+        api_keyring.commit_user_entry(username, admin_keys)
+
+
+def test_commit_many():
+    """Test committing API keys for many users with a worker pool."""
+    import os
+
+    seal_key = os.urandom(32)
+    by_user = {}
+    for key in MOCK_USER_API_KEYS:
+        by_user.setdefault(key.username, []).append(key)
+
+    for i in range(40):
+        by_user[f"bulk_user_{i}"] = [
+            UserApiKey(**(asdict(MOCK_USER_API_KEYS[2]) | {"username": f"bulk_user_{i}", "dbid": 5000 + i}))
+        ]
+    # Revoked keys are skipped, leaving an empty keyring
+    by_user["bulk_revoked"] = [
+        UserApiKey(**(asdict(MOCK_USER_API_KEYS[2]) | {"username": "bulk_revoked", "expiry": -1}))
+    ]
+
+    results = api_keyring.commit_many(by_user, seal_key=seal_key, workers=4)
+    assert results == {username: None for username in by_user}
+
+    for username, keys in by_user.items():
+        dumped = api_keyring.dump_user_keyring(username, seal_key=seal_key)
+        expected = [asdict(k) for k in keys if k.expiry != -1]
+        assert sorted(dumped, key=lambda d: d["dbid"]) == expected
+
+    # Also works with encrypt_fn and serially
+    results = api_keyring.commit_many({"admin": by_user["admin"]}, encrypt_fn=encrypt, binary=True)
+    assert results == {"admin": None}
+    dumped = api_keyring.dump_user_keyring("admin", decrypt_fn=decrypt)
+    assert sorted(dumped, key=lambda d: d["dbid"]) == [asdict(k) for k in by_user["admin"]]
+
+    with pytest.raises(ValueError):
+        api_keyring.commit_many(by_user)
+
+    pam_keyring = api_keyring.get_pam_keyring()
+    for username in by_user:
+        if username.startswith("bulk_"):
+            truenas_keyring.unlink_key(
+                serial=api_keyring.get_user_keyring(username).key.serial, keyring=pam_keyring.key.serial
+            )
+
+
+def test_aio():
+    """Test awaitable keyring operations."""
+    import asyncio
+    from truenas_api_key import aio
+
+    username = "admin"
+    user_keys = [key for key in MOCK_USER_API_KEYS if key.username == username]
+    api_keyring.commit_user_entry(username, user_keys, encrypt)
+    api_keys_ring = api_keyring.get_api_keys_keyring(username)
+    expected = api_keys_ring.read_all()
+
+    async def run():
+        queue = aio.get_completion_queue()
+        assert aio.get_completion_queue() is queue
+
+        results = await asyncio.gather(
+            aio.read_all(api_keys_ring),
+            *[aio.lookup_api_key(username, key.dbid) for key in user_keys],
+            aio.lookup_api_key(username, 99999),
+        )
+        assert results[0] == expected
+        assert results[1:-1] == [expected[str(key.dbid)] for key in user_keys]
+        assert results[-1] is None
+
+        key = await aio.search(api_keys_ring, truenas_keyring.KeyType.USER, str(user_keys[0].dbid))
+        assert await aio.read_data(key) == expected[str(user_keys[0].dbid)]
+
+        with pytest.raises(FileNotFoundError):
+            await aio.search(api_keys_ring, truenas_keyring.KeyType.USER, "99999")
+
+        serials = await aio.add_keys(api_keys_ring, [("extra", b"extra", None)])
+        assert len(serials) == 1
+        assert api_keys_ring.read_all()["extra"] == b"extra"
+
+        queue.close()
+        assert aio.get_completion_queue() is not queue
+        aio.get_completion_queue().close()
+
+    asyncio.run(run())
+
+    # Nothing is submitted once the queue's loop has gone
+    loop = asyncio.new_event_loop()
+    queue = aio.CompletionQueue(loop)
+    loop.close()
+    with pytest.raises(RuntimeError):
+        asyncio.run(queue.read_data(api_keys_ring.key))
+    assert queue._queue.pending == 0
+    queue.close()
+
+    api_keyring.clear_user_keyring(username)
+
+
+def test_commit_queue():
+    """Test write-behind commits of API keys."""
+    import os
+
+    seal_key = os.urandom(32)
+    user_keys = [key for key in MOCK_USER_API_KEYS if key.username == "admin"]
+
+    with pytest.raises(ValueError):
+        api_keyring.CommitQueue()
+
+    with api_keyring.CommitQueue(seal_key=seal_key, delay=60) as queue:
+        # Create the keys and then edit the expiry of one
+        assert not queue.submit("admin", user_keys[:1])
+        assert queue.submit("admin", user_keys)
+        edited = [UserApiKey(**(asdict(user_keys[0]) | {"expiry": 2000000000}))] + user_keys[1:]
+        assert queue.submit("admin", edited)
+        assert queue.pending == 1
+
+        assert queue.flush(timeout=10)
+        assert queue.errors() == {}
+        stats = queue.stats()
+        assert (stats["submitted"], stats["committed"]) == (3, 1)
+
+        dumped = api_keyring.dump_user_keyring("admin", seal_key=seal_key)
+        assert sorted(dumped, key=lambda d: d["dbid"]) == [asdict(k) for k in edited]
+
+    assert queue._queue.closed
+    api_keyring.clear_user_keyring("admin")
+
+
+def test_bundle_layout(monkeypatch):
+    """Test storing API keys in a single bundle and migrating between layouts."""
+    username = "admin"
+    admin_keys = [key for key in MOCK_USER_API_KEYS if key.username == username]
+    user_keyring = api_keyring.get_user_keyring(username)
+
+    try:
+        probe = truenas_keyring.add_key(
+            key_type=truenas_keyring.KeyType.BIG_KEY, description="bundle_probe",
+            data=b"x", target_keyring=user_keyring.key.serial
+        )
+        truenas_keyring.unlink_key(serial=probe.serial, keyring=user_keyring.key.serial)
+    except truenas_keyring.KeyringError:
+        # Kernel built without CONFIG_BIG_KEYS. Layout logic is the same with user keys.
+        monkeypatch.setattr(api_keyring, "BUNDLE_KEY_TYPE", truenas_keyring.KeyType.USER)
+
+    api_keyring.commit_user_entry(username, admin_keys, encrypt, decrypt)
+    expected = sorted(api_keyring.dump_user_keyring(username, decrypt), key=lambda d: d["dbid"])
+
+    # Migrate to bundle
+    api_keyring.commit_user_entry(username, admin_keys, encrypt, decrypt, layout=ApiKeyLayout.BUNDLE)
+    assert api_keyring._find_api_keys_ring(user_keyring) is None
+    bundle = api_keyring._find_bundle(user_keyring)
+    assert bundle is not None
+
+    dumped = sorted(api_keyring.dump_user_keyring(username, decrypt), key=lambda d: d["dbid"])
+    assert dumped == expected
+
+    for key in admin_keys:
+        data = api_keyring.lookup_api_key(username, key.dbid, ApiKeyLayout.BUNDLE)
+        assert loads(decrypt(data.decode())) == asdict(key)
+
+        # Lookups only check the deployment's layout
+        assert api_keyring.lookup_api_key(username, key.dbid) is None
+
+    monkeypatch.setattr(api_keyring, "_default_layout", ApiKeyLayout.PER_KEY)
+    api_keyring.set_default_layout(ApiKeyLayout.BUNDLE)
+    with pytest.raises(ValueError):
+        api_keyring.commit_many({username: admin_keys}, encrypt)
+
+    # One read per cached keyring on the path to confirm it is still linked, plus the bundle
+    truenas_keyring.get_syscall_stats(reset=True)
+    assert api_keyring.lookup_api_key(username, 1) is None
+    assert truenas_keyring.get_syscall_stats(reset=True)['read'] == 3
+
+    # Unchanged commit makes no writes; a change is a single add_key
+    truenas_keyring.get_syscall_stats(reset=True)
+    api_keyring.commit_user_entry(username, admin_keys, encrypt, decrypt, layout=ApiKeyLayout.BUNDLE)
+    assert truenas_keyring.get_syscall_stats(reset=True)['add_key'] == 0
+
+    api_keyring.commit_user_entry(username, admin_keys[:1], encrypt, decrypt)
+    stats = truenas_keyring.get_syscall_stats(reset=True)
+    assert stats['add_key'] == 1
+    assert api_keyring._find_bundle(user_keyring).serial == bundle.serial
+    assert api_keyring.lookup_api_key(username, admin_keys[1].dbid) is None
+
+    # Migrate back to per-key
+    api_keyring.set_default_layout(ApiKeyLayout.PER_KEY)
+    api_keyring.commit_user_entry(username, admin_keys, encrypt, decrypt)
+    assert api_keyring._find_bundle(user_keyring) is None
+    assert sorted(api_keyring.dump_user_keyring(username, decrypt), key=lambda d: d["dbid"]) == expected
+
+    api_keyring.commit_user_entry(username, admin_keys, encrypt, layout=ApiKeyLayout.BUNDLE)
+    api_keyring.clear_user_keyring(username)
+    assert api_keyring._find_bundle(user_keyring) is None
+    assert api_keyring.dump_user_keyring(username, decrypt) == []
+
+
+def test_commit_readers_never_see_partial_keyring():
+    """Test that concurrent readers see either the complete old or new set of API keys."""
+    username = "swaptest"
+    base = MOCK_USER_API_KEYS[0]
+    sets = [
+        [UserApiKey(**{**asdict(base), 'username': username, 'dbid': 100 + i}) for i in range(8)],
+        [UserApiKey(**{**asdict(base), 'username': username, 'dbid': 200 + i}) for i in range(8)],
+    ]
+    expected = [frozenset(str(k.dbid) for k in s) for s in sets]
+
+    api_keyring.commit_user_entry(username, sets[0], encrypt)
+    user_keyring = api_keyring.get_user_keyring(username)
+
+    stop = threading.Event()
+    observations = []
+    errors = []
+    nreaders = 4
+    nswaps = 200
+    retired = [0] * nreaders
+    # errno of a read of a keyring that a swap displaced. Once unlinked it is no longer
+    # possessed through the user keyring (EACCES), and it is then invalidated (ENOKEY).
+    retired_errnos = (errno.EACCES, errno.ENOKEY, errno.EKEYREVOKED, errno.EKEYEXPIRED)
+
+    def reader(idx):
+        while not stop.is_set():
+            try:
+                ring = user_keyring.search(
+                    key_type=truenas_keyring.KeyType.KEYRING, description=PAM_API_KEY_NAME
+                )
+                observations.append(frozenset(ring.read_all()))
+            except truenas_keyring.KeyringError as e:
+                if e.errno not in retired_errnos:
+                    errors.append(e)
+                    continue
+
+                # Resolved the old keyring just before the swap retired it. The next pass
+                # resolves the new one, so this can happen at most once per swap.
+                retired[idx] += 1
+            except Exception as e:
+                errors.append(e)
+
+    readers = [threading.Thread(target=reader, args=(i,)) for i in range(nreaders)]
+    for thd in readers:
+        thd.start()
+
+    try:
+        for i in range(nswaps):
+            api_keyring.commit_user_entry(username, sets[i % 2], encrypt)
+    finally:
+        stop.set()
+        for thd in readers:
+            thd.join()
+
+    assert errors == []
+    assert all(cnt <= nswaps for cnt in retired)
+    assert observations
+    assert all(obs in expected for obs in observations)
+
+
+def test_lookup_api_key():
+    """Test reading a single API key payload in one call."""
+    username = "admin"
+    admin_keys = [key for key in MOCK_USER_API_KEYS if key.username == username]
+    api_keyring.commit_user_entry(username, admin_keys, encrypt)
+
+    data = api_keyring.lookup_api_key(username, admin_keys[0].dbid)
+    assert data is not None
+    assert UserApiKey(**loads(decrypt(data.decode()))) == admin_keys[0]
+
+    assert api_keyring.lookup_api_key(username, 999999) is None
+    assert api_keyring.lookup_api_key("no_such_user", admin_keys[0].dbid) is None
+
+    # One read per cached keyring on the path to confirm it is still linked, plus the payload
+    truenas_keyring.get_syscall_stats(reset=True)
+    api_keyring.lookup_api_key(username, admin_keys[0].dbid)
+    stats = truenas_keyring.get_syscall_stats(reset=True)
+    assert stats['read'] == 4
+    assert stats['search'] <= 1
+
+
+def test_verify_scram():
+    """Test verifying a SCRAM client proof against a stored API key."""
+    import base64
+    import hashlib
+    import hmac
+    import os
+
+    salt = base64.b64decode('W22ZaJ0SNY7soEsUEjb6gQ==')
+    salted = hashlib.pbkdf2_hmac('sha512', b'api_key_secret', salt, 4096)
+    client_key = hmac.new(salted, b'Client Key', 'sha512').digest()
+    server_key = hmac.new(salted, b'Server Key', 'sha512').digest()
+    stored_key = hashlib.sha512(client_key).digest()
+
+    username = "scramtest"
+    key = UserApiKey(
+        username=username,
+        dbid=4242,
+        algorithm=ApiKeyAlgorithm.SHA512,
+        iterations=4096,
+        expiry=0,
+        salt=base64.b64encode(salt).decode(),
+        server_key=base64.b64encode(server_key).decode(),
+        stored_key=base64.b64encode(stored_key).decode()
+    )
+    api_keyring.commit_user_entry(username, [key], encrypt, binary=True)
+
+    auth_message = b'n=scramtest,r=abc,r=abcdef,s=W22ZaJ0SNY7soEsUEjb6gQ==,i=4096,c=biws,r=abcdef'
+    client_sig = hmac.new(stored_key, auth_message, 'sha512').digest()
+    proof = bytes(a ^ b for a, b in zip(client_key, client_sig))
+
+    server_sig = api_keyring.verify_scram(username, key.dbid, proof, auth_message, decrypt)
+    assert server_sig == hmac.new(server_key, auth_message, 'sha512').digest()
+
+    assert api_keyring.verify_scram(username, key.dbid, bytes(64), auth_message, decrypt) is None
+    assert api_keyring.verify_scram(username, 1, proof, auth_message, decrypt) is None
+
+    # JSON entries verify the same way
+    api_keyring.commit_user_entry(username, [key], encrypt)
+    assert api_keyring.verify_scram(username, key.dbid, proof, auth_message, decrypt) == server_sig
+
+    # A payload copied to another API key still decrypts but is rejected
+    api_keys_ring = api_keyring.get_api_keys_keyring(username)
+    api_keys_ring["4243"] = api_keys_ring[str(key.dbid)]
+    with pytest.raises(ValueError):
+        api_keyring.verify_scram(username, 4243, proof, auth_message, decrypt)
+    with pytest.raises(ValueError):
+        api_keyring.dump_user_keyring(username, decrypt)
+
+    del api_keys_ring["4243"]
+    assert len(api_keyring.dump_user_keyring(username, decrypt)) == 1
+
+    # Sealed entries verify natively when binary and via python when JSON
+    seal_key = os.urandom(32)
+    for binary in (True, False):
+        api_keyring.commit_user_entry(username, [key], seal_key=seal_key, binary=binary)
+        assert api_keyring.verify_scram(
+            username, key.dbid, proof, auth_message, seal_key=seal_key
+        ) == server_sig
+        assert api_keyring.verify_scram(
+            username, key.dbid, bytes(64), auth_message, seal_key=seal_key
+        ) is None
+
+    api_keys_ring["4243"] = api_keys_ring[str(key.dbid)]
+    with pytest.raises(ValueError):
+        api_keyring.verify_scram(username, 4243, proof, auth_message, seal_key=seal_key)
+    with pytest.raises(ValueError):
+        api_keyring.verify_scram(username, key.dbid, proof, auth_message, seal_key=os.urandom(32))
+    del api_keys_ring["4243"]